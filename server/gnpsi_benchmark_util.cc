@@ -0,0 +1,73 @@
+#include "server/gnpsi_benchmark_util.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#include "benchmark/benchmark.h"
+#include "glog/logging.h"
+
+namespace {
+std::atomic<int64_t> allocation_count{0};
+
+void* CountedAlloc(size_t size) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  if (void* ptr = std::malloc(size == 0 ? 1 : size)) return ptr;
+  throw std::bad_alloc();
+}
+}  // namespace
+
+void* operator new(size_t size) { return CountedAlloc(size); }
+void* operator new[](size_t size) { return CountedAlloc(size); }
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t /*size*/) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, size_t /*size*/) noexcept { std::free(ptr); }
+
+namespace gnpsi {
+
+int64_t AllocationCount() {
+  return allocation_count.load(std::memory_order_relaxed);
+}
+
+void ReportAllocationsPerSample(benchmark::State& state, int64_t start_count,
+                                int64_t samples) {
+  if (samples == 0) return;
+  state.counters["allocs_per_sample"] =
+      static_cast<double>(AllocationCount() - start_count) / samples;
+}
+
+int FreeUdpPort() {
+  int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  CHECK_EQ(bind(fd, reinterpret_cast<struct sockaddr*>(&addr), len), 0);
+  CHECK_EQ(getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr), &len),
+           0);
+  close(fd);
+  return ntohs(addr.sin_port);
+}
+
+void LatencyRecorder::Report(benchmark::State& state) {
+  if (latencies_ns_.empty()) return;
+  auto percentile = [this](double fraction) {
+    auto nth = latencies_ns_.begin() +
+               static_cast<size_t>(fraction * (latencies_ns_.size() - 1));
+    std::nth_element(latencies_ns_.begin(), nth, latencies_ns_.end());
+    return static_cast<double>(*nth);
+  };
+  state.counters["p50_ns"] = percentile(0.50);
+  state.counters["p99_ns"] = percentile(0.99);
+  state.counters["p999_ns"] = percentile(0.999);
+}
+
+}  // namespace gnpsi
@@ -0,0 +1,56 @@
+#ifndef OPENCONFIG_GNPSI_SERVER_GNPSI_BENCHMARK_UTIL_H_
+#define OPENCONFIG_GNPSI_SERVER_GNPSI_BENCHMARK_UTIL_H_
+
+#include <chrono>  // NOLINT
+#include <cstdint>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+namespace gnpsi {
+
+// Returns the number of heap allocations made so far by all threads of the
+// process. Linking the benchmark utilities replaces the global operator new to
+// count them.
+int64_t AllocationCount();
+
+// Sets the "allocs_per_sample" counter of `state` to the allocations made
+// since `start_count` per sample processed.
+void ReportAllocationsPerSample(benchmark::State& state, int64_t start_count,
+                                int64_t samples);
+
+// Returns a UDP port on the loopback interface that no socket is bound to.
+int FreeUdpPort();
+
+// Collects the latency of individual calls and reports their percentiles.
+class LatencyRecorder {
+ public:
+  // Runs `f` and records how long it took.
+  template <typename F>
+  void Measure(F&& f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    Record(std::chrono::steady_clock::now() - start);
+  }
+
+  void Record(std::chrono::steady_clock::duration latency) {
+    latencies_ns_.push_back(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+  }
+
+  // Adds the latencies recorded by `other`.
+  void Add(const LatencyRecorder& other) {
+    latencies_ns_.insert(latencies_ns_.end(), other.latencies_ns_.begin(),
+                         other.latencies_ns_.end());
+  }
+
+  // Sets the "p50_ns", "p99_ns" and "p999_ns" counters of `state`.
+  void Report(benchmark::State& state);
+
+ private:
+  std::vector<int64_t> latencies_ns_;
+};
+
+}  // namespace gnpsi
+
+#endif  // OPENCONFIG_GNPSI_SERVER_GNPSI_BENCHMARK_UTIL_H_
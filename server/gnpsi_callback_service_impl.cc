@@ -0,0 +1,212 @@
+#include "server/gnpsi_callback_service_impl.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "glog/logging.h"
+#include "grpcpp/alarm.h"
+#include "grpcpp/impl/proto_utils.h"
+#include "grpcpp/server_context.h"
+#include "grpcpp/support/byte_buffer.h"
+#include "grpcpp/support/server_callback.h"
+#include "grpcpp/support/status.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_service_impl.h"
+
+namespace gnpsi {
+
+// Streams the samples queued on its connection to one subscriber. At most one
+// write is in flight at a time; the next one is started from OnWriteDone, or
+// from OnSampleQueued if the stream was idle. Samples are written as the bytes
+// serialized once by the connection manager. A batch that is not due yet is
+// flushed by an alarm. The reactor owns itself, sharing the ownership with the
+// connection manager, and releases itself once gRPC reports the RPC done and
+// no alarm is pending.
+class GnpsiSubscribeReactor : public grpc::ServerWriteReactor<grpc::ByteBuffer>,
+                              public GnpsiConnection {
+ public:
+  GnpsiSubscribeReactor(grpc::CallbackServerContext* context,
+                        GnpsiCallbackServiceImpl* service)
+      : GnpsiConnection(context, /*writer=*/nullptr,
+                        service->connection_options()),
+        service_(service) {}
+
+  // Registers the connection with the service and starts the stream. `self`
+  // owns the reactor.
+  void Start(std::shared_ptr<GnpsiSubscribeReactor> self,
+             const grpc::ByteBuffer* request) {
+    self_ = self;
+    absl::Status status = ParseRequest(request);
+    if (status.ok()) {
+      status = Configure(request_);
+    }
+    if (status.ok()) {
+      status = service_->AddConnection(std::move(self));
+    }
+    if (!status.ok()) {
+      absl::MutexLock l(&write_mu_);
+      finished_ = true;
+      Finish(Status(StatusCode(status.code()), std::string(status.message())));
+      return;
+    }
+    // Send Initial Metadata after adding connection indicating that the client
+    // should be receiving any new samples from this point on.
+    StartSendInitialMetadata();
+    // Samples to replay and summaries are not queued by the sender, so
+    // writing them starts here.
+    if (replaying() || aggregating()) MaybeStartWrite();
+  }
+
+  void OnWriteDone(bool ok) override {
+    PendingWrite write;
+    absl::Duration duration;
+    {
+      absl::MutexLock l(&write_mu_);
+      write_in_flight_ = false;
+      write = std::move(current_);
+      current_ = PendingWrite();
+      current_buffer_.Clear();
+      duration = absl::Now() - write_start_;
+    }
+    RecordWrite(write, ok, duration);
+    MaybeStartWrite();
+  }
+
+  void OnCancel() override { CloseStream(); }
+
+  void OnDone() override {
+    service_->DropConnection(this);
+    {
+      absl::MutexLock l(&write_mu_);
+      done_ = true;
+      if (alarm_pending_) {
+        // The alarm callback releases the reactor.
+        flush_alarm_->Cancel();
+        return;
+      }
+    }
+    // The reactor may be destroyed once `self` goes out of scope.
+    std::shared_ptr<GnpsiSubscribeReactor> self = std::move(self_);
+  }
+
+ protected:
+  void OnSampleQueued() override { MaybeStartWrite(); }
+  void OnStreamClosed() override { MaybeStartWrite(); }
+
+ private:
+  absl::Status ParseRequest(const grpc::ByteBuffer* request) {
+    // Deserialization consumes the buffer; copying it only takes a reference.
+    grpc::ByteBuffer buffer(*request);
+    grpc::Status status =
+        grpc::SerializationTraits<Request>::Deserialize(&buffer, &request_);
+    if (!status.ok()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Invalid request: ", status.error_message()));
+    }
+    return absl::OkStatus();
+  }
+
+  // Starts writing the next queued sample, or batch of samples, unless a
+  // write is already in flight. Finishes the RPC once the stream is closed and
+  // no write is pending.
+  void MaybeStartWrite() ABSL_LOCKS_EXCLUDED(write_mu_) {
+    absl::MutexLock l(&write_mu_);
+    MaybeStartWriteLocked();
+  }
+
+  void MaybeStartWriteLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(write_mu_) {
+    if (write_in_flight_ || finished_) return;
+    if (IsStreamClosed()) {
+      finished_ = true;
+      Finish(Status::OK);
+      return;
+    }
+    absl::Time flush_time;
+    if (!PopWrite(absl::Now(), &current_, &flush_time)) {
+      if (flush_time != absl::InfiniteFuture()) ArmFlushAlarm(flush_time);
+      return;
+    }
+    write_in_flight_ = true;
+    if (current_.summary.has_value()) {
+      const GnpsiSampleMetadata metadata = SFlowMetadata::V5;
+      if (stream_metadata_.ShouldSend(metadata)) {
+        metadata.SetMetadata(&*current_.summary);
+      }
+      bool own_buffer;
+      grpc::SerializationTraits<Sample>::Serialize(
+          *current_.summary, &current_buffer_, &own_buffer);
+    } else if (current_.batched) {
+      current_buffer_ =
+          SharedSample::SerializeBatch(current_.samples, &stream_metadata_);
+    } else {
+      const SharedSample& sample = *current_.samples.front();
+      current_buffer_ = stream_metadata_.ShouldSend(sample.metadata())
+                            ? sample.SerializedWithMetadata()
+                            : sample.serialized();
+    }
+    write_start_ = absl::Now();
+    StartWrite(&current_buffer_);
+  }
+
+  // Retries MaybeStartWrite at `flush_time`, unless an alarm is already
+  // pending; that alarm is due no later, as the batch it was set for has not
+  // been written yet.
+  void ArmFlushAlarm(absl::Time flush_time)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(write_mu_) {
+    if (alarm_pending_) return;
+    alarm_pending_ = true;
+    flush_alarm_ = std::make_unique<grpc::Alarm>();
+    flush_alarm_->Set(absl::ToChronoTime(flush_time),
+                      [this](bool /*ok*/) { OnFlushAlarm(); });
+  }
+
+  void OnFlushAlarm() ABSL_LOCKS_EXCLUDED(write_mu_) {
+    {
+      absl::MutexLock l(&write_mu_);
+      alarm_pending_ = false;
+      if (!done_) {
+        MaybeStartWriteLocked();
+        return;
+      }
+    }
+    // OnDone has run and left releasing the reactor to the alarm.
+    std::shared_ptr<GnpsiSubscribeReactor> self = std::move(self_);
+  }
+
+  GnpsiCallbackServiceImpl* service_;
+  // Reference of the reactor to itself, released once gRPC no longer uses it.
+  // Only touched by Start, and by the last of OnDone and the alarm callback.
+  std::shared_ptr<GnpsiSubscribeReactor> self_;
+  Request request_;
+  // Lock for protecting the write state of the stream.
+  absl::Mutex write_mu_;
+  // Samples being written and their encoding. They have to stay alive until
+  // OnWriteDone.
+  PendingWrite current_ ABSL_GUARDED_BY(write_mu_);
+  grpc::ByteBuffer current_buffer_ ABSL_GUARDED_BY(write_mu_);
+  absl::Time write_start_ ABSL_GUARDED_BY(write_mu_);
+  // Metadata sent on the stream.
+  GnpsiStreamMetadata stream_metadata_ ABSL_GUARDED_BY(write_mu_);
+  bool write_in_flight_ ABSL_GUARDED_BY(write_mu_) = false;
+  bool finished_ ABSL_GUARDED_BY(write_mu_) = false;
+  // Alarm flushing a batch that is not due yet.
+  std::unique_ptr<grpc::Alarm> flush_alarm_ ABSL_GUARDED_BY(write_mu_);
+  bool alarm_pending_ ABSL_GUARDED_BY(write_mu_) = false;
+  bool done_ ABSL_GUARDED_BY(write_mu_) = false;
+};
+
+grpc::ServerWriteReactor<grpc::ByteBuffer>* GnpsiCallbackServiceImpl::Subscribe(
+    grpc::CallbackServerContext* context, const grpc::ByteBuffer* request) {
+  auto reactor = std::make_shared<GnpsiSubscribeReactor>(context, this);
+  reactor->Start(reactor, request);
+  return reactor.get();
+}
+
+}  // namespace gnpsi
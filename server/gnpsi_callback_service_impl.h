@@ -0,0 +1,57 @@
+#ifndef OPENCONFIG_GNPSI_SERVER_GNPSI_CALLBACK_SERVICE_IMPL_H_
+#define OPENCONFIG_GNPSI_SERVER_GNPSI_CALLBACK_SERVICE_IMPL_H_
+
+#include "grpcpp/server_context.h"
+#include "grpcpp/support/byte_buffer.h"
+#include "grpcpp/support/server_callback.h"
+#include "proto/gnpsi/gnpsi.grpc.pb.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_service_impl.h"
+
+namespace gnpsi {
+
+class GnpsiSubscribeReactor;
+
+// Implementation of gNPSI server on the gRPC callback API.
+// Each subscription is served by a ServerWriteReactor whose writes are driven
+// by OnWriteDone, so no thread is parked per subscriber and many clients can be
+// served by the small, fixed set of threads of the callback executor. Sample
+// fan-out, draining and stats are shared with GnpsiServiceImpl.
+//
+// Subscribe is registered as a raw method: every Sample is serialized once by
+// the connection manager and the same ByteBuffer is written to every stream.
+class GnpsiCallbackServiceImpl
+    : public ::gnpsi::gNPSI::WithRawCallbackMethod_Subscribe<
+          ::gnpsi::gNPSI::Service>,
+      public GnpsiConnectionManager {
+ public:
+  explicit GnpsiCallbackServiceImpl(int client_max_number)
+      : GnpsiCallbackServiceImpl(client_max_number, GnpsiConnectionOptions()) {
+  }
+  GnpsiCallbackServiceImpl(int client_max_number,
+                           const GnpsiConnectionOptions& connection_options)
+      : GnpsiCallbackServiceImpl(client_max_number, connection_options,
+                                 GnpsiReplayOptions()) {}
+  GnpsiCallbackServiceImpl(int client_max_number,
+                           const GnpsiConnectionOptions& connection_options,
+                           const GnpsiReplayOptions& replay_options)
+      : GnpsiConnectionManager(client_max_number, connection_options,
+                               /*serialize_samples=*/true,
+                               GnpsiCongestionCacheOptions(), replay_options) {
+  }
+
+  // Creates a reactor for the subscription and adds it to the connections.
+  // The reactor finishes with a FAILED_PRECONDITION error if the number of
+  // connections has reached client_max_number, or with an INVALID_ARGUMENT
+  // error if `request` is not a valid Request.
+  grpc::ServerWriteReactor<grpc::ByteBuffer>* Subscribe(
+      grpc::CallbackServerContext* context,
+      const grpc::ByteBuffer* request) override;
+
+ private:
+  friend class GnpsiSubscribeReactor;
+};
+
+}  // namespace gnpsi
+
+#endif  // OPENCONFIG_GNPSI_SERVER_GNPSI_CALLBACK_SERVICE_IMPL_H_
@@ -0,0 +1,265 @@
+#include "server/gnpsi_callback_service_impl.h"
+
+#include <memory>
+#include <string>
+
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "grpcpp/client_context.h"
+#include "grpcpp/create_channel.h"
+#include "grpcpp/security/credentials.h"
+#include "grpcpp/security/server_credentials.h"
+#include "grpcpp/server.h"
+#include "grpcpp/server_builder.h"
+#include "gtest/gtest.h"
+#include "proto/gnpsi/gnpsi.grpc.pb.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_sflow_test_util.h"
+
+namespace gnpsi {
+namespace {
+
+const int kClientMaxNumber = 2;
+
+class GnpsiCallbackServiceImplTest : public ::testing::Test {
+ protected:
+  GnpsiCallbackServiceImplTest() : service_(kClientMaxNumber) {
+    int port = 0;
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(),
+                             &port);
+    builder.RegisterService(&service_);
+    server_ = builder.BuildAndStart();
+    stub_ = gNPSI::NewStub(grpc::CreateChannel(
+        absl::StrCat("localhost:", port), grpc::InsecureChannelCredentials()));
+  }
+
+  ~GnpsiCallbackServiceImplTest() override { server_->Shutdown(); }
+
+  // Blocks until `count` connections are registered with the service.
+  void WaitForConnections(size_t count) {
+    while (service_.GetStats().size() != count) {
+      absl::SleepFor(absl::Milliseconds(1));
+    }
+  }
+
+  GnpsiCallbackServiceImpl service_;
+  std::unique_ptr<grpc::Server> server_;
+  std::unique_ptr<gNPSI::Stub> stub_;
+};
+
+TEST_F(GnpsiCallbackServiceImplTest, StreamsSamplesToAllSubscribers) {
+  grpc::ClientContext context1, context2;
+  auto reader1 = stub_->Subscribe(&context1, Request());
+  auto reader2 = stub_->Subscribe(&context2, Request());
+  reader1->WaitForInitialMetadata();
+  reader2->WaitForInitialMetadata();
+  WaitForConnections(2);
+
+  service_.SendSamplePacket("first");
+  service_.SendSamplePacket("second");
+  for (auto* reader : {reader1.get(), reader2.get()}) {
+    Sample sample;
+    ASSERT_TRUE(reader->Read(&sample));
+    EXPECT_EQ(sample.packet(), "first");
+    EXPECT_EQ(sample.sflow_metadata().version(), SFlowMetadata::V5);
+    ASSERT_TRUE(reader->Read(&sample));
+    EXPECT_EQ(sample.packet(), "second");
+    // Only the first message on the stream carries the metadata.
+    EXPECT_FALSE(sample.has_sflow_metadata());
+  }
+  // Stats are recorded in OnWriteDone, which may run after the client has
+  // read the sample.
+  auto all_sent = [this]() {
+    for (const GnpsiStats& stats : service_.GetStats()) {
+      if (stats.datagram_count != 2) return false;
+    }
+    return true;
+  };
+  while (!all_sent()) absl::SleepFor(absl::Milliseconds(1));
+  for (const GnpsiStats& stats : service_.GetStats()) {
+    EXPECT_EQ(stats.bytes_sampled, 11);
+    EXPECT_EQ(stats.error_count, 0);
+  }
+}
+
+TEST(GnpsiCallbackServiceImplReplayTest, ResumesFromLastSequenceNumber) {
+  GnpsiReplayOptions replay_options;
+  replay_options.max_bytes = 1 << 20;
+  GnpsiCallbackServiceImpl service(kClientMaxNumber, GnpsiConnectionOptions(),
+                                   replay_options);
+  int port = 0;
+  grpc::ServerBuilder builder;
+  builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(),
+                           &port);
+  builder.RegisterService(&service);
+  std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  std::unique_ptr<gNPSI::Stub> stub = gNPSI::NewStub(grpc::CreateChannel(
+      absl::StrCat("localhost:", port), grpc::InsecureChannelCredentials()));
+
+  service.SendSamplePacket("first");
+  service.SendSamplePacket("second");
+  Request request;
+  request.set_last_sequence_number(1);
+  grpc::ClientContext context;
+  auto reader = stub->Subscribe(&context, request);
+  reader->WaitForInitialMetadata();
+  service.SendSamplePacket("third");
+
+  Sample sample;
+  ASSERT_TRUE(reader->Read(&sample));
+  EXPECT_EQ(sample.packet(), "second");
+  EXPECT_EQ(sample.sequence_number(), 2);
+  EXPECT_EQ(sample.sflow_metadata().version(), SFlowMetadata::V5);
+  ASSERT_TRUE(reader->Read(&sample));
+  EXPECT_EQ(sample.packet(), "third");
+  EXPECT_EQ(sample.sequence_number(), 3);
+  context.TryCancel();
+  server->Shutdown();
+}
+
+TEST_F(GnpsiCallbackServiceImplTest, StreamsCompressedSamples) {
+  Request gzip_request, level_request;
+  gzip_request.mutable_compression()->set_algorithm(CompressionOptions::GZIP);
+  level_request.mutable_compression()->set_level(CompressionOptions::HIGH);
+  grpc::ClientContext context1, context2;
+  auto reader1 = stub_->Subscribe(&context1, gzip_request);
+  auto reader2 = stub_->Subscribe(&context2, level_request);
+  reader1->WaitForInitialMetadata();
+  reader2->WaitForInitialMetadata();
+  WaitForConnections(2);
+
+  const std::string packet(4096, 'p');
+  service_.SendSamplePacket(packet);
+  for (auto* reader : {reader1.get(), reader2.get()}) {
+    Sample sample;
+    ASSERT_TRUE(reader->Read(&sample));
+    EXPECT_EQ(sample.packet(), packet);
+  }
+}
+
+TEST_F(GnpsiCallbackServiceImplTest, RejectsClientsAboveMaximum) {
+  grpc::ClientContext context1, context2, context3;
+  auto reader1 = stub_->Subscribe(&context1, Request());
+  auto reader2 = stub_->Subscribe(&context2, Request());
+  reader1->WaitForInitialMetadata();
+  reader2->WaitForInitialMetadata();
+  WaitForConnections(2);
+
+  auto reader3 = stub_->Subscribe(&context3, Request());
+  Sample sample;
+  EXPECT_FALSE(reader3->Read(&sample));
+  EXPECT_EQ(reader3->Finish().error_code(),
+            grpc::StatusCode::FAILED_PRECONDITION);
+}
+
+TEST_F(GnpsiCallbackServiceImplTest, StreamsBatchesToBatchingSubscriber) {
+  Request request;
+  request.mutable_batching()->set_max_linger_ns(
+      absl::ToInt64Nanoseconds(absl::Milliseconds(200)));
+  grpc::ClientContext context;
+  auto reader = stub_->Subscribe(&context, request);
+  reader->WaitForInitialMetadata();
+  WaitForConnections(1);
+
+  service_.SendSamplePacket("first");
+  service_.SendSamplePacket("second");
+  Sample batch;
+  ASSERT_TRUE(reader->Read(&batch));
+  ASSERT_EQ(batch.batched_samples_size(), 2);
+  EXPECT_EQ(batch.batched_samples(0).packet(), "first");
+  EXPECT_EQ(batch.batched_samples(1).packet(), "second");
+  EXPECT_EQ(batch.batched_samples(0).sflow_metadata().version(),
+            SFlowMetadata::V5);
+  EXPECT_FALSE(batch.batched_samples(1).has_sflow_metadata());
+  EXPECT_TRUE(batch.packet().empty());
+}
+
+TEST_F(GnpsiCallbackServiceImplTest, StreamsSummariesToAggregatingSubscriber) {
+  Request request;
+  request.mutable_aggregation()->set_interval_ns(
+      absl::ToInt64Nanoseconds(kMinAggregationInterval));
+  grpc::ClientContext context;
+  auto reader = stub_->Subscribe(&context, request);
+  reader->WaitForInitialMetadata();
+  WaitForConnections(1);
+
+  service_.SendSamplePacket(SFlowDatagramBuilder()
+                                .AddFlowSample(1, 2, /*sampling_rate=*/10)
+                                .Build());
+  Sample sample;
+  ASSERT_TRUE(reader->Read(&sample));
+  EXPECT_TRUE(sample.packet().empty());
+  EXPECT_EQ(sample.sflow_metadata().version(), SFlowMetadata::V5);
+  EXPECT_EQ(sample.flow_summary().sample_count(), 1);
+  EXPECT_EQ(sample.flow_summary().packet_count(), 10);
+  // Summaries follow each interval, whether or not samples arrived.
+  ASSERT_TRUE(reader->Read(&sample));
+  EXPECT_FALSE(sample.has_sflow_metadata());
+  EXPECT_EQ(sample.flow_summary().sample_count(), 0);
+  context.TryCancel();
+}
+
+TEST_F(GnpsiCallbackServiceImplTest, DrainFinishesStreamWithPendingBatch) {
+  Request request;
+  request.mutable_batching()->set_max_linger_ns(
+      absl::ToInt64Nanoseconds(absl::Seconds(1)));
+  grpc::ClientContext context;
+  auto reader = stub_->Subscribe(&context, request);
+  reader->WaitForInitialMetadata();
+  WaitForConnections(1);
+
+  // The batch is held back by the linger time, so the alarm flushing it is
+  // pending when the stream finishes.
+  service_.SendSamplePacket("lingering");
+  service_.DrainConnections();
+  Sample sample;
+  EXPECT_FALSE(reader->Read(&sample));
+  EXPECT_TRUE(reader->Finish().ok());
+  WaitForConnections(0);
+}
+
+TEST_F(GnpsiCallbackServiceImplTest, RejectsOutOfRangeBatchingOptions) {
+  Request request;
+  request.mutable_batching()->set_max_batch_bytes(kMaxBatchBytes + 1);
+  grpc::ClientContext context;
+  auto reader = stub_->Subscribe(&context, request);
+  Sample sample;
+  EXPECT_FALSE(reader->Read(&sample));
+  EXPECT_EQ(reader->Finish().error_code(), grpc::StatusCode::INVALID_ARGUMENT);
+}
+
+TEST_F(GnpsiCallbackServiceImplTest, DrainFinishesStreams) {
+  grpc::ClientContext context;
+  auto reader = stub_->Subscribe(&context, Request());
+  reader->WaitForInitialMetadata();
+  WaitForConnections(1);
+
+  service_.DrainConnections();
+  Sample sample;
+  EXPECT_FALSE(reader->Read(&sample));
+  EXPECT_TRUE(reader->Finish().ok());
+  WaitForConnections(0);
+
+  // New subscriptions are rejected until the service is undrained.
+  grpc::ClientContext rejected_context;
+  auto rejected_reader = stub_->Subscribe(&rejected_context, Request());
+  EXPECT_FALSE(rejected_reader->Read(&sample));
+  EXPECT_EQ(rejected_reader->Finish().error_code(),
+            grpc::StatusCode::FAILED_PRECONDITION);
+}
+
+TEST_F(GnpsiCallbackServiceImplTest, DropsCancelledSubscriber) {
+  auto context = std::make_unique<grpc::ClientContext>();
+  auto reader = stub_->Subscribe(context.get(), Request());
+  reader->WaitForInitialMetadata();
+  WaitForConnections(1);
+
+  context->TryCancel();
+  reader->Finish();
+  WaitForConnections(0);
+}
+
+}  // namespace
+}  // namespace gnpsi
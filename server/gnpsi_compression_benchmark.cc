@@ -0,0 +1,224 @@
+// Measures compressing sFlow samples the way gRPC compresses the messages of a
+// stream with gzip or deflate: every message on its own, with zlib at its
+// default level.
+//
+// BM_Compress compresses Sample messages of state.range(1) samples, batched as
+// with BatchingOptions when there are several, with gzip if state.range(0) is 0
+// and deflate otherwise. It reports the compression ratio in "ratio", and the
+// CPU time spent per MB of messages in "cpu_s_per_mb".
+//
+// The datagrams compressed are read from the pcap file named by the
+// GNPSI_SFLOW_PCAP environment variable, which should hold sFlow datagrams
+// captured on their way to the relay. Without it, the datagrams are made up
+// of flow samples with the sampled headers of random TCP flows.
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "glog/logging.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_sflow_parser.h"
+#include "server/gnpsi_sflow_test_util.h"
+
+namespace gnpsi {
+namespace {
+
+// Number of datagrams synthesized.
+constexpr int kDatagrams = 1024;
+// Flow samples per synthesized datagram, which then takes about 1.4 KB.
+constexpr int kSamplesPerDatagram = 8;
+// Size of the sampled headers, the sFlow default.
+constexpr int kHeaderSize = 128;
+
+uint32_t ReadUint32(const char* data, bool swap) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return swap ? __builtin_bswap32(value) : value;
+}
+
+uint16_t ReadUint16Be(const char* data) {
+  return (static_cast<uint8_t>(data[0]) << 8) | static_cast<uint8_t>(data[1]);
+}
+
+// Returns the payloads of the UDP datagrams of the pcap file at `path`, for
+// the Ethernet and Linux cooked capture link types.
+std::vector<std::string> ReadPcap(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  const std::string pcap((std::istreambuf_iterator<char>(file)),
+                         std::istreambuf_iterator<char>());
+  std::vector<std::string> payloads;
+  if (pcap.size() < 24) return payloads;
+  const uint32_t magic = ReadUint32(pcap.data(), /*swap=*/false);
+  const bool swap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+  const uint32_t link_type = ReadUint32(pcap.data() + 20, swap);
+  size_t link_header_size;
+  if (link_type == 1) {
+    link_header_size = 14;
+  } else if (link_type == 113) {
+    link_header_size = 16;
+  } else {
+    LOG(ERROR) << "Unsupported pcap link type " << link_type;
+    return payloads;
+  }
+  for (size_t offset = 24; offset + 16 <= pcap.size();) {
+    const size_t size = ReadUint32(pcap.data() + offset + 8, swap);
+    const char* packet = pcap.data() + offset + 16;
+    offset += 16 + size;
+    if (offset > pcap.size() || size < link_header_size) continue;
+    size_t ip = link_header_size;
+    uint16_t ether_type = ReadUint16Be(packet + ip - 2);
+    if (ether_type == 0x8100 && size >= ip + 4) {
+      ether_type = ReadUint16Be(packet + ip + 2);
+      ip += 4;
+    }
+    size_t udp;
+    if (ether_type == 0x0800 && size >= ip + 20 && packet[ip + 9] == 17) {
+      udp = ip + (packet[ip] & 0x0f) * 4;
+    } else if (ether_type == 0x86dd && size >= ip + 40 &&
+               packet[ip + 6] == 17) {
+      udp = ip + 40;
+    } else {
+      continue;
+    }
+    if (size < udp + 8) continue;
+    payloads.emplace_back(packet + udp + 8, size - udp - 8);
+  }
+  return payloads;
+}
+
+// Returns a compact flow sample with the sampled header of a packet of a TCP
+// flow of `random`.
+std::string FlowSample(uint32_t sequence_number, std::mt19937& random) {
+  std::string header(kHeaderSize, '\0');
+  // Ethernet, with MAC addresses of a few neighbors.
+  const char macs[][6] = {{0, 0x1c, 0x73, 1, 2, 3}, {0, 0x1c, 0x73, 4, 5, 6},
+                          {0, 0x1c, 0x73, 7, 8, 9}};
+  memcpy(&header[0], macs[random() % 3], 6);
+  memcpy(&header[6], macs[random() % 3], 6);
+  header[12] = 0x08;
+  // IPv4 between hosts of two /16s, then TCP between random ports.
+  memcpy(&header[14],
+         "\x45\x00\x05\xdc\x00\x00\x40\x00\x40\x06"
+         "\x00\x00\x0a\x01\x00\x00\x0a\x02\x00\x00",
+         20);
+  for (int i : {16, 17, 18, 19, 28, 29, 32, 33}) header[i] = random();
+  for (int i = 34; i < 46; ++i) header[i] = random();
+  header[46] = 0x50;
+  header[47] = 0x10;
+  // The payload of most traffic is encrypted, so it does not compress.
+  for (int i = 54; i < kHeaderSize; ++i) header[i] = random();
+
+  std::string data;
+  auto append = [&data](uint32_t value) {
+    char bytes[4];
+    WriteXdrUint32(value, bytes);
+    data.append(bytes, 4);
+  };
+  append(sequence_number);
+  append(7);                       // Source: ifIndex 7.
+  append(4096);                    // Sampling rate.
+  append(sequence_number * 4096);  // Sample pool.
+  append(0);                       // Drops.
+  append(7);                       // Input.
+  append(8);                       // Output.
+  append(1);                       // Number of records.
+  append(1);                       // Raw packet header.
+  append(16 + kHeaderSize);        // Record length.
+  append(1);                       // Ethernet.
+  append(1514);                    // Frame length.
+  append(4);                       // Stripped.
+  append(kHeaderSize);
+  return data + header;
+}
+
+std::vector<std::string> Datagrams() {
+  if (const char* path = std::getenv("GNPSI_SFLOW_PCAP")) {
+    std::vector<std::string> datagrams = ReadPcap(path);
+    if (!datagrams.empty()) return datagrams;
+    LOG(ERROR) << "No datagrams read from " << path;
+  }
+  std::mt19937 random(42);
+  std::vector<std::string> datagrams;
+  uint32_t sequence_number = 0;
+  for (int i = 0; i < kDatagrams; ++i) {
+    SFlowDatagramBuilder builder;
+    for (int j = 0; j < kSamplesPerDatagram; ++j) {
+      builder.AddSample(/*format=*/1, FlowSample(++sequence_number, random));
+    }
+    datagrams.push_back(builder.Build());
+  }
+  return datagrams;
+}
+
+// Returns the encodings of Sample messages of `samples` datagrams each, sent
+// a millisecond apart.
+std::vector<std::string> Messages(int samples) {
+  const std::vector<std::string> datagrams = Datagrams();
+  std::vector<std::string> messages;
+  int64_t timestamp = 1700000000000000000;
+  for (size_t i = 0; i < datagrams.size(); i += samples) {
+    Sample message;
+    for (size_t j = i; j < i + samples && j < datagrams.size(); ++j) {
+      Sample* sample = samples == 1 ? &message : message.add_batched_samples();
+      sample->set_packet(datagrams[j]);
+      sample->set_timestamp(timestamp += 1000000);
+    }
+    messages.push_back(message.SerializeAsString());
+  }
+  return messages;
+}
+
+// Compresses `message` into `compressed` with the zlib parameters of gRPC.
+// Returns the size of the compressed message.
+size_t Compress(const std::string& message, bool gzip,
+                std::string* compressed) {
+  z_stream stream = {};
+  CHECK_EQ(deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                        15 | (gzip ? 16 : 0), 8, Z_DEFAULT_STRATEGY),
+           Z_OK);
+  compressed->resize(deflateBound(&stream, message.size()));
+  stream.next_in =
+      reinterpret_cast<Bytef*>(const_cast<char*>(message.data()));
+  stream.avail_in = message.size();
+  stream.next_out = reinterpret_cast<Bytef*>(&(*compressed)[0]);
+  stream.avail_out = compressed->size();
+  CHECK_EQ(deflate(&stream, Z_FINISH), Z_STREAM_END);
+  const size_t size = stream.total_out;
+  deflateEnd(&stream);
+  return size;
+}
+
+void BM_Compress(benchmark::State& state) {
+  const bool gzip = state.range(0) == 0;
+  const std::vector<std::string> messages = Messages(state.range(1));
+  std::string compressed;
+  int64_t bytes = 0;
+  int64_t compressed_bytes = 0;
+  size_t i = 0;
+  for (auto _ : state) {
+    const std::string& message = messages[i++ % messages.size()];
+    compressed_bytes += Compress(message, gzip, &compressed);
+    bytes += message.size();
+  }
+  state.SetBytesProcessed(bytes);
+  state.counters["ratio"] =
+      static_cast<double>(bytes) / std::max<int64_t>(compressed_bytes, 1);
+  state.counters["cpu_s_per_mb"] = benchmark::Counter(
+      bytes / 1e6, benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+}
+BENCHMARK(BM_Compress)
+    ->ArgNames({"deflate", "samples"})
+    ->ArgsProduct({{0, 1}, {1, 8, 64}});
+
+}  // namespace
+}  // namespace gnpsi
@@ -0,0 +1,101 @@
+#include "server/gnpsi_congestion_cache.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+#include "absl/hash/hash.h"
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_sflow_parser.h"
+#include "server/gnpsi_shared_sample.h"
+
+namespace gnpsi {
+
+GnpsiCongestionCache::GnpsiCongestionCache(
+    const GnpsiCongestionCacheOptions& options)
+    : ttl_(options.ttl) {
+  size_t num_sets = 1;
+  while (num_sets * kWays < static_cast<size_t>(options.capacity)) {
+    num_sets *= 2;
+  }
+  set_mask_ = num_sets - 1;
+  slots_.resize(num_sets * kWays);
+}
+
+size_t GnpsiCongestionCache::SetIndex(uint64_t key) const {
+  return (absl::Hash<uint64_t>()(key) & set_mask_) * kWays;
+}
+
+void GnpsiCongestionCache::Add(const CongestionTelemetry& telemetry,
+                               absl::Time now) {
+  // The record is built and the evicted one released outside of the lock.
+  std::shared_ptr<const GnpsiCongestionRecord> record =
+      std::make_shared<const GnpsiCongestionRecord>(telemetry);
+  const uint64_t key =
+      Key(static_cast<uint32_t>(telemetry.ingress_port()),
+          static_cast<uint32_t>(telemetry.sample_sequence_number()));
+  const size_t set = SetIndex(key);
+  {
+    absl::MutexLock l(&mu_);
+    // Replaces the record of the same sample, or else the oldest one.
+    Slot* victim = &slots_[set];
+    for (int i = 0; i < kWays; ++i) {
+      Slot& slot = slots_[set + i];
+      if (slot.record != nullptr && slot.key == key) {
+        victim = &slot;
+        break;
+      }
+      if (slot.add_time < victim->add_time) victim = &slot;
+    }
+    victim->key = key;
+    victim->add_time = now;
+    victim->record.swap(record);
+  }
+  empty_.store(false, std::memory_order_relaxed);
+}
+
+std::shared_ptr<const GnpsiCongestionRecord> GnpsiCongestionCache::LookupLocked(
+    uint64_t key, absl::Time now) const {
+  const size_t set = SetIndex(key);
+  for (int i = 0; i < kWays; ++i) {
+    const Slot& slot = slots_[set + i];
+    if (slot.record != nullptr && slot.key == key) {
+      if (now - slot.add_time > ttl_) return nullptr;
+      return slot.record;
+    }
+  }
+  return nullptr;
+}
+
+std::shared_ptr<const GnpsiCongestionRecord> GnpsiCongestionCache::Lookup(
+    uint32_t ingress_port, uint32_t sequence_number, absl::Time now) const {
+  absl::ReaderMutexLock l(&mu_);
+  return LookupLocked(Key(ingress_port, sequence_number), now);
+}
+
+int GnpsiCongestionCache::Join(absl::Time now, SharedSample* sample) const {
+  absl::StatusOr<SFlowDatagram> datagram =
+      SFlowDatagram::Parse(sample->packet());
+  if (!datagram.ok()) return 0;
+  int joined = 0;
+  absl::ReaderMutexLock l(&mu_);
+  SFlowSample flow_sample;
+  while (datagram->NextSample(&flow_sample)) {
+    if (flow_sample.type() != SFlowSampleType::kFlow ||
+        !flow_sample.input_if_index().has_value()) {
+      continue;
+    }
+    std::shared_ptr<const GnpsiCongestionRecord> record = LookupLocked(
+        Key(*flow_sample.input_if_index(), flow_sample.sequence_number()), now);
+    if (record == nullptr) continue;
+    sample->AddCongestionTelemetry(std::move(record));
+    ++joined;
+  }
+  return joined;
+}
+
+}  // namespace gnpsi
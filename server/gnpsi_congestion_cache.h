@@ -0,0 +1,95 @@
+#ifndef OPENCONFIG_GNPSI_SERVER_GNPSI_CONGESTION_CACHE_H_
+#define OPENCONFIG_GNPSI_SERVER_GNPSI_CONGESTION_CACHE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_shared_sample.h"
+
+namespace gnpsi {
+
+// Options for the congestion telemetry waiting to be joined with samples.
+struct GnpsiCongestionCacheOptions {
+  // Maximum number of records held. Rounded up to a power of two.
+  int capacity = 64 * 1024;
+  // Time a record can be joined with its sample after it was added.
+  absl::Duration ttl = absl::Seconds(5);
+};
+
+// Holds the congestion telemetry pushed by the platform until the sFlow flow
+// sample it describes is relayed. A record belongs to the sample with the same
+// sample sequence number received on its ingress port.
+//
+// The cache is a fixed-size set-associative table: a sample maps to a set of
+// a few slots, and a record added to a full set evicts the oldest record of
+// the set. Lookups therefore check a constant number of slots and never
+// allocate. Records expire once they are older than the TTL. This class is
+// thread-safe.
+class GnpsiCongestionCache {
+ public:
+  explicit GnpsiCongestionCache(
+      const GnpsiCongestionCacheOptions& options =
+          GnpsiCongestionCacheOptions());
+
+  // Adds `telemetry`, received at `now`. Replaces the record of the same
+  // sample, if any.
+  void Add(const CongestionTelemetry& telemetry, absl::Time now)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Returns the record of the sample with `sequence_number` received on
+  // `ingress_port`, or nullptr if there is none that is unexpired at `now`.
+  std::shared_ptr<const GnpsiCongestionRecord> Lookup(
+      uint32_t ingress_port, uint32_t sequence_number, absl::Time now) const
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Attaches to `sample` the records of the flow samples of its sFlow
+  // datagram that are unexpired at `now`. Returns the number of records
+  // attached. Does nothing if the packet is not a well-formed sFlow v5
+  // datagram.
+  int Join(absl::Time now, SharedSample* sample) const
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Returns true if no record was ever added, in which case joining can be
+  // skipped. Does not block.
+  bool empty() const { return empty_.load(std::memory_order_relaxed); }
+
+ private:
+  // Number of slots of each set.
+  static constexpr int kWays = 4;
+
+  struct Slot {
+    uint64_t key = 0;
+    absl::Time add_time = absl::InfinitePast();
+    std::shared_ptr<const GnpsiCongestionRecord> record;
+  };
+
+  // Returns the key of the sample with `sequence_number` received on
+  // `ingress_port`.
+  static uint64_t Key(uint32_t ingress_port, uint32_t sequence_number) {
+    return (uint64_t{ingress_port} << 32) | sequence_number;
+  }
+
+  // Returns the first slot of the set of `key`.
+  size_t SetIndex(uint64_t key) const;
+
+  std::shared_ptr<const GnpsiCongestionRecord> LookupLocked(
+      uint64_t key, absl::Time now) const ABSL_SHARED_LOCKS_REQUIRED(mu_);
+
+  const absl::Duration ttl_;
+  // Mask of the hash selecting the set of a key.
+  size_t set_mask_;
+  std::atomic<bool> empty_{true};
+  mutable absl::Mutex mu_;
+  std::vector<Slot> slots_ ABSL_GUARDED_BY(mu_);
+};
+
+}  // namespace gnpsi
+
+#endif  // OPENCONFIG_GNPSI_SERVER_GNPSI_CONGESTION_CACHE_H_
@@ -0,0 +1,153 @@
+// Measures joining sFlow flow samples with congestion telemetry.
+//
+// BM_CongestionJoin joins datagrams of state.range(1) flow samples, all of
+// which have a record, against a cache holding state.range(0) records.
+// BM_CongestionJoinWithIngest does the same while another thread adds records
+// at state.range(2) records per second, the way the platform pushes them.
+// BM_CongestionJoin reports the heap allocations per datagram joined, which
+// should be zero.
+//
+// BM_AddCongestionTelemetry measures the cost of adding a record.
+
+#include <atomic>
+#include <chrono>  // NOLINT
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "benchmark/benchmark.h"
+#include "grpcpp/support/slice.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_benchmark_util.h"
+#include "server/gnpsi_congestion_cache.h"
+#include "server/gnpsi_sflow_test_util.h"
+#include "server/gnpsi_shared_sample.h"
+
+namespace gnpsi {
+namespace {
+
+// Ingress ifIndex of the flow samples of the datagrams joined.
+constexpr uint32_t kIngressPort = 7;
+
+CongestionTelemetry Telemetry(int ingress_port, int sequence_number) {
+  CongestionTelemetry telemetry;
+  telemetry.set_ingress_port(ingress_port);
+  telemetry.set_egress_port(ingress_port + 1);
+  telemetry.set_sample_sequence_number(sequence_number);
+  Histogram* histogram = telemetry.mutable_egress_port_utilization_histogram();
+  for (int i = 0; i < 10; ++i) {
+    Bucket* bucket = histogram->add_data();
+    bucket->set_inclusive_start(i * 10);
+    bucket->set_exclusive_end((i + 1) * 10);
+    bucket->set_num_entries(100 * i);
+  }
+  return telemetry;
+}
+
+// Fills a cache of `records` records on other ports, plus the records of the
+// flow samples of the datagram built from `builder`.
+void FillCache(int records, int samples, GnpsiCongestionCache& cache,
+               SFlowDatagramBuilder& builder) {
+  const absl::Time now = absl::Now();
+  for (int i = 0; i < records; ++i) {
+    cache.Add(Telemetry(1 + i % 64, i), now);
+  }
+  for (int i = 1; i <= samples; ++i) {
+    builder.AddFlowSample(kIngressPort, kIngressPort + 1, 4096);
+    cache.Add(Telemetry(kIngressPort, i), now);
+  }
+}
+
+GnpsiCongestionCacheOptions CacheOptions(int records) {
+  GnpsiCongestionCacheOptions options;
+  options.capacity = records + 64;
+  options.ttl = absl::Hours(1);
+  return options;
+}
+
+// Joins the datagram built from `builder` until the benchmark ends.
+void JoinDatagrams(benchmark::State& state, const GnpsiCongestionCache& cache,
+                   const SFlowDatagramBuilder& builder) {
+  const grpc::Slice packet(builder.Build());
+  const absl::Time now = absl::Now();
+  for (auto _ : state) {
+    SharedSample sample(packet, /*timestamp=*/0, SFlowMetadata::V5);
+    benchmark::DoNotOptimize(cache.Join(now, &sample));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_CongestionJoin(benchmark::State& state) {
+  const int records = state.range(0);
+  GnpsiCongestionCache cache(CacheOptions(records));
+  SFlowDatagramBuilder builder;
+  FillCache(records, state.range(1), cache, builder);
+  int64_t start_allocations = AllocationCount();
+  JoinDatagrams(state, cache, builder);
+  ReportAllocationsPerSample(state, start_allocations, state.iterations());
+}
+
+void BM_CongestionJoinWithIngest(benchmark::State& state) {
+  const int records = state.range(0);
+  GnpsiCongestionCache cache(CacheOptions(records));
+  SFlowDatagramBuilder builder;
+  const int samples = state.range(1);
+  FillCache(records, samples, cache, builder);
+  // Adds records on other ports at the requested rate, in bursts of 100. The
+  // records of the datagram joined are added again with each burst, so they
+  // are not evicted.
+  const auto burst_interval =
+      std::chrono::nanoseconds(100'000'000'000 / state.range(2));
+  std::atomic<bool> stop{false};
+  std::thread ingest([&] {
+    int sequence_number = records;
+    auto next_burst = std::chrono::steady_clock::now();
+    while (!stop.load(std::memory_order_relaxed)) {
+      const absl::Time now = absl::Now();
+      for (int i = 0; i < 100; ++i, ++sequence_number) {
+        cache.Add(Telemetry(1 + sequence_number % 64, sequence_number), now);
+      }
+      for (int i = 1; i <= samples; ++i) {
+        cache.Add(Telemetry(kIngressPort, i), now);
+      }
+      next_burst += burst_interval;
+      std::this_thread::sleep_until(next_burst);
+    }
+  });
+  JoinDatagrams(state, cache, builder);
+  stop = true;
+  ingest.join();
+}
+
+void BM_AddCongestionTelemetry(benchmark::State& state) {
+  GnpsiCongestionCache cache(CacheOptions(state.range(0)));
+  const CongestionTelemetry telemetry = Telemetry(kIngressPort, 0);
+  std::vector<CongestionTelemetry> telemetry_batch(1024, telemetry);
+  for (size_t i = 0; i < telemetry_batch.size(); ++i) {
+    telemetry_batch[i].set_sample_sequence_number(i);
+  }
+  const absl::Time now = absl::Now();
+  int64_t i = 0;
+  for (auto _ : state) {
+    cache.Add(telemetry_batch[i++ % telemetry_batch.size()], now);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_CongestionJoin)
+    ->ArgNames({"records", "samples"})
+    ->ArgsProduct({{1024, 64 * 1024}, {1, 4, 8}});
+BENCHMARK(BM_CongestionJoinWithIngest)
+    ->ArgNames({"records", "samples", "records_per_second"})
+    ->ArgsProduct({{64 * 1024}, {4}, {100'000, 1'000'000}})
+    ->UseRealTime();
+BENCHMARK(BM_AddCongestionTelemetry)
+    ->ArgNames({"records"})
+    ->Arg(64 * 1024);
+
+}  // namespace
+}  // namespace gnpsi
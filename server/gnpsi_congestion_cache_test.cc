@@ -0,0 +1,113 @@
+#include "server/gnpsi_congestion_cache.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "absl/time/time.h"
+#include "grpcpp/support/slice.h"
+#include "gtest/gtest.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_sflow_test_util.h"
+#include "server/gnpsi_shared_sample.h"
+
+namespace gnpsi {
+namespace {
+
+const absl::Time kNow = absl::FromUnixSeconds(1700000000);
+
+GnpsiCongestionCacheOptions Options(int capacity, absl::Duration ttl) {
+  GnpsiCongestionCacheOptions options;
+  options.capacity = capacity;
+  options.ttl = ttl;
+  return options;
+}
+
+CongestionTelemetry Telemetry(int ingress_port, int sequence_number,
+                              int egress_port = 0) {
+  CongestionTelemetry telemetry;
+  telemetry.set_ingress_port(ingress_port);
+  telemetry.set_sample_sequence_number(sequence_number);
+  telemetry.set_egress_port(egress_port);
+  return telemetry;
+}
+
+TEST(GnpsiCongestionCacheTest, LooksUpRecordsBySample) {
+  GnpsiCongestionCache cache;
+  EXPECT_TRUE(cache.empty());
+  cache.Add(Telemetry(1, 10, /*egress_port=*/2), kNow);
+  EXPECT_FALSE(cache.empty());
+
+  std::shared_ptr<const GnpsiCongestionRecord> record =
+      cache.Lookup(1, 10, kNow);
+  ASSERT_NE(record, nullptr);
+  EXPECT_EQ(record->telemetry().egress_port(), 2);
+  EXPECT_EQ(cache.Lookup(1, 11, kNow), nullptr);
+  EXPECT_EQ(cache.Lookup(10, 1, kNow), nullptr);
+}
+
+TEST(GnpsiCongestionCacheTest, ReplacesRecordOfSameSample) {
+  GnpsiCongestionCache cache;
+  cache.Add(Telemetry(1, 10, /*egress_port=*/2), kNow);
+  cache.Add(Telemetry(1, 10, /*egress_port=*/3), kNow);
+  std::shared_ptr<const GnpsiCongestionRecord> record =
+      cache.Lookup(1, 10, kNow);
+  ASSERT_NE(record, nullptr);
+  EXPECT_EQ(record->telemetry().egress_port(), 3);
+}
+
+TEST(GnpsiCongestionCacheTest, ExpiresRecordsAfterTtl) {
+  GnpsiCongestionCache cache(Options(/*capacity=*/16, absl::Seconds(1)));
+  cache.Add(Telemetry(1, 10), kNow);
+  EXPECT_NE(cache.Lookup(1, 10, kNow + absl::Seconds(1)), nullptr);
+  EXPECT_EQ(cache.Lookup(1, 10, kNow + absl::Seconds(2)), nullptr);
+}
+
+TEST(GnpsiCongestionCacheTest, EvictsOldestRecordsBeyondCapacity) {
+  constexpr int kCapacity = 64;
+  GnpsiCongestionCache cache(Options(kCapacity, absl::Hours(1)));
+  constexpr int kRecords = 16 * kCapacity;
+  for (int i = 0; i < kRecords; ++i) {
+    cache.Add(Telemetry(1, i), kNow + absl::Milliseconds(i));
+  }
+  int held = 0;
+  for (int i = 0; i < kRecords; ++i) {
+    if (cache.Lookup(1, i, kNow + absl::Seconds(1)) != nullptr) ++held;
+  }
+  EXPECT_LE(held, kCapacity);
+  // The most recent record is always held.
+  EXPECT_NE(cache.Lookup(1, kRecords - 1, kNow + absl::Seconds(1)), nullptr);
+}
+
+TEST(GnpsiCongestionCacheTest, JoinsFlowSamplesOfDatagram) {
+  GnpsiCongestionCache cache;
+  // Sample sequence numbers are assigned from 1 in the order samples are
+  // added to the datagram.
+  cache.Add(Telemetry(1, 1, /*egress_port=*/2), kNow);
+  cache.Add(Telemetry(5, 3, /*egress_port=*/6), kNow);
+  // A counter sample and a record on another ingress port are not joined.
+  cache.Add(Telemetry(7, 2), kNow);
+  cache.Add(Telemetry(1, 3), kNow);
+  std::string packet = SFlowDatagramBuilder()
+                           .AddFlowSample(1, 2, 100)
+                           .AddCounterSample(7)
+                           .AddExpandedFlowSample(5, 6, 100)
+                           .Build();
+  SharedSample sample(grpc::Slice(packet), 0, SFlowMetadata::V5);
+  EXPECT_EQ(cache.Join(kNow, &sample), 2);
+  ASSERT_EQ(sample.congestion_telemetry().size(), 2);
+  EXPECT_EQ(sample.congestion_telemetry()[0]->telemetry().egress_port(), 2);
+  EXPECT_EQ(sample.congestion_telemetry()[1]->telemetry().egress_port(), 6);
+}
+
+TEST(GnpsiCongestionCacheTest, JoinIgnoresOtherPackets) {
+  GnpsiCongestionCache cache;
+  cache.Add(Telemetry(1, 1), kNow);
+  SharedSample sample(grpc::Slice(std::string("not sFlow")), 0,
+                      SFlowMetadata::V5);
+  EXPECT_EQ(cache.Join(kNow, &sample), 0);
+  EXPECT_TRUE(sample.congestion_telemetry().empty());
+}
+
+}  // namespace
+}  // namespace gnpsi
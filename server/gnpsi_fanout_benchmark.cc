@@ -0,0 +1,133 @@
+// Measures the CPU cost per sample of fanning a sample out to many subscribers.
+//
+// BM_FanOutSerializePerStream models ServerWriter<Sample>, which serializes the
+// Sample again for every stream. BM_FanOutSerializeOnce models the callback
+// service, which serializes each Sample once and writes a reference to the
+// same ByteBuffer to every stream.
+//
+// BM_EncodeSample compares the encoding of the first message on a stream, which
+// carries the metadata, with that of every later message.
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/time/time.h"
+#include "benchmark/benchmark.h"
+#include "grpcpp/impl/proto_utils.h"
+#include "grpcpp/server_context.h"
+#include "grpcpp/support/byte_buffer.h"
+#include "grpcpp/support/slice.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_service_impl.h"
+#include "server/gnpsi_shared_sample.h"
+
+namespace gnpsi {
+namespace {
+
+// Connection that writes every sample as soon as it is queued, the way an idle
+// reactor does, and throws the bytes away.
+class InlineWriteConnection : public GnpsiConnection {
+ public:
+  InlineWriteConnection(grpc::ServerContextBase* context,
+                        bool serialize_per_stream)
+      : GnpsiConnection(context, /*writer=*/nullptr),
+        serialize_per_stream_(serialize_per_stream) {}
+
+  std::string GetPeerName() const override { return "ipv4:127.0.0.1:9000"; }
+
+ protected:
+  void OnSampleQueued() override {
+    PendingWrite write;
+    absl::Time flush_time;
+    PopWrite(absl::InfinitePast(), &write, &flush_time);
+    const SharedSample* sample = write.samples.front().get();
+    grpc::ByteBuffer buffer;
+    if (serialize_per_stream_) {
+      bool own_buffer;
+      grpc::SerializationTraits<Sample>::Serialize(sample->sample(), &buffer,
+                                                   &own_buffer);
+    } else {
+      buffer = sample->serialized();
+    }
+    benchmark::DoNotOptimize(buffer);
+  }
+
+ private:
+  const bool serialize_per_stream_;
+};
+
+class BenchmarkConnectionManager : public GnpsiConnectionManager {
+ public:
+  using GnpsiConnectionManager::AddConnection;
+  using GnpsiConnectionManager::GnpsiConnectionManager;
+};
+
+void FanOut(benchmark::State& state, bool serialize_once) {
+  const int subscribers = state.range(0);
+  const std::string packet(state.range(1), 'x');
+  BenchmarkConnectionManager manager(subscribers, GnpsiConnectionOptions(),
+                                     serialize_once);
+  std::vector<std::unique_ptr<grpc::ServerContext>> contexts;
+  std::vector<std::shared_ptr<InlineWriteConnection>> connections;
+  for (int i = 0; i < subscribers; ++i) {
+    contexts.push_back(std::make_unique<grpc::ServerContext>());
+    connections.push_back(std::make_shared<InlineWriteConnection>(
+        contexts.back().get(), /*serialize_per_stream=*/!serialize_once));
+    if (!manager.AddConnection(connections.back()).ok()) {
+      state.SkipWithError("Failed to add connection");
+      return;
+    }
+  }
+  for (auto _ : state) {
+    manager.SendSamplePacket(packet);
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * packet.size() * subscribers);
+}
+
+void BM_FanOutSerializePerStream(benchmark::State& state) {
+  FanOut(state, /*serialize_once=*/false);
+}
+
+void BM_FanOutSerializeOnce(benchmark::State& state) {
+  FanOut(state, /*serialize_once=*/true);
+}
+
+void FanOutArgs(benchmark::internal::Benchmark* benchmark) {
+  benchmark->ArgNames({"subscribers", "packet_size"});
+  for (int packet_size : {128, 1500, 9000}) {
+    for (int subscribers : {1, 2, 4, 8, 16, 32, 64}) {
+      benchmark->Args({subscribers, packet_size});
+    }
+  }
+}
+
+BENCHMARK(BM_FanOutSerializePerStream)->Apply(FanOutArgs);
+BENCHMARK(BM_FanOutSerializeOnce)->Apply(FanOutArgs);
+
+// Encodes a sample of state.range(1) bytes with its metadata if state.range(0)
+// is set, and reports the size of the message in the "bytes_per_message"
+// counter.
+void BM_EncodeSample(benchmark::State& state) {
+  const bool with_metadata = state.range(0);
+  const std::string packet(state.range(1), 'x');
+  size_t bytes_per_message = 0;
+  for (auto _ : state) {
+    SharedSample sample(grpc::Slice(packet),
+                        /*timestamp=*/1700000000123456789, SFlowMetadata::V5);
+    sample.Serialize();
+    grpc::ByteBuffer buffer = with_metadata ? sample.SerializedWithMetadata()
+                                            : sample.serialized();
+    bytes_per_message = buffer.Length();
+    benchmark::DoNotOptimize(buffer);
+  }
+  state.counters["bytes_per_message"] = bytes_per_message;
+}
+
+BENCHMARK(BM_EncodeSample)
+    ->ArgNames({"with_metadata", "packet_size"})
+    ->ArgsProduct({{1, 0}, {128, 1500}});
+
+}  // namespace
+}  // namespace gnpsi
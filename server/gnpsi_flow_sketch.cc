@@ -0,0 +1,199 @@
+#include "server/gnpsi_flow_sketch.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "absl/hash/hash.h"
+#include "absl/numeric/bits.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_sflow_parser.h"
+
+namespace gnpsi {
+namespace {
+// Minimum number of counters per row of the count-min sketch, and the number
+// per flow summarized beyond that.
+constexpr size_t kMinWidth = 1024;
+constexpr size_t kWidthPerFlow = 8;
+}  // namespace
+
+GnpsiFlowKey GnpsiFlowKey::FromFlow(const SFlowFlow& flow,
+                                    uint32_t input_if_index) {
+  GnpsiFlowKey key;
+  key.input_if_index = input_if_index;
+  key.address_size = flow.src_address.size();
+  memcpy(key.src_address, flow.src_address.data(), flow.src_address.size());
+  memcpy(key.dst_address, flow.dst_address.data(), flow.dst_address.size());
+  key.protocol = flow.protocol;
+  key.src_port = flow.src_port;
+  key.dst_port = flow.dst_port;
+  return key;
+}
+
+bool GnpsiFlowKey::operator==(const GnpsiFlowKey& other) const {
+  return input_if_index == other.input_if_index &&
+         address_size == other.address_size && protocol == other.protocol &&
+         src_port == other.src_port && dst_port == other.dst_port &&
+         memcmp(src_address, other.src_address, address_size) == 0 &&
+         memcmp(dst_address, other.dst_address, address_size) == 0;
+}
+
+GnpsiFlowSketch::GnpsiFlowSketch(int top_k)
+    : top_k_(top_k),
+      width_(absl::bit_ceil(std::max(
+          kMinWidth, kWidthPerFlow * kMaxInterfaces * std::max(top_k, 1)))),
+      // Flows spread evenly over the shards, so each keeps its share of the
+      // top flows of every interface with room to spare.
+      shard_capacity_(2 * std::max(top_k, 1) / kShardCount + 8),
+      counters_(new Counter[kDepth * width_]) {
+  for (Shard& shard : shards_) {
+    absl::MutexLock l(&shard.mu);
+    for (std::vector<Candidate>& candidates : shard.candidates) {
+      candidates.reserve(shard_capacity_);
+    }
+  }
+}
+
+void GnpsiFlowSketch::AddDatagram(absl::string_view packet) {
+  absl::StatusOr<SFlowDatagram> datagram = SFlowDatagram::Parse(packet);
+  if (!datagram.ok()) return;
+  SFlowSample sample;
+  SFlowFlow flow;
+  while (datagram->NextSample(&sample)) {
+    if (sample.type() != SFlowSampleType::kFlow) continue;
+    // Each flow sample stands for sampling_rate packets like it.
+    const uint64_t packets = std::max<uint32_t>(sample.sampling_rate(), 1);
+    if (!sample.ReadFlow(&flow)) {
+      AddUnknown(packets, 0);
+      continue;
+    }
+    const uint32_t input_if_index =
+        sample.input_if_index().value_or(sample.source_if_index().value_or(0));
+    Add(GnpsiFlowKey::FromFlow(flow, input_if_index), packets,
+        packets * flow.frame_length);
+  }
+}
+
+void GnpsiFlowSketch::AddUnknown(uint64_t packets, uint64_t bytes) {
+  sample_count_.fetch_add(1, std::memory_order_relaxed);
+  packet_count_.fetch_add(packets, std::memory_order_relaxed);
+  byte_count_.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+int GnpsiFlowSketch::InterfaceSlot(uint32_t if_index) {
+  const uint64_t tag = uint64_t{if_index} + 1;
+  for (int i = 0; i < kMaxInterfaces; ++i) {
+    std::atomic<uint64_t>& slot = interfaces_[(if_index + i) % kMaxInterfaces];
+    uint64_t current = 0;
+    if (slot.compare_exchange_strong(current, tag,
+                                     std::memory_order_relaxed) ||
+        current == tag) {
+      return (if_index + i) % kMaxInterfaces;
+    }
+  }
+  return -1;
+}
+
+void GnpsiFlowSketch::Add(const GnpsiFlowKey& key, uint64_t packets,
+                          uint64_t bytes) {
+  AddUnknown(packets, bytes);
+  const uint64_t hash = absl::HashOf(key);
+  // The counter of each row is picked by a hash of its own, derived from two
+  // halves of the flow hash.
+  const uint64_t first = hash & 0xffffffff;
+  const uint64_t second = (hash >> 32) | 1;
+  uint64_t packet_estimate = std::numeric_limits<uint64_t>::max();
+  uint64_t byte_estimate = std::numeric_limits<uint64_t>::max();
+  for (int row = 0; row < kDepth; ++row) {
+    Counter& counter =
+        counters_[row * width_ + ((first + row * second) & (width_ - 1))];
+    packet_estimate = std::min(
+        packet_estimate,
+        counter.packets.fetch_add(packets, std::memory_order_relaxed) +
+            packets);
+    byte_estimate = std::min(
+        byte_estimate,
+        counter.bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+  }
+  const int slot = InterfaceSlot(key.input_if_index);
+  if (slot < 0) return;
+  Shard& shard = shards_[(hash >> 56) % kShardCount];
+  absl::MutexLock l(&shard.mu);
+  std::vector<Candidate>& candidates = shard.candidates[slot];
+  Candidate* lightest = nullptr;
+  for (Candidate& candidate : candidates) {
+    if (candidate.hash == hash && candidate.key == key) {
+      candidate.packets = std::max(candidate.packets, packet_estimate);
+      candidate.bytes = std::max(candidate.bytes, byte_estimate);
+      return;
+    }
+    if (lightest == nullptr || candidate.bytes < lightest->bytes) {
+      lightest = &candidate;
+    }
+  }
+  if (candidates.size() < shard_capacity_) {
+    candidates.push_back({hash, key, packet_estimate, byte_estimate});
+  } else if (byte_estimate > lightest->bytes) {
+    *lightest = {hash, key, packet_estimate, byte_estimate};
+  }
+}
+
+void GnpsiFlowSketch::Summarize(FlowSummary* summary) {
+  // The counters are cleared first, so that flows added meanwhile start over
+  // rather than carry the counts of this interval into the next.
+  for (size_t i = 0; i < kDepth * width_; ++i) {
+    counters_[i].packets.store(0, std::memory_order_relaxed);
+    counters_[i].bytes.store(0, std::memory_order_relaxed);
+  }
+  summary->set_sample_count(sample_count_.exchange(0));
+  summary->set_packet_count(packet_count_.exchange(0));
+  summary->set_byte_count(byte_count_.exchange(0));
+  for (std::atomic<uint64_t>& slot : interfaces_) {
+    slot.store(0, std::memory_order_relaxed);
+  }
+  std::vector<Candidate> candidates;
+  for (Shard& shard : shards_) {
+    absl::MutexLock l(&shard.mu);
+    for (std::vector<Candidate>& slot : shard.candidates) {
+      candidates.insert(candidates.end(), slot.begin(), slot.end());
+      slot.clear();
+    }
+  }
+  // Ranks by the interface of the key rather than by slot, as a sample added
+  // while the slots are freed may have landed in the slot of another one.
+  std::sort(candidates.begin(), candidates.end(),
+            [](const Candidate& a, const Candidate& b) {
+              if (a.key.input_if_index != b.key.input_if_index) {
+                return a.key.input_if_index < b.key.input_if_index;
+              }
+              return a.bytes > b.bytes;
+            });
+  summary->clear_flows();
+  int rank = 0;
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    const GnpsiFlowKey& key = candidates[i].key;
+    rank = i > 0 && candidates[i - 1].key.input_if_index == key.input_if_index
+               ? rank + 1
+               : 0;
+    if (rank >= top_k_) continue;
+    FlowCount* flow = summary->add_flows();
+    flow->set_input_if_index(key.input_if_index);
+    flow->set_src_address(key.src_address, key.address_size);
+    flow->set_dst_address(key.dst_address, key.address_size);
+    flow->set_protocol(key.protocol);
+    flow->set_src_port(key.src_port);
+    flow->set_dst_port(key.dst_port);
+    flow->set_packet_count(candidates[i].packets);
+    flow->set_byte_count(candidates[i].bytes);
+  }
+}
+
+}  // namespace gnpsi
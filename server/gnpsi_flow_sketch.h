@@ -0,0 +1,137 @@
+#ifndef OPENCONFIG_GNPSI_SERVER_GNPSI_FLOW_SKETCH_H_
+#define OPENCONFIG_GNPSI_SERVER_GNPSI_FLOW_SKETCH_H_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_sflow_parser.h"
+
+namespace gnpsi {
+
+// Identifies a flow: the interface it was received on and its 5-tuple.
+struct GnpsiFlowKey {
+  uint32_t input_if_index = 0;
+  // Addresses, followed by zeros, and their size.
+  char src_address[16] = {};
+  char dst_address[16] = {};
+  uint8_t address_size = 0;
+  uint8_t protocol = 0;
+  uint16_t src_port = 0;
+  uint16_t dst_port = 0;
+
+  // Returns the key of `flow`, received on `input_if_index`.
+  static GnpsiFlowKey FromFlow(const SFlowFlow& flow, uint32_t input_if_index);
+
+  bool operator==(const GnpsiFlowKey& other) const;
+
+  template <typename H>
+  friend H AbslHashValue(H h, const GnpsiFlowKey& key) {
+    return H::combine(
+        std::move(h), key.input_if_index,
+        absl::string_view(key.src_address, key.address_size),
+        absl::string_view(key.dst_address, key.address_size), key.protocol,
+        key.src_port, key.dst_port);
+  }
+};
+
+// Estimates the traffic of the heaviest flows of each interface in the sFlow
+// flow samples added to it, over fixed memory, for periodic summaries.
+//
+// The traffic of every flow is counted in a count-min sketch, whose estimates
+// never fall short of the actual counts. The flows with the largest estimates
+// are kept as candidates for the summary, separately for each of the first
+// kMaxInterfaces interfaces seen in an interval; flows of further interfaces
+// only count in the totals. Both are allocated up front, so adding samples
+// never allocates.
+//
+// Samples can be added from many threads at the same time without a lock
+// they all take: the sketch counters are relaxed atomics, and the candidates
+// are split into shards by flow, each with a lock of its own. Samples added
+// while a summary is taken may be counted in either interval, or in neither.
+class GnpsiFlowSketch {
+ public:
+  // Number of rows of the count-min sketch.
+  static constexpr int kDepth = 4;
+  // Number of shards of the candidates.
+  static constexpr int kShardCount = 16;
+  // Number of interfaces whose flows are ranked in each interval.
+  static constexpr int kMaxInterfaces = 64;
+
+  // Creates a sketch summarizing up to `top_k` flows per interface, with
+  // counters sized to tell them apart.
+  explicit GnpsiFlowSketch(int top_k);
+
+  GnpsiFlowSketch(const GnpsiFlowSketch&) = delete;
+  GnpsiFlowSketch& operator=(const GnpsiFlowSketch&) = delete;
+
+  // Adds the flow samples of the sFlow datagram `packet`, each weighted by
+  // its sampling rate. Ignores packets that are not well-formed sFlow v5.
+  void AddDatagram(absl::string_view packet);
+
+  // Adds a flow sample of `key` representing `packets` packets and `bytes`
+  // bytes.
+  void Add(const GnpsiFlowKey& key, uint64_t packets, uint64_t bytes);
+
+  // Adds a flow sample whose flow is unknown to the totals.
+  void AddUnknown(uint64_t packets, uint64_t bytes);
+
+  // Sets the counts and flows of `summary` to those added since the last
+  // summary, and starts over. The flows are the heaviest by bytes of each
+  // interface, by interface and heaviest first.
+  void Summarize(FlowSummary* summary);
+
+  int top_k() const { return top_k_; }
+
+ private:
+  struct Counter {
+    std::atomic<uint64_t> packets{0};
+    std::atomic<uint64_t> bytes{0};
+  };
+
+  // A flow with its estimated counts when last added.
+  struct Candidate {
+    uint64_t hash;
+    GnpsiFlowKey key;
+    uint64_t packets;
+    uint64_t bytes;
+  };
+
+  // Aligned to keep shards taken by different threads off each other's cache
+  // lines.
+  struct alignas(64) Shard {
+    absl::Mutex mu;
+    // Up to shard_capacity_ candidates per interface slot.
+    std::array<std::vector<Candidate>, kMaxInterfaces> candidates
+        ABSL_GUARDED_BY(mu);
+  };
+
+  // Returns the slot of the interface `if_index` in interfaces_, taking a free
+  // one if it has none, or -1 if all are taken.
+  int InterfaceSlot(uint32_t if_index);
+
+  const int top_k_;
+  // Counters per row, a power of two.
+  const size_t width_;
+  // Number of candidates kept per shard.
+  const size_t shard_capacity_;
+  // kDepth rows of width_ counters.
+  std::unique_ptr<Counter[]> counters_;
+  std::array<Shard, kShardCount> shards_;
+  // Interface of each slot plus one, or 0 for a free slot.
+  std::array<std::atomic<uint64_t>, kMaxInterfaces> interfaces_{};
+  std::atomic<uint64_t> sample_count_{0};
+  std::atomic<uint64_t> packet_count_{0};
+  std::atomic<uint64_t> byte_count_{0};
+};
+
+}  // namespace gnpsi
+
+#endif  // OPENCONFIG_GNPSI_SERVER_GNPSI_FLOW_SKETCH_H_
@@ -0,0 +1,205 @@
+#include "server/gnpsi_flow_sketch.h"
+
+#include <cstdint>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_sflow_test_util.h"
+
+namespace gnpsi {
+namespace {
+
+// Returns the key of a TCP flow to port 443 from `src_port`.
+GnpsiFlowKey Key(uint16_t src_port, uint32_t input_if_index = 1) {
+  GnpsiFlowKey key;
+  key.input_if_index = input_if_index;
+  key.address_size = 4;
+  key.src_address[0] = 10;
+  key.dst_address[0] = 11;
+  key.protocol = 6;
+  key.src_port = src_port;
+  key.dst_port = 443;
+  return key;
+}
+
+// Returns the source ports of the flows of `summary`, in order.
+std::vector<uint32_t> SrcPorts(const FlowSummary& summary) {
+  std::vector<uint32_t> ports;
+  for (const FlowCount& flow : summary.flows()) {
+    ports.push_back(flow.src_port());
+  }
+  return ports;
+}
+
+TEST(GnpsiFlowSketchTest, SummarizesHeaviestFlowsFirst) {
+  GnpsiFlowSketch sketch(/*top_k=*/2);
+  sketch.Add(Key(1), 10, 1000);
+  sketch.Add(Key(2), 10, 3000);
+  sketch.Add(Key(3), 10, 2000);
+  sketch.Add(Key(1), 10, 500);
+
+  FlowSummary summary;
+  sketch.Summarize(&summary);
+  EXPECT_EQ(summary.sample_count(), 4);
+  EXPECT_EQ(summary.packet_count(), 40);
+  EXPECT_EQ(summary.byte_count(), 6500);
+  EXPECT_THAT(SrcPorts(summary), testing::ElementsAre(2, 3));
+  EXPECT_EQ(summary.flows(0).byte_count(), 3000);
+  EXPECT_EQ(summary.flows(0).packet_count(), 10);
+  EXPECT_EQ(summary.flows(0).input_if_index(), 1);
+  EXPECT_EQ(summary.flows(0).protocol(), 6);
+  EXPECT_EQ(summary.flows(0).dst_port(), 443);
+  EXPECT_EQ(summary.flows(0).src_address(), std::string("\x0a\0\0\0", 4));
+}
+
+TEST(GnpsiFlowSketchTest, TellsInterfacesApart) {
+  GnpsiFlowSketch sketch(/*top_k=*/10);
+  sketch.Add(Key(1, /*input_if_index=*/1), 1, 100);
+  sketch.Add(Key(1, /*input_if_index=*/2), 1, 200);
+
+  FlowSummary summary;
+  sketch.Summarize(&summary);
+  ASSERT_EQ(summary.flows_size(), 2);
+  EXPECT_EQ(summary.flows(0).input_if_index(), 1);
+  EXPECT_EQ(summary.flows(0).byte_count(), 100);
+  EXPECT_EQ(summary.flows(1).input_if_index(), 2);
+  EXPECT_EQ(summary.flows(1).byte_count(), 200);
+}
+
+TEST(GnpsiFlowSketchTest, SummarizesHeaviestFlowsOfEachInterface) {
+  GnpsiFlowSketch sketch(/*top_k=*/2);
+  // Interface 1 carries much more than interface 2, whose flows are still
+  // ranked on their own.
+  for (uint16_t port = 1; port <= 4; ++port) {
+    sketch.Add(Key(port, /*input_if_index=*/1), 1, 1000 * port);
+    sketch.Add(Key(port, /*input_if_index=*/2), 1, port);
+  }
+
+  FlowSummary summary;
+  sketch.Summarize(&summary);
+  EXPECT_THAT(SrcPorts(summary), testing::ElementsAre(4, 3, 4, 3));
+  ASSERT_EQ(summary.flows_size(), 4);
+  EXPECT_EQ(summary.flows(0).input_if_index(), 1);
+  EXPECT_EQ(summary.flows(1).input_if_index(), 1);
+  EXPECT_EQ(summary.flows(2).input_if_index(), 2);
+  EXPECT_EQ(summary.flows(3).input_if_index(), 2);
+}
+
+TEST(GnpsiFlowSketchTest, RanksFlowsOfUpToMaxInterfaces) {
+  GnpsiFlowSketch sketch(/*top_k=*/1);
+  for (uint32_t if_index = 0; if_index <= GnpsiFlowSketch::kMaxInterfaces;
+       ++if_index) {
+    sketch.Add(Key(1, if_index), 1, 10);
+  }
+
+  FlowSummary summary;
+  sketch.Summarize(&summary);
+  // The flow of the interface past the limit only counts in the totals.
+  EXPECT_EQ(summary.sample_count(), GnpsiFlowSketch::kMaxInterfaces + 1);
+  ASSERT_EQ(summary.flows_size(), GnpsiFlowSketch::kMaxInterfaces);
+  EXPECT_EQ(summary.flows(GnpsiFlowSketch::kMaxInterfaces - 1)
+                .input_if_index(),
+            GnpsiFlowSketch::kMaxInterfaces - 1);
+
+  // Interfaces are taken afresh in each interval.
+  sketch.Add(Key(1, GnpsiFlowSketch::kMaxInterfaces), 1, 10);
+  sketch.Summarize(&summary);
+  ASSERT_EQ(summary.flows_size(), 1);
+  EXPECT_EQ(summary.flows(0).input_if_index(),
+            GnpsiFlowSketch::kMaxInterfaces);
+}
+
+TEST(GnpsiFlowSketchTest, StartsOverAfterEachSummary) {
+  GnpsiFlowSketch sketch(/*top_k=*/10);
+  sketch.Add(Key(1), 1, 100);
+  FlowSummary summary;
+  sketch.Summarize(&summary);
+
+  sketch.Add(Key(2), 1, 50);
+  sketch.Summarize(&summary);
+  EXPECT_EQ(summary.sample_count(), 1);
+  EXPECT_EQ(summary.byte_count(), 50);
+  EXPECT_THAT(SrcPorts(summary), testing::ElementsAre(2));
+  EXPECT_EQ(summary.flows(0).byte_count(), 50);
+}
+
+TEST(GnpsiFlowSketchTest, KeepsHeavyFlowsAmongManyLightOnes) {
+  GnpsiFlowSketch sketch(/*top_k=*/3);
+  for (uint16_t port = 100; port < 10100; ++port) {
+    sketch.Add(Key(port), 1, 10);
+  }
+  for (uint16_t port = 1; port <= 3; ++port) {
+    for (int i = 0; i < 100; ++i) sketch.Add(Key(port), 1, 100 * port);
+  }
+
+  FlowSummary summary;
+  sketch.Summarize(&summary);
+  EXPECT_THAT(SrcPorts(summary), testing::ElementsAre(3, 2, 1));
+  // Estimates are never below the actual counts.
+  EXPECT_GE(summary.flows(0).byte_count(), 30000);
+  EXPECT_GE(summary.flows(0).packet_count(), 100);
+}
+
+TEST(GnpsiFlowSketchTest, AddsFlowSamplesOfDatagrams) {
+  const std::string src("\x0a\x01\x02\x03", 4);
+  const std::string dst("\x0a\x04\x05\x06", 4);
+  std::string packet =
+      SFlowDatagramBuilder()
+          .AddFlowSample(/*input_if_index=*/7, 2, /*sampling_rate=*/100,
+                         {SampledIpv4HeaderRecord(src, dst, 17, 53, 53,
+                                                  /*frame_length=*/200)})
+          .AddFlowSample(7, 2, /*sampling_rate=*/10)
+          .AddCounterSample(7)
+          .Build();
+  GnpsiFlowSketch sketch(/*top_k=*/10);
+  sketch.AddDatagram(packet);
+  sketch.AddDatagram("not a datagram");
+
+  FlowSummary summary;
+  sketch.Summarize(&summary);
+  // The flow sample without a flow only counts in the totals.
+  EXPECT_EQ(summary.sample_count(), 2);
+  EXPECT_EQ(summary.packet_count(), 110);
+  EXPECT_EQ(summary.byte_count(), 20000);
+  ASSERT_EQ(summary.flows_size(), 1);
+  EXPECT_EQ(summary.flows(0).input_if_index(), 7);
+  EXPECT_EQ(summary.flows(0).src_address(), src);
+  EXPECT_EQ(summary.flows(0).dst_address(), dst);
+  EXPECT_EQ(summary.flows(0).protocol(), 17);
+  EXPECT_EQ(summary.flows(0).packet_count(), 100);
+  EXPECT_EQ(summary.flows(0).byte_count(), 20000);
+}
+
+TEST(GnpsiFlowSketchTest, CountsSamplesAddedConcurrently) {
+  GnpsiFlowSketch sketch(/*top_k=*/10);
+  constexpr int kThreadCount = 4;
+  constexpr int kSamplesPerThread = 10000;
+  std::vector<std::thread> threads;
+  for (int thread = 0; thread < kThreadCount; ++thread) {
+    threads.emplace_back([&sketch, thread] {
+      for (int i = 0; i < kSamplesPerThread; ++i) {
+        sketch.Add(Key(i % 2 == 0 ? 1 : 2 + thread), 1, 10);
+      }
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+
+  FlowSummary summary;
+  sketch.Summarize(&summary);
+  EXPECT_EQ(summary.sample_count(), kThreadCount * kSamplesPerThread);
+  ASSERT_GT(summary.flows_size(), 0);
+  // The flow all threads add to is counted in full, but for the samples other
+  // threads were adding when it was last estimated.
+  EXPECT_EQ(summary.flows(0).src_port(), 1);
+  EXPECT_GE(summary.flows(0).packet_count(),
+            kThreadCount * kSamplesPerThread / 2 - kThreadCount);
+  EXPECT_LE(summary.flows(0).packet_count(),
+            kThreadCount * kSamplesPerThread / 2);
+}
+
+}  // namespace
+}  // namespace gnpsi
@@ -0,0 +1,51 @@
+#include "server/gnpsi_histogram.h"
+
+#include <atomic>
+#include <cstdint>
+#include <limits>
+
+#include "absl/numeric/bits.h"
+#include "proto/gnpsi/histogram.pb.h"
+
+namespace gnpsi {
+
+int GnpsiHistogram::BucketIndex(int64_t value) {
+  if (value < kSubBuckets) return value < 0 ? 0 : value;
+  // The highest bit selects the power of two and the kSubBucketBits below it
+  // the sub-bucket.
+  uint64_t v = static_cast<uint64_t>(value);
+  int width = absl::bit_width(v);
+  int shift = width - kSubBucketBits - 1;
+  return kSubBuckets * (shift + 1) + ((v >> shift) & (kSubBuckets - 1));
+}
+
+void GnpsiHistogram::BucketBounds(int index, Bucket* bucket) {
+  if (index < kSubBuckets) {
+    bucket->set_inclusive_start(index);
+    bucket->set_exclusive_end(index + 1);
+    return;
+  }
+  int shift = index / kSubBuckets - 1;
+  uint64_t sub_bucket = kSubBuckets + index % kSubBuckets;
+  bucket->set_inclusive_start(sub_bucket << shift);
+  uint64_t end = (sub_bucket + 1) << shift;
+  // The end of the last bucket does not fit in an int64.
+  bucket->set_exclusive_end(
+      end > std::numeric_limits<int64_t>::max()
+          ? std::numeric_limits<int64_t>::max()
+          : static_cast<int64_t>(end));
+}
+
+Histogram GnpsiHistogram::ToProto() const {
+  Histogram histogram;
+  for (int i = 0; i < kNumBuckets; ++i) {
+    uint64_t count = buckets_[i].load(std::memory_order_relaxed);
+    if (count == 0) continue;
+    Bucket* bucket = histogram.add_data();
+    BucketBounds(i, bucket);
+    bucket->set_num_entries(count);
+  }
+  return histogram;
+}
+
+}  // namespace gnpsi
@@ -0,0 +1,51 @@
+#ifndef OPENCONFIG_GNPSI_SERVER_GNPSI_HISTOGRAM_H_
+#define OPENCONFIG_GNPSI_SERVER_GNPSI_HISTOGRAM_H_
+
+#include <atomic>
+#include <cstdint>
+
+#include "absl/time/time.h"
+#include "proto/gnpsi/histogram.pb.h"
+
+namespace gnpsi {
+
+// A histogram of non-negative values that is cheap enough to record on the
+// data path: recording is a relaxed atomic increment of one bucket, without
+// locks or allocation. Values below 4 have a bucket each; larger values are
+// bucketed with 4 buckets per power of two, so a bucket is at most 25% wider
+// than its start. This class is thread-safe.
+class GnpsiHistogram {
+ public:
+  GnpsiHistogram() = default;
+  GnpsiHistogram(const GnpsiHistogram&) = delete;
+  GnpsiHistogram& operator=(const GnpsiHistogram&) = delete;
+
+  // Adds `value` to the histogram. Negative values are counted as 0.
+  void Record(int64_t value) {
+    buckets_[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+  }
+  // Adds `duration` in nanoseconds to the histogram.
+  void Record(absl::Duration duration) {
+    Record(absl::ToInt64Nanoseconds(duration));
+  }
+
+  // Returns the non-empty buckets, in increasing order. Buckets are read
+  // independently, so values recorded concurrently may or may not be seen.
+  Histogram ToProto() const;
+
+ private:
+  static constexpr int kSubBucketBits = 2;
+  static constexpr int kSubBuckets = 1 << kSubBucketBits;
+  // Values are at most 63 bits wide.
+  static constexpr int kNumBuckets = kSubBuckets * (64 - kSubBucketBits);
+
+  static int BucketIndex(int64_t value);
+  // Sets the bounds of the bucket at `index`.
+  static void BucketBounds(int index, Bucket* bucket);
+
+  std::atomic<uint64_t> buckets_[kNumBuckets] = {};
+};
+
+}  // namespace gnpsi
+
+#endif  // OPENCONFIG_GNPSI_SERVER_GNPSI_HISTOGRAM_H_
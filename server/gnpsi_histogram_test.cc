@@ -0,0 +1,74 @@
+#include "server/gnpsi_histogram.h"
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "absl/time/time.h"
+#include "gtest/gtest.h"
+#include "proto/gnpsi/histogram.pb.h"
+
+namespace gnpsi {
+namespace {
+
+// Returns the bucket of `histogram` holding a single recorded value.
+Bucket OnlyBucket(const GnpsiHistogram& histogram) {
+  Histogram proto = histogram.ToProto();
+  EXPECT_EQ(proto.data_size(), 1);
+  return proto.data_size() == 0 ? Bucket() : proto.data(0);
+}
+
+TEST(GnpsiHistogramTest, EmptyHistogramHasNoBuckets) {
+  GnpsiHistogram histogram;
+  EXPECT_EQ(histogram.ToProto().data_size(), 0);
+}
+
+TEST(GnpsiHistogramTest, SmallValuesHaveABucketEach) {
+  for (int64_t value = 0; value < 4; ++value) {
+    GnpsiHistogram histogram;
+    histogram.Record(value);
+    Bucket bucket = OnlyBucket(histogram);
+    EXPECT_EQ(bucket.inclusive_start(), value);
+    EXPECT_EQ(bucket.exclusive_end(), value + 1);
+    EXPECT_EQ(bucket.num_entries(), 1);
+  }
+}
+
+TEST(GnpsiHistogramTest, BucketContainsRecordedValue) {
+  for (int64_t value : std::vector<int64_t>{
+           4, 5, 7, 8, 9, 10, 15, 1000, 123456789,
+           std::numeric_limits<int64_t>::max() / 3}) {
+    GnpsiHistogram histogram;
+    histogram.Record(value);
+    Bucket bucket = OnlyBucket(histogram);
+    EXPECT_LE(bucket.inclusive_start(), value);
+    EXPECT_GT(bucket.exclusive_end(), value);
+    // Buckets are at most 25% wider than their start.
+    EXPECT_LE(bucket.exclusive_end() - bucket.inclusive_start(),
+              bucket.inclusive_start() / 4);
+  }
+}
+
+TEST(GnpsiHistogramTest, ClampsOutOfRangeValues) {
+  GnpsiHistogram histogram;
+  histogram.Record(-5);
+  histogram.Record(std::numeric_limits<int64_t>::max());
+  Histogram proto = histogram.ToProto();
+  ASSERT_EQ(proto.data_size(), 2);
+  EXPECT_EQ(proto.data(0).inclusive_start(), 0);
+  EXPECT_EQ(proto.data(1).exclusive_end(),
+            std::numeric_limits<int64_t>::max());
+}
+
+TEST(GnpsiHistogramTest, RecordsDurationsInNanoseconds) {
+  GnpsiHistogram histogram;
+  histogram.Record(absl::Microseconds(3));
+  histogram.Record(absl::Microseconds(3));
+  Bucket bucket = OnlyBucket(histogram);
+  EXPECT_LE(bucket.inclusive_start(), 3000);
+  EXPECT_GT(bucket.exclusive_end(), 3000);
+  EXPECT_EQ(bucket.num_entries(), 2);
+}
+
+}  // namespace
+}  // namespace gnpsi
@@ -0,0 +1,271 @@
+#include "server/gnpsi_io_uring.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+
+namespace gnpsi {
+namespace {
+
+int IoUringSetup(unsigned entries, struct io_uring_params* params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int IoUringEnter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                 unsigned flags) {
+  return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+                 nullptr, _NSIG / 8);
+}
+
+int IoUringRegister(int ring_fd, unsigned opcode, void* arg,
+                    unsigned nr_args) {
+  return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+// Maps `size` bytes shared with the kernel, either of the io_uring `ring_fd`
+// at `offset`, or anonymous memory if `ring_fd` is -1.
+void* Map(size_t size, int ring_fd, off_t offset) {
+  int flags = MAP_SHARED | MAP_POPULATE;
+  if (ring_fd < 0) flags |= MAP_ANONYMOUS;
+  void* addr =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, ring_fd, offset);
+  return addr == MAP_FAILED ? nullptr : addr;
+}
+
+void Unmap(void* addr, size_t size) {
+  if (addr != nullptr) munmap(addr, size);
+}
+
+absl::Status ErrnoStatus(int error_number, absl::string_view message) {
+  std::string text = absl::StrCat(message, ": ", strerror(error_number));
+  // Kernels without io_uring, or with it disabled, fail with these.
+  if (error_number == ENOSYS || error_number == EPERM) {
+    return absl::UnimplementedError(text);
+  }
+  return absl::InternalError(text);
+}
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<GnpsiIoUring>> GnpsiIoUring::Create(
+    unsigned entries, int buffer_count, size_t buffer_size) {
+  if (buffer_count <= 0 || buffer_count > 32768 ||
+      (buffer_count & (buffer_count - 1)) != 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Buffer count must be a power of two up to 32768: ", buffer_count));
+  }
+  std::unique_ptr<GnpsiIoUring> ring(new GnpsiIoUring);
+  // Multishot requests post many completions per submission, so the
+  // completion queue is sized for the buffers rather than the submissions.
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER |
+                 IORING_SETUP_DEFER_TASKRUN;
+  params.cq_entries = std::max<unsigned>(2 * buffer_count, 2 * entries);
+  ring->ring_fd_ = IoUringSetup(entries, &params);
+  if (ring->ring_fd_ < 0 && errno == EINVAL) {
+    // Kernels before 6.1 lack deferred task running, which only saves work.
+    params.flags = IORING_SETUP_CQSIZE;
+    ring->ring_fd_ = IoUringSetup(entries, &params);
+  }
+  if (ring->ring_fd_ < 0) {
+    return ErrnoStatus(errno, "Failed to set up io_uring");
+  }
+  absl::Status status = ring->MapRings(params);
+  if (!status.ok()) return status;
+  status = ring->RegisterBuffers(buffer_count, buffer_size);
+  if (!status.ok()) return status;
+  return ring;
+}
+
+GnpsiIoUring::~GnpsiIoUring() {
+  if (ring_fd_ >= 0) {
+    // Cancel the armed requests before unmapping the buffers they receive
+    // into, as closing the ring only cancels them asynchronously.
+    struct io_uring_sync_cancel_reg cancel;
+    memset(&cancel, 0, sizeof(cancel));
+    cancel.flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+    cancel.timeout.tv_sec = -1;
+    cancel.timeout.tv_nsec = -1;
+    IoUringRegister(ring_fd_, IORING_REGISTER_SYNC_CANCEL, &cancel, 1);
+    close(ring_fd_);
+  }
+  Unmap(buffers_, buffers_size_);
+  Unmap(buf_ring_, buf_ring_size_);
+  Unmap(sqes_, sqes_size_);
+  if (cq_ring_ != sq_ring_) Unmap(cq_ring_, cq_ring_size_);
+  Unmap(sq_ring_, sq_ring_size_);
+}
+
+absl::Status GnpsiIoUring::MapRings(const struct io_uring_params& params) {
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    cq_ring_size_ = sq_ring_size_;
+  }
+  sq_ring_ = Map(sq_ring_size_, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == nullptr) {
+    return ErrnoStatus(errno, "Failed to map io_uring submission queue");
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = Map(cq_ring_size_, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == nullptr) {
+      return ErrnoStatus(errno, "Failed to map io_uring completion queue");
+    }
+  }
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes_ = static_cast<struct io_uring_sqe*>(
+      Map(sqes_size_, ring_fd_, IORING_OFF_SQES));
+  if (sqes_ == nullptr) {
+    return ErrnoStatus(errno, "Failed to map io_uring submission entries");
+  }
+  char* sq = static_cast<char*>(sq_ring_);
+  sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_entries_ = params.sq_entries;
+  sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  char* cq = static_cast<char*>(cq_ring_);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+  return absl::OkStatus();
+}
+
+absl::Status GnpsiIoUring::RegisterBuffers(int buffer_count,
+                                           size_t buffer_size) {
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  buf_ring_size_ = (buffer_count * sizeof(struct io_uring_buf) + page_size -
+                    1) / page_size * page_size;
+  buf_ring_ =
+      static_cast<struct io_uring_buf_ring*>(Map(buf_ring_size_, -1, 0));
+  // The control messages of a buffer are read as struct cmsghdr, so every
+  // buffer starts aligned for it.
+  constexpr size_t kAlignment = alignof(struct cmsghdr);
+  buffer_size_ = (buffer_size + kAlignment - 1) / kAlignment * kAlignment;
+  buffers_size_ = buffer_count * buffer_size_;
+  buffers_ = static_cast<char*>(Map(buffers_size_, -1, 0));
+  if (buf_ring_ == nullptr || buffers_ == nullptr) {
+    return ErrnoStatus(errno, "Failed to allocate io_uring buffers");
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_);
+  reg.ring_entries = buffer_count;
+  reg.bgid = kBufferGroup;
+  if (IoUringRegister(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    if (errno == EINVAL) {
+      return absl::UnimplementedError(
+          "io_uring provided buffer rings are not supported");
+    }
+    return ErrnoStatus(errno, "Failed to register io_uring buffers");
+  }
+  buf_mask_ = buffer_count - 1;
+  for (int id = 0; id < buffer_count; ++id) {
+    struct io_uring_buf* buf = RingEntry(id);
+    buf->addr = reinterpret_cast<uint64_t>(buffer(id));
+    buf->len = buffer_size_;
+    buf->bid = id;
+  }
+  __atomic_store_n(&buf_ring_->tail, static_cast<uint16_t>(buffer_count),
+                   __ATOMIC_RELEASE);
+  return absl::OkStatus();
+}
+
+struct io_uring_sqe* GnpsiIoUring::NextSqe() {
+  const unsigned tail = *sq_tail_;
+  if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+    return nullptr;
+  }
+  const unsigned index = tail & sq_mask_;
+  struct io_uring_sqe* sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array_[index] = index;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  ++sq_pending_;
+  return sqe;
+}
+
+bool GnpsiIoUring::PrepareRecvMsgMultishot(int fd, const struct msghdr* msg,
+                                           uint64_t user_data) {
+  struct io_uring_sqe* sqe = NextSqe();
+  if (sqe == nullptr) return false;
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(msg);
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = kBufferGroup;
+  sqe->user_data = user_data;
+  return true;
+}
+
+bool GnpsiIoUring::PreparePoll(int fd, uint32_t events, uint64_t user_data) {
+  struct io_uring_sqe* sqe = NextSqe();
+  if (sqe == nullptr) return false;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->user_data = user_data;
+  return true;
+}
+
+int GnpsiIoUring::SubmitAndWait(unsigned wait_for) {
+  int submitted =
+      IoUringEnter(ring_fd_, sq_pending_, wait_for, IORING_ENTER_GETEVENTS);
+  if (submitted < 0) return errno;
+  sq_pending_ -= submitted;
+  return 0;
+}
+
+int GnpsiIoUring::PopCompletions(GnpsiIoUringCompletion* completions,
+                                 int max_completions) {
+  const unsigned head = *cq_head_;
+  const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  const int count = std::min<unsigned>(tail - head, max_completions);
+  for (int i = 0; i < count; ++i) {
+    const struct io_uring_cqe& cqe = cqes_[(head + i) & cq_mask_];
+    completions[i] = {cqe.user_data, cqe.res, cqe.flags};
+  }
+  __atomic_store_n(cq_head_, head + count, __ATOMIC_RELEASE);
+  return count;
+}
+
+struct io_uring_buf* GnpsiIoUring::RingEntry(uint16_t index) const {
+  // The entries start at the ring itself, their first one overlaid with the
+  // tail. Compiled as C++, the flexible array of struct io_uring_buf_ring
+  // is placed after an empty struct instead, so it is not used.
+  return reinterpret_cast<struct io_uring_buf*>(buf_ring_) + index;
+}
+
+void GnpsiIoUring::RecycleBuffer(uint16_t id) {
+  const uint16_t tail = buf_ring_->tail;
+  struct io_uring_buf* buf = RingEntry(tail & buf_mask_);
+  buf->addr = reinterpret_cast<uint64_t>(buffer(id));
+  buf->len = buffer_size_;
+  buf->bid = id;
+  __atomic_store_n(&buf_ring_->tail, static_cast<uint16_t>(tail + 1),
+                   __ATOMIC_RELEASE);
+}
+
+}  // namespace gnpsi
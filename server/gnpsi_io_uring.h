@@ -0,0 +1,129 @@
+#ifndef OPENCONFIG_GNPSI_SERVER_GNPSI_IO_URING_H_
+#define OPENCONFIG_GNPSI_SERVER_GNPSI_IO_URING_H_
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+
+namespace gnpsi {
+
+// A completion of a request submitted to a GnpsiIoUring.
+struct GnpsiIoUringCompletion {
+  uint64_t user_data;
+  // Result of the request: a byte count, or a negated errno value.
+  int32_t res;
+  // IORING_CQE_F_* flags.
+  uint32_t flags;
+};
+
+// A minimal io_uring instance for receiving datagrams with multishot recvmsg
+// into a ring of provided buffers, set up with the raw system calls rather
+// than liburing.
+//
+// Provided buffers are picked by the kernel as datagrams arrive, so a single
+// armed request keeps receiving without a system call per datagram. Each
+// buffer has to be recycled once its datagram has been consumed. This class
+// is not thread-safe: it is meant to be owned by the thread reading from it.
+class GnpsiIoUring {
+ public:
+  // Buffer group of the provided buffers.
+  static constexpr uint16_t kBufferGroup = 0;
+
+  // Sets up an io_uring with room for `entries` submissions and a ring of
+  // `buffer_count` provided buffers of `buffer_size` bytes, rounded up so that
+  // each buffer is aligned for the struct cmsghdr of its control messages.
+  // `buffer_count` must be a power of two of at most 32768. Returns an UNIMPLEMENTED error
+  // if the kernel lacks io_uring or provided buffer rings, which requires
+  // Linux 5.19, and an INTERNAL error on other failures.
+  static absl::StatusOr<std::unique_ptr<GnpsiIoUring>> Create(
+      unsigned entries, int buffer_count, size_t buffer_size);
+
+  GnpsiIoUring(const GnpsiIoUring&) = delete;
+  GnpsiIoUring& operator=(const GnpsiIoUring&) = delete;
+  ~GnpsiIoUring();
+
+  // Queues a multishot recvmsg on `fd` into the provided buffers, with the
+  // name and control sizes of `msg`, which has to outlive the request. Each
+  // buffer then starts with a struct io_uring_recvmsg_out, followed by the
+  // name, the control messages and the payload. Returns false if the
+  // submission queue is full.
+  bool PrepareRecvMsgMultishot(int fd, const struct msghdr* msg,
+                               uint64_t user_data);
+
+  // Queues a single shot poll of `fd` for the poll(2) `events`. Returns false
+  // if the submission queue is full.
+  bool PreparePoll(int fd, uint32_t events, uint64_t user_data);
+
+  // Submits the queued requests and waits for at least `wait_for`
+  // completions. Returns the errno value on failure; EINTR is not retried.
+  int SubmitAndWait(unsigned wait_for);
+
+  // Submits the queued requests without waiting, to make room in the
+  // submission queue. Returns the errno value on failure.
+  int Submit() { return SubmitAndWait(/*wait_for=*/0); }
+
+  // Pops up to `max_completions` completions into `completions`. Returns the
+  // number popped.
+  int PopCompletions(GnpsiIoUringCompletion* completions, int max_completions);
+
+  // Returns the provided buffer `id` of a completion flagged with
+  // IORING_CQE_F_BUFFER, which carries it in its upper 16 bits.
+  char* buffer(uint16_t id) const { return buffers_ + id * buffer_size_; }
+  size_t buffer_size() const { return buffer_size_; }
+
+  // Gives the provided buffer `id` back to the kernel.
+  void RecycleBuffer(uint16_t id);
+
+ private:
+  GnpsiIoUring() = default;
+
+  // Maps the rings of the io_uring set up with `params`.
+  absl::Status MapRings(const struct io_uring_params& params);
+  // Allocates and registers the provided buffers.
+  absl::Status RegisterBuffers(int buffer_count, size_t buffer_size);
+  // Returns a cleared submission queue entry, queued for the next submit, or
+  // null if the submission queue is full.
+  struct io_uring_sqe* NextSqe();
+  // Returns the entry `index` of the provided buffer ring.
+  struct io_uring_buf* RingEntry(uint16_t index) const;
+
+  int ring_fd_ = -1;
+  // Mappings of the submission and completion rings, which may be the same,
+  // and of the submission queue entries.
+  void* sq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  void* cq_ring_ = nullptr;
+  size_t cq_ring_size_ = 0;
+  struct io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned sq_entries_ = 0;
+  unsigned sq_mask_ = 0;
+  unsigned* sq_array_ = nullptr;
+  // Submissions queued since the last SubmitAndWait.
+  unsigned sq_pending_ = 0;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  struct io_uring_cqe* cqes_ = nullptr;
+
+  // The provided buffer ring and the buffers it hands out.
+  struct io_uring_buf_ring* buf_ring_ = nullptr;
+  size_t buf_ring_size_ = 0;
+  uint16_t buf_mask_ = 0;
+  char* buffers_ = nullptr;
+  size_t buffers_size_ = 0;
+  size_t buffer_size_ = 0;
+};
+
+}  // namespace gnpsi
+
+#endif  // OPENCONFIG_GNPSI_SERVER_GNPSI_IO_URING_H_
@@ -0,0 +1,108 @@
+#include "server/gnpsi_packet_buffer.h"
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+#include "absl/synchronization/mutex.h"
+#include "grpcpp/support/slice.h"
+
+namespace gnpsi {
+
+// Storage of a buffer. While the buffer is in use, `pool` keeps the pool it
+// returns to alive; it is cleared once the block is back on the free list.
+struct GnpsiPacketBuffer::Block {
+  explicit Block(size_t size) : data(new char[size]) {}
+
+  std::shared_ptr<GnpsiBufferPool> pool;
+  std::unique_ptr<char[]> data;
+};
+
+GnpsiPacketBuffer& GnpsiPacketBuffer::operator=(
+    GnpsiPacketBuffer&& other) noexcept {
+  if (this != &other) {
+    Reset();
+    block_ = other.block_;
+    size_ = other.size_;
+    receive_time_ = other.receive_time_;
+    other.block_ = nullptr;
+    other.size_ = 0;
+  }
+  return *this;
+}
+
+char* GnpsiPacketBuffer::data() const {
+  return block_ == nullptr ? nullptr : block_->data.get();
+}
+
+size_t GnpsiPacketBuffer::capacity() const {
+  return block_ == nullptr ? 0 : block_->pool->buffer_size();
+}
+
+grpc::Slice GnpsiPacketBuffer::ToSlice() && {
+  if (block_ == nullptr) return grpc::Slice();
+  Block* block = block_;
+  size_t size = size_;
+  block_ = nullptr;
+  size_ = 0;
+  receive_time_ = absl::InfinitePast();
+  return grpc::Slice(block->data.get(), size, &GnpsiPacketBuffer::ReleaseBlock,
+                     block);
+}
+
+void GnpsiPacketBuffer::Reset() {
+  if (block_ == nullptr) return;
+  ReleaseBlock(block_);
+  block_ = nullptr;
+  size_ = 0;
+  receive_time_ = absl::InfinitePast();
+}
+
+void GnpsiPacketBuffer::ReleaseBlock(void* block) {
+  Block* b = static_cast<Block*>(block);
+  // The pool may be destroyed by the last reset of its reference below, so
+  // hold on to it until the block is released.
+  std::shared_ptr<GnpsiBufferPool> pool = std::move(b->pool);
+  pool->Release(b);
+}
+
+std::shared_ptr<GnpsiBufferPool> GnpsiBufferPool::Create(size_t buffer_size,
+                                                         int max_free_buffers) {
+  return std::shared_ptr<GnpsiBufferPool>(
+      new GnpsiBufferPool(buffer_size, max_free_buffers));
+}
+
+GnpsiBufferPool::~GnpsiBufferPool() {
+  for (GnpsiPacketBuffer::Block* block : free_blocks_) {
+    delete block;
+  }
+}
+
+GnpsiPacketBuffer GnpsiBufferPool::Acquire() {
+  GnpsiPacketBuffer::Block* block = nullptr;
+  {
+    absl::MutexLock l(&mu_);
+    if (!free_blocks_.empty()) {
+      block = free_blocks_.back();
+      free_blocks_.pop_back();
+    }
+  }
+  if (block == nullptr) {
+    block = new GnpsiPacketBuffer::Block(buffer_size_);
+  }
+  block->pool = shared_from_this();
+  return GnpsiPacketBuffer(block);
+}
+
+void GnpsiBufferPool::Release(GnpsiPacketBuffer::Block* block) {
+  {
+    absl::MutexLock l(&mu_);
+    if (free_blocks_.size() < max_free_buffers_) {
+      free_blocks_.push_back(block);
+      return;
+    }
+  }
+  delete block;
+}
+
+}  // namespace gnpsi
@@ -0,0 +1,112 @@
+#ifndef OPENCONFIG_GNPSI_SERVER_GNPSI_PACKET_BUFFER_H_
+#define OPENCONFIG_GNPSI_SERVER_GNPSI_PACKET_BUFFER_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "grpcpp/support/slice.h"
+
+namespace gnpsi {
+
+class GnpsiBufferPool;
+
+// A move-only handle to a fixed-size buffer from a GnpsiBufferPool. The buffer
+// goes back to its pool when the handle is destroyed, or when gRPC releases
+// the slice the buffer was handed over to with ToSlice.
+class GnpsiPacketBuffer {
+ public:
+  GnpsiPacketBuffer() = default;
+  GnpsiPacketBuffer(GnpsiPacketBuffer&& other) noexcept
+      : block_(other.block_),
+        size_(other.size_),
+        receive_time_(other.receive_time_) {
+    other.block_ = nullptr;
+    other.size_ = 0;
+  }
+  GnpsiPacketBuffer& operator=(GnpsiPacketBuffer&& other) noexcept;
+  GnpsiPacketBuffer(const GnpsiPacketBuffer&) = delete;
+  GnpsiPacketBuffer& operator=(const GnpsiPacketBuffer&) = delete;
+  ~GnpsiPacketBuffer() { Reset(); }
+
+  // Returns false for a default constructed or moved-from handle.
+  bool valid() const { return block_ != nullptr; }
+
+  char* data() const;
+  size_t capacity() const;
+
+  // Number of bytes of the buffer holding the packet.
+  size_t size() const { return size_; }
+  void set_size(size_t size) { size_ = size; }
+
+  absl::string_view view() const { return absl::string_view(data(), size_); }
+
+  // Time the packet was received, or InfinitePast() if unknown.
+  absl::Time receive_time() const { return receive_time_; }
+  void set_receive_time(absl::Time receive_time) {
+    receive_time_ = receive_time;
+  }
+
+  // Hands the buffer over to a slice of its first size() bytes without
+  // copying. The buffer goes back to the pool once the last reference to the
+  // slice is released. An invalid buffer yields an empty slice.
+  grpc::Slice ToSlice() &&;
+
+ private:
+  friend class GnpsiBufferPool;
+  struct Block;
+
+  explicit GnpsiPacketBuffer(Block* block) : block_(block) {}
+
+  // Returns the buffer to its pool.
+  void Reset();
+  // Destroy callback of the slices created by ToSlice.
+  static void ReleaseBlock(void* block);
+
+  Block* block_ = nullptr;
+  size_t size_ = 0;
+  absl::Time receive_time_ = absl::InfinitePast();
+};
+
+// A pool of fixed-size packet buffers, so that datagrams can be received into
+// memory that is reused instead of allocated per packet. This class is
+// thread-safe: buffers can be released from any thread.
+class GnpsiBufferPool : public std::enable_shared_from_this<GnpsiBufferPool> {
+ public:
+  // Creates a pool of `buffer_size` byte buffers that keeps up to
+  // `max_free_buffers` released buffers around for reuse. Every buffer
+  // holds a reference to the pool, so the pool lives until the last buffer
+  // is released.
+  static std::shared_ptr<GnpsiBufferPool> Create(size_t buffer_size,
+                                                 int max_free_buffers);
+
+  ~GnpsiBufferPool();
+
+  // Returns a buffer of buffer_size() bytes, reusing a released one if
+  // possible.
+  GnpsiPacketBuffer Acquire() ABSL_LOCKS_EXCLUDED(mu_);
+
+  size_t buffer_size() const { return buffer_size_; }
+
+ private:
+  GnpsiBufferPool(size_t buffer_size, int max_free_buffers)
+      : buffer_size_(buffer_size),
+        max_free_buffers_(std::max(max_free_buffers, 0)) {}
+
+  friend class GnpsiPacketBuffer;
+  void Release(GnpsiPacketBuffer::Block* block) ABSL_LOCKS_EXCLUDED(mu_);
+
+  const size_t buffer_size_;
+  const size_t max_free_buffers_;
+  absl::Mutex mu_;
+  std::vector<GnpsiPacketBuffer::Block*> free_blocks_ ABSL_GUARDED_BY(mu_);
+};
+
+}  // namespace gnpsi
+
+#endif  // OPENCONFIG_GNPSI_SERVER_GNPSI_PACKET_BUFFER_H_
@@ -2,11 +2,34 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <linux/filter.h>
+#include <linux/io_uring.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>  // NOLINT
+#include <utility>
+#include <vector>
+
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "glog/logging.h"
+#include "server/gnpsi_io_uring.h"
+#include "server/gnpsi_packet_buffer.h"
+#include "server/gnpsi_sequence_tracker.h"
 #include "server/gnpsi_service_impl.h"
 
 namespace {
@@ -19,13 +42,23 @@ enum ReadError {
   FatalError = 2,
 };
 
-int SetUpReadSocket(int port, int addr_family,
+// Sets up a socket bound to `port`, which shares the port with the other
+// sockets bound to it by this process if `reuse_port` is set.
+int SetUpReadSocket(int port, int addr_family, bool reuse_port,
                     gnpsi::SocketInterface* socket_provider) {
   int socket_fd = socket_provider->Socket(addr_family, SOCK_DGRAM, IPPROTO_UDP);
   if (socket_fd < 0) {
     LOG(ERROR) << "Socket creation failed: " << strerror(errno);
     return -1;
   }
+  int enable = 1;
+  if (reuse_port &&
+      socket_provider->SetSockOpt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &enable,
+                                  sizeof(enable)) < 0) {
+    LOG(ERROR) << "Failed to set SO_REUSEPORT: " << strerror(errno);
+    socket_provider->Close(socket_fd);
+    return -1;
+  }
   struct sockaddr_storage addr;
   socklen_t sock_len = 0;
   memset(&addr, 0, sizeof(addr));
@@ -54,6 +87,78 @@ int SetUpReadSocket(int port, int addr_family,
   return socket_fd;
 }
 
+// Returns the SO_ATTACH_REUSEPORT_CBPF program steering the datagrams of
+// `metadata` to one of `reader_count` sockets by the exporter identity in
+// their header, or an empty one if the header has none. The program sees the
+// UDP payload at offset 0. Loads past the end of a datagram return 0, which
+// steers short datagrams to the first socket.
+std::vector<struct sock_filter> SteeringProgram(
+    gnpsi::GnpsiSampleMetadata metadata, int reader_count) {
+  using Protocol = gnpsi::GnpsiSampleMetadata::Protocol;
+  std::vector<struct sock_filter> program;
+  if (metadata.protocol() == Protocol::kSFlow) {
+    // The agent address is at offset 8, IPv4 or IPv6 by the address type at
+    // offset 4. In sFlow v5, the sub-agent id follows it and is mixed in; in
+    // v2 and v4 the datagram sequence number follows it instead, so only the
+    // address is used.
+    if (metadata.version() == gnpsi::SFlowMetadata::V5) {
+      program = {
+          BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 4),
+          BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 2, 0, 4),
+          // IPv6: the last word of the address and the sub-agent id.
+          BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 24),
+          BPF_STMT(BPF_MISC | BPF_TAX, 0),
+          BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 20),
+          BPF_JUMP(BPF_JMP | BPF_JA, 3, 0, 0),
+          // IPv4: the address and the sub-agent id.
+          BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 12),
+          BPF_STMT(BPF_MISC | BPF_TAX, 0),
+          BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 8),
+          BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+      };
+    } else {
+      program = {
+          BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 4),
+          BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 2, 0, 2),
+          // IPv6: the last word of the address.
+          BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 20),
+          BPF_JUMP(BPF_JMP | BPF_JA, 1, 0, 0),
+          // IPv4: the address.
+          BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 8),
+      };
+    }
+  } else if (metadata.protocol() == Protocol::kNetFlow &&
+             metadata.version() == gnpsi::NetFlowMetadata::V5) {
+    // The engine type and id.
+    program = {BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20)};
+  } else if (metadata.protocol() == Protocol::kNetFlow &&
+             metadata.version() == gnpsi::NetFlowMetadata::V9) {
+    // The source id.
+    program = {BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 16)};
+  } else if (metadata.protocol() == Protocol::kIpfix) {
+    // The observation domain id.
+    program = {BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 12)};
+  } else {
+    return program;
+  }
+  program.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K,
+                             static_cast<uint32_t>(reader_count)));
+  program.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+  return program;
+}
+
+// Pins the calling thread to `cpu`, logging a warning on failure.
+void PinToCpu(int cpu) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  if (error != 0) {
+    LOG(WARNING) << "Failed to pin reader to CPU " << cpu << ": "
+                 << strerror(error);
+  }
+}
+
 ReadError ErrorNoToReadError(int error_number) {
   switch (error_number) {
     case EINTR:
@@ -64,33 +169,495 @@ ReadError ErrorNoToReadError(int error_number) {
   }
 }
 
-ReadError Read(int fd, void* buf, size_t count, int& len,
+ReadError Recv(int fd, struct msghdr* msg, int& len,
                gnpsi::SocketInterface* socket_provider) {
   ReadError err = ReadError::NoError;
-  len = socket_provider->Read(fd, buf, count);
+  len = socket_provider->RecvMsg(fd, msg, 0);
   if (len < 0) {
     err = ErrorNoToReadError(errno);
   }
   return err;
 }
+
+// Returns the SO_TIMESTAMPNS receive time in the control messages of `msg`, or
+// InfinitePast() if there is none.
+absl::Time ReceiveTimestamp(struct msghdr* msg) {
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      return absl::TimeFromTimespec(ts);
+    }
+  }
+  return absl::InfinitePast();
+}
+
+// Reads the SO_RXQ_OVFL drop count in the control messages of `msg` into
+// `drop_count`. Returns false if there is none, which is also the case until
+// the socket has dropped a datagram.
+bool ReceiveDropCount(struct msghdr* msg, uint32_t* drop_count) {
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+      memcpy(drop_count, CMSG_DATA(cmsg), sizeof(*drop_count));
+      return true;
+    }
+  }
+  return false;
+}
+
+ReadError RecvBatch(int fd, struct mmsghdr* msgs, unsigned int vlen, int flags,
+                    struct timespec* timeout, int& count,
+                    gnpsi::SocketInterface* socket_provider) {
+  ReadError err = ReadError::NoError;
+  count = socket_provider->RecvMmsg(fd, msgs, vlen, flags, timeout);
+  if (count < 0) {
+    err = ErrorNoToReadError(errno);
+  }
+  return err;
+}
 }  // namespace
 
 namespace gnpsi {
 
-const int kMaxBufferSize = 4096;
+// Size of the pooled buffers datagrams are received into.
+const int kReceiveBufferSize = 4096;
+// Minimum number of released buffers kept for reuse for datagrams larger than
+// kReceiveBufferSize. A whole batch of them is kept, but as they are rare, not
+// as many as for the pooled buffers.
+const int kLargeBufferPoolSize = 16;
+// Number of provided buffers of the io_uring backend. Datagrams are copied out
+// of them as they complete, so they only need to cover the datagrams
+// received between two waits for completions.
+const int kIoUringBufferCount = 256;
+// Space for the control message of a SO_TIMESTAMPNS receive time.
+const int kTimestampControlSize = CMSG_SPACE(sizeof(struct timespec));
+// Space for the control message of a SO_RXQ_OVFL drop count.
+const int kDropCountControlSize = CMSG_SPACE(sizeof(uint32_t));
+
+namespace {
+// Receive buffers and message headers for reading a batch of datagrams with a
+// single recvmmsg call. Datagrams are received into pooled buffers that are
+// handed over to the sender, and replaced with buffers released by earlier
+// samples.
+//
+// Each message is received into its pooled buffer followed by overflow space
+// of its own, which takes the rest of a datagram of up to max_datagram_size
+// bytes. The overflow space is allocated once, so the common small datagram
+// is still received without a copy, and only a larger datagram is copied into
+// a buffer of the large pool.
+class RecvBatchBuffers {
+ public:
+  RecvBatchBuffers(int batch_size, bool kernel_timestamps, bool kernel_drops,
+                   int buffer_pool_size, int max_datagram_size,
+                   GnpsiRelayCounters* counters)
+      : counters_(counters),
+        pool_(GnpsiBufferPool::Create(kReceiveBufferSize, buffer_pool_size)),
+        kernel_timestamps_(kernel_timestamps),
+        buffer_size_(std::min(max_datagram_size, kReceiveBufferSize)),
+        overflow_size_(std::max(max_datagram_size - kReceiveBufferSize, 0)),
+        buffers_(batch_size),
+        iovecs_(2 * batch_size),
+        msgs_(batch_size) {
+    if (overflow_size_ > 0) {
+      large_pool_ =
+          GnpsiBufferPool::Create(kReceiveBufferSize + overflow_size_,
+                                  std::max(batch_size, kLargeBufferPoolSize));
+      overflow_.reset(new char[batch_size * overflow_size_]);
+    }
+    if (kernel_timestamps || kernel_drops) {
+      control_.resize(batch_size * kControlWords);
+    }
+  }
+
+  int size() const { return msgs_.size(); }
+
+  // Replaces the buffers handed over with the last batch and resets the
+  // message headers for the next recvmmsg call.
+  struct mmsghdr* Prepare() {
+    memset(msgs_.data(), 0, msgs_.size() * sizeof(struct mmsghdr));
+    for (int i = 0; i < size(); ++i) {
+      if (!buffers_[i].valid()) buffers_[i] = pool_->Acquire();
+      // Buffers are reordered by Received, so the vectors are always reset.
+      struct iovec* iov = &iovecs_[2 * i];
+      iov[0].iov_base = buffers_[i].data();
+      iov[0].iov_len = buffer_size_;
+      iov[1].iov_base = overflow_.get() + i * overflow_size_;
+      iov[1].iov_len = overflow_size_;
+      msgs_[i].msg_hdr.msg_iov = iov;
+      msgs_[i].msg_hdr.msg_iovlen = overflow_size_ > 0 ? 2 : 1;
+      if (!control_.empty()) {
+        msgs_[i].msg_hdr.msg_control = &control_[i * kControlWords];
+        msgs_[i].msg_hdr.msg_controllen =
+            kControlWords * sizeof(struct cmsghdr);
+      }
+    }
+    return msgs_.data();
+  }
+
+  // Returns the buffers of the first `count` messages, sized and timestamped
+  // from the messages received into them, and counts the messages. Truncated
+  // datagrams are left out; their buffers are kept for the next batch. If
+  // `last_drop_count` is set, counts the kernel drops of the socket, which
+  // were last reported as `*last_drop_count`.
+  absl::Span<GnpsiPacketBuffer> Received(int count,
+                                         uint32_t* last_drop_count = nullptr) {
+    // Without kernel timestamps, the batch is stamped with a single clock
+    // read.
+    absl::Time batch_time = absl::InfinitePast();
+    int relayed = 0;
+    int large = 0;
+    uint64_t bytes = 0;
+    for (int i = 0; i < count; ++i) {
+      bytes += msgs_[i].msg_len;
+      uint32_t drop_count;
+      if (last_drop_count != nullptr &&
+          ReceiveDropCount(&msgs_[i].msg_hdr, &drop_count)) {
+        counters_->CountKernelDrops(drop_count, last_drop_count);
+      }
+      if (msgs_[i].msg_hdr.msg_flags & MSG_TRUNC) continue;
+      const size_t len = msgs_[i].msg_len;
+      if (len > kReceiveBufferSize) {
+        ++large;
+        GnpsiPacketBuffer buffer = large_pool_->Acquire();
+        memcpy(buffer.data(), buffers_[i].data(), kReceiveBufferSize);
+        memcpy(buffer.data() + kReceiveBufferSize,
+               overflow_.get() + i * overflow_size_, len - kReceiveBufferSize);
+        buffers_[i] = std::move(buffer);
+      }
+      buffers_[i].set_size(len);
+      absl::Time receive_time = absl::InfinitePast();
+      if (kernel_timestamps_) {
+        receive_time = ReceiveTimestamp(&msgs_[i].msg_hdr);
+      }
+      if (receive_time == absl::InfinitePast()) {
+        if (batch_time == absl::InfinitePast()) batch_time = absl::Now();
+        receive_time = batch_time;
+      }
+      buffers_[i].set_receive_time(receive_time);
+      if (relayed != i) std::swap(buffers_[relayed], buffers_[i]);
+      ++relayed;
+    }
+    if (count > 0) {
+      counters_->read_count.fetch_add(1, std::memory_order_relaxed);
+      counters_->byte_count.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    counters_->datagram_count.fetch_add(count, std::memory_order_relaxed);
+    if (large > 0) {
+      counters_->large_datagram_count.fetch_add(large,
+                                                std::memory_order_relaxed);
+    }
+    if (relayed < count) {
+      VLOG(1) << "Dropped " << count - relayed << " truncated datagram(s).";
+      counters_->truncated_count.fetch_add(count - relayed,
+                                           std::memory_order_relaxed);
+    }
+    return absl::MakeSpan(buffers_.data(), relayed);
+  }
+
+ private:
+  // Size of the control buffer of a message in cmsghdr, which aligns it.
+  static constexpr int kControlWords =
+      (kTimestampControlSize + kDropCountControlSize + sizeof(struct cmsghdr) -
+       1) /
+      sizeof(struct cmsghdr);
+
+  GnpsiRelayCounters* const counters_;
+  std::shared_ptr<GnpsiBufferPool> pool_;
+  // Buffers of datagrams larger than kReceiveBufferSize, if any can be
+  // received.
+  std::shared_ptr<GnpsiBufferPool> large_pool_;
+  const bool kernel_timestamps_;
+  // Size of the part of the pooled buffers datagrams are received into.
+  const int buffer_size_;
+  // Size of the overflow space of each message.
+  const int overflow_size_;
+  std::unique_ptr<char[]> overflow_;
+  std::vector<GnpsiPacketBuffer> buffers_;
+  // Two per message: its buffer and its overflow space.
+  std::vector<struct iovec> iovecs_;
+  std::vector<struct mmsghdr> msgs_;
+  // Control message buffers for the receive timestamps.
+  std::vector<struct cmsghdr> control_;
+};
+
+// Tracks the sequence numbers of `packets` read for `listener` with
+// `tracker`, if there is one and the listener relays sFlow v5.
+void TrackSequences(const GnpsiRelayListener& listener,
+                    absl::Span<const GnpsiPacketBuffer> packets,
+                    GnpsiSequenceTracker* tracker) {
+  if (tracker == nullptr ||
+      listener.metadata.protocol() != GnpsiSampleMetadata::Protocol::kSFlow ||
+      listener.metadata.version() != SFlowMetadata::V5) {
+    return;
+  }
+  tracker->Track(packets);
+}
+}  // namespace
+
+GnpsiRelayStats GnpsiRelayCounters::Snapshot() const {
+  GnpsiRelayStats stats;
+  stats.datagram_count = datagram_count.load(std::memory_order_relaxed);
+  stats.large_datagram_count =
+      large_datagram_count.load(std::memory_order_relaxed);
+  stats.truncated_count = truncated_count.load(std::memory_order_relaxed);
+  stats.read_count = read_count.load(std::memory_order_relaxed);
+  stats.byte_count = byte_count.load(std::memory_order_relaxed);
+  stats.again_count = again_count.load(std::memory_order_relaxed);
+  stats.interrupted_count = interrupted_count.load(std::memory_order_relaxed);
+  stats.kernel_drop_count = kernel_drop_count.load(std::memory_order_relaxed);
+  stats.receive_buffer_size =
+      receive_buffer_size.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void GnpsiRelayCounters::CountRetry(int error_number) {
+  if (error_number == EINTR) {
+    interrupted_count.fetch_add(1, std::memory_order_relaxed);
+  } else if (error_number == EAGAIN) {
+    again_count.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void GnpsiRelayCounters::CountKernelDrops(uint32_t drop_count,
+                                          uint32_t* last_drop_count) {
+  // The counter of the socket wraps around, so the difference is taken in
+  // its own width.
+  const uint32_t dropped = drop_count - *last_drop_count;
+  if (dropped == 0) return;
+  *last_drop_count = drop_count;
+  kernel_drop_count.fetch_add(dropped, std::memory_order_relaxed);
+}
+
+void GnpsiRelayRates::Update(absl::Time now, GnpsiRelayStats* stats) {
+  absl::MutexLock l(&mu_);
+  if (start_ == absl::InfinitePast()) {
+    start_ = now;
+    start_stats_ = *stats;
+  } else if (now - start_ >= absl::Seconds(1)) {
+    const double seconds = absl::ToDoubleSeconds(now - start_);
+    rates_.datagram_rate =
+        (stats->datagram_count - start_stats_.datagram_count) / seconds;
+    rates_.byte_rate = (stats->byte_count - start_stats_.byte_count) / seconds;
+    rates_.kernel_drop_rate =
+        (stats->kernel_drop_count - start_stats_.kernel_drop_count) / seconds;
+    start_ = now;
+    start_stats_ = *stats;
+  }
+  stats->datagram_rate = rates_.datagram_rate;
+  stats->byte_rate = rates_.byte_rate;
+  stats->kernel_drop_rate = rates_.kernel_drop_rate;
+}
+
+GnpsiRelayServer::GnpsiRelayServer(std::vector<GnpsiRelayListener> listeners,
+                                   int addr_family,
+                                   const GnpsiRelayOptions& options)
+    : listeners_(std::move(listeners)),
+      addr_family_(addr_family),
+      options_(options),
+      socket_provider_(new SocketProvider) {
+  if (options_.sequence_tracking.max_exporters > 0) {
+    for (int reader = 0; reader < std::max(options_.reader_count, 1);
+         ++reader) {
+      trackers_.push_back(
+          std::make_unique<GnpsiSequenceTracker>(options_.sequence_tracking));
+    }
+  }
+}
+
+GnpsiRelayStats GnpsiRelayServer::GetStats() {
+  GnpsiRelayStats stats = counters_.Snapshot();
+  rates_.Update(absl::Now(), &stats);
+  for (const auto& tracker : trackers_) {
+    GnpsiSequenceStats totals = tracker->GetTotals();
+    stats.sequences.datagram_count += totals.datagram_count;
+    stats.sequences.gap_count += totals.gap_count;
+    stats.sequences.lost_count += totals.lost_count;
+    stats.sequences.reorder_count += totals.reorder_count;
+    stats.sequences.duplicate_count += totals.duplicate_count;
+    stats.sequences.reset_count += totals.reset_count;
+  }
+  return stats;
+}
+
+std::vector<GnpsiSequenceStats> GnpsiRelayServer::GetExporterStats() const {
+  std::vector<GnpsiSequenceStats> stats;
+  for (const auto& tracker : trackers_) tracker->AppendExporterStats(&stats);
+  return stats;
+}
 
 void GnpsiRelayServer::StartRelayAndWait(GnpsiSenderInterface& service) {
-  LOG(INFO) << "Setting up socket to read packets.";
-  int fd = SetUpReadSocket(udp_port_, addr_family_, socket_provider_.get());
-  if (fd < 0) {
-    LOG(ERROR) << "Socket creation failed, cannot relay samples.";
+  if (listeners_.empty()) {
+    LOG(ERROR) << "No udp port to relay samples from.";
+    return;
+  }
+  const int reader_count = std::max(options_.reader_count, 1);
+  LOG(INFO) << "Setting up " << listeners_.size() * reader_count
+            << " socket(s) to read packets.";
+  // The sockets of each reader, and of all readers. The sockets sharing a
+  // port are numbered in the order they are bound, which is the order of the
+  // readers, as steering programs expect.
+  std::vector<std::vector<int>> reader_fds(reader_count);
+  std::vector<int> fds;
+  for (const GnpsiRelayListener& listener : listeners_) {
+    for (int reader = 0; reader < reader_count; ++reader) {
+      int fd = SetUpReadSocket(listener.udp_port, addr_family_,
+                               /*reuse_port=*/reader_count > 1,
+                               socket_provider_.get());
+      if (fd < 0) {
+        LOG(ERROR) << "Socket creation failed, cannot relay samples.";
+        for (int open_fd : fds) {
+          socket_provider_->Close(open_fd);
+        }
+        return;
+      }
+      SetReceiveBufferSize(fd);
+      reader_fds[reader].push_back(fd);
+      fds.push_back(fd);
+    }
+    if (reader_count > 1 && options_.steering == GnpsiReaderSteering::kAgent) {
+      AttachSteeringProgram(reader_fds[0].back(), listener);
+    }
+  }
+  bool stopped;
+  {
+    absl::MutexLock l(&mu_);
+    stopped = stopping_.load(std::memory_order_relaxed);
+    if (!stopped) fds_ = fds;
+  }
+  if (!stopped) {
+    LOG(INFO) << "Start reading sample packets with " << reader_count
+              << " reader(s).";
+    if (reader_count == 1 && options_.reader_cpus.empty()) {
+      ReaderLoop(0, reader_fds[0], service);
+    } else {
+      std::vector<std::thread> readers;
+      for (int reader = 0; reader < reader_count; ++reader) {
+        readers.emplace_back([this, reader, reader_count, &reader_fds,
+                              &service] {
+          const std::vector<int>& cpus = options_.reader_cpus;
+          if (!cpus.empty()) PinToCpu(cpus[reader % cpus.size()]);
+          ReaderLoop(reader, reader_fds[reader], service);
+          // A reader returns on Stop or on a fatal error, which then stops the
+          // others.
+          if (reader_count > 1) Stop();
+        });
+      }
+      for (std::thread& reader : readers) reader.join();
+    }
+  }
+  {
+    absl::MutexLock l(&mu_);
+    fds_.clear();
+  }
+  for (int fd : fds) {
+    socket_provider_->Close(fd);
+  }
+}
+
+void GnpsiRelayServer::ReaderLoop(int reader, const std::vector<int>& fds,
+                                  GnpsiSenderInterface& service) {
+  GnpsiSequenceTracker* tracker =
+      trackers_.empty() ? nullptr : trackers_[reader].get();
+  if (options_.backend != GnpsiRelayBackend::kIoUring ||
+      !IoUringRelayLoop(fds, tracker, service)) {
+    SocketRelayLoop(fds, tracker, service);
+  }
+}
+
+void GnpsiRelayServer::SocketRelayLoop(const std::vector<int>& fds,
+                                       GnpsiSequenceTracker* tracker,
+                                       GnpsiSenderInterface& service) {
+  if (listeners_.size() > 1) {
+    EpollRelayLoop(fds, tracker, service);
+  } else if (options_.batch_size > 1 || control_messages()) {
+    BatchedRelayLoop(fds[0], listeners_[0], tracker, service);
+  } else {
+    RelayLoop(fds[0], listeners_[0], tracker, service);
+  }
+}
+
+void GnpsiRelayServer::Stop() {
+  absl::MutexLock l(&mu_);
+  stopping_.store(true, std::memory_order_relaxed);
+  for (int fd : fds_) {
+    socket_provider_->Shutdown(fd, SHUT_RD);
+  }
+}
+
+bool GnpsiRelayServer::EnableControlMessages(int fd) {
+  int enable = 1;
+  if (options_.kernel_timestamps &&
+      socket_provider_->SetSockOpt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable,
+                                   sizeof(enable)) < 0) {
+    LOG(ERROR) << "Failed to enable socket receive timestamps: "
+               << strerror(errno);
+    return false;
+  }
+  if (options_.count_kernel_drops &&
+      socket_provider_->SetSockOpt(fd, SOL_SOCKET, SO_RXQ_OVFL, &enable,
+                                   sizeof(enable)) < 0) {
+    LOG(ERROR) << "Failed to enable socket drop counts: " << strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+void GnpsiRelayServer::SetReceiveBufferSize(int fd) {
+  const int requested = options_.receive_buffer_size;
+  if (requested > 0 &&
+      socket_provider_->SetSockOpt(fd, SOL_SOCKET, SO_RCVBUF, &requested,
+                                   sizeof(requested)) < 0) {
+    LOG(WARNING) << "Failed to set socket receive buffer size to "
+                 << requested << ": " << strerror(errno);
+  }
+  int size = 0;
+  socklen_t size_len = sizeof(size);
+  if (socket_provider_->GetSockOpt(fd, SOL_SOCKET, SO_RCVBUF, &size,
+                                   &size_len) < 0) {
     return;
   }
-  char buf[kMaxBufferSize];
-  LOG(INFO) << "Start reading sample packets.";
+  // The kernel doubles the size it was set to, after capping it.
+  if (requested > 0 && size < 2 * static_cast<int64_t>(requested)) {
+    LOG(WARNING) << "Socket receive buffer size is " << size / 2
+                 << " rather than " << requested
+                 << ", capped by net.core.rmem_max.";
+  }
+  counters_.receive_buffer_size.store(size, std::memory_order_relaxed);
+}
+
+void GnpsiRelayServer::AttachSteeringProgram(
+    int fd, const GnpsiRelayListener& listener) {
+  std::vector<struct sock_filter> program =
+      SteeringProgram(listener.metadata, std::max(options_.reader_count, 1));
+  if (program.empty()) {
+    LOG(INFO) << "No steering program for the datagrams of port "
+              << listener.udp_port << ", steering them by flow hash.";
+    return;
+  }
+  struct sock_fprog fprog;
+  fprog.len = program.size();
+  fprog.filter = program.data();
+  if (socket_provider_->SetSockOpt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                                   &fprog, sizeof(fprog)) < 0) {
+    LOG(WARNING) << "Failed to attach steering program to port "
+                 << listener.udp_port
+                 << ", steering by flow hash: " << strerror(errno);
+  }
+}
+
+void GnpsiRelayServer::RelayLoop(int fd, const GnpsiRelayListener& listener,
+                                 GnpsiSequenceTracker* tracker,
+                                 GnpsiSenderInterface& service) {
+  RecvBatchBuffers buffers(/*batch_size=*/1, /*kernel_timestamps=*/false,
+                           /*kernel_drops=*/false, options_.buffer_pool_size,
+                           options_.max_datagram_size, &counters_);
   while (true) {
+    struct mmsghdr* msg = buffers.Prepare();
     int len = 0;
-    ReadError err = Read(fd, buf, kMaxBufferSize, len, socket_provider_.get());
+    ReadError err = Recv(fd, &msg->msg_hdr, len, socket_provider_.get());
+    if (stopping_.load(std::memory_order_relaxed)) break;
     if (err == ReadError::FatalError) {
       LOG(ERROR) << "Read from socket failed with a fatal error: "
                  << strerror(errno);
@@ -98,13 +665,367 @@ void GnpsiRelayServer::StartRelayAndWait(GnpsiSenderInterface& service) {
       break;
     }
     if (err == ReadError::NonFatalError) {
+      counters_.CountRetry(errno);
       VLOG(1) << "Read from socket failed with a non fatal error: "
                    << strerror(errno);
       // Continue relaying samples and ignore current read if error is non fatal
       continue;
     }
     VLOG(1) << "Received sample with size: " << len;
-    service.SendSamplePacket(std::string(buf, len));
+    msg->msg_len = len;
+    absl::Span<GnpsiPacketBuffer> received = buffers.Received(1);
+    // The buffer is handed over with the sample, so no copy of the packet is
+    // made on its way to the sender.
+    if (!received.empty()) {
+      TrackSequences(listener, received, tracker);
+      service.SendSamplePacket(std::move(received[0]), listener.metadata);
+    }
+  }
+}
+
+void GnpsiRelayServer::BatchedRelayLoop(int fd,
+                                        const GnpsiRelayListener& listener,
+                                        GnpsiSequenceTracker* tracker,
+                                        GnpsiSenderInterface& service) {
+  if (!EnableControlMessages(fd)) return;
+  // With a timeout, recvmmsg only checks for expiry after a datagram arrives.
+  // Bound each individual wait with SO_RCVTIMEO so a partially filled batch is
+  // handed over once traffic stops.
+  int flags = MSG_WAITFORONE;
+  struct timespec timeout;
+  struct timespec* timeout_ptr = nullptr;
+  if (options_.batch_timeout > absl::ZeroDuration()) {
+    struct timeval rcv_timeout = absl::ToTimeval(options_.batch_timeout);
+    if (socket_provider_->SetSockOpt(fd, SOL_SOCKET, SO_RCVTIMEO, &rcv_timeout,
+                                     sizeof(rcv_timeout)) < 0) {
+      LOG(ERROR) << "Failed to set socket receive timeout: " << strerror(errno);
+      return;
+    }
+    flags = 0;
+    timeout_ptr = &timeout;
+  }
+  RecvBatchBuffers batch(std::max(options_.batch_size, 1),
+                         options_.kernel_timestamps,
+                         options_.count_kernel_drops,
+                         options_.buffer_pool_size,
+                         options_.max_datagram_size, &counters_);
+  // Drop count of the socket when last reported.
+  uint32_t last_drop_count = 0;
+  while (true) {
+    struct mmsghdr* msgs = batch.Prepare();
+    if (timeout_ptr != nullptr) {
+      // recvmmsg updates the timeout with the time left, so reset it per call.
+      timeout = absl::ToTimespec(options_.batch_timeout);
+    }
+    int count = 0;
+    ReadError err = RecvBatch(fd, msgs, batch.size(), flags, timeout_ptr,
+                              count, socket_provider_.get());
+    if (stopping_.load(std::memory_order_relaxed)) break;
+    if (err == ReadError::FatalError) {
+      LOG(ERROR) << "Read from socket failed with a fatal error: "
+                 << strerror(errno);
+      // Stop reading and relaying samples if error is fatal
+      break;
+    }
+    if (err == ReadError::NonFatalError) {
+      counters_.CountRetry(errno);
+      VLOG(1) << "Read from socket failed with a non fatal error: "
+              << strerror(errno);
+      // Continue relaying samples and ignore current read if error is non fatal
+      continue;
+    }
+    VLOG(1) << "Received batch of " << count << " samples.";
+    absl::Span<GnpsiPacketBuffer> received =
+        batch.Received(count, &last_drop_count);
+    if (!received.empty()) {
+      TrackSequences(listener, received, tracker);
+      service.SendSamplePackets(received, listener.metadata);
+    }
+  }
+}
+
+void GnpsiRelayServer::EpollRelayLoop(const std::vector<int>& fds,
+                                      GnpsiSequenceTracker* tracker,
+                                      GnpsiSenderInterface& service) {
+  int epoll_fd = socket_provider_->EpollCreate1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    LOG(ERROR) << "Failed to create epoll instance: " << strerror(errno);
+    return;
+  }
+  for (size_t i = 0; i < fds.size(); ++i) {
+    if (!EnableControlMessages(fds[i])) {
+      socket_provider_->Close(epoll_fd);
+      return;
+    }
+    // The event carries the index of the listener the socket belongs to.
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = i;
+    if (socket_provider_->EpollCtl(epoll_fd, EPOLL_CTL_ADD, fds[i], &event) <
+        0) {
+      LOG(ERROR) << "Failed to watch socket with epoll: " << strerror(errno);
+      socket_provider_->Close(epoll_fd);
+      return;
+    }
+  }
+  // A single set of buffers serves all sockets, as every batch is handed over
+  // before the next socket is read.
+  RecvBatchBuffers batch(std::max(options_.batch_size, 1),
+                         options_.kernel_timestamps,
+                         options_.count_kernel_drops,
+                         options_.buffer_pool_size,
+                         options_.max_datagram_size, &counters_);
+  std::vector<struct epoll_event> events(fds.size());
+  // Drop count of each socket when last reported.
+  std::vector<uint32_t> last_drop_counts(fds.size());
+  bool fatal_error = false;
+  while (!fatal_error) {
+    int ready = socket_provider_->EpollWait(epoll_fd, events.data(),
+                                            events.size(), /*timeout=*/-1);
+    if (stopping_.load(std::memory_order_relaxed)) break;
+    if (ready < 0) {
+      if (ErrorNoToReadError(errno) == ReadError::FatalError) {
+        LOG(ERROR) << "Waiting for sockets failed with a fatal error: "
+                   << strerror(errno);
+        break;
+      }
+      counters_.CountRetry(errno);
+      continue;
+    }
+    // Level triggered: each readable socket is read once per wait, so a busy
+    // listener cannot starve the others. Datagrams left over are read after
+    // the next wait.
+    for (int i = 0; i < ready; ++i) {
+      const int listener_index = events[i].data.u32;
+      const GnpsiRelayListener& listener = listeners_[listener_index];
+      int count = 0;
+      ReadError err = RecvBatch(fds[listener_index], batch.Prepare(),
+                                batch.size(), MSG_DONTWAIT, nullptr, count,
+                                socket_provider_.get());
+      if (err == ReadError::FatalError) {
+        LOG(ERROR) << "Read from socket on port " << listener.udp_port
+                   << " failed with a fatal error: " << strerror(errno);
+        // Stop reading and relaying samples if error is fatal
+        fatal_error = true;
+        break;
+      }
+      if (err == ReadError::NonFatalError) {
+        counters_.CountRetry(errno);
+        VLOG(1) << "Read from socket on port " << listener.udp_port
+                << " failed with a non fatal error: " << strerror(errno);
+        continue;
+      }
+      VLOG(1) << "Received batch of " << count << " samples on port "
+              << listener.udp_port << ".";
+      absl::Span<GnpsiPacketBuffer> received =
+          batch.Received(count, &last_drop_counts[listener_index]);
+      if (!received.empty()) {
+        TrackSequences(listener, received, tracker);
+        service.SendSamplePackets(received, listener.metadata);
+      }
+    }
+  }
+  socket_provider_->Close(epoll_fd);
+}
+
+bool GnpsiRelayServer::IoUringRelayLoop(const std::vector<int>& fds,
+                                        GnpsiSequenceTracker* tracker,
+                                        GnpsiSenderInterface& service) {
+  // Each provided buffer holds the recvmsg header and control messages before
+  // the payload, which is then copied out into a pooled buffer. This keeps the
+  // provided buffers with the kernel instead of queued with the samples, and
+  // their memory independent of the send queues.
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  if (options_.kernel_timestamps) msg.msg_controllen += kTimestampControlSize;
+  if (options_.count_kernel_drops) msg.msg_controllen += kDropCountControlSize;
+  const size_t payload_offset =
+      sizeof(struct io_uring_recvmsg_out) + msg.msg_controllen;
+  // Each listener has a recvmsg and a poll request armed.
+  absl::StatusOr<std::unique_ptr<GnpsiIoUring>> ring = GnpsiIoUring::Create(
+      std::max<unsigned>(2 * fds.size(), 8), kIoUringBufferCount,
+      payload_offset + options_.max_datagram_size);
+  if (!ring.ok()) {
+    LOG(WARNING) << "Cannot relay samples with io_uring: " << ring.status();
+    return false;
+  }
+  // Shutting down a socket does not end a multishot recvmsg, so Stop is
+  // noticed with a poll for the hang up of the shutdown.
+  const uint64_t kShutdownPoll = uint64_t{1} << 32;
+  // Queues the request of `prepare`, submitting the queued requests first if
+  // the submission queue is full. Returns false if it cannot be queued.
+  auto queue_request = [&ring](auto prepare) {
+    return prepare() || ((*ring)->Submit() == 0 && prepare());
+  };
+  auto arm_recvmsg = [&](size_t listener_index) {
+    return queue_request([&] {
+      return (*ring)->PrepareRecvMsgMultishot(fds[listener_index], &msg,
+                                              listener_index);
+    });
+  };
+  for (size_t i = 0; i < fds.size(); ++i) {
+    if (!EnableControlMessages(fds[i])) return true;
+    if (!arm_recvmsg(i) || !queue_request([&] {
+          return (*ring)->PreparePoll(fds[i], POLLRDHUP, kShutdownPoll | i);
+        })) {
+      LOG(ERROR) << "Failed to queue io_uring requests for port "
+                 << listeners_[i].udp_port;
+      return true;
+    }
+  }
+  const size_t batch_size = options_.batch_size;
+  std::shared_ptr<GnpsiBufferPool> pool =
+      GnpsiBufferPool::Create(kReceiveBufferSize, options_.buffer_pool_size);
+  std::shared_ptr<GnpsiBufferPool> large_pool = GnpsiBufferPool::Create(
+      std::max(options_.max_datagram_size, kReceiveBufferSize),
+      kLargeBufferPoolSize);
+  // Datagrams received per listener, handed over once options_.batch_size of
+  // them are received or no more completions are ready.
+  std::vector<std::vector<GnpsiPacketBuffer>> batches(fds.size());
+  // Counts of the current wait not yet added to counters_.
+  uint64_t datagrams = 0, bytes = 0, large = 0, truncated = 0;
+  bool read_counted = false;
+  // Adds the pending counts to counters_, which is done before samples are
+  // handed over so that the stats never lag behind the delivered samples.
+  auto publish_counts = [&] {
+    if (datagrams > 0 && !read_counted) {
+      counters_.read_count.fetch_add(1, std::memory_order_relaxed);
+      read_counted = true;
+    }
+    counters_.byte_count.fetch_add(bytes, std::memory_order_relaxed);
+    counters_.datagram_count.fetch_add(datagrams, std::memory_order_relaxed);
+    if (large > 0) {
+      counters_.large_datagram_count.fetch_add(large,
+                                               std::memory_order_relaxed);
+    }
+    if (truncated > 0) {
+      VLOG(1) << "Dropped " << truncated << " truncated datagram(s).";
+      counters_.truncated_count.fetch_add(truncated,
+                                          std::memory_order_relaxed);
+    }
+    datagrams = bytes = large = truncated = 0;
+  };
+  auto send_batch = [&](int listener_index) {
+    std::vector<GnpsiPacketBuffer>& batch = batches[listener_index];
+    if (batch.empty()) return;
+    publish_counts();
+    const GnpsiRelayListener& listener = listeners_[listener_index];
+    TrackSequences(listener, batch, tracker);
+    service.SendSamplePackets(absl::MakeSpan(batch), listener.metadata);
+    batch.clear();
+  };
+  std::vector<GnpsiIoUringCompletion> completions(kIoUringBufferCount);
+  // Drop count of each socket when last reported.
+  std::vector<uint32_t> last_drop_counts(fds.size());
+  bool received_any = false;
+  bool fatal_error = false;
+  // Set once the hang up of the shutdown by Stop is polled, which may only
+  // complete after stopping_ was checked.
+  bool shut_down = false;
+  while (!fatal_error && !shut_down) {
+    int error_number = (*ring)->SubmitAndWait(/*wait_for=*/1);
+    if (stopping_.load(std::memory_order_relaxed)) break;
+    if (error_number != 0) {
+      if (ErrorNoToReadError(error_number) == ReadError::FatalError) {
+        LOG(ERROR) << "Waiting for io_uring completions failed with a fatal "
+                      "error: "
+                   << strerror(error_number);
+        break;
+      }
+      counters_.CountRetry(error_number);
+      continue;
+    }
+    // Without kernel timestamps, the datagrams of a wait are stamped with a
+    // single clock read.
+    const absl::Time wait_time = absl::Now();
+    int count = 0;
+    read_counted = false;
+    while (!fatal_error &&
+           (count = (*ring)->PopCompletions(completions.data(),
+                                            completions.size())) > 0) {
+      for (int i = 0; i < count; ++i) {
+        const GnpsiIoUringCompletion& completion = completions[i];
+        if (completion.user_data & kShutdownPoll) {
+          shut_down = true;
+          continue;
+        }
+        const int listener_index = completion.user_data;
+        if (completion.flags & IORING_CQE_F_BUFFER) {
+          received_any = true;
+          ++datagrams;
+          const uint16_t id = completion.flags >> IORING_CQE_BUFFER_SHIFT;
+          const char* data = (*ring)->buffer(id);
+          struct io_uring_recvmsg_out out;
+          memcpy(&out, data, sizeof(out));
+          bytes += out.payloadlen;
+          struct msghdr control;
+          memset(&control, 0, sizeof(control));
+          control.msg_control =
+              const_cast<char*>(data) + sizeof(struct io_uring_recvmsg_out);
+          control.msg_controllen = out.controllen;
+          uint32_t drop_count;
+          if (options_.count_kernel_drops &&
+              ReceiveDropCount(&control, &drop_count)) {
+            counters_.CountKernelDrops(drop_count,
+                                       &last_drop_counts[listener_index]);
+          }
+          if (out.flags & MSG_TRUNC) {
+            ++truncated;
+          } else {
+            GnpsiPacketBuffer buffer;
+            if (out.payloadlen > kReceiveBufferSize) {
+              ++large;
+              buffer = large_pool->Acquire();
+            } else {
+              buffer = pool->Acquire();
+            }
+            memcpy(buffer.data(), data + payload_offset, out.payloadlen);
+            buffer.set_size(out.payloadlen);
+            absl::Time receive_time = absl::InfinitePast();
+            if (options_.kernel_timestamps) {
+              receive_time = ReceiveTimestamp(&control);
+            }
+            if (receive_time == absl::InfinitePast()) receive_time = wait_time;
+            buffer.set_receive_time(receive_time);
+            batches[listener_index].push_back(std::move(buffer));
+          }
+          (*ring)->RecycleBuffer(id);
+          if (batches[listener_index].size() >= batch_size) {
+            send_batch(listener_index);
+          }
+        } else if (completion.res < 0) {
+          const int error = -completion.res;
+          if (error == EINVAL && !received_any) {
+            // Multishot recvmsg needs Linux 6.0.
+            LOG(WARNING) << "Cannot relay samples with io_uring: multishot "
+                            "recvmsg is not supported.";
+            return false;
+          }
+          // The buffers ran out with ENOBUFS; they are recycled by the time
+          // the request is armed again.
+          if (error != ENOBUFS &&
+              ErrorNoToReadError(error) == ReadError::FatalError) {
+            LOG(ERROR) << "Read from socket on port "
+                       << listeners_[listener_index].udp_port
+                       << " failed with a fatal error: " << strerror(error);
+            fatal_error = true;
+            break;
+          }
+        }
+        // A multishot request ends on errors, and has to be armed again.
+        if (!(completion.flags & IORING_CQE_F_MORE) &&
+            !arm_recvmsg(listener_index)) {
+          LOG(ERROR) << "Failed to arm recvmsg again on port "
+                     << listeners_[listener_index].udp_port;
+          fatal_error = true;
+          break;
+        }
+      }
+    }
+    for (size_t i = 0; i < batches.size(); ++i) send_batch(i);
+    publish_counts();
   }
+  return true;
 }
 }  // namespace gnpsi
@@ -1,23 +1,46 @@
 #ifndef OPENCONFIG_GNPSI_SERVER_GNPSI_RELAY_SERVER_H_
 #define OPENCONFIG_GNPSI_SERVER_GNPSI_RELAY_SERVER_H_
 
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <cstdint>
 #include <memory>
+#include <utility>
+#include <vector>
 
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "server/gnpsi_sequence_tracker.h"
 #include "server/gnpsi_service_impl.h"
+#include "server/gnpsi_shared_sample.h"
 
 namespace gnpsi {
 class SocketInterface {
  public:
   virtual ~SocketInterface() {}
   virtual int Socket(int domain, int type, int protocol) = 0;
-  virtual ssize_t Read(int fd, void* buf, size_t count) = 0;
+  virtual ssize_t RecvMsg(int sockfd, struct msghdr* msg, int flags) = 0;
+  virtual int RecvMmsg(int sockfd, struct mmsghdr* msgvec, unsigned int vlen,
+                       int flags, struct timespec* timeout) = 0;
   virtual int Bind(int sockfd, const struct sockaddr* addr,
                    socklen_t addrlen) = 0;
+  virtual int SetSockOpt(int sockfd, int level, int optname,
+                         const void* optval, socklen_t optlen) = 0;
+  virtual int GetSockOpt(int sockfd, int level, int optname, void* optval,
+                         socklen_t* optlen) = 0;
+  virtual int Shutdown(int sockfd, int how) = 0;
   virtual int Close(int fd) = 0;
+  virtual int EpollCreate1(int flags) = 0;
+  virtual int EpollCtl(int epfd, int op, int fd,
+                       struct epoll_event* event) = 0;
+  virtual int EpollWait(int epfd, struct epoll_event* events, int maxevents,
+                        int timeout) = 0;
 };
 
 class SocketProvider : public SocketInterface {
@@ -26,29 +49,240 @@ class SocketProvider : public SocketInterface {
   int Socket(int domain, int type, int protocol) override {
     return socket(domain, type, protocol);
   }
-  // Reads bytes using the read system call
-  ssize_t Read(int fd, void* buf, size_t count) override {
-    return read(fd, buf, count);
+  // Reads a datagram using the recvmsg system call
+  ssize_t RecvMsg(int sockfd, struct msghdr* msg, int flags) override {
+    return recvmsg(sockfd, msg, flags);
+  }
+  // Reads multiple datagrams using the recvmmsg system call
+  int RecvMmsg(int sockfd, struct mmsghdr* msgvec, unsigned int vlen,
+               int flags, struct timespec* timeout) override {
+    return recvmmsg(sockfd, msgvec, vlen, flags, timeout);
   }
   // Binds a socket to a address using the bind system call
   int Bind(int sockfd, const struct sockaddr* addr,
            socklen_t addrlen) override {
     return bind(sockfd, addr, addrlen);
   }
+  // Sets a socket option using the setsockopt system call
+  int SetSockOpt(int sockfd, int level, int optname, const void* optval,
+                 socklen_t optlen) override {
+    return setsockopt(sockfd, level, optname, optval, optlen);
+  }
+  // Reads a socket option using the getsockopt system call
+  int GetSockOpt(int sockfd, int level, int optname, void* optval,
+                 socklen_t* optlen) override {
+    return getsockopt(sockfd, level, optname, optval, optlen);
+  }
+  // Shuts down a socket using the shutdown system call
+  int Shutdown(int sockfd, int how) override { return shutdown(sockfd, how); }
   // Closes a socket using the close system call
   int Close(int fd) override { return close(fd); }
+  // Creates an epoll instance using the epoll_create1 system call
+  int EpollCreate1(int flags) override { return epoll_create1(flags); }
+  // Registers a socket with an epoll instance using the epoll_ctl system call
+  int EpollCtl(int epfd, int op, int fd, struct epoll_event* event) override {
+    return epoll_ctl(epfd, op, fd, event);
+  }
+  // Waits for readable sockets using the epoll_wait system call
+  int EpollWait(int epfd, struct epoll_event* events, int maxevents,
+                int timeout) override {
+    return epoll_wait(epfd, events, maxevents, timeout);
+  }
+};
+
+// How the relay receives datagrams.
+enum class GnpsiRelayBackend {
+  // System calls of the SocketInterface: read or recvmmsg, with epoll for
+  // several listeners.
+  kSocket,
+  // A multishot recvmsg per socket on an io_uring, receiving into a ring of
+  // provided buffers. Falls back to kSocket if the kernel lacks support, which
+  // needs Linux 6.0.
+  kIoUring,
+};
+
+// How the datagrams of a port are spread over the readers of a relay with
+// several readers. Either way, the datagrams of an agent all go to the same
+// reader, so they are relayed in the order they arrive.
+enum class GnpsiReaderSteering {
+  // The SO_REUSEPORT hash of the kernel, of the source address and port of
+  // each datagram.
+  kFlowHash,
+  // A SO_ATTACH_REUSEPORT_CBPF program hashing the identity of the exporter
+  // in the datagram header: the agent address and sub-agent id of sFlow, the
+  // engine of NetFlow v5, the source id of NetFlow v9 and the observation
+  // domain of IPFIX. This spreads agents sending from a single address, or
+  // through a single socket of a proxy, over the readers. Falls back to
+  // kFlowHash for the other versions, or if the program cannot be attached.
+  kAgent,
+};
+
+// Options controlling how the relay reads samples from the udp port.
+struct GnpsiRelayOptions {
+  GnpsiRelayBackend backend = GnpsiRelayBackend::kSocket;
+  // Number of threads reading datagrams. With more than one, each reader has
+  // a SO_REUSEPORT socket of its own bound to every port, and the kernel
+  // steers each datagram to one of them as selected by `steering`. Readers
+  // share no lock when they hand samples to the service, unless it keeps them
+  // for replay (GnpsiReplayOptions::max_bytes): then each sample is numbered
+  // and queued for every connection under a lock they all take, so that each
+  // stream sees the sequence numbers in order, and more readers only add
+  // receive capacity.
+  int reader_count = 1;
+  GnpsiReaderSteering steering = GnpsiReaderSteering::kFlowHash;
+  // CPUs the readers are pinned to: reader i runs on reader_cpus[i %
+  // reader_cpus.size()]. When set, a single reader also runs on a thread of
+  // its own rather than on the thread calling StartRelayAndWait.
+  std::vector<int> reader_cpus;
+  // Maximum number of datagrams read with a single recvmmsg call and handed to
+  // the sender as one batch. A batch size of 1 reads one datagram per read
+  // call.
+  int batch_size = 1;
+  // Maximum time to wait for a batch to fill up. With a zero timeout a batch
+  // contains whatever datagrams are queued on the socket once the first one
+  // has arrived. Not used when relaying from several listeners, where a batch
+  // is always what is queued on a socket once epoll reports it readable.
+  absl::Duration batch_timeout = absl::ZeroDuration();
+  // Maximum number of released receive buffers kept for reuse. Datagrams are
+  // received into pooled buffers that are handed over to the sender with the
+  // packet, so this should cover the samples queued for sending.
+  int buffer_pool_size = 1024;
+  // Enables SO_TIMESTAMPNS on the socket and uses the time the kernel received
+  // each datagram as its sample timestamp. Datagrams are then read with
+  // recvmmsg, even with a batch size of 1.
+  bool kernel_timestamps = false;
+  // Enables SO_RXQ_OVFL on the sockets and counts the datagrams the kernel
+  // dropped because a receive buffer was full. Datagrams are then read with
+  // recvmmsg, even with a batch size of 1.
+  bool count_kernel_drops = false;
+  // SO_RCVBUF size of the sockets in bytes, which the kernel caps at
+  // net.core.rmem_max and then doubles for its bookkeeping. Zero keeps the
+  // default of net.core.rmem_default.
+  int receive_buffer_size = 0;
+  // Largest datagram relayed. Datagrams that fit in a pooled buffer are
+  // received straight into it. Larger ones spill over into receive space
+  // reserved per message of a batch and are then copied into a buffer of
+  // their own, so only those pay for a copy. Datagrams larger than this are
+  // truncated by the kernel; they are dropped and counted rather than relayed.
+  int max_datagram_size = 65535;
+  // Tracking of the sequence numbers of the sFlow v5 exporters relayed, to
+  // count the datagrams lost before the relay read them. Each reader tracks
+  // the exporters steered to it.
+  GnpsiSequenceTrackingOptions sequence_tracking;
+};
+
+// Counters of the datagrams read by a GnpsiRelayServer.
+struct GnpsiRelayStats {
+  // Number of datagrams read from the sockets, including dropped ones.
+  uint64_t datagram_count = 0;
+  // Number of datagrams too large for a pooled buffer, which were copied.
+  uint64_t large_datagram_count = 0;
+  // Number of datagrams dropped because they exceeded max_datagram_size.
+  uint64_t truncated_count = 0;
+  // Number of reads that returned datagrams: receive calls, or waits for
+  // io_uring completions.
+  uint64_t read_count = 0;
+  // Number of bytes of the datagrams read, including dropped ones.
+  uint64_t byte_count = 0;
+  // Number of reads retried after failing with EAGAIN, which includes batch
+  // timeouts, and with EINTR.
+  uint64_t again_count = 0;
+  uint64_t interrupted_count = 0;
+  // Number of datagrams the kernel dropped because the receive buffer of a
+  // socket was full, if count_kernel_drops is set. The kernel reports them
+  // with the next datagram received on the socket.
+  uint64_t kernel_drop_count = 0;
+  // SO_RCVBUF size of the sockets in bytes, as reported by the kernel.
+  int receive_buffer_size = 0;
+  // Rates per second of datagram_count, byte_count and kernel_drop_count
+  // over the interval between the last two calls to GetStats at least a
+  // second apart. Zero until there is such an interval.
+  double datagram_rate = 0;
+  double byte_rate = 0;
+  double kernel_drop_rate = 0;
+  // Sequence number counters of all sFlow v5 exporters, if tracked.
+  GnpsiSequenceStats sequences;
+};
+
+// Counters of a GnpsiRelayServer. They are updated once per batch with relaxed
+// atomics, so they can be read at any time without slowing down the relay.
+struct GnpsiRelayCounters {
+  // Returns a copy of the current values, without rates.
+  GnpsiRelayStats Snapshot() const;
+
+  // Counts a read retried after failing with `error_number`.
+  void CountRetry(int error_number);
+  // Counts the kernel drops up to `drop_count`, the cumulative SO_RXQ_OVFL
+  // counter of a socket, which was `*last_drop_count` when last reported.
+  void CountKernelDrops(uint32_t drop_count, uint32_t* last_drop_count);
+
+  std::atomic<uint64_t> datagram_count{0};
+  std::atomic<uint64_t> large_datagram_count{0};
+  std::atomic<uint64_t> truncated_count{0};
+  std::atomic<uint64_t> read_count{0};
+  std::atomic<uint64_t> byte_count{0};
+  std::atomic<uint64_t> again_count{0};
+  std::atomic<uint64_t> interrupted_count{0};
+  std::atomic<uint64_t> kernel_drop_count{0};
+  std::atomic<int> receive_buffer_size{0};
+};
+
+// Derives the rates of GnpsiRelayStats from the counters, over intervals of at
+// least a second between the calls to Update. Thread-safe.
+class GnpsiRelayRates {
+ public:
+  // Sets the rates of `stats`, read at `now`.
+  void Update(absl::Time now, GnpsiRelayStats* stats) ABSL_LOCKS_EXCLUDED(mu_);
+
+ private:
+  absl::Mutex mu_;
+  // Counters at the start of the current interval.
+  absl::Time start_ ABSL_GUARDED_BY(mu_) = absl::InfinitePast();
+  GnpsiRelayStats start_stats_ ABSL_GUARDED_BY(mu_);
+  // Rates of the last complete interval.
+  GnpsiRelayStats rates_ ABSL_GUARDED_BY(mu_);
+};
+
+// A loopback udp port the relay reads samples from, along with the protocol
+// and version of the datagrams sent to it. Samples relayed from the port are
+// tagged with this metadata.
+struct GnpsiRelayListener {
+  int udp_port;
+  GnpsiSampleMetadata metadata = SFlowMetadata::V5;
 };
 
 class GnpsiRelayServer {
  public:
   GnpsiRelayServer(int udp_port, int addr_family)
-      : udp_port_(udp_port),
-        addr_family_(addr_family),
-        socket_provider_(new SocketProvider) {}
+      : GnpsiRelayServer(udp_port, addr_family, GnpsiRelayOptions()) {}
+  GnpsiRelayServer(int udp_port, int addr_family,
+                   const GnpsiRelayOptions& options)
+      : GnpsiRelayServer({GnpsiRelayListener{udp_port}}, addr_family,
+                         options) {}
+  // Relays samples from several listeners. With more than one listener, all
+  // sockets of a reader are watched by a single epoll loop.
+  GnpsiRelayServer(std::vector<GnpsiRelayListener> listeners, int addr_family,
+                   const GnpsiRelayOptions& options);
 
-  // Start Relaying Samples by reading from the udp port. This is a blocking
+  // Start Relaying Samples by reading from the udp ports. This is a blocking
   // call and will keep on reading samples until a critical error is encountered
-  void StartRelayAndWait(GnpsiSenderInterface& service);
+  // on any of the ports, or until Stop is called. With several readers, a
+  // critical error on one of them stops them all. The sockets are closed when
+  // it returns. With several readers, `service` is called from all of them
+  // at the same time.
+  void StartRelayAndWait(GnpsiSenderInterface& service)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Makes StartRelayAndWait return, by shutting down its sockets to wake it
+  // up. Can be called from any thread, also before StartRelayAndWait.
+  void Stop() ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Returns the counters of the datagrams read so far, with their rates. Can
+  // be called from any thread while relaying.
+  GnpsiRelayStats GetStats();
+  // Returns the sequence number counters of each sFlow v5 exporter tracked.
+  // Can be called from any thread while relaying.
+  std::vector<GnpsiSequenceStats> GetExporterStats() const;
 
   // Mutator
   void set_socket_interface(SocketInterface* new_interface) {
@@ -56,11 +290,68 @@ class GnpsiRelayServer {
   }
 
  private:
-  int udp_port_;
+  // Relays from `fds`, the sockets of `reader` for listeners_ in the same
+  // order, with the backend of options_.
+  void ReaderLoop(int reader, const std::vector<int>& fds,
+                  GnpsiSenderInterface& service);
+  // Relays from `fds`, the sockets of a reader for listeners_ in the same
+  // order, with the loop of the kSocket backend suited to the listeners and
+  // options_.
+  void SocketRelayLoop(const std::vector<int>& fds,
+                       GnpsiSequenceTracker* tracker,
+                       GnpsiSenderInterface& service);
+  // Reads one datagram per recvmsg call and sends it to `service`.
+  void RelayLoop(int fd, const GnpsiRelayListener& listener,
+                 GnpsiSequenceTracker* tracker, GnpsiSenderInterface& service);
+  // Reads up to options_.batch_size datagrams per recvmmsg call, along with
+  // their kernel timestamps if enabled, and sends them to `service` as a batch.
+  void BatchedRelayLoop(int fd, const GnpsiRelayListener& listener,
+                        GnpsiSequenceTracker* tracker,
+                        GnpsiSenderInterface& service);
+  // Waits for any of `fds`, the sockets of listeners_ in the same order, to be
+  // readable and reads up to options_.batch_size datagrams from it without
+  // blocking.
+  void EpollRelayLoop(const std::vector<int>& fds,
+                      GnpsiSequenceTracker* tracker,
+                      GnpsiSenderInterface& service);
+  // Arms a multishot recvmsg on each of `fds` with an io_uring and sends the
+  // datagrams received to `service`, in batches of up to options_.batch_size
+  // per listener. Returns false, before relaying anything, if the kernel does
+  // not support it.
+  bool IoUringRelayLoop(const std::vector<int>& fds,
+                        GnpsiSequenceTracker* tracker,
+                        GnpsiSenderInterface& service);
+  // Enables the kernel receive timestamps and drop counts on `fd` requested
+  // by options_. Returns false on failure.
+  bool EnableControlMessages(int fd);
+  // Returns whether datagrams are read with control messages.
+  bool control_messages() const {
+    return options_.kernel_timestamps || options_.count_kernel_drops;
+  }
+  // Sets the receive buffer size of `fd` requested by options_, and records
+  // the size reported by the kernel.
+  void SetReceiveBufferSize(int fd);
+  // Attaches the kAgent steering program for `listener` to `fd`, the first
+  // of its SO_REUSEPORT sockets, if there is one for its protocol version.
+  void AttachSteeringProgram(int fd, const GnpsiRelayListener& listener);
+
+  std::vector<GnpsiRelayListener> listeners_;
   int addr_family_;
+  GnpsiRelayOptions options_;
   // The socket_ provides access calls to setup and read from sockets.  Unit
   // tests can replace the normally constructed interface with a mock interface.
   std::unique_ptr<SocketInterface> socket_provider_;
+  GnpsiRelayCounters counters_;
+  GnpsiRelayRates rates_;
+  // Sequence tracker of each reader, or none if sequence numbers are not
+  // tracked. Created up front, so that they can be read while relaying.
+  std::vector<std::unique_ptr<GnpsiSequenceTracker>> trackers_;
+  // Set by Stop, and checked by the relay loops each time they wake up.
+  std::atomic<bool> stopping_{false};
+  absl::Mutex mu_;
+  // Sockets StartRelayAndWait reads from, of all readers, for Stop to shut
+  // down.
+  std::vector<int> fds_ ABSL_GUARDED_BY(mu_);
 };
 
 }  // namespace gnpsi
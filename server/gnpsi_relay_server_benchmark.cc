@@ -0,0 +1,284 @@
+// Measures the ingest path of GnpsiRelayServer: reading datagrams from the
+// socket and handing them to the sender. The socket serves preloaded
+// datagrams from memory and the sender discards them, so the benchmarks
+// measure the relay itself rather than the kernel or the fan-out.
+//
+// Besides throughput, the benchmarks report the heap allocations per datagram
+// and the p50, p99 and p999 time between two consecutive hand-overs to the
+// sender.
+//
+// BM_RelayLoopback instead relays datagrams sent over the loopback interface,
+// to compare the blocking recvmsg loop with the io_uring backend. It reports
+// the CPU time of the relay thread per datagram relayed in "cpu_ns_per_dgram"
+// and the fraction of the datagrams sent that were lost in "loss".
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>  // NOLINT
+#include <cstdint>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "absl/types/span.h"
+#include "benchmark/benchmark.h"
+#include "glog/logging.h"
+#include "server/gnpsi_benchmark_util.h"
+#include "server/gnpsi_packet_buffer.h"
+#include "server/gnpsi_relay_server.h"
+#include "server/gnpsi_service_impl.h"
+
+namespace gnpsi {
+namespace {
+
+// Datagrams read per StartRelayAndWait call.
+constexpr int kDatagramsPerRelay = 4096;
+
+// Serves `count` copies of `datagram`, then fails with a fatal error so that
+// the relay loop returns.
+class PreloadedSocket : public SocketInterface {
+ public:
+  PreloadedSocket(const std::string& datagram, int count)
+      : datagram_(datagram), remaining_(count) {}
+
+  int Socket(int domain, int type, int protocol) override { return 3; }
+  ssize_t RecvMsg(int sockfd, struct msghdr* msg, int flags) override {
+    if (remaining_ == 0) return Exhausted();
+    --remaining_;
+    return Fill(msg);
+  }
+  int RecvMmsg(int sockfd, struct mmsghdr* msgvec, unsigned int vlen,
+               int flags, struct timespec* timeout) override {
+    if (remaining_ == 0) return Exhausted();
+    int received = std::min<int>(vlen, remaining_);
+    for (int i = 0; i < received; ++i) {
+      msgvec[i].msg_len = Fill(&msgvec[i].msg_hdr);
+    }
+    remaining_ -= received;
+    return received;
+  }
+  int Bind(int sockfd, const struct sockaddr* addr,
+           socklen_t addrlen) override {
+    return 0;
+  }
+  int SetSockOpt(int sockfd, int level, int optname, const void* optval,
+                 socklen_t optlen) override {
+    return 0;
+  }
+  int GetSockOpt(int sockfd, int level, int optname, void* optval,
+                 socklen_t* optlen) override {
+    return 0;
+  }
+  int Close(int fd) override { return 0; }
+  int Shutdown(int sockfd, int how) override { return 0; }
+  int EpollCreate1(int flags) override { return 4; }
+  int EpollCtl(int epfd, int op, int fd, struct epoll_event* event) override {
+    return 0;
+  }
+  int EpollWait(int epfd, struct epoll_event* events, int maxevents,
+                int timeout) override {
+    return Exhausted();
+  }
+
+ private:
+  // Scatters the datagram over the buffers of `msg` as recvmsg would.
+  // Returns the number of bytes received.
+  size_t Fill(struct msghdr* msg) const {
+    size_t offset = 0;
+    for (size_t i = 0; i < msg->msg_iovlen && offset < datagram_.size(); ++i) {
+      size_t len = std::min(msg->msg_iov[i].iov_len, datagram_.size() - offset);
+      memcpy(msg->msg_iov[i].iov_base, datagram_.data() + offset, len);
+      offset += len;
+    }
+    if (offset < datagram_.size()) msg->msg_flags |= MSG_TRUNC;
+    return offset;
+  }
+
+  static int Exhausted() {
+    errno = EBADF;
+    return -1;
+  }
+
+  const std::string datagram_;
+  int remaining_;
+};
+
+// Discards the packets, recording the time between hand-overs.
+class DiscardingSender : public GnpsiSenderInterface {
+ public:
+  explicit DiscardingSender(LatencyRecorder* latency) : latency_(latency) {}
+
+  void SendSamplePacket(const std::string& sample_packet,
+                        GnpsiSampleMetadata metadata) override {
+    Delivered(1);
+  }
+  void SendSamplePacket(GnpsiPacketBuffer sample_packet,
+                        GnpsiSampleMetadata metadata) override {
+    benchmark::DoNotOptimize(sample_packet.data());
+    Delivered(1);
+  }
+  void SendSamplePackets(absl::Span<GnpsiPacketBuffer> sample_packets,
+                         GnpsiSampleMetadata metadata) override {
+    for (GnpsiPacketBuffer& sample_packet : sample_packets) {
+      benchmark::DoNotOptimize(sample_packet.data());
+      sample_packet = GnpsiPacketBuffer();
+    }
+    Delivered(sample_packets.size());
+  }
+  void DrainConnections() override {}
+  void UndrainConnections() override {}
+  std::vector<GnpsiStats> GetStats() override { return {}; }
+
+  // Starts timing the hand-overs of the next relay run.
+  void Reset() { last_ = std::chrono::steady_clock::now(); }
+
+ private:
+  // Records the time per datagram since the previous hand-over.
+  void Delivered(int count) {
+    auto now = std::chrono::steady_clock::now();
+    latency_->Record((now - last_) / count);
+    last_ = now;
+  }
+
+  LatencyRecorder* latency_;
+  std::chrono::steady_clock::time_point last_;
+};
+
+// Relays datagrams of state.range(0) bytes, read state.range(1) at a time.
+void BM_RelayIngest(benchmark::State& state) {
+  const std::string datagram(state.range(0), 'x');
+  GnpsiRelayOptions options;
+  options.batch_size = state.range(1);
+  LatencyRecorder latency;
+  DiscardingSender sender(&latency);
+  int64_t start_allocations = AllocationCount();
+  for (auto _ : state) {
+    GnpsiRelayServer relay(/*udp_port=*/6343, AF_INET, options);
+    relay.set_socket_interface(
+        new PreloadedSocket(datagram, kDatagramsPerRelay));
+    sender.Reset();
+    relay.StartRelayAndWait(sender);
+  }
+  int64_t datagrams = state.iterations() * kDatagramsPerRelay;
+  ReportAllocationsPerSample(state, start_allocations, datagrams);
+  latency.Report(state);
+  state.SetItemsProcessed(datagrams);
+  state.SetBytesProcessed(datagrams * datagram.size());
+}
+
+BENCHMARK(BM_RelayIngest)
+    ->ArgNames({"packet_size", "batch_size"})
+    ->ArgsProduct({{128, 1500, 16384}, {1, 8, 32}});
+
+// Datagrams sent per iteration of BM_RelayLoopback.
+constexpr int kDatagramsPerBurst = 256;
+
+// Counts the datagrams relayed to it.
+class CountingSender : public GnpsiSenderInterface {
+ public:
+  void SendSamplePacket(const std::string& sample_packet,
+                        GnpsiSampleMetadata metadata) override {
+    count_.fetch_add(1, std::memory_order_relaxed);
+  }
+  void SendSamplePacket(GnpsiPacketBuffer sample_packet,
+                        GnpsiSampleMetadata metadata) override {
+    count_.fetch_add(1, std::memory_order_relaxed);
+  }
+  void SendSamplePackets(absl::Span<GnpsiPacketBuffer> sample_packets,
+                         GnpsiSampleMetadata metadata) override {
+    for (GnpsiPacketBuffer& sample_packet : sample_packets) {
+      sample_packet = GnpsiPacketBuffer();
+    }
+    count_.fetch_add(sample_packets.size(), std::memory_order_relaxed);
+  }
+  void DrainConnections() override {}
+  void UndrainConnections() override {}
+  std::vector<GnpsiStats> GetStats() override { return {}; }
+
+  int64_t count() const { return count_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> count_{0};
+};
+
+int64_t ThreadCpuNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Relays datagrams of state.range(2) bytes sent over the loopback interface
+// with the backend state.range(0), read state.range(1) at a time.
+void BM_RelayLoopback(benchmark::State& state) {
+  GnpsiRelayOptions options;
+  options.backend = static_cast<GnpsiRelayBackend>(state.range(0));
+  options.batch_size = state.range(1);
+  const std::string datagram(state.range(2), 'x');
+  const int port = FreeUdpPort();
+  GnpsiRelayServer relay(port, AF_INET, options);
+  CountingSender sender;
+  std::atomic<int64_t> relay_cpu_ns{0};
+  std::thread relay_thread([&] {
+    const int64_t start = ThreadCpuNanos();
+    relay.StartRelayAndWait(sender);
+    relay_cpu_ns = ThreadCpuNanos() - start;
+  });
+
+  int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  CHECK_EQ(connect(fd, reinterpret_cast<struct sockaddr*>(&addr),
+                   sizeof(addr)),
+           0);
+  // Waits for the relay to bind its socket.
+  while (sender.count() == 0) {
+    send(fd, datagram.data(), datagram.size(), 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  const int64_t start_count = sender.count();
+
+  int64_t sent = 0;
+  for (auto _ : state) {
+    for (int i = 0; i < kDatagramsPerBurst; ++i) {
+      if (send(fd, datagram.data(), datagram.size(), 0) > 0) ++sent;
+    }
+  }
+  // Gives the relay time to read what is left in the socket.
+  for (int64_t count = -1; count != sender.count();) {
+    count = sender.count();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  close(fd);
+  relay.Stop();
+  relay_thread.join();
+
+  const int64_t relayed = std::min(sender.count() - start_count, sent);
+  state.SetItemsProcessed(relayed);
+  state.SetBytesProcessed(relayed * datagram.size());
+  state.counters["cpu_ns_per_dgram"] =
+      static_cast<double>(relay_cpu_ns) / std::max<int64_t>(relayed, 1);
+  state.counters["loss"] =
+      1 - static_cast<double>(relayed) / std::max<int64_t>(sent, 1);
+}
+
+BENCHMARK(BM_RelayLoopback)
+    ->ArgNames({"io_uring", "batch_size", "packet_size"})
+    ->ArgsProduct({{static_cast<int>(GnpsiRelayBackend::kSocket),
+                    static_cast<int>(GnpsiRelayBackend::kIoUring)},
+                   {1, 32},
+                   {128, 1500}})
+    ->UseRealTime();
+
+}  // namespace
+}  // namespace gnpsi
@@ -1,34 +1,133 @@
 #include "server/gnpsi_relay_server.h"
 
+#include <arpa/inet.h>
 #include <asm-generic/errno-base.h>
+#include <linux/filter.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <cstring>
 #include <exception>
 #include <memory>
+#include <set>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
 
 #include "gmock/gmock.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
 #include "gtest/gtest.h"
+#include "server/gnpsi_io_uring.h"
+#include "server/gnpsi_sflow_test_util.h"
 #include "server/mock_gnpsi_service_impl.h"
 
 namespace gnpsi {
 namespace {
 using testing::_;
+using testing::AllOf;
+using testing::ElementsAre;
+using testing::Property;
 using testing::Invoke;
+using testing::IsNull;
+using testing::NotNull;
 using testing::Return;
 
 const int kUdpPort = 0;
+const int kBatchSize = 4;
+
+GnpsiRelayOptions BatchOptions(absl::Duration batch_timeout) {
+  GnpsiRelayOptions options;
+  options.batch_size = kBatchSize;
+  options.batch_timeout = batch_timeout;
+  return options;
+}
+
+// Scatters `packet` over the buffers of `msg` as recvmsg would, flagging it
+// with MSG_TRUNC if it does not fit. Returns the number of bytes received.
+int FillMessage(struct msghdr* msg, const std::string& packet) {
+  size_t offset = 0;
+  for (size_t i = 0; i < msg->msg_iovlen && offset < packet.size(); ++i) {
+    size_t len = std::min(msg->msg_iov[i].iov_len, packet.size() - offset);
+    memcpy(msg->msg_iov[i].iov_base, packet.data() + offset, len);
+    offset += len;
+  }
+  if (offset < packet.size()) msg->msg_flags |= MSG_TRUNC;
+  return offset;
+}
+
+// Fills the first messages of `msgvec` with `packets` as recvmmsg would.
+int FillBatch(struct mmsghdr* msgvec, const std::vector<std::string>& packets) {
+  for (size_t i = 0; i < packets.size(); ++i) {
+    msgvec[i].msg_len = FillMessage(&msgvec[i].msg_hdr, packets[i]);
+  }
+  return packets.size();
+}
+
+// Attaches a SO_TIMESTAMPNS control message with `time` to `msg` as recvmmsg
+// would.
+void SetReceiveTimestamp(struct msghdr* msg, absl::Time time) {
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
+  ASSERT_NE(cmsg, nullptr);
+  struct timespec ts = absl::ToTimespec(time);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_TIMESTAMPNS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(ts));
+  memcpy(CMSG_DATA(cmsg), &ts, sizeof(ts));
+  msg->msg_controllen = CMSG_SPACE(sizeof(ts));
+}
+
+// Attaches a SO_RXQ_OVFL control message with `drop_count` to `msg` as
+// recvmmsg would.
+void SetDropCount(struct msghdr* msg, uint32_t drop_count) {
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
+  ASSERT_NE(cmsg, nullptr);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SO_RXQ_OVFL;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(drop_count));
+  memcpy(CMSG_DATA(cmsg), &drop_count, sizeof(drop_count));
+  msg->msg_controllen = CMSG_SPACE(sizeof(drop_count));
+}
 }  // namespace
 
 // This class replaces the normal socket interface for test use
 class MockSocket : public SocketInterface {
  public:
   MOCK_METHOD(int, Socket, (int domain, int type, int protocol), (override));
-  MOCK_METHOD(ssize_t, Read, (int fd, void* buf, size_t count), (override));
+  MOCK_METHOD(ssize_t, RecvMsg, (int sockfd, struct msghdr* msg, int flags),
+              (override));
+  MOCK_METHOD(int, RecvMmsg,
+              (int sockfd, struct mmsghdr* msgvec, unsigned int vlen,
+               int flags, struct timespec* timeout),
+              (override));
   MOCK_METHOD(int, Bind,
               (int sockfd, const struct sockaddr* addr, socklen_t addrlen),
               (override));
+  MOCK_METHOD(int, SetSockOpt,
+              (int sockfd, int level, int optname, const void* optval,
+               socklen_t optlen),
+              (override));
+  MOCK_METHOD(int, GetSockOpt,
+              (int sockfd, int level, int optname, void* optval,
+               socklen_t* optlen),
+              (override));
+  MOCK_METHOD(int, Shutdown, (int sockfd, int how), (override));
   MOCK_METHOD(int, Close, (int fd), (override));
+  MOCK_METHOD(int, EpollCreate1, (int flags), (override));
+  MOCK_METHOD(int, EpollCtl,
+              (int epfd, int op, int fd, struct epoll_event* event),
+              (override));
+  MOCK_METHOD(int, EpollWait,
+              (int epfd, struct epoll_event* events, int maxevents,
+               int timeout),
+              (override));
 };
 
 class GnpsiRelayServerTest : public ::testing::Test {
@@ -47,7 +146,9 @@ TEST_F(GnpsiRelayServerTest, RelaySuccess) {
   EXPECT_CALL(*mock_socket_, Socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP))
       .WillOnce(Return(0));
   EXPECT_CALL(*mock_socket_, Bind(0, _, _)).WillOnce(Return(0));
-  EXPECT_CALL(*mock_socket_, Read(0, _, 4096))
+  // The socket is closed once the relay returns.
+  EXPECT_CALL(*mock_socket_, Close(0)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket_, RecvMsg(0, NotNull(), 0))
       .Times(2)
       .WillOnce(Invoke([&]() {
         errno = 0;
@@ -66,7 +167,8 @@ TEST_F(GnpsiRelayServerTest, NoDeathOnNonCriticalReadError) {
   EXPECT_CALL(*mock_socket_, Socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP))
       .WillOnce(Return(0));
   EXPECT_CALL(*mock_socket_, Bind(0, _, _)).WillOnce(Return(0));
-  EXPECT_CALL(*mock_socket_, Read(0, _, 4096))
+  EXPECT_CALL(*mock_socket_, Close(0)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket_, RecvMsg(0, NotNull(), 0))
       .Times(2)
       .WillOnce(Invoke([&]() {
         errno = EINTR;
@@ -81,11 +183,43 @@ TEST_F(GnpsiRelayServerTest, NoDeathOnNonCriticalReadError) {
   relay_server_.StartRelayAndWait(gnpsi_service_impl_);
 }
 
+TEST_F(GnpsiRelayServerTest, CountsReadsAndRetries) {
+  EXPECT_CALL(*mock_socket_, Socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP))
+      .WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket_, Bind(0, _, _)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket_, Close(0)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket_, RecvMsg(0, NotNull(), 0))
+      .WillOnce(Invoke([&]() {
+        errno = EAGAIN;
+        return -1;
+      }))
+      .WillOnce(Invoke([&]() {
+        errno = EINTR;
+        return -1;
+      }))
+      .WillOnce(Invoke([&](int, struct msghdr* msg, int) {
+        return FillMessage(msg, "sample");
+      }))
+      .WillOnce(Invoke([&]() {
+        errno = EFAULT;
+        return -1;
+      }));
+  EXPECT_CALL(gnpsi_service_impl_, SendSamplePacket(_, _)).Times(1);
+  relay_server_.StartRelayAndWait(gnpsi_service_impl_);
+  GnpsiRelayStats stats = relay_server_.GetStats();
+  EXPECT_EQ(stats.datagram_count, 1);
+  EXPECT_EQ(stats.read_count, 1);
+  EXPECT_EQ(stats.byte_count, 6);
+  EXPECT_EQ(stats.again_count, 1);
+  EXPECT_EQ(stats.interrupted_count, 1);
+  EXPECT_EQ(stats.kernel_drop_count, 0);
+}
+
 TEST_F(GnpsiRelayServerTest, DeathOnSocketCreationError) {
   EXPECT_CALL(*mock_socket_, Socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP))
       .WillOnce(Return(-1));
   // Assert no read calls are made in case of socket setup failure
-  EXPECT_CALL(*mock_socket_, Read(0, _, 4096)).Times(0);
+  EXPECT_CALL(*mock_socket_, RecvMsg(0, NotNull(), 0)).Times(0);
   relay_server_.StartRelayAndWait(gnpsi_service_impl_);
 }
 
@@ -95,7 +229,7 @@ TEST_F(GnpsiRelayServerTest, DeathOnSocketBindError) {
   EXPECT_CALL(*mock_socket_, Bind(0, _, _)).WillOnce(Return(-1));
   EXPECT_CALL(*mock_socket_, Close(_)).WillOnce(Return(0));
   // Assert no read calls are made in case of socket setup failure
-  EXPECT_CALL(*mock_socket_, Read(0, _, 4096)).Times(0);
+  EXPECT_CALL(*mock_socket_, RecvMsg(0, NotNull(), 0)).Times(0);
   relay_server_.StartRelayAndWait(gnpsi_service_impl_);
 }
 
@@ -103,12 +237,1005 @@ TEST_F(GnpsiRelayServerTest, DeathOnCriticalReadError) {
   EXPECT_CALL(*mock_socket_, Socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP))
       .WillOnce(Return(0));
   EXPECT_CALL(*mock_socket_, Bind(0, _, _)).WillOnce(Return(0));
-  EXPECT_CALL(*mock_socket_, Read(0, _, 4096)).Times(1).WillOnce(Invoke([&]() {
-    errno = EFAULT;
-    return -1;
-  }));
+  EXPECT_CALL(*mock_socket_, Close(0)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket_, RecvMsg(0, NotNull(), 0))
+      .Times(1)
+      .WillOnce(Invoke([&]() {
+        errno = EFAULT;
+        return -1;
+      }));
   // Assert no send call is made in case fatal error is encountered
   EXPECT_CALL(gnpsi_service_impl_, SendSamplePacket(_, _)).Times(0);
   relay_server_.StartRelayAndWait(gnpsi_service_impl_);
 }
+
+TEST_F(GnpsiRelayServerTest, RelaysLargeDatagram) {
+  const std::string packet(20000, 'l');
+  EXPECT_CALL(*mock_socket_, Socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP))
+      .WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket_, Bind(0, _, _)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket_, Close(0)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket_, RecvMsg(0, NotNull(), 0))
+      .WillOnce(Invoke([&](int, struct msghdr* msg, int) {
+        return FillMessage(msg, packet);
+      }))
+      .WillOnce(Invoke([&]() {
+        errno = EFAULT;
+        return -1;
+      }));
+  EXPECT_CALL(gnpsi_service_impl_, SendSamplePacket(packet, _)).Times(1);
+  relay_server_.StartRelayAndWait(gnpsi_service_impl_);
+  GnpsiRelayStats stats = relay_server_.GetStats();
+  EXPECT_EQ(stats.datagram_count, 1);
+  EXPECT_EQ(stats.large_datagram_count, 1);
+  EXPECT_EQ(stats.truncated_count, 0);
+}
+
+class GnpsiRelayServerBatchTest : public ::testing::Test {
+ protected:
+  GnpsiRelayServerBatchTest()
+      : mock_socket_(new MockSocket),
+        relay_server_(kUdpPort, AF_INET6,
+                      BatchOptions(absl::ZeroDuration())) {
+    relay_server_.set_socket_interface(mock_socket_);
+    EXPECT_CALL(*mock_socket_, Socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP))
+        .WillOnce(Return(0));
+    EXPECT_CALL(*mock_socket_, Bind(0, _, _)).WillOnce(Return(0));
+    EXPECT_CALL(*mock_socket_, Close(0)).WillOnce(Return(0));
+  }
+
+  MockSocket* mock_socket_;
+  MockGnpsiServiceImpl gnpsi_service_impl_;
+  GnpsiRelayServer relay_server_;
+};
+
+TEST_F(GnpsiRelayServerBatchTest, RelaySuccess) {
+  EXPECT_CALL(*mock_socket_,
+              RecvMmsg(0, NotNull(), kBatchSize, MSG_WAITFORONE, IsNull()))
+      .Times(2)
+      .WillOnce(Invoke([&](int, struct mmsghdr* msgvec, unsigned int, int,
+                           struct timespec*) {
+        errno = 0;
+        return FillBatch(msgvec, {"first", "second", "third"});
+      }))
+      .WillOnce(Invoke([&]() {
+        errno = EFAULT;
+        return -1;
+      }));
+  // Assert the whole batch is sent with a single call
+  EXPECT_CALL(gnpsi_service_impl_,
+              SendSamplePackets(
+                  ElementsAre(Property(&GnpsiPacketBuffer::view, "first"),
+                              Property(&GnpsiPacketBuffer::view, "second"),
+                              Property(&GnpsiPacketBuffer::view, "third")),
+                  _))
+      .Times(1);
+  EXPECT_CALL(gnpsi_service_impl_, SendSamplePacket(_, _)).Times(0);
+  relay_server_.StartRelayAndWait(gnpsi_service_impl_);
+}
+
+TEST_F(GnpsiRelayServerBatchTest, NoDeathOnNonCriticalReadError) {
+  EXPECT_CALL(*mock_socket_, RecvMmsg(0, NotNull(), kBatchSize, _, _))
+      .Times(2)
+      .WillOnce(Invoke([&]() {
+        errno = EAGAIN;
+        return -1;
+      }))
+      .WillOnce(Invoke([&]() {
+        errno = EFAULT;
+        return -1;
+      }));
+  // Assert no send call is made in case non fatal error is encountered
+  EXPECT_CALL(gnpsi_service_impl_, SendSamplePackets(_, _)).Times(0);
+  relay_server_.StartRelayAndWait(gnpsi_service_impl_);
+}
+
+TEST(GnpsiRelayServerTruncationTest, DropsDatagramsAboveMaxSize) {
+  MockSocket* mock_socket = new MockSocket;
+  MockGnpsiServiceImpl gnpsi_service_impl;
+  GnpsiRelayOptions options = BatchOptions(absl::ZeroDuration());
+  options.max_datagram_size = 9000;
+  GnpsiRelayServer relay_server(kUdpPort, AF_INET6, options);
+  relay_server.set_socket_interface(mock_socket);
+  EXPECT_CALL(*mock_socket, Socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP))
+      .WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket, Bind(0, _, _)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket, Close(0)).WillOnce(Return(0));
+  const std::string large(9000, 'l');
+  EXPECT_CALL(*mock_socket, RecvMmsg(0, NotNull(), kBatchSize, _, _))
+      .WillOnce(Invoke([&](int, struct mmsghdr* msgvec, unsigned int, int,
+                           struct timespec*) {
+        return FillBatch(msgvec,
+                         {"first", std::string(9001, 't'), large, "last"});
+      }))
+      .WillOnce(Invoke([&](int, struct mmsghdr* msgvec, unsigned int, int,
+                           struct timespec*) {
+        return FillBatch(msgvec, {"next"});
+      }))
+      .WillOnce(Invoke([&]() {
+        errno = EFAULT;
+        return -1;
+      }));
+  // The truncated datagram is left out of the batch.
+  EXPECT_CALL(gnpsi_service_impl,
+              SendSamplePackets(
+                  ElementsAre(Property(&GnpsiPacketBuffer::view, "first"),
+                              Property(&GnpsiPacketBuffer::view,
+                                       absl::string_view(large)),
+                              Property(&GnpsiPacketBuffer::view, "last")),
+                  _))
+      .Times(1);
+  // Its buffer is reused for the next batch.
+  EXPECT_CALL(gnpsi_service_impl,
+              SendSamplePackets(
+                  ElementsAre(Property(&GnpsiPacketBuffer::view, "next")), _))
+      .Times(1);
+  relay_server.StartRelayAndWait(gnpsi_service_impl);
+  GnpsiRelayStats stats = relay_server.GetStats();
+  EXPECT_EQ(stats.datagram_count, 5);
+  EXPECT_EQ(stats.large_datagram_count, 1);
+  EXPECT_EQ(stats.truncated_count, 1);
+}
+
+TEST(GnpsiRelayServerBatchTimeoutTest, SetsReceiveTimeout) {
+  MockSocket* mock_socket = new MockSocket;
+  MockGnpsiServiceImpl gnpsi_service_impl;
+  GnpsiRelayServer relay_server(kUdpPort, AF_INET6,
+                                BatchOptions(absl::Milliseconds(5)));
+  relay_server.set_socket_interface(mock_socket);
+  EXPECT_CALL(*mock_socket, Socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP))
+      .WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket, Bind(0, _, _)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket, Close(0)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket, SetSockOpt(0, SOL_SOCKET, SO_RCVTIMEO, NotNull(),
+                                       sizeof(struct timeval)))
+      .WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket, RecvMmsg(0, NotNull(), kBatchSize, 0, NotNull()))
+      .WillOnce(Invoke([&](int, struct mmsghdr*, unsigned int, int,
+                           struct timespec* timeout) {
+        EXPECT_EQ(timeout->tv_nsec, 5000000);
+        errno = EFAULT;
+        return -1;
+      }));
+  relay_server.StartRelayAndWait(gnpsi_service_impl);
+}
+
+TEST(GnpsiRelayServerKernelTimestampTest, RelaysKernelReceiveTime) {
+  const absl::Time receive_time = absl::FromUnixNanos(1700000000123456789);
+  MockSocket* mock_socket = new MockSocket;
+  MockGnpsiServiceImpl gnpsi_service_impl;
+  GnpsiRelayOptions options;
+  options.kernel_timestamps = true;
+  GnpsiRelayServer relay_server(kUdpPort, AF_INET6, options);
+  relay_server.set_socket_interface(mock_socket);
+  EXPECT_CALL(*mock_socket, Socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP))
+      .WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket, Bind(0, _, _)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket, Close(0)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket, SetSockOpt(0, SOL_SOCKET, SO_TIMESTAMPNS,
+                                       NotNull(), sizeof(int)))
+      .WillOnce(Return(0));
+  // Datagrams are read one at a time with recvmmsg to get their timestamps.
+  EXPECT_CALL(*mock_socket,
+              RecvMmsg(0, NotNull(), 1, MSG_WAITFORONE, IsNull()))
+      .Times(2)
+      .WillOnce(Invoke([&](int, struct mmsghdr* msgvec, unsigned int, int,
+                           struct timespec*) {
+        SetReceiveTimestamp(&msgvec[0].msg_hdr, receive_time);
+        return FillBatch(msgvec, {"sample"});
+      }))
+      .WillOnce(Invoke([&]() {
+        errno = EFAULT;
+        return -1;
+      }));
+  EXPECT_CALL(
+      gnpsi_service_impl,
+      SendSamplePackets(
+          ElementsAre(AllOf(
+              Property(&GnpsiPacketBuffer::view, "sample"),
+              Property(&GnpsiPacketBuffer::receive_time, receive_time))),
+          _))
+      .Times(1);
+  relay_server.StartRelayAndWait(gnpsi_service_impl);
+}
+
+TEST(GnpsiRelayServerKernelDropTest, CountsKernelDrops) {
+  MockSocket* mock_socket = new MockSocket;
+  MockGnpsiServiceImpl gnpsi_service_impl;
+  GnpsiRelayOptions options;
+  options.count_kernel_drops = true;
+  options.receive_buffer_size = 1 << 20;
+  GnpsiRelayServer relay_server(kUdpPort, AF_INET6, options);
+  relay_server.set_socket_interface(mock_socket);
+  EXPECT_CALL(*mock_socket, Socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP))
+      .WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket, Bind(0, _, _)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket, Close(0)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket,
+              SetSockOpt(0, SOL_SOCKET, SO_RCVBUF, NotNull(), sizeof(int)))
+      .WillOnce(Return(0));
+  // The kernel doubles the size it is set to.
+  EXPECT_CALL(*mock_socket, GetSockOpt(0, SOL_SOCKET, SO_RCVBUF, NotNull(),
+                                       NotNull()))
+      .WillOnce(Invoke([](int, int, int, void* optval, socklen_t*) {
+        *static_cast<int*>(optval) = 2 << 20;
+        return 0;
+      }));
+  EXPECT_CALL(*mock_socket,
+              SetSockOpt(0, SOL_SOCKET, SO_RXQ_OVFL, NotNull(), sizeof(int)))
+      .WillOnce(Return(0));
+  // The drop count is cumulative, and only reported once there are drops.
+  EXPECT_CALL(*mock_socket,
+              RecvMmsg(0, NotNull(), 1, MSG_WAITFORONE, IsNull()))
+      .WillOnce(Invoke([&](int, struct mmsghdr* msgvec, unsigned int, int,
+                           struct timespec*) {
+        msgvec[0].msg_hdr.msg_controllen = 0;
+        return FillBatch(msgvec, {"first"});
+      }))
+      .WillOnce(Invoke([&](int, struct mmsghdr* msgvec, unsigned int, int,
+                           struct timespec*) {
+        SetDropCount(&msgvec[0].msg_hdr, 5);
+        return FillBatch(msgvec, {"second"});
+      }))
+      .WillOnce(Invoke([&](int, struct mmsghdr* msgvec, unsigned int, int,
+                           struct timespec*) {
+        SetDropCount(&msgvec[0].msg_hdr, 7);
+        return FillBatch(msgvec, {"third"});
+      }))
+      .WillOnce(Invoke([&]() {
+        errno = EFAULT;
+        return -1;
+      }));
+  EXPECT_CALL(gnpsi_service_impl, SendSamplePackets(_, _)).Times(3);
+  relay_server.StartRelayAndWait(gnpsi_service_impl);
+  GnpsiRelayStats stats = relay_server.GetStats();
+  EXPECT_EQ(stats.datagram_count, 3);
+  EXPECT_EQ(stats.kernel_drop_count, 7);
+  EXPECT_EQ(stats.receive_buffer_size, 2 << 20);
+}
+
+TEST(GnpsiRelayRatesTest, RatesOverIntervalsOfASecond) {
+  GnpsiRelayRates rates;
+  const absl::Time start = absl::FromUnixSeconds(1700000000);
+  GnpsiRelayStats stats;
+  rates.Update(start, &stats);
+  EXPECT_EQ(stats.datagram_rate, 0);
+
+  stats.datagram_count = 100;
+  stats.byte_count = 10000;
+  stats.kernel_drop_count = 10;
+  rates.Update(start + absl::Seconds(2), &stats);
+  EXPECT_EQ(stats.datagram_rate, 50);
+  EXPECT_EQ(stats.byte_rate, 5000);
+  EXPECT_EQ(stats.kernel_drop_rate, 5);
+
+  // Within a second, the rates of the last interval are kept.
+  stats.datagram_count = 1000;
+  rates.Update(start + absl::Milliseconds(2500), &stats);
+  EXPECT_EQ(stats.datagram_rate, 50);
+  rates.Update(start + absl::Seconds(4), &stats);
+  EXPECT_EQ(stats.datagram_rate, 450);
+  EXPECT_EQ(stats.byte_rate, 0);
+}
+
+TEST(GnpsiRelayServerBatchTimeoutTest, DeathOnSetSockOptError) {
+  MockSocket* mock_socket = new MockSocket;
+  MockGnpsiServiceImpl gnpsi_service_impl;
+  GnpsiRelayServer relay_server(kUdpPort, AF_INET6,
+                                BatchOptions(absl::Milliseconds(5)));
+  relay_server.set_socket_interface(mock_socket);
+  EXPECT_CALL(*mock_socket, Socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP))
+      .WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket, Bind(0, _, _)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket, SetSockOpt(0, SOL_SOCKET, SO_RCVTIMEO, _, _))
+      .WillOnce(Return(-1));
+  EXPECT_CALL(*mock_socket, Close(0)).WillOnce(Return(0));
+  // Assert no read calls are made in case of socket setup failure
+  EXPECT_CALL(*mock_socket, RecvMmsg(_, _, _, _, _)).Times(0);
+  relay_server.StartRelayAndWait(gnpsi_service_impl);
+}
+
+TEST(GnpsiRelayServerListenerTest, TagsSamplesWithListenerMetadata) {
+  MockSocket* mock_socket = new MockSocket;
+  MockGnpsiServiceImpl gnpsi_service_impl;
+  GnpsiRelayServer relay_server({{6343, IPFIXMetadata::V10}}, AF_INET6,
+                                GnpsiRelayOptions());
+  relay_server.set_socket_interface(mock_socket);
+  EXPECT_CALL(*mock_socket, Socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP))
+      .WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket, Bind(0, _, _)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket, Close(0)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket, RecvMsg(0, NotNull(), 0))
+      .WillOnce(Invoke([](int, struct msghdr* msg, int) {
+        return FillMessage(msg, "sample");
+      }))
+      .WillOnce(Invoke([&]() {
+        errno = EFAULT;
+        return -1;
+      }));
+  // A single listener is read without epoll.
+  EXPECT_CALL(*mock_socket, EpollCreate1(_)).Times(0);
+  EXPECT_CALL(gnpsi_service_impl,
+              SendSamplePacket(_, GnpsiSampleMetadata(IPFIXMetadata::V10)))
+      .Times(1);
+  relay_server.StartRelayAndWait(gnpsi_service_impl);
+}
+
+class GnpsiRelayServerEpollTest : public ::testing::Test {
+ protected:
+  static constexpr int kEpollFd = 10;
+  static constexpr int kSFlowFd = 11;
+  static constexpr int kIpfixFd = 12;
+
+  GnpsiRelayServerEpollTest()
+      : mock_socket_(new MockSocket),
+        relay_server_({{6343, SFlowMetadata::V5}, {4739, IPFIXMetadata::V10}},
+                      AF_INET6, BatchOptions(absl::ZeroDuration())) {
+    relay_server_.set_socket_interface(mock_socket_);
+    EXPECT_CALL(*mock_socket_, Socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP))
+        .WillOnce(Return(kSFlowFd))
+        .WillOnce(Return(kIpfixFd));
+    EXPECT_CALL(*mock_socket_, Bind(_, _, _)).WillRepeatedly(Return(0));
+  }
+
+  // Expects both sockets to be registered with the epoll instance.
+  void ExpectEpollSetUp() {
+    EXPECT_CALL(*mock_socket_, EpollCreate1(EPOLL_CLOEXEC))
+        .WillOnce(Return(kEpollFd));
+    EXPECT_CALL(*mock_socket_,
+                EpollCtl(kEpollFd, EPOLL_CTL_ADD, kSFlowFd, NotNull()))
+        .WillOnce(Invoke([](int, int, int, struct epoll_event* event) {
+          EXPECT_EQ(event->events, EPOLLIN);
+          EXPECT_EQ(event->data.u32, 0);
+          return 0;
+        }));
+    EXPECT_CALL(*mock_socket_,
+                EpollCtl(kEpollFd, EPOLL_CTL_ADD, kIpfixFd, NotNull()))
+        .WillOnce(Invoke([](int, int, int, struct epoll_event* event) {
+          EXPECT_EQ(event->data.u32, 1);
+          return 0;
+        }));
+  }
+
+  MockSocket* mock_socket_;
+  MockGnpsiServiceImpl gnpsi_service_impl_;
+  GnpsiRelayServer relay_server_;
+};
+
+TEST_F(GnpsiRelayServerEpollTest, TagsSamplesPerListener) {
+  ExpectEpollSetUp();
+  EXPECT_CALL(*mock_socket_, EpollWait(kEpollFd, NotNull(), 2, -1))
+      .WillOnce(Invoke([](int, struct epoll_event* events, int, int) {
+        events[0].events = EPOLLIN;
+        events[0].data.u32 = 1;
+        events[1].events = EPOLLIN;
+        events[1].data.u32 = 0;
+        return 2;
+      }))
+      .WillOnce(Invoke([](int, struct epoll_event* events, int, int) {
+        events[0].events = EPOLLIN;
+        events[0].data.u32 = 0;
+        return 1;
+      }));
+  EXPECT_CALL(*mock_socket_,
+              RecvMmsg(kIpfixFd, NotNull(), kBatchSize, MSG_DONTWAIT, IsNull()))
+      .WillOnce(Invoke([&](int, struct mmsghdr* msgvec, unsigned int, int,
+                           struct timespec*) {
+        return FillBatch(msgvec, {"ipfix"});
+      }));
+  EXPECT_CALL(*mock_socket_,
+              RecvMmsg(kSFlowFd, NotNull(), kBatchSize, MSG_DONTWAIT, IsNull()))
+      .WillOnce(Invoke([&](int, struct mmsghdr* msgvec, unsigned int, int,
+                           struct timespec*) {
+        return FillBatch(msgvec, {"sflow1", "sflow2"});
+      }))
+      .WillOnce(Invoke([&]() {
+        errno = EFAULT;
+        return -1;
+      }));
+  EXPECT_CALL(gnpsi_service_impl_,
+              SendSamplePackets(
+                  ElementsAre(Property(&GnpsiPacketBuffer::view, "ipfix")),
+                  GnpsiSampleMetadata(IPFIXMetadata::V10)))
+      .Times(1);
+  EXPECT_CALL(gnpsi_service_impl_,
+              SendSamplePackets(
+                  ElementsAre(Property(&GnpsiPacketBuffer::view, "sflow1"),
+                              Property(&GnpsiPacketBuffer::view, "sflow2")),
+                  GnpsiSampleMetadata(SFlowMetadata::V5)))
+      .Times(1);
+  // All sockets are closed once a fatal error stops the loop.
+  EXPECT_CALL(*mock_socket_, Close(kSFlowFd)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket_, Close(kIpfixFd)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket_, Close(kEpollFd)).WillOnce(Return(0));
+  relay_server_.StartRelayAndWait(gnpsi_service_impl_);
+}
+
+TEST_F(GnpsiRelayServerEpollTest, SkipsSocketWithNothingToRead) {
+  ExpectEpollSetUp();
+  EXPECT_CALL(*mock_socket_, EpollWait(kEpollFd, NotNull(), 2, -1))
+      .WillOnce(Invoke([](int, struct epoll_event* events, int, int) {
+        events[0].events = EPOLLIN;
+        events[0].data.u32 = 0;
+        return 1;
+      }))
+      .WillOnce(Invoke([]() {
+        errno = EBADF;
+        return -1;
+      }));
+  EXPECT_CALL(*mock_socket_, RecvMmsg(kSFlowFd, _, _, MSG_DONTWAIT, _))
+      .WillOnce(Invoke([&]() {
+        errno = EAGAIN;
+        return -1;
+      }));
+  EXPECT_CALL(gnpsi_service_impl_, SendSamplePackets(_, _)).Times(0);
+  EXPECT_CALL(*mock_socket_, Close(_)).Times(3).WillRepeatedly(Return(0));
+  relay_server_.StartRelayAndWait(gnpsi_service_impl_);
+}
+
+TEST_F(GnpsiRelayServerEpollTest, DeathOnEpollCreationError) {
+  EXPECT_CALL(*mock_socket_, EpollCreate1(_)).WillOnce(Return(-1));
+  EXPECT_CALL(*mock_socket_, Close(kSFlowFd)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket_, Close(kIpfixFd)).WillOnce(Return(0));
+  // Assert no read calls are made in case of epoll setup failure
+  EXPECT_CALL(*mock_socket_, EpollWait(_, _, _, _)).Times(0);
+  EXPECT_CALL(*mock_socket_, RecvMmsg(_, _, _, _, _)).Times(0);
+  relay_server_.StartRelayAndWait(gnpsi_service_impl_);
+}
+
+TEST(GnpsiRelayServerReadersTest, FatalErrorOnOneReaderStopsAll) {
+  const int kFirstFd = 3;
+  const int kSecondFd = 4;
+  GnpsiRelayOptions options;
+  options.reader_count = 2;
+  options.steering = GnpsiReaderSteering::kAgent;
+  GnpsiRelayServer relay_server(kUdpPort, AF_INET6, options);
+  MockSocket* mock_socket = new MockSocket;
+  relay_server.set_socket_interface(mock_socket);
+  MockGnpsiServiceImpl gnpsi_service_impl;
+  EXPECT_CALL(*mock_socket, Socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP))
+      .WillOnce(Return(kFirstFd))
+      .WillOnce(Return(kSecondFd));
+  // Both sockets share the port, and the first one steers the datagrams.
+  EXPECT_CALL(*mock_socket, SetSockOpt(_, SOL_SOCKET, SO_REUSEPORT, _, _))
+      .Times(2)
+      .WillRepeatedly(Return(0));
+  EXPECT_CALL(*mock_socket,
+              SetSockOpt(kFirstFd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                         NotNull(), sizeof(struct sock_fprog)))
+      .WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket, Bind(_, _, _)).Times(2).WillRepeatedly(Return(0));
+  EXPECT_CALL(*mock_socket, RecvMsg(kFirstFd, NotNull(), 0))
+      .WillOnce(Invoke([&]() {
+        errno = EFAULT;
+        return -1;
+      }));
+  // The second reader keeps reading until it is stopped.
+  EXPECT_CALL(*mock_socket, RecvMsg(kSecondFd, NotNull(), 0))
+      .WillRepeatedly(Invoke([&]() {
+        absl::SleepFor(absl::Milliseconds(1));
+        errno = EAGAIN;
+        return -1;
+      }));
+  EXPECT_CALL(*mock_socket, Shutdown(_, SHUT_RD))
+      .Times(testing::AtLeast(2))
+      .WillRepeatedly(Return(0));
+  EXPECT_CALL(*mock_socket, Close(kFirstFd)).WillOnce(Return(0));
+  EXPECT_CALL(*mock_socket, Close(kSecondFd)).WillOnce(Return(0));
+  relay_server.StartRelayAndWait(gnpsi_service_impl);
+}
+
+namespace {
+// Returns a loopback udp port that is free at the time of the call.
+int FreeUdpPort() {
+  int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  bind(fd, reinterpret_cast<struct sockaddr*>(&addr), len);
+  getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr), &len);
+  close(fd);
+  return ntohs(addr.sin_port);
+}
+
+void SendDatagram(int port, const std::string& datagram, int fd = -1) {
+  const bool own_socket = fd < 0;
+  if (own_socket) fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  EXPECT_EQ(sendto(fd, datagram.data(), datagram.size(), 0,
+                   reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)),
+            datagram.size());
+  if (own_socket) close(fd);
+}
+
+// Records the packets relayed to it.
+class RecordingSender : public GnpsiSenderInterface {
+ public:
+  struct Packet {
+    std::string data;
+    GnpsiSampleMetadata metadata;
+    absl::Time receive_time;
+    // Thread the packet was relayed from.
+    std::thread::id thread;
+  };
+
+  void SendSamplePacket(const std::string& sample_packet,
+                        GnpsiSampleMetadata metadata) override {
+    absl::MutexLock l(&mu_);
+    WaitUntilResumed();
+    packets_.push_back({sample_packet, metadata, absl::InfinitePast(),
+                        std::this_thread::get_id()});
+  }
+  void SendSamplePacket(GnpsiPacketBuffer sample_packet,
+                        GnpsiSampleMetadata metadata) override {
+    absl::MutexLock l(&mu_);
+    WaitUntilResumed();
+    packets_.push_back({std::string(sample_packet.view()), metadata,
+                        sample_packet.receive_time(),
+                        std::this_thread::get_id()});
+  }
+  void DrainConnections() override {}
+  void UndrainConnections() override {}
+  std::vector<GnpsiStats> GetStats() override { return {}; }
+
+  // Makes the relay wait in the next send until Resume, so that datagrams
+  // queue up on its sockets.
+  void Pause() {
+    absl::MutexLock l(&mu_);
+    paused_ = true;
+  }
+  void Resume() {
+    absl::MutexLock l(&mu_);
+    paused_ = false;
+  }
+
+  // Waits up to 10 seconds for `count` packets, and returns the packets.
+  std::vector<Packet> WaitForPackets(size_t count) {
+    absl::MutexLock l(&mu_);
+    auto received = [this, count]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+      return packets_.size() >= count;
+    };
+    mu_.AwaitWithTimeout(absl::Condition(&received), absl::Seconds(10));
+    return packets_;
+  }
+
+ private:
+  void WaitUntilResumed() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    auto resumed = [this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+      return !paused_;
+    };
+    mu_.Await(absl::Condition(&resumed));
+  }
+
+  absl::Mutex mu_;
+  std::vector<Packet> packets_ ABSL_GUARDED_BY(mu_);
+  bool paused_ ABSL_GUARDED_BY(mu_) = false;
+};
+
+std::string BackendName(
+    const ::testing::TestParamInfo<GnpsiRelayBackend>& info) {
+  return info.param == GnpsiRelayBackend::kIoUring ? "IoUring" : "Socket";
+}
+}  // namespace
+
+// Relays datagrams sent to loopback ports, with each backend.
+class GnpsiRelayServerLoopbackTest
+    : public ::testing::TestWithParam<GnpsiRelayBackend> {
+ protected:
+  void SetUp() override {
+    if (GetParam() == GnpsiRelayBackend::kIoUring &&
+        !GnpsiIoUring::Create(/*entries=*/8, /*buffer_count=*/8,
+                              /*buffer_size=*/4096)
+             .ok()) {
+      GTEST_SKIP() << "io_uring is not supported.";
+    }
+  }
+
+  GnpsiRelayOptions Options() const {
+    GnpsiRelayOptions options;
+    options.backend = GetParam();
+    options.batch_size = kBatchSize;
+    return options;
+  }
+
+  // Relays with `relay` on a thread of its own until Stop.
+  void Start(GnpsiRelayServer& relay) {
+    relay_thread_ = std::thread([&] { relay.StartRelayAndWait(sender_); });
+  }
+  void Stop(GnpsiRelayServer& relay) {
+    relay.Stop();
+    relay_thread_.join();
+  }
+
+  RecordingSender sender_;
+  std::thread relay_thread_;
+};
+
+TEST_P(GnpsiRelayServerLoopbackTest, RelaysDatagrams) {
+  const int port = FreeUdpPort();
+  GnpsiRelayServer relay(port, AF_INET, Options());
+  Start(relay);
+  // The datagrams may be sent before the relay has bound its socket.
+  const std::string large(20000, 'l');
+  std::vector<RecordingSender::Packet> packets;
+  for (int attempt = 0; attempt < 100 && packets.empty(); ++attempt) {
+    SendDatagram(port, "first");
+    absl::SleepFor(absl::Milliseconds(10));
+    packets = sender_.WaitForPackets(0);
+  }
+  SendDatagram(port, "second");
+  SendDatagram(port, large);
+  packets = sender_.WaitForPackets(3);
+  Stop(relay);
+  ASSERT_GE(packets.size(), 3);
+  const int first = packets.size() - 3;
+  EXPECT_EQ(packets[first].data, "first");
+  EXPECT_EQ(packets[first + 1].data, "second");
+  EXPECT_EQ(packets[first + 2].data, large);
+  EXPECT_EQ(packets[first].metadata, GnpsiSampleMetadata(SFlowMetadata::V5));
+  GnpsiRelayStats stats = relay.GetStats();
+  EXPECT_EQ(stats.datagram_count, packets.size());
+  EXPECT_EQ(stats.large_datagram_count, 1);
+  EXPECT_EQ(stats.truncated_count, 0);
+  size_t bytes = 0;
+  for (const RecordingSender::Packet& packet : packets) {
+    bytes += packet.data.size();
+  }
+  EXPECT_EQ(stats.byte_count, bytes);
+  EXPECT_GE(stats.read_count, 1);
+  EXPECT_LE(stats.read_count, stats.datagram_count);
+  EXPECT_GT(stats.receive_buffer_size, 0);
+}
+
+TEST_P(GnpsiRelayServerLoopbackTest, CountsKernelDrops) {
+  const int port = FreeUdpPort();
+  GnpsiRelayOptions options = Options();
+  options.count_kernel_drops = true;
+  // The smallest receive buffer, which holds a few datagrams.
+  options.receive_buffer_size = 1;
+  GnpsiRelayServer relay(port, AF_INET, options);
+  Start(relay);
+  std::vector<RecordingSender::Packet> packets;
+  for (int attempt = 0; attempt < 100 && packets.empty(); ++attempt) {
+    SendDatagram(port, "warm up");
+    absl::SleepFor(absl::Milliseconds(10));
+    packets = sender_.WaitForPackets(0);
+  }
+  ASSERT_FALSE(packets.empty());
+  // More warm ups may still be on their way. They are relayed ahead of a
+  // last datagram, which is counted before it is relayed.
+  SendDatagram(port, "warmed up");
+  for (int attempt = 0; attempt < 100 && packets.back().data != "warmed up";
+       ++attempt) {
+    packets = sender_.WaitForPackets(packets.size() + 1);
+  }
+  ASSERT_EQ(packets.back().data, "warmed up");
+  const uint64_t warm_up_count = relay.GetStats().datagram_count;
+  // The relay stops reading while the sender waits, so the datagrams beyond
+  // what the relay and the socket hold are dropped.
+  sender_.Pause();
+  int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  const int kDatagrams = 1000;
+  for (int i = 0; i < kDatagrams; ++i) SendDatagram(port, "flood", fd);
+  absl::SleepFor(absl::Milliseconds(50));
+  sender_.Resume();
+  // The drops are reported with the next datagram received. It may be dropped
+  // too while the relay catches up, and is then sent again.
+  int last_count = 0;
+  for (int attempt = 0; attempt < 100 && packets.back().data != "last";
+       ++attempt) {
+    SendDatagram(port, "last", fd);
+    ++last_count;
+    absl::SleepFor(absl::Milliseconds(10));
+    packets = sender_.WaitForPackets(0);
+  }
+  close(fd);
+  Stop(relay);
+  ASSERT_EQ(packets.back().data, "last");
+  GnpsiRelayStats stats = relay.GetStats();
+  EXPECT_GT(stats.kernel_drop_count, 0);
+  EXPECT_EQ(stats.datagram_count - warm_up_count + stats.kernel_drop_count,
+            kDatagrams + last_count);
+}
+
+TEST_P(GnpsiRelayServerLoopbackTest, DropsDatagramsAboveMaxSize) {
+  const int port = FreeUdpPort();
+  GnpsiRelayOptions options = Options();
+  options.max_datagram_size = 9000;
+  GnpsiRelayServer relay(port, AF_INET, options);
+  Start(relay);
+  std::vector<RecordingSender::Packet> packets;
+  for (int attempt = 0; attempt < 100 && packets.empty(); ++attempt) {
+    SendDatagram(port, "first");
+    absl::SleepFor(absl::Milliseconds(10));
+    packets = sender_.WaitForPackets(0);
+  }
+  SendDatagram(port, std::string(9001, 't'));
+  SendDatagram(port, "last");
+  packets = sender_.WaitForPackets(packets.size() + 1);
+  Stop(relay);
+  EXPECT_EQ(packets.back().data, "last");
+  GnpsiRelayStats stats = relay.GetStats();
+  EXPECT_EQ(stats.datagram_count, packets.size() + 1);
+  EXPECT_EQ(stats.truncated_count, 1);
+}
+
+TEST_P(GnpsiRelayServerLoopbackTest, TagsSamplesPerListener) {
+  const int sflow_port = FreeUdpPort();
+  const int ipfix_port = FreeUdpPort();
+  GnpsiRelayServer relay(
+      {{sflow_port, SFlowMetadata::V5}, {ipfix_port, IPFIXMetadata::V10}},
+      AF_INET, Options());
+  Start(relay);
+  std::vector<RecordingSender::Packet> packets;
+  for (int attempt = 0; attempt < 100 && packets.size() < 2; ++attempt) {
+    SendDatagram(sflow_port, "sflow");
+    SendDatagram(ipfix_port, "ipfix");
+    absl::SleepFor(absl::Milliseconds(10));
+    packets = sender_.WaitForPackets(0);
+  }
+  Stop(relay);
+  ASSERT_GE(packets.size(), 2);
+  for (const RecordingSender::Packet& packet : packets) {
+    EXPECT_EQ(packet.metadata,
+              packet.data == "sflow" ? GnpsiSampleMetadata(SFlowMetadata::V5)
+                                     : GnpsiSampleMetadata(IPFIXMetadata::V10));
+  }
+}
+
+TEST_P(GnpsiRelayServerLoopbackTest, RelaysFromManyListeners) {
+  // More listeners than the smallest io_uring has room to arm requests for.
+  std::vector<GnpsiRelayListener> listeners;
+  for (int i = 0; i < 10; ++i) listeners.push_back({FreeUdpPort()});
+  GnpsiRelayServer relay(listeners, AF_INET, Options());
+  Start(relay);
+  std::vector<RecordingSender::Packet> packets;
+  for (int attempt = 0; attempt < 100 && packets.size() < listeners.size();
+       ++attempt) {
+    for (const GnpsiRelayListener& listener : listeners) {
+      SendDatagram(listener.udp_port, std::to_string(listener.udp_port));
+    }
+    absl::SleepFor(absl::Milliseconds(10));
+    packets = sender_.WaitForPackets(0);
+  }
+  Stop(relay);
+  std::set<std::string> relayed;
+  for (const RecordingSender::Packet& packet : packets) {
+    relayed.insert(packet.data);
+  }
+  for (const GnpsiRelayListener& listener : listeners) {
+    EXPECT_EQ(relayed.count(std::to_string(listener.udp_port)), 1)
+        << "port " << listener.udp_port;
+  }
+}
+
+TEST_P(GnpsiRelayServerLoopbackTest, TracksExporterSequenceNumbers) {
+  const int port = FreeUdpPort();
+  GnpsiRelayServer relay(port, AF_INET, Options());
+  Start(relay);
+  // Another sub-agent keeps sending until the relay has bound its socket.
+  std::vector<RecordingSender::Packet> packets;
+  for (uint32_t sequence_number = 1;
+       sequence_number <= 100 && packets.empty(); ++sequence_number) {
+    SendDatagram(port, SFlowDatagramBuilder()
+                           .set_sub_agent_id(9)
+                           .set_sequence_number(sequence_number)
+                           .Build());
+    absl::SleepFor(absl::Milliseconds(10));
+    packets = sender_.WaitForPackets(0);
+  }
+  for (uint32_t sequence_number : {1, 2, 4, 5}) {
+    SendDatagram(port, SFlowDatagramBuilder()
+                           .set_sequence_number(sequence_number)
+                           .Build());
+  }
+  packets = sender_.WaitForPackets(packets.size() + 4);
+  Stop(relay);
+  GnpsiRelayStats stats = relay.GetStats();
+  EXPECT_EQ(stats.sequences.datagram_count, packets.size());
+  EXPECT_EQ(stats.sequences.gap_count, 1);
+  EXPECT_EQ(stats.sequences.lost_count, 1);
+  std::vector<GnpsiSequenceStats> exporters = relay.GetExporterStats();
+  ASSERT_EQ(exporters.size(), 2);
+  for (const GnpsiSequenceStats& exporter : exporters) {
+    EXPECT_EQ(exporter.agent_address, "10.0.0.1");
+    if (exporter.sub_agent_id == 0) {
+      EXPECT_EQ(exporter.datagram_count, 4);
+      EXPECT_EQ(exporter.lost_count, 1);
+    }
+  }
+}
+
+TEST_P(GnpsiRelayServerLoopbackTest, RelaysKernelReceiveTime) {
+  const int port = FreeUdpPort();
+  GnpsiRelayOptions options = Options();
+  options.kernel_timestamps = true;
+  GnpsiRelayServer relay(port, AF_INET, options);
+  Start(relay);
+  std::vector<RecordingSender::Packet> packets;
+  absl::Time sent = absl::InfinitePast();
+  for (int attempt = 0; attempt < 100 && packets.empty(); ++attempt) {
+    sent = absl::Now();
+    SendDatagram(port, "sample");
+    absl::SleepFor(absl::Milliseconds(10));
+    packets = sender_.WaitForPackets(0);
+  }
+  Stop(relay);
+  ASSERT_FALSE(packets.empty());
+  EXPECT_GE(packets.back().receive_time, sent);
+  EXPECT_LE(packets.back().receive_time, sent + absl::Milliseconds(10));
+}
+
+// Every received datagram carries control messages, which are read from
+// each buffer the datagrams are received into.
+TEST_P(GnpsiRelayServerLoopbackTest, RelaysControlMessagesOfEveryDatagram) {
+  const int port = FreeUdpPort();
+  GnpsiRelayOptions options = Options();
+  options.kernel_timestamps = true;
+  options.count_kernel_drops = true;
+  GnpsiRelayServer relay(port, AF_INET, options);
+  Start(relay);
+  std::vector<RecordingSender::Packet> packets;
+  for (int attempt = 0; attempt < 100 && packets.empty(); ++attempt) {
+    SendDatagram(port, "warm up");
+    absl::SleepFor(absl::Milliseconds(10));
+    packets = sender_.WaitForPackets(0);
+  }
+  ASSERT_FALSE(packets.empty());
+  const absl::Time sent = absl::Now();
+  const int kDatagrams = 16;
+  for (int i = 0; i < kDatagrams; ++i) {
+    SendDatagram(port, absl::StrCat("sample ", i));
+  }
+  packets = sender_.WaitForPackets(packets.size() + kDatagrams);
+  Stop(relay);
+  ASSERT_GE(packets.size(), kDatagrams);
+  const int first = packets.size() - kDatagrams;
+  for (int i = 0; i < kDatagrams; ++i) {
+    EXPECT_EQ(packets[first + i].data, absl::StrCat("sample ", i));
+    EXPECT_GE(packets[first + i].receive_time, sent);
+  }
+  EXPECT_EQ(relay.GetStats().kernel_drop_count, 0);
+}
+
+TEST_P(GnpsiRelayServerLoopbackTest, SteersEachSocketToOneReader) {
+  const int port = FreeUdpPort();
+  GnpsiRelayOptions options = Options();
+  options.reader_count = 2;
+  GnpsiRelayServer relay(port, AF_INET, options);
+  Start(relay);
+  // Datagrams sent before all sockets are bound are not steered.
+  std::vector<RecordingSender::Packet> packets;
+  for (int attempt = 0; attempt < 100 && packets.empty(); ++attempt) {
+    SendDatagram(port, "warm up");
+    absl::SleepFor(absl::Milliseconds(10));
+    packets = sender_.WaitForPackets(0);
+  }
+  int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  const int kDatagrams = 20;
+  for (int i = 0; i < kDatagrams; ++i) {
+    SendDatagram(port, std::to_string(i), fd);
+  }
+  close(fd);
+  packets = sender_.WaitForPackets(packets.size() + kDatagrams);
+  Stop(relay);
+  std::vector<std::string> relayed;
+  std::set<std::thread::id> threads;
+  for (const RecordingSender::Packet& packet : packets) {
+    if (packet.data == "warm up") continue;
+    relayed.push_back(packet.data);
+    threads.insert(packet.thread);
+  }
+  ASSERT_EQ(relayed.size(), kDatagrams);
+  for (int i = 0; i < kDatagrams; ++i) {
+    EXPECT_EQ(relayed[i], std::to_string(i));
+  }
+  EXPECT_EQ(threads.size(), 1);
+}
+
+TEST_P(GnpsiRelayServerLoopbackTest, SteersEachAgentToOneReader) {
+  const int port = FreeUdpPort();
+  GnpsiRelayOptions options = Options();
+  options.reader_count = 2;
+  options.steering = GnpsiReaderSteering::kAgent;
+  options.reader_cpus = {0};
+  GnpsiRelayServer relay(port, AF_INET, options);
+  Start(relay);
+  std::vector<RecordingSender::Packet> packets;
+  for (int attempt = 0; attempt < 100 && packets.empty(); ++attempt) {
+    SendDatagram(port, "warm up");
+    absl::SleepFor(absl::Milliseconds(10));
+    packets = sender_.WaitForPackets(0);
+  }
+  // Datagrams of agents 10.0.0.0 and 10.0.0.1 interleaved, each sent from a
+  // socket of its own, so that only the agent tells them apart.
+  const std::string agents[] = {std::string("\x0a\0\0\0", 4),
+                                std::string("\x0a\0\0\x01", 4)};
+  const int kDatagrams = 20;
+  std::vector<std::string> sent[2];
+  for (int i = 0; i < kDatagrams; ++i) {
+    for (int agent = 0; agent < 2; ++agent) {
+      sent[agent].push_back(SFlowDatagramBuilder(agents[agent])
+                                .AddFlowSample(i, 0, /*sampling_rate=*/1)
+                                .Build());
+      SendDatagram(port, sent[agent].back());
+    }
+  }
+  packets = sender_.WaitForPackets(packets.size() + 2 * kDatagrams);
+  Stop(relay);
+  std::vector<std::string> relayed[2];
+  std::set<std::thread::id> threads[2];
+  for (const RecordingSender::Packet& packet : packets) {
+    if (packet.data == "warm up") continue;
+    const int agent = packet.data.substr(8, 4) == agents[0] ? 0 : 1;
+    relayed[agent].push_back(packet.data);
+    threads[agent].insert(packet.thread);
+  }
+  for (int agent = 0; agent < 2; ++agent) {
+    EXPECT_EQ(relayed[agent], sent[agent]);
+    EXPECT_EQ(threads[agent].size(), 1);
+  }
+  EXPECT_NE(threads[0], threads[1]);
+}
+
+TEST_P(GnpsiRelayServerLoopbackTest, SteersSFlowV2AgentsApart) {
+  // sFlow v2 has no sub-agent id after the agent address, so the address
+  // alone must tell the agents apart.
+  const int port = FreeUdpPort();
+  GnpsiRelayOptions options = Options();
+  options.reader_count = 2;
+  options.steering = GnpsiReaderSteering::kAgent;
+  options.reader_cpus = {0};
+  GnpsiRelayServer relay({{port, SFlowMetadata::V2}}, AF_INET, options);
+  Start(relay);
+  std::vector<RecordingSender::Packet> packets;
+  for (int attempt = 0; attempt < 100 && packets.empty(); ++attempt) {
+    SendDatagram(port, "warm up");
+    absl::SleepFor(absl::Milliseconds(10));
+    packets = sender_.WaitForPackets(0);
+  }
+  const std::string agents[] = {std::string("\x0a\0\0\0", 4),
+                                std::string("\x0a\0\0\x01", 4)};
+  const int kDatagrams = 20;
+  for (int i = 0; i < kDatagrams; ++i) {
+    for (int agent = 0; agent < 2; ++agent) {
+      std::string datagram = SFlowDatagramBuilder(agents[agent])
+                                 .AddFlowSample(i, 0, /*sampling_rate=*/1)
+                                 .Build();
+      datagram[3] = 2;
+      SendDatagram(port, datagram);
+    }
+  }
+  packets = sender_.WaitForPackets(packets.size() + 2 * kDatagrams);
+  Stop(relay);
+  std::set<std::thread::id> threads[2];
+  for (const RecordingSender::Packet& packet : packets) {
+    if (packet.data == "warm up") continue;
+    EXPECT_EQ(packet.metadata, GnpsiSampleMetadata(SFlowMetadata::V2));
+    threads[packet.data.substr(8, 4) == agents[0] ? 0 : 1].insert(
+        packet.thread);
+  }
+  for (int agent = 0; agent < 2; ++agent) {
+    EXPECT_EQ(threads[agent].size(), 1);
+  }
+  EXPECT_NE(threads[0], threads[1]);
+}
+
+TEST_P(GnpsiRelayServerLoopbackTest, ReturnsRightAwayOnceStopped) {
+  GnpsiRelayServer relay(FreeUdpPort(), AF_INET, Options());
+  relay.Stop();
+  relay.StartRelayAndWait(sender_);
+  EXPECT_EQ(relay.GetStats().datagram_count, 0);
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, GnpsiRelayServerLoopbackTest,
+                         ::testing::Values(GnpsiRelayBackend::kSocket,
+                                           GnpsiRelayBackend::kIoUring),
+                         BackendName);
 }  // namespace gnpsi
@@ -0,0 +1,117 @@
+#include "server/gnpsi_replay_ring.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "glog/logging.h"
+#include "server/gnpsi_shared_sample.h"
+#include "server/gnpsi_spool.h"
+
+namespace gnpsi {
+
+std::unique_ptr<GnpsiReplayRing> GnpsiReplayRing::Create(
+    const GnpsiReplayOptions& options) {
+  if (options.max_bytes <= 0) return nullptr;
+  std::unique_ptr<GnpsiSpool> spool;
+  if (!options.spool.directory.empty()) {
+    absl::StatusOr<std::unique_ptr<GnpsiSpool>> created =
+        GnpsiSpool::Create(options.spool);
+    if (created.ok()) {
+      spool = *std::move(created);
+    } else {
+      LOG(ERROR) << "Failed to create replay spool, keeping samples in memory "
+                 << "only: " << created.status();
+    }
+  }
+  return std::make_unique<GnpsiReplayRing>(options, std::move(spool));
+}
+
+void GnpsiReplayRing::Append(std::shared_ptr<const SharedSample> sample,
+                             absl::Time now) {
+  // Evicted samples are released outside of the lock, as releasing the last
+  // reference frees their buffers. With a spool, they are handed over to it
+  // under the lock instead, so readers find them in either place.
+  std::vector<std::shared_ptr<const SharedSample>> evicted;
+  {
+    absl::MutexLock l(&mu_);
+    last_sequence_number_ = sample->sequence_number();
+    bytes_ += sample->packet().size();
+    entries_.push_back({std::move(sample), now});
+    while (!entries_.empty() &&
+           (bytes_ > options_.max_bytes ||
+            now - entries_.front().append_time > options_.max_age)) {
+      bytes_ -= entries_.front().sample->packet().size();
+      evicted.push_back(std::move(entries_.front().sample));
+      entries_.pop_front();
+    }
+    if (spool_ != nullptr && !evicted.empty()) {
+      spool_->Write(std::move(evicted));
+    }
+  }
+}
+
+bool GnpsiReplayRing::Read(
+    uint64_t* after, absl::Time now, int max_samples,
+    std::vector<std::shared_ptr<const SharedSample>>* samples) const {
+  if (spool_ != nullptr) {
+    // Samples evicted from memory are read from the spool without holding the
+    // lock, so appending does not wait for them.
+    bool spooled;
+    {
+      absl::MutexLock l(&mu_);
+      spooled = *after + 1 < FirstSequenceNumberLocked();
+    }
+    if (spooled) {
+      const size_t size = samples->size();
+      if (!spool_->Read(after, max_samples, samples)) return false;
+      max_samples -= samples->size() - size;
+    }
+  }
+  absl::MutexLock l(&mu_);
+  if (spool_ != nullptr && *after + 1 < FirstSequenceNumberLocked()) {
+    // The samples evicted since are read under the lock, so that none are
+    // evicted between the spool and memory.
+    const size_t size = samples->size();
+    if (!spool_->Read(after, max_samples, samples)) return false;
+    max_samples -= samples->size() - size;
+  }
+  return ReadLocked(after, now, max_samples, samples);
+}
+
+uint64_t GnpsiReplayRing::FirstSequenceNumberLocked() const {
+  return entries_.empty() ? last_sequence_number_ + 1
+                          : entries_.front().sample->sequence_number();
+}
+
+bool GnpsiReplayRing::ReadLocked(
+    uint64_t* after, absl::Time now, int max_samples,
+    std::vector<std::shared_ptr<const SharedSample>>* samples) const {
+  if (entries_.empty()) return true;
+  // Sequence numbers are consecutive, so the first sample after `after` is
+  // found without searching.
+  const uint64_t first = entries_.front().sample->sequence_number();
+  size_t index = *after < first ? 0 : *after - first + 1;
+  for (int read = 0; index < entries_.size(); ++index) {
+    const Entry& entry = entries_[index];
+    if (now - entry.append_time <= options_.max_age) {
+      if (read == max_samples) break;
+      samples->push_back(entry.sample);
+      ++read;
+    }
+    *after = entry.sample->sequence_number();
+  }
+  return index >= entries_.size();
+}
+
+uint64_t GnpsiReplayRing::last_sequence_number() const {
+  absl::MutexLock l(&mu_);
+  return last_sequence_number_;
+}
+
+}  // namespace gnpsi
@@ -0,0 +1,99 @@
+#ifndef OPENCONFIG_GNPSI_SERVER_GNPSI_REPLAY_RING_H_
+#define OPENCONFIG_GNPSI_SERVER_GNPSI_REPLAY_RING_H_
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "server/gnpsi_shared_sample.h"
+#include "server/gnpsi_spool.h"
+
+namespace gnpsi {
+
+// Options for keeping recently relayed samples, so that a collector whose
+// stream broke can resume from the last sample it received.
+struct GnpsiReplayOptions {
+  // Maximum number of packet bytes held. Samples are not kept if 0. Keeping
+  // them serializes the senders of samples, see
+  // GnpsiRelayOptions::reader_count.
+  int64_t max_bytes = 0;
+  // Maximum time a sample is held after it was relayed.
+  absl::Duration max_age = absl::Seconds(60);
+  // Spool the samples evicted from memory are written to, to outlast longer
+  // collector outages. Spooled samples are held until the spool is full,
+  // regardless of max_age.
+  GnpsiSpoolOptions spool;
+};
+
+// The samples most recently relayed, in the order of their sequence numbers.
+// The samples are shared with the send queues of the connections, so holding
+// them only costs the references. The oldest samples are evicted once the
+// packet bytes held exceed the maximum, or once they get too old. Evicted
+// samples are written to the spool if there is one, and read back from it
+// when a reader is behind the samples held in memory. This class is
+// thread-safe.
+class GnpsiReplayRing {
+ public:
+  explicit GnpsiReplayRing(const GnpsiReplayOptions& options,
+                           std::unique_ptr<GnpsiSpool> spool = nullptr)
+      : options_(options), spool_(std::move(spool)) {}
+
+  // Returns a ring for `options`, or null if they do not keep samples. If the
+  // spool of `options` cannot be created, the error is logged and the ring
+  // only keeps samples in memory.
+  static std::unique_ptr<GnpsiReplayRing> Create(
+      const GnpsiReplayOptions& options);
+
+  GnpsiReplayRing(const GnpsiReplayRing&) = delete;
+  GnpsiReplayRing& operator=(const GnpsiReplayRing&) = delete;
+
+  // Appends `sample`, relayed at `now`. Its sequence number must be the one
+  // following the last sample appended.
+  void Append(std::shared_ptr<const SharedSample> sample, absl::Time now)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Appends to `samples` up to `max_samples` held samples with a sequence
+  // number above `*after`, skipping the samples in memory older than the
+  // maximum age at `now`, and advances `*after` past them. Returns true if no
+  // samples are left after `*after`.
+  bool Read(uint64_t* after, absl::Time now, int max_samples,
+            std::vector<std::shared_ptr<const SharedSample>>* samples) const
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Returns the sequence number of the last sample appended, or 0 if none.
+  uint64_t last_sequence_number() const ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Null if evicted samples are not spooled.
+  GnpsiSpool* spool() const { return spool_.get(); }
+
+ private:
+  struct Entry {
+    std::shared_ptr<const SharedSample> sample;
+    absl::Time append_time;
+  };
+
+  // Sequence number of the first sample held in memory.
+  uint64_t FirstSequenceNumberLocked() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Read() from the samples held in memory.
+  bool ReadLocked(uint64_t* after, absl::Time now, int max_samples,
+                  std::vector<std::shared_ptr<const SharedSample>>* samples)
+      const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  const GnpsiReplayOptions options_;
+  const std::unique_ptr<GnpsiSpool> spool_;
+  mutable absl::Mutex mu_;
+  std::deque<Entry> entries_ ABSL_GUARDED_BY(mu_);
+  // Number of packet bytes of entries_.
+  int64_t bytes_ ABSL_GUARDED_BY(mu_) = 0;
+  uint64_t last_sequence_number_ ABSL_GUARDED_BY(mu_) = 0;
+};
+
+}  // namespace gnpsi
+
+#endif  // OPENCONFIG_GNPSI_SERVER_GNPSI_REPLAY_RING_H_
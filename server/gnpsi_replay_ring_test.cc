@@ -0,0 +1,145 @@
+#include "server/gnpsi_replay_ring.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "absl/time/time.h"
+#include "grpcpp/support/slice.h"
+#include "gtest/gtest.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_shared_sample.h"
+#include "server/gnpsi_spool.h"
+
+namespace gnpsi {
+namespace {
+
+const absl::Time kNow = absl::FromUnixSeconds(1700000000);
+
+GnpsiReplayOptions Options(int64_t max_bytes, absl::Duration max_age) {
+  GnpsiReplayOptions options;
+  options.max_bytes = max_bytes;
+  options.max_age = max_age;
+  return options;
+}
+
+std::shared_ptr<const SharedSample> MakeSample(uint64_t sequence_number,
+                                               int size = 10) {
+  return std::make_shared<SharedSample>(
+      grpc::Slice(std::string(size, 'x')), /*timestamp=*/0,
+      GnpsiSampleMetadata(SFlowMetadata::V5), sequence_number);
+}
+
+// Returns the sequence numbers of `samples`.
+std::vector<uint64_t> SequenceNumbers(
+    const std::vector<std::shared_ptr<const SharedSample>>& samples) {
+  std::vector<uint64_t> sequence_numbers;
+  for (const auto& sample : samples) {
+    sequence_numbers.push_back(sample->sequence_number());
+  }
+  return sequence_numbers;
+}
+
+TEST(GnpsiReplayRingTest, ReadsSamplesAfterSequenceNumber) {
+  GnpsiReplayRing ring(Options(/*max_bytes=*/1000, absl::Seconds(60)));
+  EXPECT_EQ(ring.last_sequence_number(), 0);
+  for (uint64_t i = 1; i <= 5; ++i) ring.Append(MakeSample(i), kNow);
+  EXPECT_EQ(ring.last_sequence_number(), 5);
+
+  std::vector<std::shared_ptr<const SharedSample>> samples;
+  uint64_t after = 2;
+  EXPECT_FALSE(ring.Read(&after, kNow, /*max_samples=*/2, &samples));
+  EXPECT_EQ(SequenceNumbers(samples), (std::vector<uint64_t>{3, 4}));
+  EXPECT_EQ(after, 4);
+  EXPECT_TRUE(ring.Read(&after, kNow, /*max_samples=*/2, &samples));
+  EXPECT_EQ(SequenceNumbers(samples), (std::vector<uint64_t>{3, 4, 5}));
+  EXPECT_EQ(after, 5);
+
+  samples.clear();
+  EXPECT_TRUE(ring.Read(&after, kNow, /*max_samples=*/2, &samples));
+  EXPECT_TRUE(samples.empty());
+}
+
+TEST(GnpsiReplayRingTest, EvictsOldestSamplesBeyondMaxBytes) {
+  GnpsiReplayRing ring(Options(/*max_bytes=*/30, absl::Seconds(60)));
+  for (uint64_t i = 1; i <= 5; ++i) ring.Append(MakeSample(i), kNow);
+
+  std::vector<std::shared_ptr<const SharedSample>> samples;
+  uint64_t after = 0;
+  EXPECT_TRUE(ring.Read(&after, kNow, /*max_samples=*/10, &samples));
+  EXPECT_EQ(SequenceNumbers(samples), (std::vector<uint64_t>{3, 4, 5}));
+}
+
+TEST(GnpsiReplayRingTest, SkipsSamplesOlderThanMaxAge) {
+  GnpsiReplayRing ring(Options(/*max_bytes=*/1000, absl::Seconds(10)));
+  ring.Append(MakeSample(1), kNow);
+  ring.Append(MakeSample(2), kNow + absl::Seconds(5));
+  ring.Append(MakeSample(3), kNow + absl::Seconds(6));
+
+  // The first sample expired by the time of the read, without a later append
+  // evicting it.
+  std::vector<std::shared_ptr<const SharedSample>> samples;
+  uint64_t after = 0;
+  EXPECT_TRUE(ring.Read(&after, kNow + absl::Seconds(11),
+                        /*max_samples=*/10, &samples));
+  EXPECT_EQ(SequenceNumbers(samples), (std::vector<uint64_t>{2, 3}));
+  EXPECT_EQ(after, 3);
+
+  // Appending evicts the expired samples.
+  ring.Append(MakeSample(4), kNow + absl::Seconds(16));
+  samples.clear();
+  after = 0;
+  EXPECT_TRUE(ring.Read(&after, kNow + absl::Seconds(16),
+                        /*max_samples=*/10, &samples));
+  EXPECT_EQ(SequenceNumbers(samples), (std::vector<uint64_t>{3, 4}));
+}
+
+TEST(GnpsiReplayRingTest, ReadsNothingAfterLastSequenceNumber) {
+  GnpsiReplayRing ring(Options(/*max_bytes=*/1000, absl::Seconds(60)));
+  for (uint64_t i = 1; i <= 3; ++i) ring.Append(MakeSample(i), kNow);
+
+  std::vector<std::shared_ptr<const SharedSample>> samples;
+  uint64_t after = 7;
+  EXPECT_TRUE(ring.Read(&after, kNow, /*max_samples=*/10, &samples));
+  EXPECT_TRUE(samples.empty());
+  EXPECT_EQ(after, 7);
+}
+
+TEST(GnpsiReplayRingTest, ReadsEvictedSamplesFromSpool) {
+  GnpsiSpoolOptions spool_options;
+  spool_options.directory =
+      absl::StrCat(::testing::TempDir(), "/replay_spool");
+  spool_options.segment_bytes = GnpsiSpool::kMinSegmentBytes;
+  spool_options.max_bytes = GnpsiSpool::kMinSegmentBytes;
+  auto spool = GnpsiSpool::Create(spool_options);
+  ASSERT_TRUE(spool.ok()) << spool.status();
+  GnpsiReplayRing ring(Options(/*max_bytes=*/30, absl::Seconds(60)),
+                       *std::move(spool));
+  for (uint64_t i = 1; i <= 5; ++i) {
+    auto sample = std::make_shared<SharedSample>(
+        grpc::Slice(std::string(10, 'x')), /*timestamp=*/0,
+        GnpsiSampleMetadata(SFlowMetadata::V5), i);
+    sample->Serialize();
+    ring.Append(std::move(sample), kNow);
+  }
+
+  // The first two samples are read from the spool, whether or not they have
+  // been written to disk yet.
+  std::vector<std::shared_ptr<const SharedSample>> samples;
+  uint64_t after = 0;
+  EXPECT_FALSE(ring.Read(&after, kNow, /*max_samples=*/1, &samples));
+  EXPECT_FALSE(ring.Read(&after, kNow, /*max_samples=*/2, &samples));
+  EXPECT_TRUE(ring.Read(&after, kNow, /*max_samples=*/10, &samples));
+  EXPECT_EQ(SequenceNumbers(samples), (std::vector<uint64_t>{1, 2, 3, 4, 5}));
+
+  ring.spool()->Flush();
+  samples.clear();
+  after = 1;
+  EXPECT_TRUE(ring.Read(&after, kNow, /*max_samples=*/10, &samples));
+  EXPECT_EQ(SequenceNumbers(samples), (std::vector<uint64_t>{2, 3, 4, 5}));
+}
+
+}  // namespace
+}  // namespace gnpsi
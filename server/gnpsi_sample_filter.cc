@@ -0,0 +1,140 @@
+#include "server/gnpsi_sample_filter.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <string>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_sflow_parser.h"
+
+namespace gnpsi {
+namespace {
+uint32_t SampleTypeBit(SampleFilter::SampleType type) {
+  return uint32_t{1} << type;
+}
+
+bool Contains(const absl::flat_hash_set<uint32_t>& if_indexes,
+              std::optional<uint32_t> if_index) {
+  return if_index.has_value() && if_indexes.contains(*if_index);
+}
+}  // namespace
+
+absl::StatusOr<GnpsiSampleFilter> GnpsiSampleFilter::Create(
+    const Request& request) {
+  GnpsiSampleFilter filter;
+  const SampleFilter& sample_filter = request.filter();
+  for (int type : sample_filter.sample_types()) {
+    if (type != SampleFilter::FLOW && type != SampleFilter::COUNTER) {
+      return absl::InvalidArgumentError("Unknown sample type in filter.");
+    }
+    filter.sample_types_ |=
+        SampleTypeBit(static_cast<SampleFilter::SampleType>(type));
+  }
+  filter.input_if_indexes_.insert(sample_filter.input_if_index().begin(),
+                                  sample_filter.input_if_index().end());
+  filter.output_if_indexes_.insert(sample_filter.output_if_index().begin(),
+                                   sample_filter.output_if_index().end());
+  const std::string& agent_address = sample_filter.agent_address();
+  if (!agent_address.empty() && agent_address.size() != 4 &&
+      agent_address.size() != 16) {
+    return absl::InvalidArgumentError(
+        "Filter agent address must be 4 or 16 bytes.");
+  }
+  filter.agent_address_ = agent_address;
+  filter.subsampling_ = std::max<uint32_t>(request.subsampling(), 1);
+  filter.passes_all_ = filter.sample_types_ == 0 &&
+                       filter.input_if_indexes_.empty() &&
+                       filter.output_if_indexes_.empty() &&
+                       filter.agent_address_.empty() &&
+                       filter.subsampling_ == 1;
+  return filter;
+}
+
+bool GnpsiSampleFilter::Matches(const SFlowSample& sample) const {
+  uint32_t type_bit = 0;
+  switch (sample.type()) {
+    case SFlowSampleType::kFlow:
+      type_bit = SampleTypeBit(SampleFilter::FLOW);
+      break;
+    case SFlowSampleType::kCounter:
+      type_bit = SampleTypeBit(SampleFilter::COUNTER);
+      break;
+    case SFlowSampleType::kOther:
+      break;
+  }
+  if (sample_types_ != 0 && (sample_types_ & type_bit) == 0) return false;
+  if (input_if_indexes_.empty() && output_if_indexes_.empty()) return true;
+  switch (sample.type()) {
+    case SFlowSampleType::kFlow:
+      return Contains(input_if_indexes_, sample.input_if_index()) ||
+             Contains(output_if_indexes_, sample.output_if_index());
+    case SFlowSampleType::kCounter:
+      return Contains(input_if_indexes_, sample.source_if_index()) ||
+             Contains(output_if_indexes_, sample.source_if_index());
+    case SFlowSampleType::kOther:
+      return false;
+  }
+  return false;
+}
+
+GnpsiSampleFilter::Result GnpsiSampleFilter::Apply(absl::string_view packet,
+                                                   char* filtered,
+                                                   size_t* filtered_size) {
+  absl::StatusOr<SFlowDatagram> datagram = SFlowDatagram::Parse(packet);
+  if (!datagram.ok()) return Result::kUnchanged;
+  if (!agent_address_.empty() &&
+      datagram->agent_address() != agent_address_) {
+    return Result::kDropped;
+  }
+  // The samples follow the header and their number. Samples are only copied
+  // once the first one is dropped or rewritten; until then the datagram may
+  // still be sent as is.
+  const char* samples_begin = packet.data() + datagram->header().size() + 4;
+  char* end = nullptr;
+  uint32_t kept = 0;
+  SFlowSample sample;
+  while (datagram->NextSample(&sample)) {
+    bool keep = Matches(sample);
+    const bool rewrite = keep && subsampling_ > 1 &&
+                         sample.type() == SFlowSampleType::kFlow;
+    if (rewrite &&
+        flow_samples_.value.fetch_add(1, std::memory_order_relaxed) %
+                subsampling_ !=
+            0) {
+      keep = false;
+    }
+    if (end == nullptr && (!keep || rewrite)) {
+      const size_t prefix_size = sample.encoding().data() - samples_begin;
+      memcpy(filtered, packet.data(), samples_begin - packet.data());
+      end = filtered + (samples_begin - packet.data());
+      memcpy(end, samples_begin, prefix_size);
+      end += prefix_size;
+    }
+    if (!keep) continue;
+    ++kept;
+    if (end == nullptr) continue;
+    memcpy(end, sample.encoding().data(), sample.encoding().size());
+    if (rewrite) {
+      uint64_t sampling_rate = uint64_t{sample.sampling_rate()} * subsampling_;
+      WriteXdrUint32(
+          std::min<uint64_t>(sampling_rate,
+                             std::numeric_limits<uint32_t>::max()),
+          end + sample.sampling_rate_offset());
+    }
+    end += sample.encoding().size();
+  }
+  if (kept == 0) return Result::kDropped;
+  if (end == nullptr) return Result::kUnchanged;
+  WriteXdrUint32(kept, filtered + datagram->header().size());
+  *filtered_size = end - filtered;
+  return Result::kFiltered;
+}
+
+}  // namespace gnpsi
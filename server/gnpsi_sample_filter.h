@@ -0,0 +1,83 @@
+#ifndef OPENCONFIG_GNPSI_SERVER_GNPSI_SAMPLE_FILTER_H_
+#define OPENCONFIG_GNPSI_SERVER_GNPSI_SAMPLE_FILTER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "absl/container/flat_hash_set.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_sflow_parser.h"
+
+namespace gnpsi {
+
+// The filter and subsampling requested by a subscriber, applied to the sFlow
+// datagrams sent to it. Subsampling makes it stateful, so each connection has
+// a filter of its own. Apply can be called from several threads at the same
+// time, as the readers of a relay do; the count of flow samples subsampled is
+// atomic. Assigning a filter is not thread-safe.
+class GnpsiSampleFilter {
+ public:
+  // A filter that passes every datagram as is.
+  GnpsiSampleFilter() = default;
+
+  // Returns the filter requested by `request`, or an InvalidArgument error if
+  // it is malformed.
+  static absl::StatusOr<GnpsiSampleFilter> Create(const Request& request);
+
+  // Returns true if every datagram passes the filter unchanged, in which case
+  // Apply need not be called.
+  bool passes_all() const { return passes_all_; }
+
+  enum class Result {
+    // The datagram is sent as is.
+    kUnchanged,
+    // No sample of the datagram passes, so it is not sent.
+    kDropped,
+    // The datagram is sent with only some of its samples, or with rewritten
+    // sampling rates.
+    kFiltered,
+  };
+
+  // Applies the filter to the sFlow datagram `packet`. If the result is
+  // kFiltered, the datagram to send is written to `filtered`, which must have
+  // room for packet.size() bytes, and its size to `filtered_size`. Does not
+  // allocate.
+  Result Apply(absl::string_view packet, char* filtered,
+               size_t* filtered_size);
+
+ private:
+  // A counter that is copied along with the filter.
+  struct Counter {
+    Counter() = default;
+    Counter(const Counter& other)
+        : value(other.value.load(std::memory_order_relaxed)) {}
+    Counter& operator=(const Counter& other) {
+      value.store(other.value.load(std::memory_order_relaxed),
+                  std::memory_order_relaxed);
+      return *this;
+    }
+
+    std::atomic<uint64_t> value{0};
+  };
+
+  // Returns true if `sample` matches the sample types and interfaces.
+  bool Matches(const SFlowSample& sample) const;
+
+  bool passes_all_ = true;
+  // Bit per SampleFilter::SampleType to send, or 0 for all types.
+  uint32_t sample_types_ = 0;
+  absl::flat_hash_set<uint32_t> input_if_indexes_;
+  absl::flat_hash_set<uint32_t> output_if_indexes_;
+  std::string agent_address_;
+  uint32_t subsampling_ = 1;
+  // Number of flow samples that passed the filter, for subsampling.
+  Counter flow_samples_;
+};
+
+}  // namespace gnpsi
+
+#endif  // OPENCONFIG_GNPSI_SERVER_GNPSI_SAMPLE_FILTER_H_
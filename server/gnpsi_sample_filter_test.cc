@@ -0,0 +1,179 @@
+#include "server/gnpsi_sample_filter.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_sflow_parser.h"
+#include "server/gnpsi_sflow_test_util.h"
+
+namespace gnpsi {
+namespace {
+using testing::ElementsAre;
+
+GnpsiSampleFilter CreateFilter(const Request& request) {
+  absl::StatusOr<GnpsiSampleFilter> filter = GnpsiSampleFilter::Create(request);
+  EXPECT_TRUE(filter.ok()) << filter.status();
+  return filter.ok() ? *filter : GnpsiSampleFilter();
+}
+
+// Applies `filter` to `packet` and returns the datagram to send, or an empty
+// string if it is dropped.
+std::string Apply(GnpsiSampleFilter& filter, const std::string& packet) {
+  std::string filtered(packet.size(), '\0');
+  size_t filtered_size = 0;
+  switch (filter.Apply(packet, filtered.data(), &filtered_size)) {
+    case GnpsiSampleFilter::Result::kUnchanged:
+      return packet;
+    case GnpsiSampleFilter::Result::kDropped:
+      return "";
+    case GnpsiSampleFilter::Result::kFiltered:
+      break;
+  }
+  filtered.resize(filtered_size);
+  return filtered;
+}
+
+// Returns the input ifIndex of the flow samples of `packet`, and the source
+// ifIndex of its counter samples.
+std::vector<uint32_t> SampleIfIndexes(const std::string& packet) {
+  std::vector<uint32_t> if_indexes;
+  absl::StatusOr<SFlowDatagram> datagram = SFlowDatagram::Parse(packet);
+  EXPECT_TRUE(datagram.ok()) << datagram.status();
+  if (!datagram.ok()) return if_indexes;
+  SFlowSample sample;
+  while (datagram->NextSample(&sample)) {
+    if_indexes.push_back(sample.source_if_index().value_or(0));
+  }
+  EXPECT_EQ(if_indexes.size(), datagram->num_samples());
+  return if_indexes;
+}
+
+std::vector<uint32_t> SamplingRates(const std::string& packet) {
+  std::vector<uint32_t> sampling_rates;
+  absl::StatusOr<SFlowDatagram> datagram = SFlowDatagram::Parse(packet);
+  if (!datagram.ok()) return sampling_rates;
+  SFlowSample sample;
+  while (datagram->NextSample(&sample)) {
+    sampling_rates.push_back(sample.sampling_rate());
+  }
+  return sampling_rates;
+}
+
+TEST(GnpsiSampleFilterTest, PassesAllWithoutFilter) {
+  EXPECT_TRUE(GnpsiSampleFilter().passes_all());
+  EXPECT_TRUE(CreateFilter(Request()).passes_all());
+  Request request;
+  request.set_subsampling(1);
+  EXPECT_TRUE(CreateFilter(request).passes_all());
+}
+
+TEST(GnpsiSampleFilterTest, RejectsMalformedFilters) {
+  Request bad_address;
+  bad_address.mutable_filter()->set_agent_address("12345");
+  EXPECT_EQ(GnpsiSampleFilter::Create(bad_address).status().code(),
+            absl::StatusCode::kInvalidArgument);
+
+  Request bad_type;
+  bad_type.mutable_filter()->add_sample_types(
+      SampleFilter::SAMPLE_TYPE_UNSPECIFIED);
+  EXPECT_EQ(GnpsiSampleFilter::Create(bad_type).status().code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(GnpsiSampleFilterTest, KeepsSamplesOfInterfaces) {
+  Request request;
+  request.mutable_filter()->add_input_if_index(1);
+  request.mutable_filter()->add_output_if_index(9);
+  GnpsiSampleFilter filter = CreateFilter(request);
+  EXPECT_FALSE(filter.passes_all());
+
+  std::string packet = SFlowDatagramBuilder()
+                           .AddFlowSample(1, 2, 100)
+                           .AddFlowSample(3, 4, 100)
+                           .AddExpandedFlowSample(5, 9, 100)
+                           .AddCounterSample(9)
+                           .AddCounterSample(4)
+                           .Build();
+  EXPECT_THAT(SampleIfIndexes(Apply(filter, packet)), ElementsAre(1, 5, 9));
+}
+
+TEST(GnpsiSampleFilterTest, SendsDatagramAsIsIfAllSamplesMatch) {
+  Request request;
+  request.mutable_filter()->add_sample_types(SampleFilter::FLOW);
+  GnpsiSampleFilter filter = CreateFilter(request);
+  std::string packet = SFlowDatagramBuilder()
+                           .AddFlowSample(1, 2, 100)
+                           .AddExpandedFlowSample(3, 4, 100)
+                           .Build();
+  std::string filtered(packet.size(), '\0');
+  size_t filtered_size = 0;
+  EXPECT_EQ(filter.Apply(packet, filtered.data(), &filtered_size),
+            GnpsiSampleFilter::Result::kUnchanged);
+}
+
+TEST(GnpsiSampleFilterTest, DropsDatagramWithoutMatchingSamples) {
+  Request request;
+  request.mutable_filter()->add_sample_types(SampleFilter::COUNTER);
+  GnpsiSampleFilter filter = CreateFilter(request);
+  EXPECT_EQ(Apply(filter, SFlowDatagramBuilder().AddFlowSample(1, 2, 100)
+                              .Build()),
+            "");
+  EXPECT_THAT(SampleIfIndexes(Apply(filter, SFlowDatagramBuilder()
+                                                .AddFlowSample(1, 2, 100)
+                                                .AddCounterSample(7)
+                                                .Build())),
+              ElementsAre(7));
+}
+
+TEST(GnpsiSampleFilterTest, KeepsDatagramsOfAgent) {
+  const std::string other_agent("\x0a\0\0\x02", 4);
+  Request request;
+  request.mutable_filter()->set_agent_address(other_agent);
+  GnpsiSampleFilter filter = CreateFilter(request);
+  std::string packet = SFlowDatagramBuilder().AddCounterSample(1).Build();
+  EXPECT_EQ(Apply(filter, packet), "");
+  std::string other_packet =
+      SFlowDatagramBuilder(other_agent).AddCounterSample(1).Build();
+  EXPECT_EQ(Apply(filter, other_packet), other_packet);
+}
+
+TEST(GnpsiSampleFilterTest, SubsamplesFlowSamplesAndScalesSamplingRate) {
+  Request request;
+  request.set_subsampling(2);
+  GnpsiSampleFilter filter = CreateFilter(request);
+  std::string first = SFlowDatagramBuilder()
+                          .AddFlowSample(1, 2, 100)
+                          .AddFlowSample(3, 4, 100)
+                          .AddCounterSample(5)
+                          .AddExpandedFlowSample(6, 7, 300)
+                          .Build();
+  std::string filtered = Apply(filter, first);
+  EXPECT_THAT(SampleIfIndexes(filtered), ElementsAre(1, 5, 6));
+  EXPECT_THAT(SamplingRates(filtered), ElementsAre(200, 0, 600));
+  // Subsampling carries on across datagrams.
+  std::string second = SFlowDatagramBuilder()
+                           .AddFlowSample(8, 9, 0xffffffff)
+                           .AddFlowSample(10, 11, 0xffffffff)
+                           .Build();
+  filtered = Apply(filter, second);
+  EXPECT_THAT(SampleIfIndexes(filtered), ElementsAre(10));
+  EXPECT_THAT(SamplingRates(filtered), ElementsAre(0xffffffff));
+}
+
+TEST(GnpsiSampleFilterTest, SendsMalformedDatagramsAsIs) {
+  Request request;
+  request.mutable_filter()->add_input_if_index(1);
+  GnpsiSampleFilter filter = CreateFilter(request);
+  const std::string packet = "not an sFlow datagram";
+  EXPECT_EQ(Apply(filter, packet), packet);
+}
+
+}  // namespace
+}  // namespace gnpsi
@@ -0,0 +1,189 @@
+#include "server/gnpsi_sequence_tracker.h"
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/hash/hash.h"
+#include "absl/numeric/bits.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "server/gnpsi_packet_buffer.h"
+#include "server/gnpsi_sflow_parser.h"
+
+namespace gnpsi {
+namespace {
+// Returns the text form of an IPv4 or IPv6 agent address.
+std::string AddressToString(const char* address, int size) {
+  char text[INET6_ADDRSTRLEN];
+  if (inet_ntop(size == 4 ? AF_INET : AF_INET6, address, text, sizeof(text)) ==
+      nullptr) {
+    return "";
+  }
+  return text;
+}
+}  // namespace
+
+GnpsiSequenceTracker::GnpsiSequenceTracker(
+    const GnpsiSequenceTrackingOptions& options)
+    : stale_after_(options.stale_after),
+      exporters_(absl::bit_ceil(
+          static_cast<size_t>(std::max(options.max_exporters, 1)))) {}
+
+void GnpsiSequenceTracker::Track(absl::Span<const GnpsiPacketBuffer> packets) {
+  absl::MutexLock l(&mu_);
+  for (const GnpsiPacketBuffer& packet : packets) {
+    SFlowDatagramHeader header;
+    if (!ReadSFlowDatagramHeader(packet.view(), &header)) continue;
+    TrackLocked(header.agent_address, header.sub_agent_id,
+                header.sequence_number, header.uptime, packet.receive_time());
+  }
+}
+
+void GnpsiSequenceTracker::Track(absl::string_view packet, absl::Time now) {
+  SFlowDatagramHeader header;
+  if (!ReadSFlowDatagramHeader(packet, &header)) return;
+  absl::MutexLock l(&mu_);
+  TrackLocked(header.agent_address, header.sub_agent_id,
+              header.sequence_number, header.uptime, now);
+}
+
+GnpsiSequenceTracker::Exporter& GnpsiSequenceTracker::FindLocked(
+    absl::string_view agent_address, uint32_t sub_agent_id, absl::Time now) {
+  const size_t mask = exporters_.size() - 1;
+  const size_t hash = absl::HashOf(agent_address, sub_agent_id);
+  // The entry the exporter takes if it is not tracked: the first unused or
+  // stale one, or else the one seen least recently.
+  Exporter* free = nullptr;
+  Exporter* oldest = nullptr;
+  for (size_t probe = 0; probe < kMaxProbes && probe <= mask; ++probe) {
+    Exporter& exporter = exporters_[(hash + probe) & mask];
+    if (exporter.address_size == agent_address.size() &&
+        exporter.sub_agent_id == sub_agent_id &&
+        memcmp(exporter.agent_address, agent_address.data(),
+               agent_address.size()) == 0) {
+      if (now - exporter.last_seen < stale_after_) return exporter;
+      // A stale exporter is forgotten, and starts over in its own entry.
+      free = &exporter;
+      break;
+    }
+    if (free != nullptr) continue;
+    if (exporter.address_size == 0 ||
+        now - exporter.last_seen >= stale_after_) {
+      free = &exporter;
+    } else if (oldest == nullptr || exporter.last_seen < oldest->last_seen) {
+      oldest = &exporter;
+    }
+  }
+  if (free == nullptr) {
+    ++eviction_count_;
+    free = oldest;
+  }
+  *free = Exporter();
+  memcpy(free->agent_address, agent_address.data(), agent_address.size());
+  free->address_size = agent_address.size();
+  free->sub_agent_id = sub_agent_id;
+  return *free;
+}
+
+void GnpsiSequenceTracker::TrackLocked(absl::string_view agent_address,
+                                       uint32_t sub_agent_id,
+                                       uint32_t sequence_number,
+                                       uint32_t uptime, absl::Time now) {
+  Exporter& exporter = FindLocked(agent_address, sub_agent_id, now);
+  const bool first = exporter.window == 0;
+  exporter.last_seen = now;
+  ++exporter.counters.datagram_count;
+  ++totals_.datagram_count;
+  // Sequence numbers wrap around, so they are compared by their distance.
+  const int32_t delta =
+      static_cast<int32_t>(sequence_number - exporter.highest_sequence_number);
+  // An exporter starts over when it restarts, which also resets its uptime,
+  // while its uptime only wraps around along with a continued sequence.
+  const bool reset =
+      !first && (delta < -kWindow + 1 ||
+                 (delta >= kWindow && uptime < exporter.uptime));
+  if (first || reset) {
+    if (reset) {
+      ++exporter.counters.reset_count;
+      ++totals_.reset_count;
+    }
+    exporter.first_sequence_number = sequence_number;
+    exporter.highest_sequence_number = sequence_number;
+    exporter.uptime = uptime;
+    exporter.window = 1;
+    return;
+  }
+  if (delta > 0) {
+    if (delta > 1) {
+      ++exporter.counters.gap_count;
+      ++totals_.gap_count;
+      exporter.counters.lost_count += delta - 1;
+      totals_.lost_count += delta - 1;
+    }
+    exporter.window = delta >= kWindow ? 1 : (exporter.window << delta) | 1;
+    exporter.highest_sequence_number = sequence_number;
+    exporter.uptime = uptime;
+    return;
+  }
+  const uint64_t bit = uint64_t{1} << -delta;
+  if (exporter.window & bit) {
+    ++exporter.counters.duplicate_count;
+    ++totals_.duplicate_count;
+    return;
+  }
+  exporter.window |= bit;
+  ++exporter.counters.reorder_count;
+  ++totals_.reorder_count;
+  // Unless it preceded the first datagram tracked, the datagram was counted
+  // as lost in a gap, and arrived after all.
+  if (static_cast<int32_t>(sequence_number - exporter.first_sequence_number) >
+      0) {
+    --exporter.counters.lost_count;
+    --totals_.lost_count;
+  }
+}
+
+GnpsiSequenceStats GnpsiSequenceTracker::GetTotals() const {
+  absl::MutexLock l(&mu_);
+  GnpsiSequenceStats stats;
+  stats.datagram_count = totals_.datagram_count;
+  stats.gap_count = totals_.gap_count;
+  stats.lost_count = totals_.lost_count;
+  stats.reorder_count = totals_.reorder_count;
+  stats.duplicate_count = totals_.duplicate_count;
+  stats.reset_count = totals_.reset_count;
+  return stats;
+}
+
+void GnpsiSequenceTracker::AppendExporterStats(
+    std::vector<GnpsiSequenceStats>* stats) const {
+  absl::MutexLock l(&mu_);
+  for (const Exporter& exporter : exporters_) {
+    if (exporter.address_size == 0) continue;
+    GnpsiSequenceStats& exporter_stats = stats->emplace_back();
+    exporter_stats.agent_address =
+        AddressToString(exporter.agent_address, exporter.address_size);
+    exporter_stats.sub_agent_id = exporter.sub_agent_id;
+    exporter_stats.datagram_count = exporter.counters.datagram_count;
+    exporter_stats.gap_count = exporter.counters.gap_count;
+    exporter_stats.lost_count = exporter.counters.lost_count;
+    exporter_stats.reorder_count = exporter.counters.reorder_count;
+    exporter_stats.duplicate_count = exporter.counters.duplicate_count;
+    exporter_stats.reset_count = exporter.counters.reset_count;
+  }
+}
+
+uint64_t GnpsiSequenceTracker::eviction_count() const {
+  absl::MutexLock l(&mu_);
+  return eviction_count_;
+}
+
+}  // namespace gnpsi
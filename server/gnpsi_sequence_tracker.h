@@ -0,0 +1,138 @@
+#ifndef OPENCONFIG_GNPSI_SERVER_GNPSI_SEQUENCE_TRACKER_H_
+#define OPENCONFIG_GNPSI_SERVER_GNPSI_SEQUENCE_TRACKER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "server/gnpsi_packet_buffer.h"
+
+namespace gnpsi {
+
+// Options for tracking the datagram sequence numbers of sFlow v5 exporters.
+struct GnpsiSequenceTrackingOptions {
+  // Maximum number of exporters tracked. Sequence numbers are not tracked if
+  // 0.
+  int max_exporters = 1024;
+  // Time after which an exporter that sent nothing is forgotten, and its
+  // entry reused.
+  absl::Duration stale_after = absl::Minutes(10);
+};
+
+// Counters of the datagram sequence numbers of an sFlow v5 exporter, or of all
+// exporters.
+struct GnpsiSequenceStats {
+  // Agent address and sub-agent id of the exporter. Empty for all exporters.
+  std::string agent_address;
+  uint32_t sub_agent_id = 0;
+  // Number of datagrams received.
+  uint64_t datagram_count = 0;
+  // Number of gaps in the sequence numbers received, and of the datagrams
+  // missing in them that did not arrive later. These were lost before the
+  // relay read them.
+  uint64_t gap_count = 0;
+  uint64_t lost_count = 0;
+  // Number of datagrams received after a datagram that followed them.
+  uint64_t reorder_count = 0;
+  // Number of datagrams received more than once.
+  uint64_t duplicate_count = 0;
+  // Number of times the exporter started its sequence over, as it does when
+  // it restarts.
+  uint64_t reset_count = 0;
+};
+
+// Tracks the datagram sequence numbers of sFlow v5 exporters, identified by
+// agent address and sub-agent id, to count the datagrams lost, reordered or
+// duplicated on their way to the relay.
+//
+// Exporters are kept in a fixed-size open-addressing table, looked up with a
+// bounded number of probes, so tracking a datagram only reads its header and
+// never allocates. Stale exporters are evicted once their entry is needed, and
+// if the probed entries are all in use, the one seen least recently is. The
+// counters of evicted exporters remain in the totals.
+//
+// Each exporter has to be tracked by a single tracker, as with a tracker per
+// relay reader. This class is thread-safe, so the counters can be read while
+// datagrams are tracked.
+class GnpsiSequenceTracker {
+ public:
+  // Number of sequence numbers below the highest one received that are told
+  // apart as reordered or duplicated.
+  static constexpr int kWindow = 64;
+
+  explicit GnpsiSequenceTracker(const GnpsiSequenceTrackingOptions& options);
+
+  GnpsiSequenceTracker(const GnpsiSequenceTracker&) = delete;
+  GnpsiSequenceTracker& operator=(const GnpsiSequenceTracker&) = delete;
+
+  // Tracks the sFlow v5 datagrams of `packets`, at their receive time. Other
+  // packets are ignored.
+  void Track(absl::Span<const GnpsiPacketBuffer> packets)
+      ABSL_LOCKS_EXCLUDED(mu_);
+  // Tracks `packet` if it is an sFlow v5 datagram, received at `now`.
+  void Track(absl::string_view packet, absl::Time now)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Returns the counters of all exporters tracked, including evicted ones.
+  GnpsiSequenceStats GetTotals() const ABSL_LOCKS_EXCLUDED(mu_);
+  // Appends the counters of each exporter currently tracked to `stats`.
+  void AppendExporterStats(std::vector<GnpsiSequenceStats>* stats) const
+      ABSL_LOCKS_EXCLUDED(mu_);
+  // Returns the number of exporters evicted before they were stale.
+  uint64_t eviction_count() const ABSL_LOCKS_EXCLUDED(mu_);
+
+ private:
+  // Number of entries probed for an exporter.
+  static constexpr int kMaxProbes = 8;
+
+  struct Counters {
+    uint64_t datagram_count = 0;
+    uint64_t gap_count = 0;
+    uint64_t lost_count = 0;
+    uint64_t reorder_count = 0;
+    uint64_t duplicate_count = 0;
+    uint64_t reset_count = 0;
+  };
+
+  struct Exporter {
+    // Agent address, followed by zeros, and its size. An unused entry has a
+    // size of 0.
+    char agent_address[16] = {};
+    uint8_t address_size = 0;
+    uint32_t sub_agent_id = 0;
+    // Sequence number the tracking of the exporter started with.
+    uint32_t first_sequence_number = 0;
+    uint32_t highest_sequence_number = 0;
+    // Uptime in the datagram with the highest sequence number.
+    uint32_t uptime = 0;
+    // Bit i is set if highest_sequence_number - i was received.
+    uint64_t window = 0;
+    absl::Time last_seen;
+    Counters counters;
+  };
+
+  // Tracks a datagram with the header fields given, received at `now`.
+  void TrackLocked(absl::string_view agent_address, uint32_t sub_agent_id,
+                   uint32_t sequence_number, uint32_t uptime, absl::Time now)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  // Returns the entry of the exporter, which is cleared if it was not
+  // tracked.
+  Exporter& FindLocked(absl::string_view agent_address, uint32_t sub_agent_id,
+                       absl::Time now) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  const absl::Duration stale_after_;
+  mutable absl::Mutex mu_;
+  // Power of two sized, so that hashes are masked into it.
+  std::vector<Exporter> exporters_ ABSL_GUARDED_BY(mu_);
+  Counters totals_ ABSL_GUARDED_BY(mu_);
+  uint64_t eviction_count_ ABSL_GUARDED_BY(mu_) = 0;
+};
+
+}  // namespace gnpsi
+
+#endif  // OPENCONFIG_GNPSI_SERVER_GNPSI_SEQUENCE_TRACKER_H_
@@ -0,0 +1,231 @@
+#include "server/gnpsi_sequence_tracker.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/time/time.h"
+#include "gtest/gtest.h"
+#include "server/gnpsi_packet_buffer.h"
+#include "server/gnpsi_sflow_test_util.h"
+
+namespace gnpsi {
+namespace {
+
+const absl::Time kNow = absl::FromUnixSeconds(1700000000);
+
+// Returns a datagram of the default agent with `sequence_number`.
+std::string Datagram(uint32_t sequence_number, uint32_t uptime = 1000,
+                     uint32_t sub_agent_id = 0) {
+  return SFlowDatagramBuilder()
+      .set_sub_agent_id(sub_agent_id)
+      .set_sequence_number(sequence_number)
+      .set_uptime(uptime)
+      .Build();
+}
+
+// Tracks the datagrams of the default agent with `sequence_numbers`.
+void TrackAll(const std::vector<uint32_t>& sequence_numbers,
+              GnpsiSequenceTracker& tracker) {
+  for (uint32_t sequence_number : sequence_numbers) {
+    tracker.Track(Datagram(sequence_number), kNow);
+  }
+}
+
+TEST(GnpsiSequenceTrackerTest, CountsInOrderDatagrams) {
+  GnpsiSequenceTracker tracker{GnpsiSequenceTrackingOptions()};
+  TrackAll({1, 2, 3, 4}, tracker);
+
+  GnpsiSequenceStats totals = tracker.GetTotals();
+  EXPECT_EQ(totals.datagram_count, 4);
+  EXPECT_EQ(totals.gap_count, 0);
+  EXPECT_EQ(totals.lost_count, 0);
+  EXPECT_EQ(totals.reorder_count, 0);
+  EXPECT_EQ(totals.duplicate_count, 0);
+  EXPECT_EQ(totals.reset_count, 0);
+}
+
+TEST(GnpsiSequenceTrackerTest, CountsGapsAndLostDatagrams) {
+  GnpsiSequenceTracker tracker{GnpsiSequenceTrackingOptions()};
+  TrackAll({1, 2, 5, 6, 10}, tracker);
+
+  GnpsiSequenceStats totals = tracker.GetTotals();
+  EXPECT_EQ(totals.datagram_count, 5);
+  EXPECT_EQ(totals.gap_count, 2);
+  EXPECT_EQ(totals.lost_count, 5);
+}
+
+TEST(GnpsiSequenceTrackerTest, ReorderedDatagramIsNotLost) {
+  GnpsiSequenceTracker tracker{GnpsiSequenceTrackingOptions()};
+  TrackAll({1, 3, 2, 4}, tracker);
+
+  GnpsiSequenceStats totals = tracker.GetTotals();
+  EXPECT_EQ(totals.gap_count, 1);
+  EXPECT_EQ(totals.lost_count, 0);
+  EXPECT_EQ(totals.reorder_count, 1);
+}
+
+TEST(GnpsiSequenceTrackerTest, DatagramBeforeTheFirstIsNotLost) {
+  GnpsiSequenceTracker tracker{GnpsiSequenceTrackingOptions()};
+  TrackAll({5, 4, 6}, tracker);
+
+  GnpsiSequenceStats totals = tracker.GetTotals();
+  EXPECT_EQ(totals.reorder_count, 1);
+  EXPECT_EQ(totals.lost_count, 0);
+}
+
+TEST(GnpsiSequenceTrackerTest, CountsDuplicates) {
+  GnpsiSequenceTracker tracker{GnpsiSequenceTrackingOptions()};
+  TrackAll({1, 2, 2, 3, 1}, tracker);
+
+  GnpsiSequenceStats totals = tracker.GetTotals();
+  EXPECT_EQ(totals.duplicate_count, 2);
+  EXPECT_EQ(totals.reorder_count, 0);
+  EXPECT_EQ(totals.lost_count, 0);
+}
+
+TEST(GnpsiSequenceTrackerTest, CountsResetWhenSequenceStartsOver) {
+  GnpsiSequenceTracker tracker{GnpsiSequenceTrackingOptions()};
+  TrackAll({1000, 1001, 1, 2}, tracker);
+
+  GnpsiSequenceStats totals = tracker.GetTotals();
+  EXPECT_EQ(totals.reset_count, 1);
+  EXPECT_EQ(totals.lost_count, 0);
+  EXPECT_EQ(totals.reorder_count, 0);
+}
+
+TEST(GnpsiSequenceTrackerTest, CountsResetWhenUptimeGoesBack) {
+  GnpsiSequenceTracker tracker{GnpsiSequenceTrackingOptions()};
+  tracker.Track(Datagram(1, /*uptime=*/50000), kNow);
+  // A restarted exporter may come back with a larger sequence number, but
+  // its uptime starts over.
+  tracker.Track(Datagram(500, /*uptime=*/100), kNow);
+
+  GnpsiSequenceStats totals = tracker.GetTotals();
+  EXPECT_EQ(totals.reset_count, 1);
+  EXPECT_EQ(totals.lost_count, 0);
+}
+
+TEST(GnpsiSequenceTrackerTest, LargeGapWithGrowingUptimeIsLoss) {
+  GnpsiSequenceTracker tracker{GnpsiSequenceTrackingOptions()};
+  tracker.Track(Datagram(1, /*uptime=*/100), kNow);
+  tracker.Track(Datagram(501, /*uptime=*/50000), kNow);
+
+  GnpsiSequenceStats totals = tracker.GetTotals();
+  EXPECT_EQ(totals.reset_count, 0);
+  EXPECT_EQ(totals.gap_count, 1);
+  EXPECT_EQ(totals.lost_count, 499);
+}
+
+TEST(GnpsiSequenceTrackerTest, FollowsSequenceAcrossWraparound) {
+  GnpsiSequenceTracker tracker{GnpsiSequenceTrackingOptions()};
+  TrackAll({0xfffffffe, 0xffffffff, 1, 0}, tracker);
+
+  GnpsiSequenceStats totals = tracker.GetTotals();
+  EXPECT_EQ(totals.reset_count, 0);
+  EXPECT_EQ(totals.gap_count, 1);
+  EXPECT_EQ(totals.reorder_count, 1);
+  EXPECT_EQ(totals.lost_count, 0);
+}
+
+TEST(GnpsiSequenceTrackerTest, TracksExportersSeparately) {
+  GnpsiSequenceTracker tracker{GnpsiSequenceTrackingOptions()};
+  const std::string ipv6_address("\x20\x01\x0d\xb8\0\0\0\0\0\0\0\0\0\0\0\x01",
+                                 16);
+  tracker.Track(Datagram(1, 1000, /*sub_agent_id=*/0), kNow);
+  tracker.Track(Datagram(1, 1000, /*sub_agent_id=*/1), kNow);
+  tracker.Track(Datagram(3, 1000, /*sub_agent_id=*/1), kNow);
+  tracker.Track(
+      SFlowDatagramBuilder(ipv6_address).set_sequence_number(7).Build(), kNow);
+
+  std::vector<GnpsiSequenceStats> stats;
+  tracker.AppendExporterStats(&stats);
+  ASSERT_EQ(stats.size(), 3);
+  int lost_count = 0;
+  for (const GnpsiSequenceStats& exporter : stats) {
+    if (exporter.agent_address == "10.0.0.1" && exporter.sub_agent_id == 0) {
+      EXPECT_EQ(exporter.datagram_count, 1);
+      EXPECT_EQ(exporter.lost_count, 0);
+    } else if (exporter.agent_address == "10.0.0.1") {
+      EXPECT_EQ(exporter.sub_agent_id, 1);
+      EXPECT_EQ(exporter.datagram_count, 2);
+      EXPECT_EQ(exporter.lost_count, 1);
+    } else {
+      EXPECT_EQ(exporter.agent_address, "2001:db8::1");
+      EXPECT_EQ(exporter.datagram_count, 1);
+    }
+    lost_count += exporter.lost_count;
+  }
+  EXPECT_EQ(lost_count, 1);
+  EXPECT_EQ(tracker.GetTotals().lost_count, 1);
+}
+
+TEST(GnpsiSequenceTrackerTest, IgnoresOtherPackets) {
+  GnpsiSequenceTracker tracker{GnpsiSequenceTrackingOptions()};
+  tracker.Track("not a datagram", kNow);
+
+  EXPECT_EQ(tracker.GetTotals().datagram_count, 0);
+}
+
+TEST(GnpsiSequenceTrackerTest, TracksPacketsAtTheirReceiveTime) {
+  GnpsiSequenceTrackingOptions options;
+  options.max_exporters = 1;
+  options.stale_after = absl::Minutes(1);
+  GnpsiSequenceTracker tracker(options);
+  std::shared_ptr<GnpsiBufferPool> pool = GnpsiBufferPool::Create(1024, 4);
+  std::vector<GnpsiPacketBuffer> packets;
+  for (uint32_t sequence_number : {1, 3}) {
+    std::string datagram = Datagram(sequence_number);
+    GnpsiPacketBuffer& packet = packets.emplace_back(pool->Acquire());
+    datagram.copy(packet.data(), datagram.size());
+    packet.set_size(datagram.size());
+    packet.set_receive_time(kNow);
+  }
+  tracker.Track(packets);
+  EXPECT_EQ(tracker.GetTotals().lost_count, 1);
+
+  // The exporter was last seen at the receive time of its packets, so it is
+  // stale a minute later, and its entry taken without an eviction.
+  tracker.Track(SFlowDatagramBuilder(std::string("\x0a\0\0\x02", 4)).Build(),
+                kNow + absl::Minutes(1));
+  EXPECT_EQ(tracker.eviction_count(), 0);
+}
+
+TEST(GnpsiSequenceTrackerTest, EvictsLeastRecentlySeenExporterWhenFull) {
+  GnpsiSequenceTrackingOptions options;
+  options.max_exporters = 2;
+  GnpsiSequenceTracker tracker(options);
+  for (int agent = 1; agent <= 3; ++agent) {
+    const std::string address = {10, 0, 0, static_cast<char>(agent)};
+    tracker.Track(SFlowDatagramBuilder(address).Build(),
+                  kNow + absl::Seconds(agent));
+  }
+
+  std::vector<GnpsiSequenceStats> stats;
+  tracker.AppendExporterStats(&stats);
+  ASSERT_EQ(stats.size(), 2);
+  EXPECT_NE(stats[0].agent_address, "10.0.0.1");
+  EXPECT_NE(stats[1].agent_address, "10.0.0.1");
+  EXPECT_EQ(tracker.eviction_count(), 1);
+  // Evicted exporters remain counted in the totals.
+  EXPECT_EQ(tracker.GetTotals().datagram_count, 3);
+}
+
+TEST(GnpsiSequenceTrackerTest, ForgetsStaleExporters) {
+  GnpsiSequenceTrackingOptions options;
+  options.max_exporters = 1;
+  options.stale_after = absl::Minutes(1);
+  GnpsiSequenceTracker tracker(options);
+  tracker.Track(Datagram(1), kNow);
+  tracker.Track(Datagram(100), kNow + absl::Minutes(2));
+
+  // The exporter was forgotten, so the jump is not counted as a loss.
+  GnpsiSequenceStats totals = tracker.GetTotals();
+  EXPECT_EQ(totals.datagram_count, 2);
+  EXPECT_EQ(totals.lost_count, 0);
+  EXPECT_EQ(tracker.eviction_count(), 0);
+}
+
+}  // namespace
+}  // namespace gnpsi
@@ -1,12 +1,18 @@
 #include "server/gnpsi_service_impl.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "absl/base/thread_annotations.h"
 #include "glog/logging.h"
 #include "absl/status/status.h"
+#include "absl/status/statusor.h"
 #include "absl/strings/match.h"
 #include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
@@ -15,10 +21,27 @@
 #include "absl/synchronization/mutex.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
+#include "grpc/compression.h"
+#include "grpcpp/support/slice.h"
 #include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_congestion_cache.h"
+#include "server/gnpsi_histogram.h"
+#include "server/gnpsi_packet_buffer.h"
+#include "server/gnpsi_replay_ring.h"
+#include "server/gnpsi_sample_filter.h"
+#include "server/gnpsi_shared_sample.h"
 
 namespace gnpsi {
 
+GnpsiStats GnpsiConnectionCounters::Snapshot() const {
+  GnpsiStats stats(collector_ip, collector_port);
+  stats.datagram_count = datagram_count.load(std::memory_order_relaxed);
+  stats.bytes_sampled = bytes_sampled.load(std::memory_order_relaxed);
+  stats.error_count = error_count.load(std::memory_order_relaxed);
+  stats.dropped_count = dropped_count.load(std::memory_order_relaxed);
+  return stats;
+}
+
 absl::Status GnpsiConnection::InitializeStats() {
   std::string uri = this->GetPeerName();
   LOG(INFO) << "uri: " << uri;
@@ -33,7 +56,8 @@ absl::Status GnpsiConnection::InitializeStats() {
         return absl::InternalError(
             "Error retrieving port information from uri string");
       }
-      this->stats_ = GnpsiStats(ip, port);
+      counters_->collector_ip = std::string(ip);
+      counters_->collector_port = port;
       return absl::OkStatus();
     }
     return absl::NotFoundError("Port not found in uri string");
@@ -48,7 +72,8 @@ absl::Status GnpsiConnection::InitializeStats() {
         return absl::InternalError(
             "Error retrieving port information from uri string");
       }
-      this->stats_ = GnpsiStats(ip, port);
+      counters_->collector_ip = std::string(ip);
+      counters_->collector_port = port;
       return absl::OkStatus();
     }
     return absl::NotFoundError("Port not found in uri string");
@@ -56,12 +81,360 @@ absl::Status GnpsiConnection::InitializeStats() {
   return absl::InvalidArgumentError("The passed URI format is not supported");
 }
 
-void GnpsiConnection::WaitUntilClosed() {
+absl::Status GnpsiConnection::Configure(const Request& request) {
+  absl::StatusOr<GnpsiSampleFilter> filter = GnpsiSampleFilter::Create(request);
+  if (!filter.ok()) return filter.status();
+  filter_ = *std::move(filter);
+  resume_after_ = request.last_sequence_number();
+  if (request.has_compression()) {
+    absl::Status status = ConfigureCompression(request.compression());
+    if (!status.ok()) return status;
+  }
+  if (request.has_aggregation()) return ConfigureAggregation(request);
+  if (!request.has_batching()) return absl::OkStatus();
+  const BatchingOptions& batching = request.batching();
+  if (batching.max_batch_bytes() > kMaxBatchBytes) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("max_batch_bytes must not exceed ", kMaxBatchBytes));
+  }
+  absl::Duration max_linger = absl::Nanoseconds(batching.max_linger_ns());
+  if (max_linger > kMaxBatchLinger) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("max_linger_ns must not exceed ",
+                     absl::ToInt64Nanoseconds(kMaxBatchLinger)));
+  }
+  absl::MutexLock l(&mu_);
+  batching_ = true;
+  max_batch_bytes_ = batching.max_batch_bytes() == 0
+                         ? kDefaultMaxBatchBytes
+                         : batching.max_batch_bytes();
+  max_linger_ = max_linger;
+  return absl::OkStatus();
+}
+
+absl::Status GnpsiConnection::ConfigureCompression(
+    const CompressionOptions& compression) {
+  if (compression.algorithm() != CompressionOptions::ALGORITHM_UNSPECIFIED &&
+      compression.level() != CompressionOptions::LEVEL_UNSPECIFIED) {
+    return absl::InvalidArgumentError(
+        "Compression algorithm and level must not both be set");
+  }
+  // gRPC compresses every message of the stream with the algorithm requested
+  // in its initial metadata, falling back to none if the client does not
+  // accept it.
+  switch (compression.algorithm()) {
+    case CompressionOptions::ALGORITHM_UNSPECIFIED:
+      break;
+    case CompressionOptions::NONE:
+      context_->set_compression_algorithm(GRPC_COMPRESS_NONE);
+      return absl::OkStatus();
+    case CompressionOptions::GZIP:
+      context_->set_compression_algorithm(GRPC_COMPRESS_GZIP);
+      return absl::OkStatus();
+    case CompressionOptions::DEFLATE:
+      context_->set_compression_algorithm(GRPC_COMPRESS_DEFLATE);
+      return absl::OkStatus();
+    default:
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Unknown compression algorithm ", compression.algorithm()));
+  }
+  switch (compression.level()) {
+    case CompressionOptions::LEVEL_UNSPECIFIED:
+      return absl::OkStatus();
+    case CompressionOptions::LOW:
+      context_->set_compression_level(GRPC_COMPRESS_LEVEL_LOW);
+      return absl::OkStatus();
+    case CompressionOptions::MEDIUM:
+      context_->set_compression_level(GRPC_COMPRESS_LEVEL_MED);
+      return absl::OkStatus();
+    case CompressionOptions::HIGH:
+      context_->set_compression_level(GRPC_COMPRESS_LEVEL_HIGH);
+      return absl::OkStatus();
+    default:
+      return absl::InvalidArgumentError(
+          absl::StrCat("Unknown compression level ", compression.level()));
+  }
+}
+
+absl::Status GnpsiConnection::ConfigureAggregation(const Request& request) {
+  if (request.has_batching() || request.last_sequence_number() != 0) {
+    return absl::InvalidArgumentError(
+        "aggregation must not be set along with batching or "
+        "last_sequence_number");
+  }
+  const AggregationOptions& aggregation = request.aggregation();
+  absl::Duration interval = aggregation.interval_ns() == 0
+                                ? kDefaultAggregationInterval
+                                : absl::Nanoseconds(aggregation.interval_ns());
+  if (interval < kMinAggregationInterval ||
+      interval > kMaxAggregationInterval) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "interval_ns must be between ",
+        absl::ToInt64Nanoseconds(kMinAggregationInterval), " and ",
+        absl::ToInt64Nanoseconds(kMaxAggregationInterval)));
+  }
+  if (aggregation.top_k() > kMaxAggregationTopK) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("top_k must not exceed ", kMaxAggregationTopK));
+  }
+  sketch_ = std::make_unique<GnpsiFlowSketch>(
+      aggregation.top_k() == 0 ? kDefaultAggregationTopK : aggregation.top_k());
+  aggregation_interval_ = interval;
+  absl::MutexLock l(&mu_);
+  interval_start_ = absl::Now();
+  return absl::OkStatus();
+}
+
+void GnpsiConnection::CloseStream() {
+  {
+    absl::MutexLock l(&mu_);
+    is_stream_closed_ = true;
+  }
+  OnStreamClosed();
+}
+
+bool GnpsiConnection::EnqueueSample(std::shared_ptr<const SharedSample> sample,
+                                    absl::Time now) {
+  bool disconnect = false;
+  {
+    absl::MutexLock l(&mu_);
+    if (is_stream_closed_) return false;
+    // The context is only checked while the stream is open, as the connection
+    // may outlive it once closed.
+    if (context_->IsCancelled()) {
+      LOG(ERROR) << "Failed to send sample packet to " << GetPeerName() << ".";
+      IncrementWriteErrorCount();
+      disconnect = true;
+    } else if (replaying_.load(std::memory_order_relaxed) ||
+               (sample->sequence_number() != 0 &&
+                sample->sequence_number() <= replayed_through_)) {
+      // Live samples relayed before the replay caught up have been replayed.
+      return true;
+    } else if (queue_.size() >= max_queue_size()) {
+      counters_->dropped_count.fetch_add(1, std::memory_order_relaxed);
+      switch (options_.overflow_policy) {
+        case GnpsiOverflowPolicy::kDropOldest:
+          queued_bytes_ -= queue_.front().sample->packet().size();
+          queue_.pop_front();
+          break;
+        case GnpsiOverflowPolicy::kDropNewest:
+          return true;
+        case GnpsiOverflowPolicy::kDisconnect:
+          LOG(ERROR) << "Send queue of " << GetPeerName()
+                     << " is full, closing the connection.";
+          disconnect = true;
+          break;
+      }
+    }
+    if (disconnect) {
+      is_stream_closed_ = true;
+    } else {
+      queued_bytes_ += sample->packet().size();
+      queue_.push_back({std::move(sample), now});
+      counters_->queue_depth.Record(queue_.size());
+    }
+  }
+  if (disconnect) {
+    OnStreamClosed();
+    return false;
+  }
+  OnSampleQueued();
+  return true;
+}
+
+bool GnpsiConnection::BatchFullLocked() const {
+  // A full queue is flushed as well, rather than dropping samples while they
+  // linger.
+  return queued_bytes_ >= max_batch_bytes_ ||
+         queue_.size() >= max_queue_size();
+}
+
+void GnpsiConnection::StartReplay(GnpsiReplaySource* source,
+                                  uint64_t last_sequence_number) {
+  // A sequence number that has not been reached is from before the server
+  // restarted, and nothing can be replayed. One that has just been reached
+  // still replays, as samples may be relayed before the connection is added.
+  if (resume_after_ == 0 || resume_after_ > last_sequence_number) return;
+  absl::MutexLock l(&mu_);
+  replay_source_ = source;
+  replayed_through_ = resume_after_;
+  replaying_.store(true, std::memory_order_release);
+}
+
+void GnpsiConnection::QueueReplay(absl::Time now) {
+  if (!replaying()) return;
+  const int max_samples = std::min(kReplayBatchSize, options_.max_queue_size);
+  std::vector<std::shared_ptr<const SharedSample>> samples;
+  while (true) {
+    uint64_t after;
+    {
+      absl::MutexLock l(&mu_);
+      if (is_stream_closed_ || !queue_.empty()) return;
+      after = replayed_through_;
+    }
+    // Samples are read and filtered without holding the lock, so that the
+    // sender is not held up by the replay.
+    samples.clear();
+    bool caught_up =
+        replay_source_->ReadReplay(*this, &after, now, max_samples, &samples);
+    absl::MutexLock l(&mu_);
+    if (caught_up) {
+      // The samples relayed since are read with the lock held, so that none
+      // is missed when switching over to live samples: samples relayed later
+      // are queued once the lock is released.
+      caught_up = replay_source_->ReadReplay(
+          *this, &after, now, max_samples - samples.size(), &samples);
+    }
+    replayed_through_ = after;
+    for (std::shared_ptr<const SharedSample>& sample : samples) {
+      queued_bytes_ += sample->packet().size();
+      queue_.push_back({std::move(sample), now});
+    }
+    if (caught_up) {
+      LOG(INFO) << "Replay to " << GetPeerName() << " caught up at sample "
+                << replayed_through_ << ".";
+      // The writer no longer uses the filter once this is visible.
+      replaying_.store(false, std::memory_order_release);
+      return;
+    }
+    if (!queue_.empty()) return;
+  }
+}
+
+bool GnpsiConnection::PopWrite(absl::Time now, PendingWrite* write,
+                               absl::Time* flush_time) {
+  QueueReplay(now);
   absl::MutexLock l(&mu_);
-  auto stream_disconnected = [this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
-    return is_stream_closed_;
-  };
-  mu_.Await(absl::Condition(&stream_disconnected));
+  return PopWriteLocked(now, write, flush_time);
+}
+
+bool GnpsiConnection::PopWriteLocked(absl::Time now, PendingWrite* write,
+                                     absl::Time* flush_time) {
+  if (sketch_ != nullptr) return PopSummaryLocked(now, write, flush_time);
+  if (queue_.empty()) {
+    *flush_time = absl::InfiniteFuture();
+    return false;
+  }
+  if (!batching_) {
+    counters_->enqueue_to_write_start.Record(now - queue_.front().enqueue_time);
+    write->samples.push_back(std::move(queue_.front().sample));
+    queued_bytes_ -= write->samples.back()->packet().size();
+    queue_.pop_front();
+    return true;
+  }
+  absl::Time due = queue_.front().enqueue_time + max_linger_;
+  if (due > now && !BatchFullLocked()) {
+    *flush_time = due;
+    return false;
+  }
+  write->batched = true;
+  uint64_t batch_bytes = 0;
+  while (!queue_.empty()) {
+    size_t size = queue_.front().sample->packet().size();
+    if (!write->samples.empty() && batch_bytes + size > max_batch_bytes_) {
+      break;
+    }
+    batch_bytes += size;
+    counters_->enqueue_to_write_start.Record(now - queue_.front().enqueue_time);
+    write->samples.push_back(std::move(queue_.front().sample));
+    queue_.pop_front();
+  }
+  queued_bytes_ -= batch_bytes;
+  return true;
+}
+
+bool GnpsiConnection::PopSummaryLocked(absl::Time now, PendingWrite* write,
+                                       absl::Time* flush_time) {
+  const absl::Time end = interval_start_ + aggregation_interval_;
+  if (now < end) {
+    *flush_time = end;
+    return false;
+  }
+  FlowSummary* summary = write->summary.emplace().mutable_flow_summary();
+  sketch_->Summarize(summary);
+  summary->set_start_timestamp(absl::ToUnixNanos(interval_start_));
+  summary->set_end_timestamp(absl::ToUnixNanos(end));
+  // A writer that fell behind by whole intervals summarizes them as one, and
+  // starts the next interval now.
+  interval_start_ = now - end >= aggregation_interval_ ? now : end;
+  return true;
+}
+
+void GnpsiConnection::RecordWrite(const PendingWrite& write, bool ok,
+                                  absl::Duration duration) {
+  counters_->write_duration.Record(duration);
+  if (!ok) {
+    // If it fails to send response to the client, close this connection.
+    LOG(ERROR) << "Failed to send sample packet to " << GetPeerName() << ".";
+    IncrementWriteErrorCount();
+    CloseStream();
+    return;
+  }
+  VLOG(1) << "Successfully sent " << write.samples.size()
+          << " sample packet(s) to " << GetPeerName() << ".";
+  uint64_t bytes = 0;
+  for (const std::shared_ptr<const SharedSample>& sample : write.samples) {
+    bytes += sample->packet().size();
+  }
+  counters_->datagram_count.fetch_add(write.samples.size(),
+                                      std::memory_order_relaxed);
+  counters_->bytes_sampled.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void GnpsiConnection::WaitUntilClosed() {
+  while (true) {
+    PendingWrite write;
+    QueueReplay(absl::Now());
+    {
+      absl::MutexLock l(&mu_);
+      absl::Time flush_time;
+      while (!is_stream_closed_ &&
+             !PopWriteLocked(absl::Now(), &write, &flush_time)) {
+        if (sketch_ != nullptr) {
+          if (IsContextCancelled()) {
+            is_stream_closed_ = true;
+            break;
+          }
+          flush_time = std::min(flush_time,
+                                absl::Now() + kAggregationCancelCheckInterval);
+        }
+        // Wakes up when the first sample is queued or the batch fills up,
+        // and otherwise when the pending batch is due.
+        const bool queue_empty = queue_.empty();
+        auto wake_up = [this, queue_empty]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(
+                           mu_) {
+          return is_stream_closed_ || (queue_empty && !queue_.empty()) ||
+                 (batching_ && BatchFullLocked());
+        };
+        mu_.AwaitWithDeadline(absl::Condition(&wake_up), flush_time);
+      }
+      if (is_stream_closed_) return;
+    }
+    // The write blocks on flow control, so it is done without holding the lock
+    // to let the sender keep queueing samples.
+    bool ok = !IsContextCancelled();
+    absl::Time write_start = absl::Now();
+    if (ok && write.summary.has_value()) {
+      const GnpsiSampleMetadata metadata = SFlowMetadata::V5;
+      if (stream_metadata_.ShouldSend(metadata)) {
+        metadata.SetMetadata(&*write.summary);
+      }
+      ok = SendResponse(*write.summary);
+    } else if (ok && write.batched) {
+      Sample batch;
+      SharedSample::BuildBatch(write.samples, &stream_metadata_, &batch);
+      ok = SendResponse(batch);
+    } else if (ok) {
+      const SharedSample& sample = *write.samples.front();
+      if (stream_metadata_.ShouldSend(sample.metadata())) {
+        ok = SendResponse(sample.SampleWithMetadata());
+      } else {
+        ok = SendResponse(sample.sample());
+      }
+    }
+    RecordWrite(write, ok, absl::Now() - write_start);
+    if (!ok) return;
+  }
 }
 
 Status GnpsiServiceImpl::Subscribe(ServerContext* context,
@@ -71,24 +444,30 @@ Status GnpsiServiceImpl::Subscribe(ServerContext* context,
     LOG(ERROR) << "StreamSflowSample context is a nullptr.";
     return Status(StatusCode::INVALID_ARGUMENT, "Context cannot be nullptr.");
   }
-  auto connection = std::make_unique<GnpsiConnection>(context, writer);
-  absl::Status status = AddConnection(connection.get());
+  auto connection = std::make_shared<GnpsiConnection>(context, writer,
+                                                      connection_options());
+  absl::Status status = connection->Configure(*request);
+  if (status.ok()) {
+    status = AddConnection(connection);
+  }
   if (!status.ok()) {
     return Status(StatusCode(status.code()), std::string(status.message()));
   }
   // Send Initial Metadata after adding connection indicating that the client
   // should be receiving any new samples from this point on.
   writer->SendInitialMetadata();
-  // Blocks until it is closed by client and removes it from internal vector.
+  // Writes samples until it is closed by client and removes it from internal
+  // vector.
   connection->WaitUntilClosed();
   DropConnection(connection.get());
   return Status::OK;
 }
 
-int GnpsiServiceImpl::GetAliveConnections() {
+int GnpsiConnectionManager::GetAliveConnections() {
   // Check if any connection is stale.
-  int alive_connections = gnpsi_connections_.size();
-  for (GnpsiConnection* connection : gnpsi_connections_) {
+  const ConnectionList& connections = *connections_;
+  int alive_connections = connections.size();
+  for (const std::shared_ptr<GnpsiConnection>& connection : connections) {
     if (connection->IsContextCancelled()) {
       alive_connections--;
       connection->CloseStream();
@@ -97,7 +476,8 @@ int GnpsiServiceImpl::GetAliveConnections() {
   return alive_connections;
 }
 
-absl::Status GnpsiServiceImpl::AddConnection(GnpsiConnection* connection) {
+absl::Status GnpsiConnectionManager::AddConnection(
+    std::shared_ptr<GnpsiConnection> connection) {
   absl::MutexLock l(&mu_);
   if (service_drained_) {
     LOG(ERROR) << "Cannot add connections since the service has been drained.";
@@ -117,72 +497,258 @@ absl::Status GnpsiServiceImpl::AddConnection(GnpsiConnection* connection) {
     LOG(ERROR) << "Error while creating stats object for peer - "
                << status.message();
   }
-  gnpsi_connections_.push_back(connection);
+  // Replay starts before the connection is added, so the samples relayed from
+  // now on are either replayed or queued live: a sample the senders do not
+  // queue for the connection is in the replay ring by the time it is added.
+  if (replay_ring_ != nullptr) {
+    connection->StartReplay(
+        this, last_sequence_number_.load(std::memory_order_acquire));
+  }
+  auto connections = std::make_shared<ConnectionList>(*connections_);
+  connections->push_back(std::move(connection));
+  std::atomic_store_explicit(
+      &connections_, std::shared_ptr<const ConnectionList>(connections),
+      std::memory_order_release);
   return absl::OkStatus();
 }
 
-// Iterate through the connections vector and remove `connection` if it exists.
-void GnpsiServiceImpl::DropConnection(GnpsiConnection* connection) {
+void GnpsiConnectionManager::DropConnection(GnpsiConnection* connection) {
+  // Senders only check the context of open connections, so the context may
+  // be destroyed once the connection is closed and dropped.
+  connection->CloseStream();
   absl::MutexLock l(&mu_);
-  for (auto iter = gnpsi_connections_.begin(); iter != gnpsi_connections_.end();
-       ++iter) {
-    if (*iter == connection) {
-      LOG(INFO) << "Dropping gNPSI connection to " << connection->GetPeerName();
-      gnpsi_connections_.erase(iter);
-      break;
-    }
+  auto connections = std::make_shared<ConnectionList>();
+  connections->reserve(connections_->size());
+  for (const std::shared_ptr<GnpsiConnection>& other : *connections_) {
+    if (other.get() != connection) connections->push_back(other);
   }
+  if (connections->size() == connections_->size()) return;
+  LOG(INFO) << "Dropping gNPSI connection to " << connection->GetPeerName();
+  std::atomic_store_explicit(
+      &connections_, std::shared_ptr<const ConnectionList>(connections),
+      std::memory_order_release);
 }
 
-void GnpsiServiceImpl::DrainConnections() {
+void GnpsiConnectionManager::AddCongestionTelemetry(
+    const CongestionTelemetry& telemetry) {
+  congestion_cache_.Add(telemetry, absl::Now());
+}
+
+void GnpsiConnectionManager::DrainConnections() {
   absl::MutexLock lock(&mu_);
   service_drained_ = true;
   // Close all active connections.
-  for (auto it = gnpsi_connections_.begin(), end = gnpsi_connections_.end();
-       it != end; it++) {
-    auto connection = *it;
+  for (const std::shared_ptr<GnpsiConnection>& connection : *connections_) {
     connection->CloseStream();
   }
 }
 
-void GnpsiServiceImpl::UndrainConnections() {
+void GnpsiConnectionManager::UndrainConnections() {
   absl::MutexLock lock(&mu_);
   service_drained_ = false;
 }
 
-void GnpsiServiceImpl::SendSamplePacket(
-    const std::string& sample_packet, ::gnpsi::SFlowMetadata::Version version) {
-  absl::MutexLock l(&mu_);
-  Sample response;
-  response.set_packet(sample_packet);
-  response.set_timestamp(absl::ToUnixNanos(absl::Now()));
-  response.mutable_sflow_metadata()->set_version(version);
-  for (auto it = gnpsi_connections_.begin(), end = gnpsi_connections_.end();
-       it != end; it++) {
-    auto connection = *it;
-    if (!connection->IsContextCancelled() &&
-        connection->SendResponse(response)) {
-      VLOG(1) << "Successfully sent sample packet to "
-              << connection->GetPeerName() << ".";
-      connection->IncrementDatagramCount();
-      connection->IncrementBytesSampled(sample_packet.size());
-    } else {
-      // If it fails to send response to any client, close this connection.
-      LOG(ERROR) << "Failed to send sample packet to "
-                 << connection->GetPeerName() << ".";
-      connection->IncrementWriteErrorCount();
-      connection->CloseStream();
+void GnpsiConnectionManager::SendSamplePacket(
+    const std::string& sample_packet, GnpsiSampleMetadata metadata) {
+  absl::Time receive_time = absl::Now();
+  GnpsiPacketBuffer filter_buffer;
+  absl::MutexLockMaybe l(replay_ring_ != nullptr ? &sequence_mu_ : nullptr);
+  SendSample(*connections(), grpc::Slice(sample_packet), metadata,
+             receive_time, absl::Now(), &filter_buffer);
+}
+
+void GnpsiConnectionManager::SendSamplePacket(
+    GnpsiPacketBuffer sample_packet, GnpsiSampleMetadata metadata) {
+  absl::Time receive_time = sample_packet.receive_time();
+  GnpsiPacketBuffer filter_buffer;
+  absl::MutexLockMaybe l(replay_ring_ != nullptr ? &sequence_mu_ : nullptr);
+  SendSample(*connections(), std::move(sample_packet).ToSlice(), metadata,
+             receive_time, absl::Now(), &filter_buffer);
+}
+
+void GnpsiConnectionManager::SendSamplePackets(
+    absl::Span<GnpsiPacketBuffer> sample_packets,
+    GnpsiSampleMetadata metadata) {
+  GnpsiPacketBuffer filter_buffer;
+  absl::MutexLockMaybe l(replay_ring_ != nullptr ? &sequence_mu_ : nullptr);
+  // The clock and the connections are read once for the whole batch.
+  absl::Time now = absl::Now();
+  std::shared_ptr<const ConnectionList> connections = this->connections();
+  for (GnpsiPacketBuffer& sample_packet : sample_packets) {
+    absl::Time receive_time = sample_packet.receive_time();
+    SendSample(*connections, std::move(sample_packet).ToSlice(), metadata,
+               receive_time, now, &filter_buffer);
+  }
+}
+
+void GnpsiConnectionManager::SendSample(const ConnectionList& connections,
+                                        grpc::Slice sample_packet,
+                                        GnpsiSampleMetadata metadata,
+                                        absl::Time receive_time,
+                                        absl::Time now,
+                                        GnpsiPacketBuffer* filter_buffer) {
+  // Samples are timestamped with the time their datagram was received if it is
+  // known, rather than with the time they are sent.
+  absl::Time timestamp = now;
+  if (receive_time != absl::InfinitePast()) {
+    ingest_to_enqueue_.Record(now - receive_time);
+    timestamp = receive_time;
+  }
+  // The response is built once and shared by the queues of all connections
+  // that do not filter it.
+  uint64_t sequence_number = 0;
+  if (replay_ring_ != nullptr) {
+    sequence_number =
+        last_sequence_number_.fetch_add(1, std::memory_order_acq_rel) + 1;
+  }
+  std::shared_ptr<const SharedSample> shared_response =
+      MakeSharedSample(std::move(sample_packet), absl::ToUnixNanos(timestamp),
+                       metadata, sequence_number, now);
+  // The sample is kept for replay before it is queued for the connections,
+  // so connections that catch up with their replay miss none.
+  if (replay_ring_ != nullptr) replay_ring_->Append(shared_response, now);
+  // Connections still replaying skip the sample in EnqueueSample, which tells
+  // under their lock whether their replay reads it from the ring.
+  for (const std::shared_ptr<GnpsiConnection>& connection : connections) {
+    if (connection->aggregating()) {
+      AggregateSample(shared_response, *connection, now, filter_buffer);
+      continue;
+    }
+    if (connection->filter().passes_all()) {
+      connection->EnqueueSample(shared_response, now);
+      continue;
+    }
+    std::shared_ptr<const SharedSample> filtered =
+        FilterSample(shared_response, *connection, now, filter_buffer);
+    if (filtered != nullptr) {
+      connection->EnqueueSample(std::move(filtered), now);
     }
   }
 }
 
-std::vector<GnpsiStats> GnpsiServiceImpl::GetStats() {
-  absl::MutexLock l(&mu_);
+std::shared_ptr<const SharedSample> GnpsiConnectionManager::MakeSharedSample(
+    grpc::Slice packet, int64_t timestamp, GnpsiSampleMetadata metadata,
+    uint64_t sequence_number, absl::Time now) const {
+  auto sample = std::make_shared<SharedSample>(std::move(packet), timestamp,
+                                               metadata, sequence_number);
+  if (metadata.protocol() == GnpsiSampleMetadata::Protocol::kSFlow &&
+      !congestion_cache_.empty()) {
+    congestion_cache_.Join(now, sample.get());
+  }
+  if (serialize_samples_) {
+    sample->Serialize();
+  } else {
+    sample->BuildSample();
+  }
+  return sample;
+}
+
+void GnpsiConnectionManager::AggregateSample(
+    const std::shared_ptr<const SharedSample>& sample,
+    GnpsiConnection& connection, absl::Time now,
+    GnpsiPacketBuffer* filter_buffer) const {
+  // Only sFlow datagrams are summarized; the others are not sent at all.
+  if (sample->metadata().protocol() != GnpsiSampleMetadata::Protocol::kSFlow) {
+    return;
+  }
+  if (connection.filter().passes_all()) {
+    connection.Aggregate(sample->packet());
+    return;
+  }
+  std::shared_ptr<const SharedSample> filtered =
+      FilterSample(sample, connection, now, filter_buffer);
+  if (filtered != nullptr) connection.Aggregate(filtered->packet());
+}
+
+std::shared_ptr<const SharedSample> GnpsiConnectionManager::FilterSample(
+    const std::shared_ptr<const SharedSample>& sample,
+    GnpsiConnection& connection, absl::Time now,
+    GnpsiPacketBuffer* buffer) const {
+  if (sample->metadata().protocol() != GnpsiSampleMetadata::Protocol::kSFlow) {
+    return sample;
+  }
+  // The filtered datagram is written to a pooled buffer, which is only handed
+  // over with the sample if the datagram changed. Datagrams too large for the
+  // pooled buffers are filtered into a copy.
+  absl::string_view packet = sample->packet();
+  std::string large_buffer;
+  char* data;
+  if (packet.size() > kFilterBufferSize) {
+    large_buffer.resize(packet.size());
+    data = large_buffer.data();
+  } else {
+    if (!buffer->valid()) *buffer = filter_pool_->Acquire();
+    data = buffer->data();
+  }
+  size_t filtered_size = 0;
+  switch (connection.filter().Apply(packet, data, &filtered_size)) {
+    case GnpsiSampleFilter::Result::kUnchanged:
+      return sample;
+    case GnpsiSampleFilter::Result::kDropped:
+      return nullptr;
+    case GnpsiSampleFilter::Result::kFiltered:
+      break;
+  }
+  grpc::Slice filtered;
+  if (large_buffer.empty()) {
+    buffer->set_size(filtered_size);
+    filtered = std::move(*buffer).ToSlice();
+  } else {
+    filtered = grpc::Slice(large_buffer.data(), filtered_size);
+  }
+  // The filtered datagram is joined again, so that it only carries the
+  // telemetry of the samples it kept.
+  return MakeSharedSample(std::move(filtered), sample->timestamp(),
+                          sample->metadata(), sample->sequence_number(), now);
+}
+
+bool GnpsiConnectionManager::ReadReplay(
+    GnpsiConnection& connection, uint64_t* after, absl::Time now,
+    int max_samples,
+    std::vector<std::shared_ptr<const SharedSample>>* samples) {
+  const size_t first = samples->size();
+  const bool caught_up =
+      replay_ring_->Read(after, now, max_samples, samples);
+  if (connection.filter().passes_all()) return caught_up;
+  // Replayed samples are filtered like live ones, into buffers of their own.
+  GnpsiPacketBuffer buffer;
+  size_t kept = first;
+  for (size_t i = first; i < samples->size(); ++i) {
+    std::shared_ptr<const SharedSample> filtered =
+        FilterSample((*samples)[i], connection, now, &buffer);
+    if (filtered != nullptr) (*samples)[kept++] = std::move(filtered);
+  }
+  samples->resize(kept);
+  return caught_up;
+}
+
+std::vector<GnpsiStats> GnpsiConnectionManager::GetStats() {
+  std::shared_ptr<const ConnectionList> connections = this->connections();
   std::vector<GnpsiStats> stats;
-  for (auto it = gnpsi_connections_.begin(), end = gnpsi_connections_.end();
-       it != end; it++) {
-    stats.push_back((*it)->GetConnectionStats());
+  stats.reserve(connections->size());
+  for (const std::shared_ptr<GnpsiConnection>& connection : *connections) {
+    stats.push_back(connection->GetConnectionStats());
   }
   return stats;
 }
+
+GnpsiHistograms GnpsiConnectionManager::GetHistograms() {
+  GnpsiHistograms histograms;
+  histograms.ingest_to_enqueue_ns = ingest_to_enqueue_.ToProto();
+  std::shared_ptr<const ConnectionList> connections = this->connections();
+  for (const std::shared_ptr<GnpsiConnection>& gnpsi_connection :
+       *connections) {
+    const std::shared_ptr<const GnpsiConnectionCounters> counters =
+        gnpsi_connection->counters();
+    GnpsiConnectionHistograms& connection =
+        histograms.connections.emplace_back();
+    connection.collector_ip = counters->collector_ip;
+    connection.collector_port = counters->collector_port;
+    connection.enqueue_to_write_start_ns =
+        counters->enqueue_to_write_start.ToProto();
+    connection.write_duration_ns = counters->write_duration.ToProto();
+    connection.queue_depth = counters->queue_depth.ToProto();
+  }
+  return histograms;
+}
 }  // namespace gnpsi
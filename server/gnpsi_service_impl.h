@@ -1,16 +1,36 @@
 #ifndef OPENCONFIG_GNPSI_SERVER_GNPSI_SERVICE_IMPL_H_
 #define OPENCONFIG_GNPSI_SERVER_GNPSI_SERVICE_IMPL_H_
 
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
+#include <deque>
+#include <memory>
+#include <optional>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "absl/container/inlined_vector.h"
 #include "absl/status/status.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "grpcpp/server_context.h"
+#include "grpcpp/support/slice.h"
 #include "grpcpp/support/status.h"
 #include "proto/gnpsi/gnpsi.grpc.pb.h"
 #include "proto/gnpsi/gnpsi.pb.h"
+#include "proto/gnpsi/histogram.pb.h"
+#include "server/gnpsi_congestion_cache.h"
+#include "server/gnpsi_flow_sketch.h"
+#include "server/gnpsi_histogram.h"
+#include "server/gnpsi_packet_buffer.h"
+#include "server/gnpsi_replay_ring.h"
+#include "server/gnpsi_sample_filter.h"
+#include "server/gnpsi_shared_sample.h"
 
 namespace gnpsi {
 
@@ -23,40 +43,199 @@ using ::grpc::StatusCode;
 inline constexpr absl::string_view kIpv4Indicator = "ipv4";
 inline constexpr absl::string_view kIpv6Indicator = "ipv6";
 
+// Batch size used when a Request asks for batching without a size.
+inline constexpr uint32_t kDefaultMaxBatchBytes = 64 * 1024;
+// Upper bounds of the batching options of a Request.
+inline constexpr uint32_t kMaxBatchBytes = 1024 * 1024;
+inline constexpr absl::Duration kMaxBatchLinger = absl::Seconds(1);
+// Size of the pooled buffers filtered datagrams are written to. Larger
+// datagrams are filtered into buffers of their own.
+inline constexpr size_t kFilterBufferSize = 4096;
+// Number of released filter buffers kept for reuse.
+inline constexpr int kFilterBufferPoolSize = 256;
+// Maximum number of samples a resuming connection queues at a time for replay.
+inline constexpr int kReplayBatchSize = 64;
+// Defaults and bounds of the aggregation options of a Request.
+inline constexpr absl::Duration kDefaultAggregationInterval = absl::Seconds(10);
+inline constexpr absl::Duration kMinAggregationInterval = absl::Seconds(1);
+inline constexpr absl::Duration kMaxAggregationInterval = absl::Hours(1);
+inline constexpr uint32_t kDefaultAggregationTopK = 10;
+inline constexpr uint32_t kMaxAggregationTopK = 100;
+// Interval at which the sync API checks whether the client cancelled an
+// aggregating stream, which has no samples queued to notice it.
+inline constexpr absl::Duration kAggregationCancelCheckInterval =
+    absl::Seconds(1);
+
 struct GnpsiStats {
-  GnpsiStats() : datagram_count(0), bytes_sampled(0), error_count(0) {}
+  GnpsiStats()
+      : datagram_count(0), bytes_sampled(0), error_count(0), dropped_count(0) {}
   GnpsiStats(absl::string_view ip, int port)
       : collector_ip(ip),
         collector_port(port),
         datagram_count(0),
         bytes_sampled(0),
-        error_count(0) {}
+        error_count(0),
+        dropped_count(0) {}
 
   std::string collector_ip;
   int collector_port;
-  int datagram_count;
+  uint64_t datagram_count;
   uint64_t bytes_sampled;
-  int error_count;
+  uint64_t error_count;
+  // Number of samples dropped because the send queue was full.
+  uint64_t dropped_count;
+};
+
+// Stats of a connection. The counters are updated on the data path with
+// relaxed atomics, so they can be read at any time without taking the locks of
+// the data path, also after the connection is gone. The collector address is
+// set before the connection is shared with other threads.
+struct GnpsiConnectionCounters {
+  // Returns a copy of the current values. The counters are read
+  // independently, so they may be off by the samples in flight.
+  GnpsiStats Snapshot() const;
+
+  std::string collector_ip;
+  int collector_port = 0;
+  std::atomic<uint64_t> datagram_count{0};
+  std::atomic<uint64_t> bytes_sampled{0};
+  std::atomic<uint64_t> error_count{0};
+  std::atomic<uint64_t> dropped_count{0};
+  // Time samples wait in the send queue until their write starts (ns).
+  GnpsiHistogram enqueue_to_write_start;
+  // Time it takes to write a message to the stream (ns).
+  GnpsiHistogram write_duration;
+  // Number of samples in the send queue each time a sample is queued.
+  GnpsiHistogram queue_depth;
+};
+
+// Histograms of a connection.
+struct GnpsiConnectionHistograms {
+  std::string collector_ip;
+  int collector_port;
+  Histogram enqueue_to_write_start_ns;
+  Histogram write_duration_ns;
+  Histogram queue_depth;
+};
+
+// Histograms of the stages samples go through from being received to being
+// written to each connection.
+struct GnpsiHistograms {
+  // Time from receiving a datagram to queueing it for the connections (ns).
+  Histogram ingest_to_enqueue_ns;
+  std::vector<GnpsiConnectionHistograms> connections;
+};
+
+// Action taken when a sample is sent to a connection whose send queue is full.
+enum class GnpsiOverflowPolicy {
+  // Drops the oldest queued sample to make room for the new one.
+  kDropOldest,
+  // Drops the new sample.
+  kDropNewest,
+  // Closes the connection.
+  kDisconnect,
+};
+
+// Options for the send queue of each connection.
+struct GnpsiConnectionOptions {
+  // Maximum number of samples queued for a connection. Values below 1 are
+  // taken as 1.
+  int max_queue_size = 1024;
+  GnpsiOverflowPolicy overflow_policy = GnpsiOverflowPolicy::kDropOldest;
 };
 
-// Interface to gNPSI sender method
+// Interface to gNPSI sender method. A relay with several readers calls it from
+// all of them at the same time.
 class GnpsiSenderInterface {
  public:
   virtual ~GnpsiSenderInterface() = default;
   virtual void SendSamplePacket(
       const std::string& sample_packet,
-      SFlowMetadata::Version version = SFlowMetadata::V5) = 0;
+      GnpsiSampleMetadata metadata = SFlowMetadata::V5) = 0;
+  // Sends a sample packet, taking ownership of its buffer. Implementations can
+  // override this to hand the buffer on without copying the packet.
+  virtual void SendSamplePacket(
+      GnpsiPacketBuffer sample_packet,
+      GnpsiSampleMetadata metadata = SFlowMetadata::V5) {
+    SendSamplePacket(std::string(sample_packet.view()), metadata);
+  }
+  // Sends a batch of sample packets in order, taking ownership of their
+  // buffers. Implementations can override this to amortize per-packet overhead
+  // across the batch.
+  virtual void SendSamplePackets(
+      absl::Span<GnpsiPacketBuffer> sample_packets,
+      GnpsiSampleMetadata metadata = SFlowMetadata::V5) {
+    for (GnpsiPacketBuffer& sample_packet : sample_packets) {
+      SendSamplePacket(std::move(sample_packet), metadata);
+    }
+  }
+  // Adds congestion telemetry to attach to the sFlow flow sample it
+  // describes, identified by its ingress port and sample sequence number. It
+  // has to be added before the datagram carrying the sample is sent.
+  // Implementations that do not attach telemetry ignore it.
+  virtual void AddCongestionTelemetry(const CongestionTelemetry& telemetry) {}
   virtual void DrainConnections() = 0;
   virtual void UndrainConnections() = 0;
   virtual std::vector<GnpsiStats> GetStats() = 0;
 };
 
-// A connection between a client and gNPSI server. This class is thread-safe.
+class GnpsiConnection;
+
+// Source of the samples replayed to connections resuming a previous stream.
+class GnpsiReplaySource {
+ public:
+  virtual ~GnpsiReplaySource() = default;
+
+  // Appends to `samples` the samples relayed after the sequence number
+  // `*after`, as filtered for `connection`, reading up to `max_samples` of
+  // them, and advances `*after` past them. Returns true if no samples are left
+  // to replay after `*after`.
+  virtual bool ReadReplay(
+      GnpsiConnection& connection, uint64_t* after, absl::Time now,
+      int max_samples,
+      std::vector<std::shared_ptr<const SharedSample>>* samples) = 0;
+};
+
+// A connection between a client and gNPSI server. Samples sent to the
+// connection are queued and written to the stream by a writer of its own, so a
+// slow client does not hold up the sender. With the sync API the writer is the
+// thread blocked in WaitUntilClosed; subclasses can instead drain the queue
+// from the OnSampleQueued and OnStreamClosed hooks. This class is thread-safe.
+//
+// If the client asked for batching, queued samples are written in batches of
+// up to the requested number of bytes, each held back no longer than the
+// requested linger time.
+//
+// A connection resuming a previous stream first replays the samples it missed.
+// The writer reads them in small batches from the replay source, outside of
+// the locks taken by the sender. Live samples are ignored until the replay has
+// caught up, as they are read from the replay source as well.
+//
+// If the client asked for aggregation, the sFlow datagrams sent to the
+// connection are added to a flow sketch instead of queued, without taking the
+// lock of the connection, and the writer writes a summary of the sketch at
+// the end of each interval.
 class GnpsiConnection {
  public:
-  explicit GnpsiConnection(ServerContext* context,
-                           ServerWriterInterface<Sample>* writer)
-      : context_(context), writer_(writer), is_stream_closed_(false) {}
+  // Samples written to the stream as one message.
+  struct PendingWrite {
+    absl::InlinedVector<std::shared_ptr<const SharedSample>, 1> samples;
+    // Whether the samples are written as a batch in batched_samples rather
+    // than as a single Sample.
+    bool batched = false;
+    // Summary of an interval, written instead of samples by aggregating
+    // connections. It carries the metadata if it is the first message.
+    std::optional<Sample> summary;
+  };
+
+  explicit GnpsiConnection(
+      grpc::ServerContextBase* context, ServerWriterInterface<Sample>* writer,
+      const GnpsiConnectionOptions& options = GnpsiConnectionOptions())
+      : context_(context),
+        writer_(writer),
+        options_(ValidOptions(options)),
+        counters_(std::make_shared<GnpsiConnectionCounters>()),
+        is_stream_closed_(false) {}
 
   virtual ~GnpsiConnection() = default;
 
@@ -68,13 +247,47 @@ class GnpsiConnection {
     return writer_->Write(response);
   }
 
+  // Applies the options requested by the client. Returns an INVALID_ARGUMENT
+  // error if they are out of range. Must be called before samples are queued
+  // and before the initial metadata is sent, as it carries the compression
+  // of the stream.
+  absl::Status Configure(const Request& request) ABSL_LOCKS_EXCLUDED(mu_);
+
   // Sets is_stream_closed_ to true.
-  void CloseStream() ABSL_LOCKS_EXCLUDED(mu_) {
+  void CloseStream() ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Returns true once the stream is closed.
+  bool IsStreamClosed() ABSL_LOCKS_EXCLUDED(mu_) {
     absl::MutexLock l(&mu_);
-    is_stream_closed_ = true;
+    return is_stream_closed_;
   }
-  // Blocks until connection is closed. This can either be the stream is broken
-  // or context is cancelled.
+
+  // Starts replaying the samples of `source` relayed after the sequence number
+  // requested by the client, if any. `last_sequence_number` is that of a
+  // sample relayed before the request was received; sequence numbers beyond
+  // it are from before the server restarted. Must be called before live
+  // samples are queued.
+  void StartReplay(GnpsiReplaySource* source, uint64_t last_sequence_number)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Returns true while the connection replays samples and ignores live ones.
+  // Does not block.
+  bool replaying() const { return replaying_.load(std::memory_order_acquire); }
+
+  // Queues `sample` to be written to the stream at time `now`. If the queue
+  // is full, applies the overflow policy of the connection. Samples are
+  // ignored while replaying, and so are samples that have been replayed
+  // already. Returns false if the connection is closed, closing it first if
+  // the client cancelled the stream.
+  bool EnqueueSample(std::shared_ptr<const SharedSample> sample,
+                     absl::Time now) ABSL_LOCKS_EXCLUDED(mu_);
+  bool EnqueueSample(std::shared_ptr<const SharedSample> sample)
+      ABSL_LOCKS_EXCLUDED(mu_) {
+    return EnqueueSample(std::move(sample), absl::Now());
+  }
+
+  // Writes queued samples to the stream and blocks until connection is closed.
+  // This can either be the stream is broken or context is cancelled.
   void WaitUntilClosed() ABSL_LOCKS_EXCLUDED(mu_);
 
   // Initialize the stats object with the required connection related values.
@@ -83,51 +296,177 @@ class GnpsiConnection {
   // a:b:c:d:: and connection_port = e.
   absl::Status InitializeStats();
 
-  // Increment the count of datagram sent to this connection by 1.
-  void IncrementDatagramCount() { this->stats_.datagram_count++; }
+  // Increment the count of write errors for this connection by 1.
+  void IncrementWriteErrorCount() {
+    counters_->error_count.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Returns the number of datagrams sent to this connection. Does not block.
+  GnpsiStats GetConnectionStats() const { return counters_->Snapshot(); }
 
-  // Increment the bytes sampled by size of packet.
-  void IncrementBytesSampled(uint64_t packet_size) {
-    this->stats_.bytes_sampled += packet_size;
+  // Returns the counters of this connection. They stay valid after the
+  // connection is destroyed.
+  std::shared_ptr<const GnpsiConnectionCounters> counters() const {
+    return counters_;
   }
 
-  // Increment the count of write errors for this connection by 1.
-  void IncrementWriteErrorCount() { this->stats_.error_count++; }
+  // Returns the filter of the samples sent to this connection. It is set by
+  // Configure and then used by the threads fanning samples out, which may be
+  // several at the same time, or by the writer while replaying.
+  GnpsiSampleFilter& filter() { return filter_; }
+
+  // Returns true if the client asked for summaries instead of samples. Set by
+  // Configure.
+  bool aggregating() const { return sketch_ != nullptr; }
+
+  // Adds the flow samples of the sFlow datagram `packet` to the summary of
+  // the current interval of an aggregating connection. Can be called from
+  // many threads at the same time.
+  void Aggregate(absl::string_view packet) { sketch_->AddDatagram(packet); }
+
+ protected:
+  // Called without locks held after a sample has been queued.
+  virtual void OnSampleQueued() {}
+  // Called without locks held when the stream is closed.
+  virtual void OnStreamClosed() {}
 
-  // Returns the number of datagrams sent to this connection.
-  GnpsiStats GetConnectionStats() { return this->stats_; }
+  // Removes the samples of the next message from the queue into `write` and
+  // returns true. Returns false if no message is ready at `now`, and sets
+  // `flush_time` to the time the pending batch is due, or to InfiniteFuture()
+  // if the queue is empty. Queues the next samples to replay first if the
+  // queue is empty.
+  bool PopWrite(absl::Time now, PendingWrite* write, absl::Time* flush_time)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Records the outcome of writing `write` to the stream, which took
+  // `duration`. A failed write closes the connection.
+  void RecordWrite(const PendingWrite& write, bool ok, absl::Duration duration)
+      ABSL_LOCKS_EXCLUDED(mu_);
 
  private:
-  ServerContext* context_;
+  // A sample waiting in the queue.
+  struct QueuedSample {
+    std::shared_ptr<const SharedSample> sample;
+    absl::Time enqueue_time;
+  };
+
+  bool PopWriteLocked(absl::Time now, PendingWrite* write,
+                      absl::Time* flush_time)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  // Requests `compression` for the messages of the stream.
+  absl::Status ConfigureCompression(const CompressionOptions& compression);
+  // Sets up the aggregation requested by `request`.
+  absl::Status ConfigureAggregation(const Request& request);
+  // Pops the summary of the current interval into `write` if it has ended at
+  // `now`, and otherwise sets `flush_time` to its end.
+  bool PopSummaryLocked(absl::Time now, PendingWrite* write,
+                        absl::Time* flush_time)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  // Queues the next samples to replay at `now` if the queue is empty. Once
+  // there are none left, switches the connection over to live samples.
+  void QueueReplay(absl::Time now) ABSL_LOCKS_EXCLUDED(mu_);
+  // Returns `options` with a queue of at least one sample.
+  static GnpsiConnectionOptions ValidOptions(GnpsiConnectionOptions options) {
+    options.max_queue_size = std::max(options.max_queue_size, 1);
+    return options;
+  }
+  // Returns the maximum number of queued samples, which is at least 1.
+  size_t max_queue_size() const { return options_.max_queue_size; }
+  // Returns true if the queued samples fill a batch, regardless of how long
+  // they have been waiting.
+  bool BatchFullLocked() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  grpc::ServerContextBase* context_;
   ServerWriterInterface<::gnpsi::Sample>* writer_;
-  // Lock for protecting is_stream_closed_.
+  const GnpsiConnectionOptions options_;
+  const std::shared_ptr<GnpsiConnectionCounters> counters_;
+  // Metadata sent on the stream. Only accessed by WaitUntilClosed.
+  GnpsiStreamMetadata stream_metadata_;
+  GnpsiSampleFilter filter_;
+  // Sketch of the flows of the current interval, if the client asked for
+  // aggregation.
+  std::unique_ptr<GnpsiFlowSketch> sketch_;
+  absl::Duration aggregation_interval_;
+  // Sequence number of the last sample the client received before, from the
+  // request. 0 if the client does not resume a stream.
+  uint64_t resume_after_ = 0;
+  // Source of the samples replayed. Set by StartReplay.
+  GnpsiReplaySource* replay_source_ = nullptr;
+  // Set while replaying; only changes under mu_.
+  std::atomic<bool> replaying_{false};
+  // Lock for protecting the members below.
   absl::Mutex mu_;
+  // Sequence number of the last sample replayed or skipped.
+  uint64_t replayed_through_ ABSL_GUARDED_BY(mu_) = 0;
   // When set to true, it means stream is broken.
   bool is_stream_closed_ ABSL_GUARDED_BY(mu_);
-  // Maintains the stats for this connections.
-  GnpsiStats stats_;
+  // Batching requested by the client. Batches are at most max_batch_bytes_
+  // packet bytes.
+  bool batching_ ABSL_GUARDED_BY(mu_) = false;
+  uint32_t max_batch_bytes_ ABSL_GUARDED_BY(mu_) = 0;
+  absl::Duration max_linger_ ABSL_GUARDED_BY(mu_);
+  // Start of the interval summarized next by an aggregating connection.
+  absl::Time interval_start_ ABSL_GUARDED_BY(mu_);
+  // Samples waiting to be written to the stream. The samples are shared with
+  // the queues of all other connections.
+  std::deque<QueuedSample> queue_ ABSL_GUARDED_BY(mu_);
+  // Number of packet bytes in queue_.
+  uint64_t queued_bytes_ ABSL_GUARDED_BY(mu_) = 0;
 };
 
-// Implementation of gNPSI server.
-// 1. Supports Subscribe from clients.
-// 2. Exposes an interface for server to send Sample response.
-class GnpsiServiceImpl : public ::gnpsi::gNPSI::Service,
-                         public GnpsiSenderInterface {
+// Keeps track of the connections of a gNPSI service and fans samples out to
+// them. Shared by the sync and callback API implementations of the service.
+// The connections are kept in a list that is copied on every change, so
+// samples are fanned out without taking the lock of adding and dropping
+// connections, and neither waits for the other. Several threads can send
+// samples at the same time; they only take turns if replay is enabled.
+// Each sample is prepared once for all connections: serialized for
+// connections that write raw bytes when `serialize_samples` is set, built as a
+// Sample message otherwise. The congestion telemetry of the flow samples of
+// sFlow datagrams is attached to them as they are prepared.
+//
+// If `replay_options` allow, recently relayed samples are numbered and kept
+// for connections that resume a previous stream.
+class GnpsiConnectionManager : public GnpsiSenderInterface,
+                               private GnpsiReplaySource {
  public:
-  explicit GnpsiServiceImpl(int client_max_number)
-      : client_max_number_(client_max_number) {}
-
-  // Creates a new GnpsiConnection and adds it into gnpsi_connections_ vector.
-  // Returns a FAILED_PRECONDITION error if gnpsi_connections_ size has reached
-  // client_max_number_.
-  Status Subscribe(ServerContext* context, const Request* request,
-                   ServerWriter<Sample>* writer)
-      ABSL_LOCKS_EXCLUDED(mu_) override;
+  explicit GnpsiConnectionManager(
+      int client_max_number,
+      const GnpsiConnectionOptions& connection_options =
+          GnpsiConnectionOptions(),
+      bool serialize_samples = false,
+      const GnpsiCongestionCacheOptions& congestion_cache_options =
+          GnpsiCongestionCacheOptions(),
+      const GnpsiReplayOptions& replay_options = GnpsiReplayOptions())
+      : client_max_number_(client_max_number),
+        connection_options_(connection_options),
+        serialize_samples_(serialize_samples),
+        congestion_cache_(congestion_cache_options),
+        replay_ring_(GnpsiReplayRing::Create(replay_options)),
+        filter_pool_(GnpsiBufferPool::Create(kFilterBufferSize,
+                                             kFilterBufferPoolSize)),
+        connections_(std::make_shared<const ConnectionList>()) {}
 
-  // Sends Sample response to each client.
+  // Queues a Sample response for each client.
   void SendSamplePacket(const std::string& sample_packet,
-                        SFlowMetadata::Version version = SFlowMetadata::V5)
-      ABSL_LOCKS_EXCLUDED(mu_) override;
+                        GnpsiSampleMetadata metadata = SFlowMetadata::V5)
+      ABSL_LOCKS_EXCLUDED(sequence_mu_) override;
+
+  // Queues a Sample response for each client. The packet is not copied when
+  // samples are serialized.
+  void SendSamplePacket(GnpsiPacketBuffer sample_packet,
+                        GnpsiSampleMetadata metadata = SFlowMetadata::V5)
+      ABSL_LOCKS_EXCLUDED(sequence_mu_) override;
+
+  // Queues a Sample response per packet for each client, reading the
+  // connections once for the whole batch.
+  void SendSamplePackets(absl::Span<GnpsiPacketBuffer> sample_packets,
+                         GnpsiSampleMetadata metadata = SFlowMetadata::V5)
+      ABSL_LOCKS_EXCLUDED(sequence_mu_) override;
+
+  // Caches `telemetry` until its sample is sent. Does not contend with the
+  // sending of samples for longer than a cache update.
+  void AddCongestionTelemetry(const CongestionTelemetry& telemetry) override;
 
   // Closes all current conections and blocks any new incoming connections.
   void DrainConnections() ABSL_LOCKS_EXCLUDED(mu_) override;
@@ -135,29 +474,132 @@ class GnpsiServiceImpl : public ::gnpsi::gNPSI::Service,
   // Resumes the service and allows new connections.
   void UndrainConnections() ABSL_LOCKS_EXCLUDED(mu_) override;
 
-  // Returns stats per connection collected by the server.
-  std::vector<GnpsiStats> GetStats() ABSL_LOCKS_EXCLUDED(mu_) override;
+  // Returns stats per connection collected by the server. Does not block.
+  std::vector<GnpsiStats> GetStats() override;
 
- private:
-  int client_max_number_;
-  // Lock for protecting member fields.
-  absl::Mutex mu_;
-  // Adds `connection` to internal vector.
-  // Returns true if `connection` is successfully added.
-  // Returns false and does nothing if number of alive connections reaches
-  // client_max_number_.
-  absl::Status AddConnection(GnpsiConnection* connection)
+  // Returns the latency and queue depth histograms collected by the server.
+  // Like GetStats, does not block.
+  GnpsiHistograms GetHistograms();
+
+ protected:
+  const GnpsiConnectionOptions& connection_options() const {
+    return connection_options_;
+  }
+
+  // Adds `connection` to the connections samples are sent to, sharing its
+  // ownership with the senders.
+  // Returns OK if `connection` is successfully added.
+  // Returns a FAILED_PRECONDITION error and does nothing if the service is
+  // drained or the number of alive connections reaches client_max_number_.
+  absl::Status AddConnection(std::shared_ptr<GnpsiConnection> connection)
       ABSL_LOCKS_EXCLUDED(mu_);
-  // Removes `connection` from gnpsi_connections_ if it exists. Otherwise, does
-  // nothing.
+  // Closes `connection` and removes it from the connections if it exists.
+  // Otherwise, does nothing. Senders may still hold the connection until they
+  // are done with the current sample, but no longer touch its server context.
   void DropConnection(GnpsiConnection* connection) ABSL_LOCKS_EXCLUDED(mu_);
+
+ private:
+  int client_max_number_;
+  // Options for the send queue of each new connection.
+  const GnpsiConnectionOptions connection_options_;
+  const bool serialize_samples_;
+  // Congestion telemetry waiting for its sample.
+  GnpsiCongestionCache congestion_cache_;
+  // Samples kept for replay, or nullptr if replay is disabled.
+  const std::unique_ptr<GnpsiReplayRing> replay_ring_;
+  using ConnectionList = std::vector<std::shared_ptr<GnpsiConnection>>;
+
+  // Returns the current connections. Does not block.
+  std::shared_ptr<const ConnectionList> connections() const {
+    return std::atomic_load_explicit(&connections_, std::memory_order_acquire);
+  }
   // Returns the number of alive connections and marks stale connections as
   // closed.
   int GetAliveConnections() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
-  // Maintains a vector of GnpsiConnection.
-  std::vector<GnpsiConnection*> gnpsi_connections_ ABSL_GUARDED_BY(mu_);
+  // Queues `sample_packet`, received at `receive_time`, for each client of
+  // `connections` at time `now`. Datagrams filtered for some of the clients
+  // are written to `filter_buffer`. Must be called with sequence_mu_ held if
+  // replay is enabled.
+  void SendSample(const ConnectionList& connections, grpc::Slice sample_packet,
+                  GnpsiSampleMetadata metadata, absl::Time receive_time,
+                  absl::Time now, GnpsiPacketBuffer* filter_buffer);
+  // Returns a sample of `packet`, prepared to be shared by the queues of many
+  // connections, with the congestion telemetry unexpired at `now` attached.
+  std::shared_ptr<const SharedSample> MakeSharedSample(
+      grpc::Slice packet, int64_t timestamp, GnpsiSampleMetadata metadata,
+      uint64_t sequence_number, absl::Time now) const;
+  // Adds the sFlow `sample` to the summary of the aggregating `connection`, as
+  // filtered for it at `now` into `filter_buffer`.
+  void AggregateSample(const std::shared_ptr<const SharedSample>& sample,
+                       GnpsiConnection& connection, absl::Time now,
+                       GnpsiPacketBuffer* filter_buffer) const;
+  // Returns `sample` as filtered for `connection` at `now`, or nullptr if none
+  // of it passes the filter of the connection. A filtered datagram is written
+  // to `buffer`, which is acquired from filter_pool_ if it is not valid, and
+  // handed over to the filtered sample.
+  std::shared_ptr<const SharedSample> FilterSample(
+      const std::shared_ptr<const SharedSample>& sample,
+      GnpsiConnection& connection, absl::Time now,
+      GnpsiPacketBuffer* buffer) const;
+  bool ReadReplay(
+      GnpsiConnection& connection, uint64_t* after, absl::Time now,
+      int max_samples,
+      std::vector<std::shared_ptr<const SharedSample>>* samples) override;
+  std::shared_ptr<GnpsiBufferPool> filter_pool_;
+  // Lock for protecting the connections while they are added and dropped.
+  absl::Mutex mu_;
+  // The connections samples are sent to. The list is never modified: it is
+  // replaced by a modified copy under mu_, and read with atomic loads.
+  std::shared_ptr<const ConnectionList> connections_;
   // Indicates whether service drain has been initiated.
   bool service_drained_ ABSL_GUARDED_BY(mu_) = false;
+  // Lock taken by the senders while replay is enabled, so that samples are
+  // numbered, kept for replay and queued in the same order. Held for the
+  // whole fan-out, as a stream seeing N + 1 before N would skip N when it
+  // resumes after N + 1; this serializes the relay readers.
+  absl::Mutex sequence_mu_;
+  // Sequence number of the last sample relayed, if replay is enabled. Only
+  // incremented under sequence_mu_.
+  std::atomic<uint64_t> last_sequence_number_{0};
+  GnpsiHistogram ingest_to_enqueue_;
+};
+
+// Implementation of gNPSI server.
+// 1. Supports Subscribe from clients.
+// 2. Exposes an interface for server to send Sample response.
+//
+// Every subscription occupies a thread of the sync server for its lifetime. See
+// GnpsiCallbackServiceImpl for an implementation that does not.
+//
+// Samples are written as Sample messages through the ServerWriter<Sample> of
+// the generated service, so each sample is encoded again for every
+// subscriber. gRPC generates no sync variant of a raw method, and writing the
+// bytes a SharedSample serialized once would take replacing the handler of
+// Subscribe with internal gRPC classes. GnpsiCallbackServiceImpl registers
+// Subscribe as a raw callback method and writes those bytes to all
+// subscribers, so it is the one to use with many of them.
+class GnpsiServiceImpl : public ::gnpsi::gNPSI::Service,
+                         public GnpsiConnectionManager {
+ public:
+  explicit GnpsiServiceImpl(int client_max_number)
+      : GnpsiConnectionManager(client_max_number) {}
+  GnpsiServiceImpl(int client_max_number,
+                   const GnpsiConnectionOptions& connection_options)
+      : GnpsiConnectionManager(client_max_number, connection_options) {}
+  GnpsiServiceImpl(int client_max_number,
+                   const GnpsiConnectionOptions& connection_options,
+                   const GnpsiReplayOptions& replay_options)
+      : GnpsiConnectionManager(client_max_number, connection_options,
+                               /*serialize_samples=*/false,
+                               GnpsiCongestionCacheOptions(), replay_options) {
+  }
+
+  // Creates a new GnpsiConnection and adds it to the connections. Returns a
+  // FAILED_PRECONDITION error if the number of connections has reached
+  // client_max_number_, or an INVALID_ARGUMENT error if the options of
+  // `request` are out of range.
+  Status Subscribe(ServerContext* context, const Request* request,
+                   ServerWriter<Sample>* writer) override;
 };
 
 }  // namespace gnpsi
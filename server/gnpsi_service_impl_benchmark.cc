@@ -0,0 +1,159 @@
+// Measures GnpsiServiceImpl::SendSamplePacket with subscribers writing to
+// fake streams, alone and with stats being polled concurrently.
+//
+// Every subscriber is a GnpsiConnection with a writer thread that writes its
+// queue to a ServerWriterInterface discarding the samples, as a Subscribe call
+// would. Besides throughput, the benchmarks report the p50, p99 and p999
+// latency of a SendSamplePacket call and the share of samples dropped because
+// a writer fell behind. BM_SendSamplePacket also reports the heap allocations
+// per sample, including those of the writer threads; the polling variant does
+// not, as its GetStats calls allocate and would be counted too.
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "grpcpp/server_context.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_benchmark_util.h"
+#include "server/gnpsi_service_impl.h"
+
+namespace gnpsi {
+namespace {
+
+class DiscardingWriter : public ServerWriterInterface<Sample> {
+ public:
+  void SendInitialMetadata() override {}
+  bool Write(const Sample& msg, grpc::WriteOptions options) override {
+    benchmark::DoNotOptimize(msg.packet().data());
+    return true;
+  }
+};
+
+class BenchmarkConnection : public GnpsiConnection {
+ public:
+  using GnpsiConnection::GnpsiConnection;
+
+  std::string GetPeerName() const override { return "ipv4:127.0.0.1:9000"; }
+};
+
+class BenchmarkServiceImpl : public GnpsiServiceImpl {
+ public:
+  using GnpsiServiceImpl::AddConnection;
+  using GnpsiServiceImpl::DropConnection;
+  using GnpsiServiceImpl::GnpsiServiceImpl;
+};
+
+// Subscribers of a service, each with a writer thread draining its queue.
+class Subscribers {
+ public:
+  Subscribers(int count, BenchmarkServiceImpl& service) : service_(service) {
+    for (int i = 0; i < count; ++i) {
+      contexts_.push_back(std::make_unique<grpc::ServerContext>());
+      connections_.push_back(std::make_shared<BenchmarkConnection>(
+          contexts_.back().get(), &writer_));
+      service_.AddConnection(connections_.back()).IgnoreError();
+    }
+    for (auto& connection : connections_) {
+      threads_.emplace_back([&connection] { connection->WaitUntilClosed(); });
+    }
+  }
+
+  ~Subscribers() {
+    for (auto& connection : connections_) {
+      connection->CloseStream();
+    }
+    for (std::thread& thread : threads_) {
+      thread.join();
+    }
+    for (auto& connection : connections_) {
+      service_.DropConnection(connection.get());
+    }
+  }
+
+ private:
+  BenchmarkServiceImpl& service_;
+  DiscardingWriter writer_;
+  std::vector<std::unique_ptr<grpc::ServerContext>> contexts_;
+  std::vector<std::shared_ptr<BenchmarkConnection>> connections_;
+  std::vector<std::thread> threads_;
+};
+
+// Sets the "dropped_per_sample" counter of `state` from the stats of
+// `service`.
+void ReportDropped(benchmark::State& state, BenchmarkServiceImpl& service,
+                   int64_t samples) {
+  uint64_t dropped = 0;
+  for (const GnpsiStats& stats : service.GetStats()) {
+    dropped += stats.dropped_count;
+  }
+  if (samples == 0) return;
+  state.counters["dropped_per_sample"] =
+      static_cast<double>(dropped) / samples;
+}
+
+// Sends samples of state.range(1) bytes to state.range(0) subscribers, while
+// `stats_pollers` threads call GetStats in a loop. Allocations per sample are
+// only reported without pollers, since AllocationCount counts every thread.
+void SendSamples(benchmark::State& state, int stats_pollers) {
+  const int subscribers = state.range(0);
+  const std::string packet(state.range(1), 'x');
+  BenchmarkServiceImpl service(subscribers);
+  Subscribers subscriber_set(subscribers, service);
+  std::atomic<bool> stop_polling{false};
+  std::vector<std::thread> pollers;
+  for (int i = 0; i < stats_pollers; ++i) {
+    pollers.emplace_back([&service, &stop_polling] {
+      while (!stop_polling.load(std::memory_order_relaxed)) {
+        benchmark::DoNotOptimize(service.GetStats());
+      }
+    });
+  }
+  LatencyRecorder latency;
+  int64_t start_allocations = AllocationCount();
+  for (auto _ : state) {
+    latency.Measure([&] { service.SendSamplePacket(packet); });
+  }
+  if (stats_pollers == 0) {
+    ReportAllocationsPerSample(state, start_allocations, state.iterations());
+  }
+  stop_polling = true;
+  for (std::thread& poller : pollers) {
+    poller.join();
+  }
+  latency.Report(state);
+  ReportDropped(state, service, state.iterations() * subscribers);
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * packet.size() * subscribers);
+}
+
+void BM_SendSamplePacket(benchmark::State& state) {
+  SendSamples(state, /*stats_pollers=*/0);
+}
+
+void BM_SendSamplePacketWithStatsPolling(benchmark::State& state) {
+  SendSamples(state, /*stats_pollers=*/1);
+}
+
+void SubscriberArgs(benchmark::internal::Benchmark* benchmark) {
+  benchmark->ArgNames({"subscribers", "packet_size"});
+  for (int packet_size : {128, 1500, 9000}) {
+    for (int subscribers : {1, 4, 16, 64}) {
+      benchmark->Args({subscribers, packet_size});
+    }
+  }
+}
+
+BENCHMARK(BM_SendSamplePacket)->Apply(SubscriberArgs)->UseRealTime();
+BENCHMARK(BM_SendSamplePacketWithStatsPolling)
+    ->ArgNames({"subscribers", "packet_size"})
+    ->Args({16, 1500})
+    ->Args({64, 1500})
+    ->UseRealTime();
+
+}  // namespace
+}  // namespace gnpsi
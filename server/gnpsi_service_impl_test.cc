@@ -0,0 +1,844 @@
+#include "server/gnpsi_service_impl.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "gmock/gmock.h"
+#include "grpc/compression.h"
+#include "grpcpp/server_context.h"
+#include "gtest/gtest.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_packet_buffer.h"
+#include "server/gnpsi_sflow_test_util.h"
+#include "server/gnpsi_spool.h"
+
+namespace gnpsi {
+namespace {
+using testing::ElementsAre;
+
+// Returns whether `sample` carries metadata of any protocol.
+bool HasMetadata(const Sample& sample) {
+  return sample.has_sflow_metadata() || sample.has_netflow_metadata() ||
+         sample.has_ipfix_metadata();
+}
+
+// Records the packets written to the stream. Writes fail once `fail_writes`
+// is set.
+class FakeWriter : public ServerWriterInterface<Sample> {
+ public:
+  void SendInitialMetadata() override {}
+  bool Write(const Sample& msg, grpc::WriteOptions options) override {
+    absl::MutexLock l(&mu_);
+    if (fail_writes_) return false;
+    if (msg.has_flow_summary()) {
+      summaries_.push_back(msg.flow_summary());
+      with_metadata_.push_back(HasMetadata(msg));
+      return true;
+    }
+    if (msg.batched_samples_size() == 0) {
+      packets_.push_back(msg.packet());
+      timestamps_.push_back(msg.timestamp());
+      with_metadata_.push_back(HasMetadata(msg));
+      congestion_telemetry_sizes_.push_back(msg.congestion_telemetry_size());
+      sequence_numbers_.push_back(msg.sequence_number());
+      return true;
+    }
+    for (const Sample& sample : msg.batched_samples()) {
+      packets_.push_back(sample.packet());
+      with_metadata_.push_back(HasMetadata(sample));
+    }
+    batch_sizes_.push_back(msg.batched_samples_size());
+    return true;
+  }
+  void set_fail_writes(bool fail_writes) {
+    absl::MutexLock l(&mu_);
+    fail_writes_ = fail_writes;
+  }
+  std::vector<std::string> packets() {
+    absl::MutexLock l(&mu_);
+    return packets_;
+  }
+  // Timestamps of the samples written, unless batched.
+  std::vector<int64_t> timestamps() {
+    absl::MutexLock l(&mu_);
+    return timestamps_;
+  }
+  // Number of samples in each batched message written.
+  std::vector<int> batch_sizes() {
+    absl::MutexLock l(&mu_);
+    return batch_sizes_;
+  }
+  // Whether each sample written carried metadata.
+  std::vector<bool> with_metadata() {
+    absl::MutexLock l(&mu_);
+    return with_metadata_;
+  }
+  // Number of congestion records of the samples written, unless batched.
+  std::vector<int> congestion_telemetry_sizes() {
+    absl::MutexLock l(&mu_);
+    return congestion_telemetry_sizes_;
+  }
+  // Sequence numbers of the samples written, unless batched.
+  std::vector<uint64_t> sequence_numbers() {
+    absl::MutexLock l(&mu_);
+    return sequence_numbers_;
+  }
+  // Flow summaries written.
+  std::vector<FlowSummary> summaries() {
+    absl::MutexLock l(&mu_);
+    return summaries_;
+  }
+
+ private:
+  absl::Mutex mu_;
+  bool fail_writes_ ABSL_GUARDED_BY(mu_) = false;
+  std::vector<std::string> packets_ ABSL_GUARDED_BY(mu_);
+  std::vector<int64_t> timestamps_ ABSL_GUARDED_BY(mu_);
+  std::vector<int> batch_sizes_ ABSL_GUARDED_BY(mu_);
+  std::vector<bool> with_metadata_ ABSL_GUARDED_BY(mu_);
+  std::vector<int> congestion_telemetry_sizes_ ABSL_GUARDED_BY(mu_);
+  std::vector<uint64_t> sequence_numbers_ ABSL_GUARDED_BY(mu_);
+  std::vector<FlowSummary> summaries_ ABSL_GUARDED_BY(mu_);
+};
+
+std::shared_ptr<const SharedSample> MakeSample(
+    absl::string_view packet,
+    GnpsiSampleMetadata metadata = SFlowMetadata::V5) {
+  auto sample = std::make_shared<SharedSample>(
+      grpc::Slice(std::string(packet)), /*timestamp=*/0, metadata);
+  sample->BuildSample();
+  return sample;
+}
+
+GnpsiConnectionOptions QueueOptions(int max_queue_size,
+                                    GnpsiOverflowPolicy overflow_policy) {
+  GnpsiConnectionOptions options;
+  options.max_queue_size = max_queue_size;
+  options.overflow_policy = overflow_policy;
+  return options;
+}
+
+Request BatchingRequest(uint32_t max_batch_bytes, absl::Duration max_linger) {
+  Request request;
+  request.mutable_batching()->set_max_batch_bytes(max_batch_bytes);
+  request.mutable_batching()->set_max_linger_ns(
+      absl::ToInt64Nanoseconds(max_linger));
+  return request;
+}
+
+class GnpsiConnectionTest : public ::testing::Test {
+ protected:
+  grpc::ServerContext context_;
+  FakeWriter writer_;
+};
+
+TEST_F(GnpsiConnectionTest, WritesQueuedSamplesInOrder) {
+  GnpsiConnection connection(
+      &context_, &writer_, QueueOptions(4, GnpsiOverflowPolicy::kDropOldest));
+  EXPECT_TRUE(connection.EnqueueSample(MakeSample("a")));
+  EXPECT_TRUE(connection.EnqueueSample(MakeSample("bc")));
+  std::thread writer_thread([&connection] { connection.WaitUntilClosed(); });
+  while (writer_.packets().size() < 2) std::this_thread::yield();
+  connection.CloseStream();
+  writer_thread.join();
+  EXPECT_THAT(writer_.packets(), ElementsAre("a", "bc"));
+  GnpsiStats stats = connection.GetConnectionStats();
+  EXPECT_EQ(stats.datagram_count, 2);
+  EXPECT_EQ(stats.bytes_sampled, 3);
+  EXPECT_EQ(stats.dropped_count, 0);
+}
+
+TEST_F(GnpsiConnectionTest, SendsMetadataOnlyWhenItChanges) {
+  GnpsiConnection connection(&context_, &writer_);
+  EXPECT_TRUE(connection.EnqueueSample(MakeSample("a")));
+  EXPECT_TRUE(connection.EnqueueSample(MakeSample("b")));
+  EXPECT_TRUE(
+      connection.EnqueueSample(MakeSample("c", IPFIXMetadata::V10)));
+  EXPECT_TRUE(
+      connection.EnqueueSample(MakeSample("d", IPFIXMetadata::V10)));
+  std::thread writer_thread([&connection] { connection.WaitUntilClosed(); });
+  while (writer_.packets().size() < 4) std::this_thread::yield();
+  connection.CloseStream();
+  writer_thread.join();
+  // The first message on the stream carries the metadata, and so does the
+  // first sample of another protocol.
+  EXPECT_THAT(writer_.with_metadata(), ElementsAre(true, false, true, false));
+}
+
+TEST_F(GnpsiConnectionTest, DropOldestOnOverflow) {
+  GnpsiConnection connection(
+      &context_, &writer_, QueueOptions(2, GnpsiOverflowPolicy::kDropOldest));
+  EXPECT_TRUE(connection.EnqueueSample(MakeSample("a")));
+  EXPECT_TRUE(connection.EnqueueSample(MakeSample("b")));
+  EXPECT_TRUE(connection.EnqueueSample(MakeSample("c")));
+  std::thread writer_thread([&connection] { connection.WaitUntilClosed(); });
+  while (writer_.packets().size() < 2) std::this_thread::yield();
+  connection.CloseStream();
+  writer_thread.join();
+  EXPECT_THAT(writer_.packets(), ElementsAre("b", "c"));
+  EXPECT_EQ(connection.GetConnectionStats().dropped_count, 1);
+}
+
+TEST_F(GnpsiConnectionTest, QueuesAtLeastOneSample) {
+  GnpsiConnection connection(
+      &context_, &writer_, QueueOptions(0, GnpsiOverflowPolicy::kDropOldest));
+  EXPECT_TRUE(connection.EnqueueSample(MakeSample("a")));
+  EXPECT_TRUE(connection.EnqueueSample(MakeSample("b")));
+  std::thread writer_thread([&connection] { connection.WaitUntilClosed(); });
+  while (writer_.packets().empty()) std::this_thread::yield();
+  connection.CloseStream();
+  writer_thread.join();
+  EXPECT_THAT(writer_.packets(), ElementsAre("b"));
+  EXPECT_EQ(connection.GetConnectionStats().dropped_count, 1);
+}
+
+TEST_F(GnpsiConnectionTest, DropNewestOnOverflow) {
+  GnpsiConnection connection(
+      &context_, &writer_, QueueOptions(2, GnpsiOverflowPolicy::kDropNewest));
+  EXPECT_TRUE(connection.EnqueueSample(MakeSample("a")));
+  EXPECT_TRUE(connection.EnqueueSample(MakeSample("b")));
+  EXPECT_TRUE(connection.EnqueueSample(MakeSample("c")));
+  std::thread writer_thread([&connection] { connection.WaitUntilClosed(); });
+  while (writer_.packets().size() < 2) std::this_thread::yield();
+  connection.CloseStream();
+  writer_thread.join();
+  EXPECT_THAT(writer_.packets(), ElementsAre("a", "b"));
+  EXPECT_EQ(connection.GetConnectionStats().dropped_count, 1);
+}
+
+TEST_F(GnpsiConnectionTest, DisconnectOnOverflow) {
+  GnpsiConnection connection(
+      &context_, &writer_, QueueOptions(1, GnpsiOverflowPolicy::kDisconnect));
+  EXPECT_TRUE(connection.EnqueueSample(MakeSample("a")));
+  EXPECT_FALSE(connection.EnqueueSample(MakeSample("b")));
+  EXPECT_FALSE(connection.EnqueueSample(MakeSample("c")));
+  // The connection is already closed, so nothing is written.
+  connection.WaitUntilClosed();
+  EXPECT_TRUE(writer_.packets().empty());
+  EXPECT_EQ(connection.GetConnectionStats().dropped_count, 1);
+}
+
+TEST_F(GnpsiConnectionTest, ClosesOnWriteError) {
+  GnpsiConnection connection(
+      &context_, &writer_, QueueOptions(4, GnpsiOverflowPolicy::kDropOldest));
+  writer_.set_fail_writes(true);
+  EXPECT_TRUE(connection.EnqueueSample(MakeSample("a")));
+  // Returns once the failed write closes the connection.
+  connection.WaitUntilClosed();
+  EXPECT_FALSE(connection.EnqueueSample(MakeSample("b")));
+  EXPECT_EQ(connection.GetConnectionStats().error_count, 1);
+}
+
+TEST_F(GnpsiConnectionTest, BatchesQueuedSamplesUpToMaxBatchBytes) {
+  GnpsiConnection connection(
+      &context_, &writer_, QueueOptions(8, GnpsiOverflowPolicy::kDropOldest));
+  ASSERT_TRUE(
+      connection.Configure(BatchingRequest(4, absl::ZeroDuration())).ok());
+  EXPECT_TRUE(connection.EnqueueSample(MakeSample("ab")));
+  EXPECT_TRUE(connection.EnqueueSample(MakeSample("cd")));
+  EXPECT_TRUE(connection.EnqueueSample(MakeSample("e")));
+  std::thread writer_thread([&connection] { connection.WaitUntilClosed(); });
+  while (writer_.packets().size() < 3) std::this_thread::yield();
+  connection.CloseStream();
+  writer_thread.join();
+  EXPECT_THAT(writer_.packets(), ElementsAre("ab", "cd", "e"));
+  EXPECT_THAT(writer_.batch_sizes(), ElementsAre(2, 1));
+  GnpsiStats stats = connection.GetConnectionStats();
+  EXPECT_EQ(stats.datagram_count, 3);
+  EXPECT_EQ(stats.bytes_sampled, 5);
+}
+
+TEST_F(GnpsiConnectionTest, HoldsBatchUntilLingerTimeExpires) {
+  const absl::Duration linger = absl::Milliseconds(50);
+  GnpsiConnection connection(
+      &context_, &writer_, QueueOptions(8, GnpsiOverflowPolicy::kDropOldest));
+  ASSERT_TRUE(connection.Configure(BatchingRequest(1000, linger)).ok());
+  std::thread writer_thread([&connection] { connection.WaitUntilClosed(); });
+  absl::Time start = absl::Now();
+  EXPECT_TRUE(connection.EnqueueSample(MakeSample("a")));
+  EXPECT_TRUE(connection.EnqueueSample(MakeSample("b")));
+  while (writer_.packets().size() < 2) std::this_thread::yield();
+  EXPECT_GE(absl::Now() - start, linger);
+  connection.CloseStream();
+  writer_thread.join();
+  EXPECT_THAT(writer_.packets(), ElementsAre("a", "b"));
+  EXPECT_THAT(writer_.batch_sizes(), ElementsAre(2));
+}
+
+TEST_F(GnpsiConnectionTest, RejectsOutOfRangeBatchingOptions) {
+  GnpsiConnection connection(&context_, &writer_);
+  EXPECT_EQ(connection
+                .Configure(BatchingRequest(kMaxBatchBytes + 1,
+                                           absl::ZeroDuration()))
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(connection
+                .Configure(BatchingRequest(0, kMaxBatchLinger +
+                                                  absl::Nanoseconds(1)))
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST_F(GnpsiConnectionTest, RejectsInvalidAggregationOptions) {
+  GnpsiConnection connection(&context_, &writer_);
+  Request request;
+  request.mutable_aggregation()->set_interval_ns(
+      absl::ToInt64Nanoseconds(kMinAggregationInterval) - 1);
+  EXPECT_EQ(connection.Configure(request).code(),
+            absl::StatusCode::kInvalidArgument);
+  request.mutable_aggregation()->set_interval_ns(0);
+  request.mutable_aggregation()->set_top_k(kMaxAggregationTopK + 1);
+  EXPECT_EQ(connection.Configure(request).code(),
+            absl::StatusCode::kInvalidArgument);
+  request.mutable_aggregation()->set_top_k(0);
+  request.set_last_sequence_number(1);
+  EXPECT_EQ(connection.Configure(request).code(),
+            absl::StatusCode::kInvalidArgument);
+  request.set_last_sequence_number(0);
+  request.mutable_batching()->set_max_batch_bytes(1000);
+  EXPECT_EQ(connection.Configure(request).code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST_F(GnpsiConnectionTest, RequestsCompression) {
+  GnpsiConnection connection(&context_, &writer_);
+  Request request;
+  request.mutable_compression()->set_algorithm(CompressionOptions::GZIP);
+  ASSERT_TRUE(connection.Configure(request).ok());
+  EXPECT_EQ(context_.compression_algorithm(), GRPC_COMPRESS_GZIP);
+
+  grpc::ServerContext level_context;
+  GnpsiConnection level_connection(&level_context, &writer_);
+  request.mutable_compression()->set_algorithm(
+      CompressionOptions::ALGORITHM_UNSPECIFIED);
+  request.mutable_compression()->set_level(CompressionOptions::HIGH);
+  ASSERT_TRUE(level_connection.Configure(request).ok());
+  EXPECT_TRUE(level_context.compression_level_set());
+  EXPECT_EQ(level_context.compression_level(), GRPC_COMPRESS_LEVEL_HIGH);
+}
+
+TEST_F(GnpsiConnectionTest, RejectsInvalidCompressionOptions) {
+  GnpsiConnection connection(&context_, &writer_);
+  Request request;
+  request.mutable_compression()->set_algorithm(CompressionOptions::DEFLATE);
+  request.mutable_compression()->set_level(CompressionOptions::LOW);
+  EXPECT_EQ(connection.Configure(request).code(),
+            absl::StatusCode::kInvalidArgument);
+  request.mutable_compression()->set_level(
+      CompressionOptions::LEVEL_UNSPECIFIED);
+  request.mutable_compression()->set_algorithm(
+      static_cast<CompressionOptions::Algorithm>(42));
+  EXPECT_EQ(connection.Configure(request).code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+// Connection whose OnSampleQueued blocks until `release` is notified, holding
+// up the sender in the middle of fanning out a sample.
+class BlockingConnection : public GnpsiConnection {
+ public:
+  BlockingConnection(grpc::ServerContextBase* context,
+                     absl::Notification* queued, absl::Notification* release)
+      : GnpsiConnection(context, /*writer=*/nullptr),
+        queued_(queued),
+        release_(release) {}
+
+  std::string GetPeerName() const override { return "ipv4:10.0.0.1:9000"; }
+
+ protected:
+  void OnSampleQueued() override {
+    if (!queued_->HasBeenNotified()) queued_->Notify();
+    release_->WaitForNotification();
+  }
+
+ private:
+  absl::Notification* queued_;
+  absl::Notification* release_;
+};
+
+class TestConnectionManager : public GnpsiConnectionManager {
+ public:
+  using GnpsiConnectionManager::AddConnection;
+  using GnpsiConnectionManager::DropConnection;
+  using GnpsiConnectionManager::GnpsiConnectionManager;
+};
+
+TEST(GnpsiConnectionManagerTest, GetStatsDoesNotWaitForSender) {
+  grpc::ServerContext context;
+  absl::Notification queued, release;
+  auto connection =
+      std::make_shared<BlockingConnection>(&context, &queued, &release);
+  TestConnectionManager manager(/*client_max_number=*/1);
+  ASSERT_TRUE(manager.AddConnection(connection).ok());
+  connection->IncrementWriteErrorCount();
+
+  std::thread sender([&manager] { manager.SendSamplePacket("sample"); });
+  queued.WaitForNotification();
+  std::vector<GnpsiStats> stats = manager.GetStats();
+  release.Notify();
+  sender.join();
+
+  ASSERT_EQ(stats.size(), 1);
+  EXPECT_EQ(stats[0].collector_ip, "10.0.0.1");
+  EXPECT_EQ(stats[0].collector_port, 9000);
+  EXPECT_EQ(stats[0].error_count, 1);
+  manager.DropConnection(connection.get());
+  EXPECT_TRUE(manager.GetStats().empty());
+}
+
+TEST(GnpsiConnectionManagerTest, AddsAndDropsConnectionsWhileSending) {
+  grpc::ServerContext context;
+  absl::Notification queued, release;
+  auto connection =
+      std::make_shared<BlockingConnection>(&context, &queued, &release);
+  TestConnectionManager manager(/*client_max_number=*/2);
+  ASSERT_TRUE(manager.AddConnection(connection).ok());
+
+  std::thread sender([&manager] { manager.SendSamplePacket("sample"); });
+  queued.WaitForNotification();
+  FakeWriter writer;
+  auto other = std::make_shared<GnpsiConnection>(&context, &writer);
+  EXPECT_TRUE(manager.AddConnection(other).ok());
+  EXPECT_EQ(manager.GetStats().size(), 2);
+  manager.DropConnection(other.get());
+  // The sender keeps the connection it is sending to alive.
+  manager.DropConnection(connection.get());
+  EXPECT_TRUE(connection->IsStreamClosed());
+  EXPECT_TRUE(manager.GetStats().empty());
+  std::weak_ptr<BlockingConnection> dropped = connection;
+  connection.reset();
+  EXPECT_FALSE(dropped.expired());
+  release.Notify();
+  sender.join();
+  EXPECT_TRUE(dropped.expired());
+}
+
+TEST(GnpsiConnectionManagerTest, TimestampsSamplesWithReceiveTime) {
+  const absl::Time receive_time = absl::FromUnixNanos(1700000000123456789);
+  grpc::ServerContext context;
+  FakeWriter writer;
+  auto connection = std::make_shared<GnpsiConnection>(&context, &writer);
+  TestConnectionManager manager(/*client_max_number=*/1);
+  ASSERT_TRUE(manager.AddConnection(connection).ok());
+  auto pool = GnpsiBufferPool::Create(/*buffer_size=*/64,
+                                      /*max_free_buffers=*/1);
+  GnpsiPacketBuffer buffer = pool->Acquire();
+  memcpy(buffer.data(), "sample", 6);
+  buffer.set_size(6);
+  buffer.set_receive_time(receive_time);
+  manager.SendSamplePacket(std::move(buffer));
+
+  std::thread writer_thread([connection] { connection->WaitUntilClosed(); });
+  while (writer.packets().empty()) std::this_thread::yield();
+  connection->CloseStream();
+  writer_thread.join();
+  EXPECT_THAT(writer.packets(), ElementsAre("sample"));
+  EXPECT_THAT(writer.timestamps(),
+              ElementsAre(absl::ToUnixNanos(receive_time)));
+  manager.DropConnection(connection.get());
+}
+
+TEST(GnpsiConnectionManagerTest, FiltersSamplesPerConnection) {
+  grpc::ServerContext context;
+  FakeWriter writer, filtered_writer;
+  auto connection = std::make_shared<GnpsiConnection>(&context, &writer);
+  auto filtered_connection =
+      std::make_shared<GnpsiConnection>(&context, &filtered_writer);
+  Request request;
+  request.mutable_filter()->add_input_if_index(1);
+  ASSERT_TRUE(filtered_connection->Configure(request).ok());
+  TestConnectionManager manager(/*client_max_number=*/2);
+  ASSERT_TRUE(manager.AddConnection(connection).ok());
+  ASSERT_TRUE(manager.AddConnection(filtered_connection).ok());
+
+  const std::string matching = SFlowDatagramBuilder()
+                                   .AddFlowSample(1, 2, 100)
+                                   .AddFlowSample(3, 4, 100)
+                                   .Build();
+  const std::string other = SFlowDatagramBuilder()
+                                .AddFlowSample(3, 4, 100)
+                                .Build();
+  manager.SendSamplePacket(matching);
+  manager.SendSamplePacket(other);
+  manager.SendSamplePacket("not sFlow");
+
+  std::thread writer_thread([connection] { connection->WaitUntilClosed(); });
+  std::thread filtered_writer_thread(
+      [filtered_connection] { filtered_connection->WaitUntilClosed(); });
+  while (writer.packets().size() < 3 || filtered_writer.packets().size() < 2) {
+    std::this_thread::yield();
+  }
+  connection->CloseStream();
+  filtered_connection->CloseStream();
+  writer_thread.join();
+  filtered_writer_thread.join();
+  EXPECT_THAT(writer.packets(), ElementsAre(matching, other, "not sFlow"));
+  EXPECT_THAT(
+      filtered_writer.packets(),
+      ElementsAre(SFlowDatagramBuilder().AddFlowSample(1, 2, 100).Build(),
+                  "not sFlow"));
+  manager.DropConnection(connection.get());
+  manager.DropConnection(filtered_connection.get());
+}
+
+TEST(GnpsiConnectionManagerTest, SubsamplesSamplesOfSeveralSenders) {
+  constexpr int kSenderCount = 4;
+  constexpr int kPacketsPerSender = 1000;
+  grpc::ServerContext context;
+  FakeWriter writer;
+  auto connection = std::make_shared<GnpsiConnection>(
+      &context, &writer,
+      QueueOptions(kSenderCount * kPacketsPerSender,
+                   GnpsiOverflowPolicy::kDropNewest));
+  Request request;
+  request.set_subsampling(4);
+  ASSERT_TRUE(connection->Configure(request).ok());
+  TestConnectionManager manager(/*client_max_number=*/1);
+  ASSERT_TRUE(manager.AddConnection(connection).ok());
+
+  // Readers of a relay send samples at the same time, sharing the filter of
+  // the connection.
+  const std::string packet =
+      SFlowDatagramBuilder().AddFlowSample(1, 2, 100).Build();
+  std::vector<std::thread> senders;
+  for (int i = 0; i < kSenderCount; ++i) {
+    senders.emplace_back([&manager, &packet] {
+      for (int j = 0; j < kPacketsPerSender; ++j) {
+        manager.SendSamplePacket(packet);
+      }
+    });
+  }
+  for (std::thread& sender : senders) sender.join();
+  std::thread writer_thread([connection] { connection->WaitUntilClosed(); });
+  constexpr size_t kExpected = kSenderCount * kPacketsPerSender / 4;
+  const absl::Time deadline = absl::Now() + absl::Seconds(10);
+  while (writer.packets().size() < kExpected && absl::Now() < deadline) {
+    std::this_thread::yield();
+  }
+  // Leaves time for any samples beyond those expected to be written.
+  absl::SleepFor(absl::Milliseconds(50));
+  connection->CloseStream();
+  writer_thread.join();
+  manager.DropConnection(connection.get());
+  EXPECT_EQ(writer.packets().size(), kExpected);
+  EXPECT_EQ(connection->GetConnectionStats().dropped_count, 0);
+}
+
+TEST(GnpsiConnectionManagerTest, SummarizesSamplesOfAggregatingConnections) {
+  grpc::ServerContext context;
+  FakeWriter writer;
+  auto connection = std::make_shared<GnpsiConnection>(&context, &writer);
+  // The interval starts once the connection is configured.
+  const absl::Time start = absl::Now();
+  Request request;
+  request.mutable_aggregation()->set_interval_ns(
+      absl::ToInt64Nanoseconds(kMinAggregationInterval));
+  request.mutable_aggregation()->set_top_k(1);
+  request.mutable_filter()->add_input_if_index(1);
+  ASSERT_TRUE(connection->Configure(request).ok());
+  TestConnectionManager manager(/*client_max_number=*/1);
+  ASSERT_TRUE(manager.AddConnection(connection).ok());
+
+  const std::string src("\x0a\0\0\x01", 4);
+  const std::string dst("\x0a\0\0\x02", 4);
+  std::thread writer_thread([connection] { connection->WaitUntilClosed(); });
+  manager.SendSamplePacket(
+      SFlowDatagramBuilder()
+          .AddFlowSample(1, 2, /*sampling_rate=*/10,
+                         {SampledIpv4HeaderRecord(src, dst, 6, 1000, 443)})
+          .AddFlowSample(1, 2, /*sampling_rate=*/10,
+                         {SampledIpv4HeaderRecord(src, dst, 6, 1001, 443)})
+          .AddFlowSample(1, 2, /*sampling_rate=*/10,
+                         {SampledIpv4HeaderRecord(src, dst, 6, 1000, 443)})
+          .AddFlowSample(3, 4, /*sampling_rate=*/10,
+                         {SampledIpv4HeaderRecord(src, dst, 6, 1002, 443)})
+          .Build());
+  manager.SendSamplePacket("not sFlow");
+  while (writer.summaries().empty()) std::this_thread::yield();
+  connection->CloseStream();
+  writer_thread.join();
+  manager.DropConnection(connection.get());
+
+  // Samples are summarized rather than written, after the filter.
+  EXPECT_TRUE(writer.packets().empty());
+  const FlowSummary summary = writer.summaries().front();
+  EXPECT_GE(absl::Now() - start, kMinAggregationInterval);
+  EXPECT_EQ(summary.end_timestamp() - summary.start_timestamp(),
+            absl::ToInt64Nanoseconds(kMinAggregationInterval));
+  EXPECT_EQ(summary.sample_count(), 3);
+  EXPECT_EQ(summary.packet_count(), 30);
+  ASSERT_EQ(summary.flows_size(), 1);
+  EXPECT_EQ(summary.flows(0).src_port(), 1000);
+  EXPECT_EQ(summary.flows(0).packet_count(), 20);
+  EXPECT_EQ(summary.flows(0).byte_count(), 20000);
+  EXPECT_TRUE(writer.with_metadata().front());
+}
+
+TEST(GnpsiConnectionManagerTest, AttachesCongestionTelemetry) {
+  grpc::ServerContext context;
+  FakeWriter writer, filtered_writer;
+  auto connection = std::make_shared<GnpsiConnection>(&context, &writer);
+  auto filtered_connection =
+      std::make_shared<GnpsiConnection>(&context, &filtered_writer);
+  Request request;
+  request.mutable_filter()->add_input_if_index(1);
+  ASSERT_TRUE(filtered_connection->Configure(request).ok());
+  TestConnectionManager manager(/*client_max_number=*/2);
+  ASSERT_TRUE(manager.AddConnection(connection).ok());
+  ASSERT_TRUE(manager.AddConnection(filtered_connection).ok());
+
+  // The flow samples of the datagram have sequence numbers 1 and 2.
+  for (const auto& [ingress_port, sequence_number] :
+       std::vector<std::pair<int, int>>{{1, 1}, {3, 2}, {3, 3}}) {
+    CongestionTelemetry telemetry;
+    telemetry.set_ingress_port(ingress_port);
+    telemetry.set_sample_sequence_number(sequence_number);
+    manager.AddCongestionTelemetry(telemetry);
+  }
+  manager.SendSamplePacket(SFlowDatagramBuilder()
+                               .AddFlowSample(1, 2, 100)
+                               .AddFlowSample(3, 4, 100)
+                               .Build());
+  manager.SendSamplePacket(SFlowDatagramBuilder().AddCounterSample(3).Build());
+
+  std::thread writer_thread([connection] { connection->WaitUntilClosed(); });
+  std::thread filtered_writer_thread(
+      [filtered_connection] { filtered_connection->WaitUntilClosed(); });
+  while (writer.packets().size() < 2 || filtered_writer.packets().empty()) {
+    std::this_thread::yield();
+  }
+  connection->CloseStream();
+  filtered_connection->CloseStream();
+  writer_thread.join();
+  filtered_writer_thread.join();
+  EXPECT_THAT(writer.congestion_telemetry_sizes(), ElementsAre(2, 0));
+  // The filtered datagram only carries the telemetry of the sample it kept.
+  EXPECT_THAT(filtered_writer.congestion_telemetry_sizes(), ElementsAre(1));
+  manager.DropConnection(connection.get());
+  manager.DropConnection(filtered_connection.get());
+}
+
+TEST(GnpsiConnectionManagerTest, ResumesFromLastSequenceNumber) {
+  GnpsiReplayOptions replay_options;
+  replay_options.max_bytes = 1 << 20;
+  TestConnectionManager manager(/*client_max_number=*/1,
+                                GnpsiConnectionOptions(),
+                                /*serialize_samples=*/false,
+                                GnpsiCongestionCacheOptions(), replay_options);
+  manager.SendSamplePacket("first");
+  manager.SendSamplePacket("second");
+  manager.SendSamplePacket("third");
+
+  grpc::ServerContext context;
+  FakeWriter writer;
+  auto connection = std::make_shared<GnpsiConnection>(&context, &writer);
+  Request request;
+  request.set_last_sequence_number(1);
+  ASSERT_TRUE(connection->Configure(request).ok());
+  ASSERT_TRUE(manager.AddConnection(connection).ok());
+  EXPECT_TRUE(connection->replaying());
+  // Sent while the connection is replaying, so it is read from the ring.
+  manager.SendSamplePacket("fourth");
+
+  std::thread writer_thread([connection] { connection->WaitUntilClosed(); });
+  while (writer.packets().size() < 3) std::this_thread::yield();
+  EXPECT_FALSE(connection->replaying());
+  manager.SendSamplePacket("fifth");
+  while (writer.packets().size() < 4) std::this_thread::yield();
+  connection->CloseStream();
+  writer_thread.join();
+  EXPECT_THAT(writer.packets(), ElementsAre("second", "third", "fourth",
+                                            "fifth"));
+  EXPECT_THAT(writer.sequence_numbers(), ElementsAre(2, 3, 4, 5));
+  EXPECT_THAT(writer.with_metadata(), ElementsAre(true, false, false, false));
+  manager.DropConnection(connection.get());
+}
+
+TEST(GnpsiConnectionManagerTest, ResumesWithoutGapsWhileSamplesAreRelayed) {
+  GnpsiReplayOptions replay_options;
+  replay_options.max_bytes = 1 << 20;
+  TestConnectionManager manager(/*client_max_number=*/1,
+                                GnpsiConnectionOptions(),
+                                /*serialize_samples=*/false,
+                                GnpsiCongestionCacheOptions(), replay_options);
+  // Samples are numbered in the order this thread relays them.
+  std::atomic<uint64_t> relayed{0};
+  std::atomic<bool> stop{false};
+  std::thread sender([&] {
+    while (!stop.load()) {
+      manager.SendSamplePacket("sample");
+      relayed.fetch_add(1);
+      std::this_thread::yield();
+    }
+  });
+  while (relayed.load() < 100) std::this_thread::yield();
+
+  // Each connection switches over from replay to live samples while samples
+  // keep being relayed, and must see each one once.
+  for (int round = 0; round < 200; ++round) {
+    grpc::ServerContext context;
+    FakeWriter writer;
+    auto connection = std::make_shared<GnpsiConnection>(
+        &context, &writer,
+        QueueOptions(1 << 16, GnpsiOverflowPolicy::kDisconnect));
+    Request request;
+    const uint64_t last_sequence_number = relayed.load() - 50;
+    request.set_last_sequence_number(last_sequence_number);
+    ASSERT_TRUE(connection->Configure(request).ok());
+    ASSERT_TRUE(manager.AddConnection(connection).ok());
+    std::thread writer_thread([connection] { connection->WaitUntilClosed(); });
+    const absl::Time deadline = absl::Now() + absl::Seconds(10);
+    while ((connection->replaying() || writer.packets().size() < 200) &&
+           absl::Now() < deadline) {
+      std::this_thread::yield();
+    }
+    connection->CloseStream();
+    writer_thread.join();
+    manager.DropConnection(connection.get());
+
+    const std::vector<uint64_t> sequence_numbers = writer.sequence_numbers();
+    ASSERT_GE(sequence_numbers.size(), 200) << "round " << round;
+    for (size_t i = 0; i < sequence_numbers.size(); ++i) {
+      ASSERT_EQ(sequence_numbers[i], last_sequence_number + 1 + i)
+          << "round " << round;
+    }
+  }
+  stop.store(true);
+  sender.join();
+}
+
+TEST(GnpsiConnectionManagerTest, FiltersReplayedSamples) {
+  GnpsiReplayOptions replay_options;
+  replay_options.max_bytes = 1 << 20;
+  TestConnectionManager manager(/*client_max_number=*/1,
+                                GnpsiConnectionOptions(),
+                                /*serialize_samples=*/false,
+                                GnpsiCongestionCacheOptions(), replay_options);
+  manager.SendSamplePacket("first");
+  manager.SendSamplePacket(SFlowDatagramBuilder()
+                               .AddFlowSample(1, 2, 100)
+                               .AddFlowSample(3, 4, 100)
+                               .Build());
+  manager.SendSamplePacket(
+      SFlowDatagramBuilder().AddFlowSample(3, 4, 100).Build());
+  manager.SendSamplePacket("not sFlow");
+
+  grpc::ServerContext context;
+  FakeWriter writer;
+  auto connection = std::make_shared<GnpsiConnection>(&context, &writer);
+  Request request;
+  request.set_last_sequence_number(1);
+  request.mutable_filter()->add_input_if_index(1);
+  ASSERT_TRUE(connection->Configure(request).ok());
+  ASSERT_TRUE(manager.AddConnection(connection).ok());
+
+  std::thread writer_thread([connection] { connection->WaitUntilClosed(); });
+  while (writer.packets().size() < 2) std::this_thread::yield();
+  connection->CloseStream();
+  writer_thread.join();
+  EXPECT_THAT(
+      writer.packets(),
+      ElementsAre(SFlowDatagramBuilder().AddFlowSample(1, 2, 100).Build(),
+                  "not sFlow"));
+  // The datagram filtered out leaves a gap in the sequence numbers.
+  EXPECT_THAT(writer.sequence_numbers(), ElementsAre(2, 4));
+  manager.DropConnection(connection.get());
+}
+
+TEST(GnpsiConnectionManagerTest, ResumesFromSpool) {
+  GnpsiReplayOptions replay_options;
+  // Only the last two samples are held in memory.
+  replay_options.max_bytes = 10;
+  replay_options.spool.directory =
+      absl::StrCat(::testing::TempDir(), "/resume_spool");
+  replay_options.spool.segment_bytes = GnpsiSpool::kMinSegmentBytes;
+  replay_options.spool.max_bytes = GnpsiSpool::kMinSegmentBytes;
+  TestConnectionManager manager(/*client_max_number=*/1,
+                                GnpsiConnectionOptions(),
+                                /*serialize_samples=*/false,
+                                GnpsiCongestionCacheOptions(), replay_options);
+  for (const char* packet : {"one", "two", "three", "four", "five"}) {
+    manager.SendSamplePacket(packet);
+  }
+
+  grpc::ServerContext context;
+  FakeWriter writer;
+  auto connection = std::make_shared<GnpsiConnection>(&context, &writer);
+  Request request;
+  request.set_last_sequence_number(1);
+  ASSERT_TRUE(connection->Configure(request).ok());
+  ASSERT_TRUE(manager.AddConnection(connection).ok());
+
+  std::thread writer_thread([connection] { connection->WaitUntilClosed(); });
+  while (writer.packets().size() < 4) std::this_thread::yield();
+  connection->CloseStream();
+  writer_thread.join();
+  EXPECT_THAT(writer.packets(), ElementsAre("two", "three", "four", "five"));
+  EXPECT_THAT(writer.sequence_numbers(), ElementsAre(2, 3, 4, 5));
+  manager.DropConnection(connection.get());
+}
+
+TEST(GnpsiConnectionManagerTest, SendsOnlyLiveSamplesWithoutReplay) {
+  TestConnectionManager manager(/*client_max_number=*/1);
+  manager.SendSamplePacket("missed");
+
+  grpc::ServerContext context;
+  FakeWriter writer;
+  auto connection = std::make_shared<GnpsiConnection>(&context, &writer);
+  Request request;
+  request.set_last_sequence_number(1);
+  ASSERT_TRUE(connection->Configure(request).ok());
+  ASSERT_TRUE(manager.AddConnection(connection).ok());
+  EXPECT_FALSE(connection->replaying());
+  manager.SendSamplePacket("live");
+
+  std::thread writer_thread([connection] { connection->WaitUntilClosed(); });
+  while (writer.packets().empty()) std::this_thread::yield();
+  connection->CloseStream();
+  writer_thread.join();
+  EXPECT_THAT(writer.packets(), ElementsAre("live"));
+  EXPECT_THAT(writer.sequence_numbers(), ElementsAre(0));
+  manager.DropConnection(connection.get());
+}
+
+TEST(GnpsiConnectionManagerTest, RecordsHistograms) {
+  grpc::ServerContext context;
+  absl::Notification queued, release;
+  release.Notify();
+  auto connection =
+      std::make_shared<BlockingConnection>(&context, &queued, &release);
+  TestConnectionManager manager(/*client_max_number=*/1);
+  ASSERT_TRUE(manager.AddConnection(connection).ok());
+  manager.SendSamplePacket("first");
+  manager.SendSamplePacket("second");
+
+  GnpsiHistograms histograms = manager.GetHistograms();
+  int64_t ingested = 0;
+  for (const Bucket& bucket : histograms.ingest_to_enqueue_ns.data()) {
+    ingested += bucket.num_entries();
+  }
+  EXPECT_EQ(ingested, 2);
+  ASSERT_EQ(histograms.connections.size(), 1);
+  const GnpsiConnectionHistograms& connection_histograms =
+      histograms.connections[0];
+  EXPECT_EQ(connection_histograms.collector_ip, "10.0.0.1");
+  // The samples are not written, so the queue grows to two samples.
+  ASSERT_EQ(connection_histograms.queue_depth.data_size(), 2);
+  EXPECT_EQ(connection_histograms.queue_depth.data(0).inclusive_start(), 1);
+  EXPECT_EQ(connection_histograms.queue_depth.data(1).inclusive_start(), 2);
+  EXPECT_EQ(connection_histograms.write_duration_ns.data_size(), 0);
+  manager.DropConnection(connection.get());
+}
+}  // namespace
+}  // namespace gnpsi
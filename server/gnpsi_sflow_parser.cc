@@ -0,0 +1,362 @@
+#include "server/gnpsi_sflow_parser.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+
+namespace gnpsi {
+namespace {
+constexpr uint32_t kSFlowVersion5 = 5;
+constexpr uint32_t kAddressTypeIpV4 = 1;
+constexpr uint32_t kAddressTypeIpV6 = 2;
+
+// Sample formats of the standard (zero) enterprise.
+constexpr uint32_t kFlowSample = 1;
+constexpr uint32_t kCounterSample = 2;
+constexpr uint32_t kExpandedFlowSample = 3;
+constexpr uint32_t kExpandedCounterSample = 4;
+
+// Size of the format and length preceding the data of a sample.
+constexpr size_t kSampleHeaderSize = 8;
+// Minimum data size of each sample format, up to its number of records.
+constexpr size_t kFlowSampleSize = 32;
+constexpr size_t kCounterSampleSize = 12;
+constexpr size_t kExpandedFlowSampleSize = 44;
+constexpr size_t kExpandedCounterSampleSize = 16;
+
+// Flow record formats of the standard enterprise.
+constexpr uint32_t kSampledHeader = 1;
+constexpr uint32_t kSampledIpv4 = 3;
+constexpr uint32_t kSampledIpv6 = 4;
+// Minimum data size of the flow record formats.
+constexpr size_t kSampledHeaderSize = 16;
+constexpr size_t kSampledIpv4Size = 24;
+constexpr size_t kSampledIpv6Size = 48;
+
+// Header protocols of a sampled header record.
+constexpr uint32_t kHeaderEthernet = 1;
+constexpr uint32_t kHeaderIpv4 = 11;
+constexpr uint32_t kHeaderIpv6 = 12;
+
+constexpr uint16_t kEtherTypeIpv4 = 0x0800;
+constexpr uint16_t kEtherTypeIpv6 = 0x86dd;
+constexpr uint16_t kEtherTypeVlan = 0x8100;
+constexpr uint16_t kEtherTypeQinQ = 0x88a8;
+
+constexpr uint8_t kProtocolTcp = 6;
+constexpr uint8_t kProtocolUdp = 17;
+constexpr uint8_t kProtocolSctp = 132;
+
+// Source id type of an ifIndex data source.
+constexpr uint32_t kIfIndexSource = 0;
+
+// Returns the ifIndex of a data source, if it is one. ifIndex 0 is unknown.
+std::optional<uint32_t> IfIndexSource(uint32_t type, uint32_t index) {
+  if (type != kIfIndexSource || index == 0) return std::nullopt;
+  return index;
+}
+
+// Returns the ifIndex of a single interface in the compact encoding of the
+// input or output of a flow sample, where the top two bits are the format.
+std::optional<uint32_t> CompactInterface(uint32_t interface) {
+  return IfIndexSource(interface >> 30, interface & 0x3fffffff);
+}
+
+// Reads the big-endian 16-bit integer at `data`.
+uint16_t ReadUint16(const char* data) {
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+  return (uint16_t{bytes[0]} << 8) | uint16_t{bytes[1]};
+}
+
+// Reads the ports of a `protocol` packet with the transport header at the
+// start of `transport` into `flow`, if it has them.
+void ReadPorts(uint8_t protocol, absl::string_view transport, SFlowFlow* flow) {
+  flow->protocol = protocol;
+  if ((protocol != kProtocolTcp && protocol != kProtocolUdp &&
+       protocol != kProtocolSctp) ||
+      transport.size() < 4) {
+    return;
+  }
+  flow->src_port = ReadUint16(transport.data());
+  flow->dst_port = ReadUint16(transport.data() + 2);
+}
+
+// Reads the flow of the IPv4 packet `packet` into `flow`. Returns false if it
+// is truncated before its addresses.
+bool ReadIpv4Flow(absl::string_view packet, SFlowFlow* flow) {
+  if (packet.size() < 20 || (packet[0] >> 4) != 4) return false;
+  const size_t header_size = (packet[0] & 0xf) * 4;
+  flow->src_address = packet.substr(12, 4);
+  flow->dst_address = packet.substr(16, 4);
+  // Only the first fragment carries the transport header.
+  const bool first_fragment = (ReadUint16(packet.data() + 6) & 0x1fff) == 0;
+  ReadPorts(packet[9],
+            first_fragment && header_size >= 20 && header_size <= packet.size()
+                ? packet.substr(header_size)
+                : absl::string_view(),
+            flow);
+  return true;
+}
+
+// Reads the flow of the IPv6 packet `packet` into `flow`. Returns false if it
+// is truncated before its addresses. Ports are only read if no extension
+// header precedes the transport header.
+bool ReadIpv6Flow(absl::string_view packet, SFlowFlow* flow) {
+  if (packet.size() < 40 || (packet[0] >> 4 & 0xf) != 6) return false;
+  flow->src_address = packet.substr(8, 16);
+  flow->dst_address = packet.substr(24, 16);
+  ReadPorts(packet[6], packet.substr(40), flow);
+  return true;
+}
+
+// Reads the flow of the Ethernet frame `frame` into `flow`, skipping up to two
+// VLAN tags. Returns false if it is not an IPv4 or IPv6 packet.
+bool ReadEthernetFlow(absl::string_view frame, SFlowFlow* flow) {
+  size_t offset = 12;
+  for (int tags = 0; tags <= 2; ++tags) {
+    if (frame.size() < offset + 2) return false;
+    const uint16_t ether_type = ReadUint16(frame.data() + offset);
+    if (ether_type == kEtherTypeIpv4) {
+      return ReadIpv4Flow(frame.substr(offset + 2), flow);
+    }
+    if (ether_type == kEtherTypeIpv6) {
+      return ReadIpv6Flow(frame.substr(offset + 2), flow);
+    }
+    if (ether_type != kEtherTypeVlan && ether_type != kEtherTypeQinQ) break;
+    offset += 4;
+  }
+  return false;
+}
+
+// Reads the flow of the flow record of `format` with `data` into `flow`.
+// Returns false if it is not a record the flow can be read from.
+bool ReadFlowRecord(uint32_t format, absl::string_view data, SFlowFlow* flow) {
+  switch (format) {
+    case kSampledHeader: {
+      if (data.size() < kSampledHeaderSize) return false;
+      const uint32_t header_protocol = ReadXdrUint32(data.data());
+      const uint32_t header_size = ReadXdrUint32(data.data() + 12);
+      if (header_size > data.size() - kSampledHeaderSize) return false;
+      const absl::string_view header =
+          data.substr(kSampledHeaderSize, header_size);
+      flow->frame_length = ReadXdrUint32(data.data() + 4);
+      switch (header_protocol) {
+        case kHeaderEthernet:
+          return ReadEthernetFlow(header, flow);
+        case kHeaderIpv4:
+          return ReadIpv4Flow(header, flow);
+        case kHeaderIpv6:
+          return ReadIpv6Flow(header, flow);
+        default:
+          return false;
+      }
+    }
+    case kSampledIpv4:
+    case kSampledIpv6: {
+      const size_t address_size = format == kSampledIpv4 ? 4 : 16;
+      if (data.size() <
+          (format == kSampledIpv4 ? kSampledIpv4Size : kSampledIpv6Size)) {
+        return false;
+      }
+      flow->frame_length = ReadXdrUint32(data.data());
+      flow->protocol = ReadXdrUint32(data.data() + 4);
+      flow->src_address = data.substr(8, address_size);
+      flow->dst_address = data.substr(8 + address_size, address_size);
+      const char* ports = data.data() + 8 + 2 * address_size;
+      flow->src_port = ReadXdrUint32(ports);
+      flow->dst_port = ReadXdrUint32(ports + 4);
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// Reads consecutive XDR integers from a bounds-checked view.
+class XdrReader {
+ public:
+  explicit XdrReader(absl::string_view data) : data_(data) {}
+
+  bool ReadUint32(uint32_t* value) {
+    if (data_.size() < 4) return false;
+    *value = ReadXdrUint32(data_.data());
+    data_.remove_prefix(4);
+    return true;
+  }
+
+  bool ReadBytes(size_t size, absl::string_view* bytes) {
+    if (data_.size() < size) return false;
+    *bytes = data_.substr(0, size);
+    data_.remove_prefix(size);
+    return true;
+  }
+
+  absl::string_view remaining() const { return data_; }
+
+ private:
+  absl::string_view data_;
+};
+}  // namespace
+
+bool ReadSFlowDatagramHeader(absl::string_view packet,
+                             SFlowDatagramHeader* header) {
+  // Version, address type, and an IPv4 address or the start of an IPv6 one.
+  if (packet.size() < 12 || ReadXdrUint32(packet.data()) != kSFlowVersion5) {
+    return false;
+  }
+  const uint32_t address_type = ReadXdrUint32(packet.data() + 4);
+  size_t address_size;
+  if (address_type == kAddressTypeIpV4) {
+    address_size = 4;
+  } else if (address_type == kAddressTypeIpV6) {
+    address_size = 16;
+  } else {
+    return false;
+  }
+  // The address is followed by the sub-agent id, sequence number and uptime.
+  if (packet.size() < 8 + address_size + 12) return false;
+  const char* fields = packet.data() + 8 + address_size;
+  header->agent_address = packet.substr(8, address_size);
+  header->sub_agent_id = ReadXdrUint32(fields);
+  header->sequence_number = ReadXdrUint32(fields + 4);
+  header->uptime = ReadXdrUint32(fields + 8);
+  return true;
+}
+
+uint32_t SFlowSample::sampling_rate() const {
+  if (type_ != SFlowSampleType::kFlow) return 0;
+  return ReadXdrUint32(encoding_.data() + sampling_rate_offset_);
+}
+
+bool SFlowSample::ReadFlow(SFlowFlow* flow) const {
+  XdrReader reader(records_);
+  for (uint32_t i = 0; i < num_records_; ++i) {
+    uint32_t format, length;
+    absl::string_view data;
+    if (!reader.ReadUint32(&format) || !reader.ReadUint32(&length) ||
+        !reader.ReadBytes(length, &data)) {
+      return false;
+    }
+    *flow = SFlowFlow();
+    if (ReadFlowRecord(format, data, flow)) return true;
+  }
+  return false;
+}
+
+absl::StatusOr<SFlowDatagram> SFlowDatagram::Parse(absl::string_view packet) {
+  XdrReader reader(packet);
+  uint32_t version, address_type;
+  if (!reader.ReadUint32(&version) || version != kSFlowVersion5) {
+    return absl::InvalidArgumentError("Not an sFlow v5 datagram.");
+  }
+  if (!reader.ReadUint32(&address_type)) {
+    return absl::InvalidArgumentError("Truncated sFlow datagram header.");
+  }
+  SFlowDatagram datagram;
+  size_t address_size = 0;
+  if (address_type == kAddressTypeIpV4) {
+    address_size = 4;
+  } else if (address_type == kAddressTypeIpV6) {
+    address_size = 16;
+  } else {
+    return absl::InvalidArgumentError("Unknown sFlow agent address type.");
+  }
+  uint32_t sub_agent_id, uptime;
+  if (!reader.ReadBytes(address_size, &datagram.agent_address_) ||
+      !reader.ReadUint32(&sub_agent_id) ||
+      !reader.ReadUint32(&datagram.sequence_number_) ||
+      !reader.ReadUint32(&uptime)) {
+    return absl::InvalidArgumentError("Truncated sFlow datagram header.");
+  }
+  datagram.header_ =
+      packet.substr(0, packet.size() - reader.remaining().size());
+  if (!reader.ReadUint32(&datagram.num_samples_)) {
+    return absl::InvalidArgumentError("Truncated sFlow datagram header.");
+  }
+  // All samples are checked up front, so reading them later cannot fail.
+  absl::string_view samples = reader.remaining();
+  absl::string_view unread = samples;
+  for (uint32_t i = 0; i < datagram.num_samples_; ++i) {
+    SFlowSample sample;
+    if (!ReadSample(&unread, &sample)) {
+      return absl::InvalidArgumentError("Malformed sFlow sample.");
+    }
+  }
+  datagram.unread_samples_ = samples.substr(0, samples.size() - unread.size());
+  return datagram;
+}
+
+bool SFlowDatagram::NextSample(SFlowSample* sample) {
+  if (unread_samples_.empty()) return false;
+  return ReadSample(&unread_samples_, sample);
+}
+
+bool SFlowDatagram::ReadSample(absl::string_view* samples,
+                               SFlowSample* sample) {
+  XdrReader reader(*samples);
+  uint32_t format, length;
+  absl::string_view data;
+  if (!reader.ReadUint32(&format) || !reader.ReadUint32(&length) ||
+      !reader.ReadBytes(length, &data)) {
+    return false;
+  }
+  *sample = SFlowSample();
+  sample->encoding_ = samples->substr(0, kSampleHeaderSize + length);
+  samples->remove_prefix(kSampleHeaderSize + length);
+  switch (format) {
+    case kFlowSample: {
+      if (data.size() < kFlowSampleSize) return false;
+      sample->type_ = SFlowSampleType::kFlow;
+      uint32_t source_id = ReadXdrUint32(data.data() + 4);
+      sample->source_if_index_ =
+          IfIndexSource(source_id >> 24, source_id & 0xffffff);
+      sample->sampling_rate_offset_ = kSampleHeaderSize + 8;
+      sample->input_if_index_ =
+          CompactInterface(ReadXdrUint32(data.data() + 20));
+      sample->output_if_index_ =
+          CompactInterface(ReadXdrUint32(data.data() + 24));
+      sample->num_records_ = ReadXdrUint32(data.data() + 28);
+      sample->records_ = data.substr(kFlowSampleSize);
+      break;
+    }
+    case kExpandedFlowSample:
+      if (data.size() < kExpandedFlowSampleSize) return false;
+      sample->type_ = SFlowSampleType::kFlow;
+      sample->source_if_index_ = IfIndexSource(
+          ReadXdrUint32(data.data() + 4), ReadXdrUint32(data.data() + 8));
+      sample->sampling_rate_offset_ = kSampleHeaderSize + 12;
+      sample->input_if_index_ = IfIndexSource(
+          ReadXdrUint32(data.data() + 24), ReadXdrUint32(data.data() + 28));
+      sample->output_if_index_ = IfIndexSource(
+          ReadXdrUint32(data.data() + 32), ReadXdrUint32(data.data() + 36));
+      sample->num_records_ = ReadXdrUint32(data.data() + 40);
+      sample->records_ = data.substr(kExpandedFlowSampleSize);
+      break;
+    case kCounterSample: {
+      if (data.size() < kCounterSampleSize) return false;
+      sample->type_ = SFlowSampleType::kCounter;
+      uint32_t source_id = ReadXdrUint32(data.data() + 4);
+      sample->source_if_index_ =
+          IfIndexSource(source_id >> 24, source_id & 0xffffff);
+      break;
+    }
+    case kExpandedCounterSample:
+      if (data.size() < kExpandedCounterSampleSize) return false;
+      sample->type_ = SFlowSampleType::kCounter;
+      sample->source_if_index_ = IfIndexSource(
+          ReadXdrUint32(data.data() + 4), ReadXdrUint32(data.data() + 8));
+      break;
+    default:
+      // Samples of other formats or enterprises are carried along opaquely.
+      return true;
+  }
+  // All standard samples start with their sequence number.
+  sample->sequence_number_ = ReadXdrUint32(data.data());
+  return true;
+}
+
+}  // namespace gnpsi
@@ -0,0 +1,152 @@
+#ifndef OPENCONFIG_GNPSI_SERVER_GNPSI_SFLOW_PARSER_H_
+#define OPENCONFIG_GNPSI_SERVER_GNPSI_SFLOW_PARSER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+
+namespace gnpsi {
+
+// Reads the big-endian (XDR) 32-bit integer at `data`.
+inline uint32_t ReadXdrUint32(const char* data) {
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+  return (uint32_t{bytes[0]} << 24) | (uint32_t{bytes[1]} << 16) |
+         (uint32_t{bytes[2]} << 8) | uint32_t{bytes[3]};
+}
+
+// Writes `value` as a big-endian (XDR) 32-bit integer at `data`.
+inline void WriteXdrUint32(uint32_t value, char* data) {
+  data[0] = static_cast<char>(value >> 24);
+  data[1] = static_cast<char>(value >> 16);
+  data[2] = static_cast<char>(value >> 8);
+  data[3] = static_cast<char>(value);
+}
+
+// The header of an sFlow v5 datagram, which identifies its exporter and its
+// place in the sequence of datagrams of the exporter. It references the
+// datagram it was read from.
+struct SFlowDatagramHeader {
+  // 4 bytes for IPv4, 16 for IPv6.
+  absl::string_view agent_address;
+  uint32_t sub_agent_id = 0;
+  // Incremented by the exporter for each datagram it sends.
+  uint32_t sequence_number = 0;
+  // Milliseconds since the exporter started.
+  uint32_t uptime = 0;
+};
+
+// Reads the header of the sFlow v5 datagram in `packet` into `header` at a
+// fixed cost, without checking the samples. Returns false if `packet` does not
+// start with one.
+bool ReadSFlowDatagramHeader(absl::string_view packet,
+                             SFlowDatagramHeader* header);
+
+enum class SFlowSampleType { kFlow, kCounter, kOther };
+
+// The flow of the packet a flow sample was taken from. It references the
+// datagram it was read from.
+struct SFlowFlow {
+  // 4 bytes for IPv4, 16 for IPv6.
+  absl::string_view src_address;
+  absl::string_view dst_address;
+  // IP protocol number, and the ports of TCP, UDP and SCTP packets.
+  uint8_t protocol = 0;
+  uint16_t src_port = 0;
+  uint16_t dst_port = 0;
+  // Length of the sampled packet in bytes.
+  uint32_t frame_length = 0;
+};
+
+// A sample of an sFlow v5 datagram. It references the datagram it was read
+// from, which has to outlive it.
+class SFlowSample {
+ public:
+  SFlowSample() = default;
+
+  SFlowSampleType type() const { return type_; }
+
+  // The whole encoding of the sample, including its format and length.
+  absl::string_view encoding() const { return encoding_; }
+
+  // Sequence number of a flow or counter sample, incremented by its data
+  // source for each sample it takes.
+  uint32_t sequence_number() const { return sequence_number_; }
+
+  // ifIndex of the sampled data source: the interface a counter sample was
+  // taken on, or the one a flow sample was sampled on.
+  std::optional<uint32_t> source_if_index() const { return source_if_index_; }
+
+  // ifIndex a flow sample was received on or sent out of, if it was a single
+  // interface.
+  std::optional<uint32_t> input_if_index() const { return input_if_index_; }
+  std::optional<uint32_t> output_if_index() const { return output_if_index_; }
+
+  // Sampling rate of a flow sample, and its offset in encoding().
+  uint32_t sampling_rate() const;
+  size_t sampling_rate_offset() const { return sampling_rate_offset_; }
+
+  // Reads the flow of a flow sample into `flow`, from the first of its
+  // records that is a sampled header of an Ethernet, IPv4 or IPv6 packet, or
+  // a sampled IPv4 or IPv6 record. Returns false if it has none that can be
+  // decoded. Does not allocate.
+  bool ReadFlow(SFlowFlow* flow) const;
+
+ private:
+  friend class SFlowDatagram;
+
+  SFlowSampleType type_ = SFlowSampleType::kOther;
+  absl::string_view encoding_;
+  uint32_t sequence_number_ = 0;
+  std::optional<uint32_t> source_if_index_;
+  std::optional<uint32_t> input_if_index_;
+  std::optional<uint32_t> output_if_index_;
+  size_t sampling_rate_offset_ = 0;
+  // Flow records of a flow sample, which are only checked by ReadFlow.
+  uint32_t num_records_ = 0;
+  absl::string_view records_;
+};
+
+// A bounds-checked view of an sFlow v5 datagram, as specified in
+// https://sflow.org/sflow_version_5.txt. Parsing and reading samples do not
+// allocate: everything references the datagram, which has to outlive this
+// object.
+class SFlowDatagram {
+ public:
+  // Returns the datagram in `packet`, or an error if `packet` is not a
+  // well-formed sFlow v5 datagram.
+  static absl::StatusOr<SFlowDatagram> Parse(absl::string_view packet);
+
+  // Agent address of the datagram: 4 bytes for IPv4, 16 for IPv6.
+  absl::string_view agent_address() const { return agent_address_; }
+  uint32_t sequence_number() const { return sequence_number_; }
+  uint32_t num_samples() const { return num_samples_; }
+
+  // Encoding of the datagram header, up to the number of samples. A datagram
+  // is this header, the number of samples and the samples.
+  absl::string_view header() const { return header_; }
+
+  // Reads the next sample of the datagram into `sample`. Returns false once
+  // all samples have been read.
+  bool NextSample(SFlowSample* sample);
+
+ private:
+  SFlowDatagram() = default;
+
+  // Reads the sample at the start of `samples` into `sample` and advances
+  // `samples` past it. Returns false if the sample is malformed.
+  static bool ReadSample(absl::string_view* samples, SFlowSample* sample);
+
+  absl::string_view agent_address_;
+  uint32_t sequence_number_ = 0;
+  uint32_t num_samples_ = 0;
+  absl::string_view header_;
+  // Samples not read by NextSample yet.
+  absl::string_view unread_samples_;
+};
+
+}  // namespace gnpsi
+
+#endif  // OPENCONFIG_GNPSI_SERVER_GNPSI_SFLOW_PARSER_H_
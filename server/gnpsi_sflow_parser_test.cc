@@ -0,0 +1,209 @@
+#include "server/gnpsi_sflow_parser.h"
+
+#include <string>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "gtest/gtest.h"
+#include "server/gnpsi_sflow_test_util.h"
+
+namespace gnpsi {
+namespace {
+
+TEST(SFlowDatagramTest, ParsesHeader) {
+  std::string packet = SFlowDatagramBuilder().AddCounterSample(3).Build();
+  absl::StatusOr<SFlowDatagram> datagram = SFlowDatagram::Parse(packet);
+  ASSERT_TRUE(datagram.ok()) << datagram.status();
+  EXPECT_EQ(datagram->agent_address(), TestAgentAddress());
+  EXPECT_EQ(datagram->sequence_number(), 42);
+  EXPECT_EQ(datagram->num_samples(), 1);
+  // The header is followed by the number of samples.
+  EXPECT_EQ(datagram->header().size(), 24);
+}
+
+TEST(SFlowDatagramTest, ParsesIpv6AgentAddress) {
+  const std::string agent_address(16, '\x20');
+  std::string packet = SFlowDatagramBuilder(agent_address).Build();
+  absl::StatusOr<SFlowDatagram> datagram = SFlowDatagram::Parse(packet);
+  ASSERT_TRUE(datagram.ok()) << datagram.status();
+  EXPECT_EQ(datagram->agent_address(), agent_address);
+  EXPECT_EQ(datagram->num_samples(), 0);
+}
+
+TEST(SFlowDatagramTest, ReadsHeaderWithoutSamples) {
+  std::string packet = SFlowDatagramBuilder()
+                           .set_sub_agent_id(3)
+                           .set_sequence_number(7)
+                           .set_uptime(1000)
+                           .AddCounterSample(3)
+                           .Build();
+  // The samples are not read, so a truncated one makes no difference.
+  packet.resize(packet.size() - 4);
+  SFlowDatagramHeader header;
+  ASSERT_TRUE(ReadSFlowDatagramHeader(packet, &header));
+  EXPECT_EQ(header.agent_address, TestAgentAddress());
+  EXPECT_EQ(header.sub_agent_id, 3);
+  EXPECT_EQ(header.sequence_number, 7);
+  EXPECT_EQ(header.uptime, 1000);
+
+  const std::string agent_address(16, '\x20');
+  const std::string ipv6_packet = SFlowDatagramBuilder(agent_address).Build();
+  ASSERT_TRUE(ReadSFlowDatagramHeader(ipv6_packet, &header));
+  EXPECT_EQ(header.agent_address, agent_address);
+
+  EXPECT_FALSE(ReadSFlowDatagramHeader(packet.substr(0, 23), &header));
+  packet[3] = 4;
+  EXPECT_FALSE(ReadSFlowDatagramHeader(packet, &header));
+}
+
+TEST(SFlowDatagramTest, ReadsSamples) {
+  std::string packet = SFlowDatagramBuilder()
+                           .AddFlowSample(/*input_if_index=*/1,
+                                          /*output_if_index=*/2,
+                                          /*sampling_rate=*/100)
+                           .AddExpandedFlowSample(/*input_if_index=*/3,
+                                                  /*output_if_index=*/4,
+                                                  /*sampling_rate=*/200)
+                           .AddCounterSample(/*if_index=*/5)
+                           .AddSample(/*format=*/(1 << 12) | 1, "opaque..")
+                           .Build();
+  absl::StatusOr<SFlowDatagram> datagram = SFlowDatagram::Parse(packet);
+  ASSERT_TRUE(datagram.ok()) << datagram.status();
+  SFlowSample sample;
+
+  ASSERT_TRUE(datagram->NextSample(&sample));
+  EXPECT_EQ(sample.type(), SFlowSampleType::kFlow);
+  EXPECT_EQ(sample.sequence_number(), 1);
+  EXPECT_EQ(sample.source_if_index(), 1);
+  EXPECT_EQ(sample.input_if_index(), 1);
+  EXPECT_EQ(sample.output_if_index(), 2);
+  EXPECT_EQ(sample.sampling_rate(), 100);
+  EXPECT_EQ(sample.encoding().size(), 40);
+
+  ASSERT_TRUE(datagram->NextSample(&sample));
+  EXPECT_EQ(sample.type(), SFlowSampleType::kFlow);
+  EXPECT_EQ(sample.source_if_index(), 3);
+  EXPECT_EQ(sample.input_if_index(), 3);
+  EXPECT_EQ(sample.output_if_index(), 4);
+  EXPECT_EQ(sample.sampling_rate(), 200);
+
+  ASSERT_TRUE(datagram->NextSample(&sample));
+  EXPECT_EQ(sample.type(), SFlowSampleType::kCounter);
+  EXPECT_EQ(sample.sequence_number(), 3);
+  EXPECT_EQ(sample.source_if_index(), 5);
+  EXPECT_EQ(sample.input_if_index(), std::nullopt);
+
+  // Samples of other enterprises are opaque.
+  ASSERT_TRUE(datagram->NextSample(&sample));
+  EXPECT_EQ(sample.type(), SFlowSampleType::kOther);
+  EXPECT_EQ(sample.encoding().substr(8), "opaque..");
+
+  EXPECT_FALSE(datagram->NextSample(&sample));
+}
+
+TEST(SFlowDatagramTest, ReadsFlowsOfFlowSamples) {
+  const std::string src("\x0a\x01\x02\x03", 4);
+  const std::string dst("\x0a\x04\x05\x06", 4);
+  const std::string src6("\x20\x01\x0d\xb8\0\0\0\0\0\0\0\0\0\0\0\x01", 16);
+  const std::string dst6("\x20\x01\x0d\xb8\0\0\0\0\0\0\0\0\0\0\0\x02", 16);
+  std::string packet =
+      SFlowDatagramBuilder()
+          .AddFlowSample(1, 2, 100,
+                         {SampledIpv4HeaderRecord(src, dst, /*protocol=*/6,
+                                                  /*src_port=*/1234,
+                                                  /*dst_port=*/443,
+                                                  /*frame_length=*/1500)})
+          .AddExpandedFlowSample(
+              3, 4, 200,
+              {SampledIpv6Record(src6, dst6, /*protocol=*/17,
+                                 /*src_port=*/53, /*dst_port=*/5353,
+                                 /*length=*/80)})
+          .AddFlowSample(5, 6, 300)
+          .Build();
+  absl::StatusOr<SFlowDatagram> datagram = SFlowDatagram::Parse(packet);
+  ASSERT_TRUE(datagram.ok()) << datagram.status();
+  SFlowSample sample;
+  SFlowFlow flow;
+
+  ASSERT_TRUE(datagram->NextSample(&sample));
+  ASSERT_TRUE(sample.ReadFlow(&flow));
+  EXPECT_EQ(flow.src_address, src);
+  EXPECT_EQ(flow.dst_address, dst);
+  EXPECT_EQ(flow.protocol, 6);
+  EXPECT_EQ(flow.src_port, 1234);
+  EXPECT_EQ(flow.dst_port, 443);
+  EXPECT_EQ(flow.frame_length, 1500);
+
+  ASSERT_TRUE(datagram->NextSample(&sample));
+  ASSERT_TRUE(sample.ReadFlow(&flow));
+  EXPECT_EQ(flow.src_address, src6);
+  EXPECT_EQ(flow.dst_address, dst6);
+  EXPECT_EQ(flow.protocol, 17);
+  EXPECT_EQ(flow.src_port, 53);
+  EXPECT_EQ(flow.dst_port, 5353);
+  EXPECT_EQ(flow.frame_length, 80);
+
+  // A flow sample without records has no flow.
+  ASSERT_TRUE(datagram->NextSample(&sample));
+  EXPECT_FALSE(sample.ReadFlow(&flow));
+}
+
+TEST(SFlowDatagramTest, DoesNotReadFlowsOfTruncatedHeaders) {
+  std::string record = SampledIpv4HeaderRecord(
+      std::string(4, '\x01'), std::string(4, '\x02'), 6, 1, 2);
+  // The header length, which the record has to hold.
+  record[23] = static_cast<char>(record.size());
+  std::string packet =
+      SFlowDatagramBuilder().AddFlowSample(1, 2, 100, {record}).Build();
+  absl::StatusOr<SFlowDatagram> datagram = SFlowDatagram::Parse(packet);
+  ASSERT_TRUE(datagram.ok()) << datagram.status();
+  SFlowSample sample;
+  SFlowFlow flow;
+  ASSERT_TRUE(datagram->NextSample(&sample));
+  EXPECT_FALSE(sample.ReadFlow(&flow));
+}
+
+TEST(SFlowDatagramTest, InterfacesOtherThanASingleIfIndexAreUnknown) {
+  // A discarded packet has output format 1, and ifIndex 0 is unknown.
+  std::string packet = SFlowDatagramBuilder()
+                           .AddFlowSample(/*input_if_index=*/0,
+                                          /*output_if_index=*/(1u << 30) | 7,
+                                          /*sampling_rate=*/1)
+                           .Build();
+  absl::StatusOr<SFlowDatagram> datagram = SFlowDatagram::Parse(packet);
+  ASSERT_TRUE(datagram.ok()) << datagram.status();
+  SFlowSample sample;
+  ASSERT_TRUE(datagram->NextSample(&sample));
+  EXPECT_EQ(sample.input_if_index(), std::nullopt);
+  EXPECT_EQ(sample.output_if_index(), std::nullopt);
+}
+
+TEST(SFlowDatagramTest, RejectsTruncatedDatagrams) {
+  std::string packet = SFlowDatagramBuilder()
+                           .AddFlowSample(1, 2, 100)
+                           .AddCounterSample(3)
+                           .Build();
+  for (size_t size = 0; size < packet.size(); ++size) {
+    EXPECT_FALSE(SFlowDatagram::Parse(packet.substr(0, size)).ok())
+        << "size " << size;
+  }
+}
+
+TEST(SFlowDatagramTest, RejectsMalformedDatagrams) {
+  std::string packet = SFlowDatagramBuilder().AddCounterSample(3).Build();
+  std::string version4 = packet;
+  version4[3] = 4;
+  EXPECT_FALSE(SFlowDatagram::Parse(version4).ok());
+
+  std::string unknown_address_type = packet;
+  unknown_address_type[7] = 3;
+  EXPECT_FALSE(SFlowDatagram::Parse(unknown_address_type).ok());
+
+  // A flow sample too short for its fixed fields.
+  std::string short_flow_sample =
+      SFlowDatagramBuilder().AddSample(/*format=*/1, "12345678").Build();
+  EXPECT_FALSE(SFlowDatagram::Parse(short_flow_sample).ok());
+}
+
+}  // namespace
+}  // namespace gnpsi
@@ -0,0 +1,172 @@
+#ifndef OPENCONFIG_GNPSI_SERVER_GNPSI_SFLOW_TEST_UTIL_H_
+#define OPENCONFIG_GNPSI_SERVER_GNPSI_SFLOW_TEST_UTIL_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "server/gnpsi_sflow_parser.h"
+
+namespace gnpsi {
+
+// Agent address of the datagrams built by default: 10.0.0.1.
+inline std::string TestAgentAddress() { return std::string("\x0a\0\0\x01", 4); }
+
+// Returns a sampled header flow record of an Ethernet frame of
+// `frame_length` bytes, carrying an IPv4 packet of `protocol` from
+// `src_address`:`src_port` to `dst_address`:`dst_port`.
+inline std::string SampledIpv4HeaderRecord(const std::string& src_address,
+                                           const std::string& dst_address,
+                                           uint8_t protocol, uint16_t src_port,
+                                           uint16_t dst_port,
+                                           uint32_t frame_length = 1000) {
+  std::string header(12, '\x02');  // MAC addresses.
+  header += std::string("\x08\x00", 2);
+  header += std::string("\x45\0\0\0\0\0\0\0\x40", 9);
+  header += static_cast<char>(protocol);
+  header += std::string(2, '\0');  // Checksum.
+  header += src_address + dst_address;
+  header += {static_cast<char>(src_port >> 8), static_cast<char>(src_port),
+             static_cast<char>(dst_port >> 8), static_cast<char>(dst_port)};
+  header += std::string(8, '\0');
+  std::string record(24, '\0');
+  WriteXdrUint32(1, record.data());  // Format: sampled header.
+  WriteXdrUint32(16 + header.size(), record.data() + 4);
+  WriteXdrUint32(1, record.data() + 8);  // Header protocol: Ethernet.
+  WriteXdrUint32(frame_length, record.data() + 12);
+  WriteXdrUint32(0, record.data() + 16);  // Stripped.
+  WriteXdrUint32(header.size(), record.data() + 20);
+  return record + header;
+}
+
+// Returns a sampled IPv6 flow record of a packet of `length` bytes.
+inline std::string SampledIpv6Record(const std::string& src_address,
+                                     const std::string& dst_address,
+                                     uint8_t protocol, uint16_t src_port,
+                                     uint16_t dst_port, uint32_t length) {
+  std::string record(16, '\0');
+  WriteXdrUint32(4, record.data());  // Format: sampled IPv6.
+  WriteXdrUint32(56, record.data() + 4);
+  WriteXdrUint32(length, record.data() + 8);
+  WriteXdrUint32(protocol, record.data() + 12);
+  record += src_address + dst_address;
+  char fields[16];
+  WriteXdrUint32(src_port, fields);
+  WriteXdrUint32(dst_port, fields + 4);
+  WriteXdrUint32(0, fields + 8);   // TCP flags.
+  WriteXdrUint32(0, fields + 12);  // Priority.
+  return record.append(fields, sizeof(fields));
+}
+
+// Builds sFlow v5 datagrams for tests.
+class SFlowDatagramBuilder {
+ public:
+  explicit SFlowDatagramBuilder(
+      const std::string& agent_address = TestAgentAddress())
+      : agent_address_(agent_address) {}
+
+  // Sets the header fields following the agent address.
+  SFlowDatagramBuilder& set_sub_agent_id(uint32_t sub_agent_id) {
+    sub_agent_id_ = sub_agent_id;
+    return *this;
+  }
+  SFlowDatagramBuilder& set_sequence_number(uint32_t sequence_number) {
+    sequence_number_ = sequence_number;
+    return *this;
+  }
+  SFlowDatagramBuilder& set_uptime(uint32_t uptime) {
+    uptime_ = uptime;
+    return *this;
+  }
+
+  // Adds a compact flow sample with the encoded flow `records`.
+  SFlowDatagramBuilder& AddFlowSample(
+      uint32_t input_if_index, uint32_t output_if_index,
+      uint32_t sampling_rate, const std::vector<std::string>& records = {}) {
+    std::string data;
+    AppendXdr(++sample_sequence_number_, &data);
+    AppendXdr(input_if_index, &data);  // Source: ifIndex input_if_index.
+    AppendXdr(sampling_rate, &data);
+    AppendXdr(1000, &data);  // Sample pool.
+    AppendXdr(0, &data);     // Drops.
+    AppendXdr(input_if_index, &data);
+    AppendXdr(output_if_index, &data);
+    AppendRecords(records, &data);
+    return AddSample(/*format=*/1, data);
+  }
+
+  // Adds an expanded flow sample with the encoded flow `records`.
+  SFlowDatagramBuilder& AddExpandedFlowSample(
+      uint32_t input_if_index, uint32_t output_if_index,
+      uint32_t sampling_rate, const std::vector<std::string>& records = {}) {
+    std::string data;
+    AppendXdr(++sample_sequence_number_, &data);
+    AppendXdr(0, &data);  // Source: ifIndex input_if_index.
+    AppendXdr(input_if_index, &data);
+    AppendXdr(sampling_rate, &data);
+    AppendXdr(1000, &data);  // Sample pool.
+    AppendXdr(0, &data);     // Drops.
+    AppendXdr(0, &data);
+    AppendXdr(input_if_index, &data);
+    AppendXdr(0, &data);
+    AppendXdr(output_if_index, &data);
+    AppendRecords(records, &data);
+    return AddSample(/*format=*/3, data);
+  }
+
+  // Adds a compact counter sample of `if_index` without counter records.
+  SFlowDatagramBuilder& AddCounterSample(uint32_t if_index) {
+    std::string data;
+    AppendXdr(++sample_sequence_number_, &data);
+    AppendXdr(if_index, &data);
+    AppendXdr(0, &data);  // Number of records.
+    return AddSample(/*format=*/2, data);
+  }
+
+  // Adds a sample of `format` with `data`.
+  SFlowDatagramBuilder& AddSample(uint32_t format, absl::string_view data) {
+    AppendXdr(format, &samples_);
+    AppendXdr(data.size(), &samples_);
+    samples_.append(data.data(), data.size());
+    ++num_samples_;
+    return *this;
+  }
+
+  std::string Build() const {
+    std::string datagram;
+    AppendXdr(5, &datagram);
+    AppendXdr(agent_address_.size() == 16 ? 2 : 1, &datagram);
+    datagram += agent_address_;
+    AppendXdr(sub_agent_id_, &datagram);
+    AppendXdr(sequence_number_, &datagram);
+    AppendXdr(uptime_, &datagram);
+    AppendXdr(num_samples_, &datagram);
+    return datagram + samples_;
+  }
+
+ private:
+  static void AppendXdr(uint32_t value, std::string* data) {
+    char bytes[4];
+    WriteXdrUint32(value, bytes);
+    data->append(bytes, 4);
+  }
+
+  static void AppendRecords(const std::vector<std::string>& records,
+                            std::string* data) {
+    AppendXdr(records.size(), data);
+    for (const std::string& record : records) *data += record;
+  }
+
+  std::string agent_address_;
+  uint32_t sub_agent_id_ = 0;
+  uint32_t sequence_number_ = 42;
+  uint32_t uptime_ = 0;
+  std::string samples_;
+  uint32_t num_samples_ = 0;
+  uint32_t sample_sequence_number_ = 0;
+};
+
+}  // namespace gnpsi
+
+#endif  // OPENCONFIG_GNPSI_SERVER_GNPSI_SFLOW_TEST_UTIL_H_
@@ -0,0 +1,218 @@
+#include "server/gnpsi_shared_sample.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/container/inlined_vector.h"
+#include "absl/types/span.h"
+#include "google/protobuf/arena.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/wire_format_lite.h"
+#include "grpcpp/support/byte_buffer.h"
+#include "grpcpp/support/slice.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+
+namespace gnpsi {
+namespace {
+using ::google::protobuf::io::CodedOutputStream;
+using ::google::protobuf::internal::WireFormatLite;
+
+// Upper bound of the encoding of the timestamp and sequence_number fields and
+// the tag and length of the packet field.
+constexpr int kMaxHeaderSize = 32;
+// Upper bound of the encoding of a metadata field.
+constexpr int kMaxMetadataFieldSize = 16;
+// Upper bound of the tag and length of a sample in batched_samples.
+constexpr int kMaxBatchedSampleHeaderSize = 8;
+// Number of slices of a Sample encoded without allocating: the metadata
+// field, the header, the packet and a few congestion_telemetry fields.
+constexpr int kInlinedSlices = 8;
+}  // namespace
+
+GnpsiCongestionRecord::GnpsiCongestionRecord(CongestionTelemetry telemetry)
+    : telemetry_(std::move(telemetry)) {
+  std::string field;
+  const size_t size = telemetry_.ByteSizeLong();
+  uint8_t header[kMaxBatchedSampleHeaderSize];
+  uint8_t* end = CodedOutputStream::WriteTagToArray(
+      WireFormatLite::MakeTag(Sample::kCongestionTelemetryFieldNumber,
+                              WireFormatLite::WIRETYPE_LENGTH_DELIMITED),
+      header);
+  end = CodedOutputStream::WriteVarint32ToArray(size, end);
+  field.reserve((end - header) + size);
+  field.append(reinterpret_cast<const char*>(header), end - header);
+  telemetry_.AppendToString(&field);
+  field_ = grpc::Slice(std::move(field));
+}
+
+int GnpsiSampleMetadata::field_number() const {
+  switch (protocol_) {
+    case Protocol::kSFlow:
+      return Sample::kSflowMetadataFieldNumber;
+    case Protocol::kNetFlow:
+      return Sample::kNetflowMetadataFieldNumber;
+    case Protocol::kIpfix:
+      return Sample::kIpfixMetadataFieldNumber;
+  }
+  return Sample::kSflowMetadataFieldNumber;
+}
+
+void GnpsiSampleMetadata::SetMetadata(Sample* sample) const {
+  switch (protocol_) {
+    case Protocol::kSFlow:
+      sample->mutable_sflow_metadata()->set_version(
+          static_cast<SFlowMetadata::Version>(version_));
+      break;
+    case Protocol::kNetFlow:
+      sample->mutable_netflow_metadata()->set_version(
+          static_cast<NetFlowMetadata::Version>(version_));
+      break;
+    case Protocol::kIpfix:
+      sample->mutable_ipfix_metadata()->set_version(
+          static_cast<IPFIXMetadata::Version>(version_));
+      break;
+  }
+}
+
+void SharedSample::BuildSample() {
+  sample_ = google::protobuf::Arena::Create<Sample>(&arena_);
+  sample_->set_packet(packet().data(), packet().size());
+  sample_->set_timestamp(timestamp_);
+  sample_->set_sequence_number(sequence_number_);
+  for (const auto& record : congestion_telemetry_) {
+    *sample_->add_congestion_telemetry() = record->telemetry();
+  }
+}
+
+Sample SharedSample::SampleWithMetadata() const {
+  Sample sample = *sample_;
+  metadata_.SetMetadata(&sample);
+  return sample;
+}
+
+void SharedSample::Serialize() {
+  // The fields are encoded in the same way as Sample::SerializeToString, but
+  // the metadata is encoded on its own and the packet is written last, so that
+  // everything before its bytes fits in small header slices followed by the
+  // packet slice itself. Parsers accept fields in any order.
+  uint8_t metadata_field[kMaxMetadataFieldSize];
+  uint8_t* end = CodedOutputStream::WriteTagToArray(
+      WireFormatLite::MakeTag(metadata_.field_number(),
+                              WireFormatLite::WIRETYPE_LENGTH_DELIMITED),
+      metadata_field);
+  // The version is field 1 of all metadata messages. An UNSPECIFIED version
+  // is the default and is not encoded.
+  if (metadata_.version() != 0) {
+    uint8_t metadata[8];
+    uint8_t* metadata_end = CodedOutputStream::WriteTagToArray(
+        WireFormatLite::MakeTag(SFlowMetadata::kVersionFieldNumber,
+                                WireFormatLite::WIRETYPE_VARINT),
+        metadata);
+    metadata_end = CodedOutputStream::WriteVarint64ToArray(
+        static_cast<int64_t>(metadata_.version()), metadata_end);
+    end = CodedOutputStream::WriteVarint32ToArray(metadata_end - metadata, end);
+    for (uint8_t* it = metadata; it != metadata_end; ++it) {
+      *end++ = *it;
+    }
+  } else {
+    end = CodedOutputStream::WriteVarint32ToArray(0, end);
+  }
+  // Both headers are small enough to be inlined in their slices, so copying
+  // them does not allocate.
+  metadata_field_ = grpc::Slice(metadata_field, end - metadata_field);
+
+  uint8_t header[kMaxHeaderSize];
+  end = header;
+  if (timestamp_ != 0) {
+    end = CodedOutputStream::WriteTagToArray(
+        WireFormatLite::MakeTag(Sample::kTimestampFieldNumber,
+                                WireFormatLite::WIRETYPE_VARINT),
+        end);
+    end = CodedOutputStream::WriteVarint64ToArray(timestamp_, end);
+  }
+  if (sequence_number_ != 0) {
+    end = CodedOutputStream::WriteTagToArray(
+        WireFormatLite::MakeTag(Sample::kSequenceNumberFieldNumber,
+                                WireFormatLite::WIRETYPE_VARINT),
+        end);
+    end = CodedOutputStream::WriteVarint64ToArray(sequence_number_, end);
+  }
+  if (packet_.size() != 0) {
+    end = CodedOutputStream::WriteTagToArray(
+        WireFormatLite::MakeTag(Sample::kPacketFieldNumber,
+                                WireFormatLite::WIRETYPE_LENGTH_DELIMITED),
+        end);
+    end = CodedOutputStream::WriteVarint32ToArray(packet_.size(), end);
+  }
+  header_ = grpc::Slice(header, end - header);
+  congestion_telemetry_size_ = 0;
+  for (const auto& record : congestion_telemetry_) {
+    congestion_telemetry_size_ += record->field().size();
+  }
+  absl::InlinedVector<grpc::Slice, kInlinedSlices> slices;
+  AppendSlices(&slices);
+  serialized_ = grpc::ByteBuffer(slices.data(), slices.size());
+}
+
+template <typename Slices>
+void SharedSample::AppendSlices(Slices* slices) const {
+  slices->push_back(header_);
+  if (packet_.size() != 0) {
+    slices->push_back(packet_);
+  }
+  // Repeated fields may follow the packet; parsers accept fields in any order.
+  for (const auto& record : congestion_telemetry_) {
+    slices->push_back(record->field());
+  }
+}
+
+grpc::ByteBuffer SharedSample::SerializedWithMetadata() const {
+  absl::InlinedVector<grpc::Slice, kInlinedSlices> slices;
+  slices.push_back(metadata_field_);
+  AppendSlices(&slices);
+  return grpc::ByteBuffer(slices.data(), slices.size());
+}
+
+void SharedSample::BuildBatch(
+    absl::Span<const std::shared_ptr<const SharedSample>> samples,
+    GnpsiStreamMetadata* stream_metadata, Sample* batch) {
+  batch->mutable_batched_samples()->Reserve(samples.size());
+  for (const std::shared_ptr<const SharedSample>& sample : samples) {
+    Sample* batched_sample = batch->add_batched_samples();
+    *batched_sample = sample->sample();
+    if (stream_metadata->ShouldSend(sample->metadata())) {
+      sample->metadata().SetMetadata(batched_sample);
+    }
+  }
+}
+
+grpc::ByteBuffer SharedSample::SerializeBatch(
+    absl::Span<const std::shared_ptr<const SharedSample>> samples,
+    GnpsiStreamMetadata* stream_metadata) {
+  // Each sample is a length-delimited batched_samples field: a small slice with
+  // its tag and length followed by the slices of the sample itself.
+  std::vector<grpc::Slice> slices;
+  slices.reserve(4 * samples.size());
+  for (const std::shared_ptr<const SharedSample>& sample : samples) {
+    const bool with_metadata =
+        stream_metadata->ShouldSend(sample->metadata());
+    uint8_t header[kMaxBatchedSampleHeaderSize];
+    uint8_t* end = CodedOutputStream::WriteTagToArray(
+        WireFormatLite::MakeTag(Sample::kBatchedSamplesFieldNumber,
+                                WireFormatLite::WIRETYPE_LENGTH_DELIMITED),
+        header);
+    end = CodedOutputStream::WriteVarint32ToArray(
+        sample->SerializedSize(with_metadata), end);
+    slices.emplace_back(header, end - header);
+    if (with_metadata) {
+      slices.push_back(sample->metadata_field_);
+    }
+    sample->AppendSlices(&slices);
+  }
+  return grpc::ByteBuffer(slices.data(), slices.size());
+}
+
+}  // namespace gnpsi
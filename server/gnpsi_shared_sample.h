@@ -0,0 +1,215 @@
+#ifndef OPENCONFIG_GNPSI_SERVER_GNPSI_SHARED_SAMPLE_H_
+#define OPENCONFIG_GNPSI_SERVER_GNPSI_SHARED_SAMPLE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <utility>
+
+#include "absl/container/inlined_vector.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "google/protobuf/arena.h"
+#include "grpcpp/support/byte_buffer.h"
+#include "grpcpp/support/slice.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+
+namespace gnpsi {
+
+// The protocol and version of the datagrams relayed in samples, which select
+// the metadata field set on each Sample. Converts implicitly from the Version
+// enum of each metadata message.
+class GnpsiSampleMetadata {
+ public:
+  enum class Protocol { kSFlow, kNetFlow, kIpfix };
+
+  GnpsiSampleMetadata(SFlowMetadata::Version version)  // NOLINT
+      : protocol_(Protocol::kSFlow), version_(version) {}
+  GnpsiSampleMetadata(NetFlowMetadata::Version version)  // NOLINT
+      : protocol_(Protocol::kNetFlow), version_(version) {}
+  GnpsiSampleMetadata(IPFIXMetadata::Version version)  // NOLINT
+      : protocol_(Protocol::kIpfix), version_(version) {}
+
+  Protocol protocol() const { return protocol_; }
+  // Value of the Version enum of the metadata message of protocol().
+  int version() const { return version_; }
+
+  // Number of the Sample field holding the metadata message of protocol().
+  int field_number() const;
+
+  // Sets the metadata field of `sample` for protocol() to version().
+  void SetMetadata(Sample* sample) const;
+
+  bool operator==(const GnpsiSampleMetadata& other) const {
+    return protocol_ == other.protocol_ && version_ == other.version_;
+  }
+  bool operator!=(const GnpsiSampleMetadata& other) const {
+    return !(*this == other);
+  }
+
+ private:
+  Protocol protocol_;
+  int version_;
+};
+
+// Tracks the metadata sent on a stream. As specified by gnpsi.proto, the
+// metadata is only present in the first message on the stream. A relay
+// forwarding several protocols sends it again whenever it changes, so clients
+// can tell the samples of each protocol apart.
+class GnpsiStreamMetadata {
+ public:
+  // Returns whether a sample with `metadata` has to carry it, and records it
+  // as sent if so.
+  bool ShouldSend(GnpsiSampleMetadata metadata) {
+    if (sent_.has_value() && *sent_ == metadata) return false;
+    sent_ = metadata;
+    return true;
+  }
+
+ private:
+  std::optional<GnpsiSampleMetadata> sent_;
+};
+
+// Congestion telemetry of a sample, along with the encoding of the
+// congestion_telemetry field of a Sample carrying it. It is immutable, so it
+// can be attached to any number of samples without copies.
+class GnpsiCongestionRecord {
+ public:
+  explicit GnpsiCongestionRecord(CongestionTelemetry telemetry);
+
+  const CongestionTelemetry& telemetry() const { return telemetry_; }
+  const grpc::Slice& field() const { return field_; }
+
+ private:
+  CongestionTelemetry telemetry_;
+  grpc::Slice field_;
+};
+
+// A sample relayed to every connection. It is built once and shared, read-only,
+// by the send queues of all connections.
+//
+// The packet is held in a ref-counted slice, usually wrapping the buffer the
+// datagram was received into. Streams that write Sample messages use
+// sample(), which is built on an arena owned by this object. Streams that
+// write raw bytes use serialized(), which references the packet slice instead
+// of copying it, so the payload reaches the wire without further copies.
+//
+// Both omit the metadata, which only the first message on a stream carries.
+// SampleWithMetadata() and SerializedWithMetadata() provide the variants with
+// metadata for that message. Congestion telemetry attached to the sample is
+// referenced in the same way as the packet.
+class SharedSample {
+ public:
+  // A `sequence_number` of 0 is not encoded.
+  SharedSample(grpc::Slice packet, int64_t timestamp,
+               GnpsiSampleMetadata metadata, uint64_t sequence_number = 0)
+      : packet_(std::move(packet)),
+        timestamp_(timestamp),
+        sequence_number_(sequence_number),
+        metadata_(metadata),
+        arena_(arena_block_, sizeof(arena_block_)) {}
+
+  SharedSample(const SharedSample&) = delete;
+  SharedSample& operator=(const SharedSample&) = delete;
+
+  // Attaches `record` to the sample. Must be called before BuildSample() or
+  // Serialize().
+  void AddCongestionTelemetry(
+      std::shared_ptr<const GnpsiCongestionRecord> record) {
+    congestion_telemetry_.push_back(std::move(record));
+  }
+
+  // Builds sample(). The packet is copied into the Sample.
+  void BuildSample();
+
+  // Builds serialized(), the wire encoding of the Sample, and the encoding of
+  // its metadata field. The packet slice is referenced rather than copied.
+  void Serialize();
+
+  // Builds `batch`, a Sample carrying copies of `samples` in its
+  // batched_samples. Samples carry their metadata if `stream_metadata` says
+  // so. Requires BuildSample() to have been called on each of them.
+  static void BuildBatch(
+      absl::Span<const std::shared_ptr<const SharedSample>> samples,
+      GnpsiStreamMetadata* stream_metadata, Sample* batch);
+
+  // Returns the wire encoding of the Sample built by BuildBatch. It references
+  // the slices of serialized() of each sample rather than copying them, and
+  // requires Serialize() to have been called on each of them.
+  static grpc::ByteBuffer SerializeBatch(
+      absl::Span<const std::shared_ptr<const SharedSample>> samples,
+      GnpsiStreamMetadata* stream_metadata);
+
+  absl::string_view packet() const {
+    return absl::string_view(reinterpret_cast<const char*>(packet_.begin()),
+                             packet_.size());
+  }
+  int64_t timestamp() const { return timestamp_; }
+  uint64_t sequence_number() const { return sequence_number_; }
+  GnpsiSampleMetadata metadata() const { return metadata_; }
+  absl::Span<const std::shared_ptr<const GnpsiCongestionRecord>>
+  congestion_telemetry() const {
+    return congestion_telemetry_;
+  }
+
+  // Requires BuildSample() to have been called.
+  const Sample& sample() const { return *sample_; }
+
+  // Returns a copy of sample() with the metadata set. Requires BuildSample()
+  // to have been called.
+  Sample SampleWithMetadata() const;
+
+  // Empty unless Serialize() has been called. Copies of a ByteBuffer share the
+  // underlying slices, so writing it to many streams neither re-encodes nor
+  // copies the sample.
+  const grpc::ByteBuffer& serialized() const { return serialized_; }
+
+  // Returns serialized() preceded by the metadata field. Like serialized(), it
+  // references the slices of the sample rather than copying them. Requires
+  // Serialize() to have been called.
+  grpc::ByteBuffer SerializedWithMetadata() const;
+
+  // Returns the size of the wire encoding of the Sample with or without its
+  // metadata. Requires Serialize() to have been called.
+  size_t SerializedSize(bool with_metadata) const {
+    return (with_metadata ? metadata_field_.size() : 0) + header_.size() +
+           packet_.size() + congestion_telemetry_size_;
+  }
+
+ private:
+  // Large enough for the Sample itself, so building it does not allocate
+  // arena blocks from the heap.
+  static constexpr size_t kArenaBlockSize = 512;
+  // Number of congestion records attached without allocating. A datagram
+  // usually carries a handful of flow samples.
+  static constexpr size_t kInlinedCongestionRecords = 8;
+
+  // Appends the slices of the wire encoding of the Sample, but its metadata
+  // field, to `slices`.
+  template <typename Slices>
+  void AppendSlices(Slices* slices) const;
+
+  grpc::Slice packet_;
+  // Encoding of the fields before the packet bytes, but the metadata. Set by
+  // Serialize().
+  grpc::Slice header_;
+  // Encoding of the metadata field. Set by Serialize().
+  grpc::Slice metadata_field_;
+  absl::InlinedVector<std::shared_ptr<const GnpsiCongestionRecord>,
+                      kInlinedCongestionRecords>
+      congestion_telemetry_;
+  // Size of the congestion_telemetry fields. Set by Serialize().
+  size_t congestion_telemetry_size_ = 0;
+  int64_t timestamp_;
+  uint64_t sequence_number_;
+  GnpsiSampleMetadata metadata_;
+  alignas(8) char arena_block_[kArenaBlockSize];
+  google::protobuf::Arena arena_;
+  Sample* sample_ = nullptr;
+  grpc::ByteBuffer serialized_;
+};
+
+}  // namespace gnpsi
+
+#endif  // OPENCONFIG_GNPSI_SERVER_GNPSI_SHARED_SAMPLE_H_
@@ -0,0 +1,265 @@
+#include "server/gnpsi_shared_sample.h"
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "grpcpp/impl/proto_utils.h"
+#include "grpcpp/support/byte_buffer.h"
+#include "grpcpp/support/slice.h"
+#include "gtest/gtest.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_packet_buffer.h"
+
+namespace gnpsi {
+namespace {
+
+Sample ExpectedSample(const std::string& packet, int64_t timestamp,
+                      std::optional<GnpsiSampleMetadata> metadata) {
+  Sample sample;
+  sample.set_packet(packet);
+  sample.set_timestamp(timestamp);
+  if (metadata.has_value()) metadata->SetMetadata(&sample);
+  return sample;
+}
+
+std::string ToString(const grpc::ByteBuffer& buffer) {
+  std::vector<grpc::Slice> slices;
+  EXPECT_TRUE(buffer.Dump(&slices).ok());
+  std::string bytes;
+  for (const grpc::Slice& slice : slices) {
+    bytes.append(reinterpret_cast<const char*>(slice.begin()), slice.size());
+  }
+  return bytes;
+}
+
+class SharedSampleSerializeTest
+    : public ::testing::TestWithParam<
+          std::tuple<std::string, int64_t, GnpsiSampleMetadata>> {};
+
+TEST_P(SharedSampleSerializeTest, ParsesAsSample) {
+  const auto& [packet, timestamp, metadata] = GetParam();
+  SharedSample shared_sample(grpc::Slice(packet), timestamp, metadata);
+  shared_sample.Serialize();
+
+  Sample parsed;
+  ASSERT_TRUE(parsed.ParseFromString(ToString(shared_sample.serialized())));
+  Sample expected = ExpectedSample(packet, timestamp, std::nullopt);
+  EXPECT_EQ(parsed.SerializeAsString(), expected.SerializeAsString());
+  EXPECT_EQ(shared_sample.serialized().Length(), expected.ByteSizeLong());
+  EXPECT_EQ(shared_sample.SerializedSize(/*with_metadata=*/false),
+            expected.ByteSizeLong());
+
+  grpc::ByteBuffer with_metadata = shared_sample.SerializedWithMetadata();
+  ASSERT_TRUE(parsed.ParseFromString(ToString(with_metadata)));
+  expected = ExpectedSample(packet, timestamp, metadata);
+  EXPECT_EQ(parsed.SerializeAsString(), expected.SerializeAsString());
+  EXPECT_EQ(with_metadata.Length(), expected.ByteSizeLong());
+  EXPECT_EQ(shared_sample.SerializedSize(/*with_metadata=*/true),
+            expected.ByteSizeLong());
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Fields, SharedSampleSerializeTest,
+    ::testing::Combine(::testing::Values("", "x", std::string(4096, 'p')),
+                       ::testing::Values(0, 1, 1700000000123456789),
+                       ::testing::Values(
+                           GnpsiSampleMetadata(SFlowMetadata::UNSPECIFIED),
+                           GnpsiSampleMetadata(SFlowMetadata::V5),
+                           GnpsiSampleMetadata(NetFlowMetadata::V9),
+                           GnpsiSampleMetadata(IPFIXMetadata::V10))));
+
+TEST(GnpsiSampleMetadataTest, SetsMetadataOfProtocol) {
+  Sample sflow;
+  GnpsiSampleMetadata(SFlowMetadata::V5).SetMetadata(&sflow);
+  EXPECT_EQ(sflow.sflow_metadata().version(), SFlowMetadata::V5);
+  EXPECT_FALSE(sflow.has_netflow_metadata());
+  EXPECT_FALSE(sflow.has_ipfix_metadata());
+
+  Sample netflow;
+  GnpsiSampleMetadata(NetFlowMetadata::V9).SetMetadata(&netflow);
+  EXPECT_EQ(netflow.netflow_metadata().version(), NetFlowMetadata::V9);
+  EXPECT_FALSE(netflow.has_sflow_metadata());
+
+  Sample ipfix;
+  GnpsiSampleMetadata(IPFIXMetadata::V10).SetMetadata(&ipfix);
+  EXPECT_EQ(ipfix.ipfix_metadata().version(), IPFIXMetadata::V10);
+  EXPECT_FALSE(ipfix.has_sflow_metadata());
+}
+
+TEST(SharedSampleTest, SerializedReferencesPacketBuffer) {
+  auto pool = GnpsiBufferPool::Create(/*buffer_size=*/64,
+                                      /*max_free_buffers=*/1);
+  GnpsiPacketBuffer buffer = pool->Acquire();
+  const char* data = buffer.data();
+  memcpy(buffer.data(), "datagram", 8);
+  buffer.set_size(8);
+  SharedSample shared_sample(std::move(buffer).ToSlice(), 1, SFlowMetadata::V5);
+  shared_sample.Serialize();
+
+  std::vector<grpc::Slice> slices;
+  ASSERT_TRUE(shared_sample.serialized().Dump(&slices).ok());
+  ASSERT_EQ(slices.size(), 2);
+  EXPECT_EQ(reinterpret_cast<const char*>(slices[1].begin()), data);
+  EXPECT_EQ(shared_sample.packet(), "datagram");
+}
+
+TEST(SharedSampleTest, BuildSample) {
+  SharedSample shared_sample(grpc::Slice(std::string("datagram")), 42,
+                             SFlowMetadata::V5);
+  shared_sample.BuildSample();
+  EXPECT_EQ(shared_sample.sample().SerializeAsString(),
+            ExpectedSample("datagram", 42, std::nullopt).SerializeAsString());
+  EXPECT_EQ(shared_sample.SampleWithMetadata().SerializeAsString(),
+            ExpectedSample("datagram", 42, SFlowMetadata::V5)
+                .SerializeAsString());
+}
+
+TEST(SharedSampleTest, SerializesSequenceNumber) {
+  for (uint64_t sequence_number : {uint64_t{1}, ~uint64_t{0}}) {
+    SharedSample shared_sample(grpc::Slice(std::string("datagram")),
+                               1700000000123456789, SFlowMetadata::V5,
+                               sequence_number);
+    shared_sample.Serialize();
+    shared_sample.BuildSample();
+    Sample expected = ExpectedSample("datagram", 1700000000123456789,
+                                     SFlowMetadata::V5);
+    expected.set_sequence_number(sequence_number);
+    grpc::ByteBuffer serialized = shared_sample.SerializedWithMetadata();
+    Sample parsed;
+    ASSERT_TRUE(parsed.ParseFromString(ToString(serialized)));
+    EXPECT_EQ(parsed.SerializeAsString(), expected.SerializeAsString());
+    EXPECT_EQ(serialized.Length(), expected.ByteSizeLong());
+    EXPECT_EQ(shared_sample.SampleWithMetadata().SerializeAsString(),
+              expected.SerializeAsString());
+  }
+}
+
+TEST(SharedSampleTest, CarriesCongestionTelemetry) {
+  auto shared_sample = std::make_shared<SharedSample>(
+      grpc::Slice(std::string("datagram")), 42, SFlowMetadata::V5);
+  Sample expected = ExpectedSample("datagram", 42, std::nullopt);
+  // More records than are held without allocating.
+  for (int i = 1; i <= 10; ++i) {
+    CongestionTelemetry telemetry;
+    telemetry.set_ingress_port(i);
+    telemetry.set_egress_port(i + 100);
+    telemetry.set_sample_sequence_number(i * 1000);
+    shared_sample->AddCongestionTelemetry(
+        std::make_shared<GnpsiCongestionRecord>(telemetry));
+    *expected.add_congestion_telemetry() = telemetry;
+  }
+  shared_sample->BuildSample();
+  shared_sample->Serialize();
+  EXPECT_EQ(shared_sample->sample().SerializeAsString(),
+            expected.SerializeAsString());
+
+  Sample parsed;
+  ASSERT_TRUE(parsed.ParseFromString(ToString(shared_sample->serialized())));
+  EXPECT_EQ(parsed.SerializeAsString(), expected.SerializeAsString());
+  EXPECT_EQ(shared_sample->SerializedSize(/*with_metadata=*/false),
+            expected.ByteSizeLong());
+
+  GnpsiStreamMetadata stream_metadata;
+  std::vector<std::shared_ptr<const SharedSample>> samples = {shared_sample};
+  grpc::ByteBuffer batch =
+      SharedSample::SerializeBatch(samples, &stream_metadata);
+  ASSERT_TRUE(parsed.ParseFromString(ToString(batch)));
+  ASSERT_EQ(parsed.batched_samples_size(), 1);
+  EXPECT_EQ(parsed.batched_samples(0).congestion_telemetry_size(), 10);
+  EXPECT_EQ(parsed.batched_samples(0).congestion_telemetry(9).egress_port(),
+            110);
+}
+
+TEST(GnpsiStreamMetadataTest, SendsFirstAndChangedMetadata) {
+  GnpsiStreamMetadata stream_metadata;
+  EXPECT_TRUE(stream_metadata.ShouldSend(SFlowMetadata::V5));
+  EXPECT_FALSE(stream_metadata.ShouldSend(SFlowMetadata::V5));
+  EXPECT_TRUE(stream_metadata.ShouldSend(IPFIXMetadata::V10));
+  EXPECT_FALSE(stream_metadata.ShouldSend(IPFIXMetadata::V10));
+  EXPECT_TRUE(stream_metadata.ShouldSend(SFlowMetadata::V5));
+}
+
+TEST(SharedSampleTest, SerializeBatchMatchesBuildBatch) {
+  std::vector<std::shared_ptr<const SharedSample>> samples;
+  const std::vector<std::pair<std::string, GnpsiSampleMetadata>> packets = {
+      {"first", SFlowMetadata::V5},
+      {"", SFlowMetadata::V5},
+      {std::string(300, 'p'), NetFlowMetadata::V9}};
+  for (const auto& [packet, metadata] : packets) {
+    auto sample = std::make_shared<SharedSample>(
+        grpc::Slice(packet), /*timestamp=*/packet.size() + 1, metadata);
+    sample->BuildSample();
+    sample->Serialize();
+    samples.push_back(std::move(sample));
+  }
+  GnpsiStreamMetadata build_metadata;
+  Sample batch;
+  SharedSample::BuildBatch(samples, &build_metadata, &batch);
+  ASSERT_EQ(batch.batched_samples_size(), 3);
+  EXPECT_EQ(batch.batched_samples(2).packet(), std::string(300, 'p'));
+  EXPECT_EQ(batch.batched_samples(2).timestamp(), 301);
+  EXPECT_TRUE(batch.batched_samples(0).has_sflow_metadata());
+  EXPECT_FALSE(batch.batched_samples(1).has_sflow_metadata());
+  EXPECT_EQ(batch.batched_samples(2).netflow_metadata().version(),
+            NetFlowMetadata::V9);
+
+  GnpsiStreamMetadata serialize_metadata;
+  grpc::ByteBuffer serialized =
+      SharedSample::SerializeBatch(samples, &serialize_metadata);
+  Sample parsed;
+  ASSERT_TRUE(parsed.ParseFromString(ToString(serialized)));
+  EXPECT_EQ(parsed.SerializeAsString(), batch.SerializeAsString());
+  EXPECT_EQ(serialized.Length(), batch.ByteSizeLong());
+}
+
+TEST(GnpsiBufferPoolTest, ReusesReleasedBuffers) {
+  auto pool = GnpsiBufferPool::Create(/*buffer_size=*/64,
+                                      /*max_free_buffers=*/1);
+  GnpsiPacketBuffer buffer = pool->Acquire();
+  EXPECT_EQ(buffer.capacity(), 64);
+  const char* data = buffer.data();
+  { GnpsiPacketBuffer released = std::move(buffer); }
+  EXPECT_FALSE(buffer.valid());
+  EXPECT_EQ(pool->Acquire().data(), data);
+}
+
+TEST(GnpsiBufferPoolTest, SliceReleasesBufferToPool) {
+  auto pool = GnpsiBufferPool::Create(/*buffer_size=*/64,
+                                      /*max_free_buffers=*/1);
+  GnpsiPacketBuffer buffer = pool->Acquire();
+  const char* data = buffer.data();
+  {
+    grpc::Slice slice = std::move(buffer).ToSlice();
+    grpc::Slice copy = slice;
+  }
+  EXPECT_EQ(pool->Acquire().data(), data);
+}
+
+TEST(GnpsiBufferPoolTest, InvalidBufferYieldsEmptySlice) {
+  EXPECT_EQ(GnpsiPacketBuffer().ToSlice().size(), 0);
+  auto pool = GnpsiBufferPool::Create(/*buffer_size=*/64,
+                                      /*max_free_buffers=*/1);
+  GnpsiPacketBuffer buffer = pool->Acquire();
+  GnpsiPacketBuffer moved = std::move(buffer);
+  EXPECT_EQ(std::move(buffer).ToSlice().size(), 0);
+}
+
+TEST(GnpsiBufferPoolTest, BufferOutlivesPoolHandle) {
+  auto pool = GnpsiBufferPool::Create(/*buffer_size=*/64,
+                                      /*max_free_buffers=*/1);
+  GnpsiPacketBuffer buffer = pool->Acquire();
+  pool.reset();
+  memcpy(buffer.data(), "still valid", 11);
+  buffer.set_size(11);
+  EXPECT_EQ(buffer.view(), "still valid");
+}
+
+}  // namespace
+}  // namespace gnpsi
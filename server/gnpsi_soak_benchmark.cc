@@ -0,0 +1,302 @@
+// Soak test of the whole relay path on a single machine: synthetic sFlow v5
+// datagrams are sent over the loopback interface to a GnpsiRelayServer, which
+// feeds a GnpsiServiceImpl served on a localhost gRPC port, and Subscribe
+// clients read the samples back. Meant to be run before upgrades to catch
+// throughput and latency regressions of the relay as a whole.
+//
+// Each run sends datagrams of packet_size bytes at `rate` datagrams per second
+// for kSoakDuration, to `subscribers` clients of which `slow` spend
+// kSlowReadDelay on each sample they read. It reports:
+//  - "sent_rate": datagrams sent per second.
+//  - "socket_loss": share of the datagrams sent that the relay did not read,
+//    along with "kernel_drops", those the kernel dropped because the receive
+//    buffer was full, and "sequence_gaps", the datagrams the relay found
+//    missing from the sequence numbers of the exporter.
+//  - "queue_loss": share of the samples relayed to each subscriber dropped
+//    because its send queue was full.
+//  - "delivered_rate" and "slow_delivered_rate": samples read per second by
+//    each fast and each slow subscriber, and "fast_loss", the share of the
+//    samples relayed that fast subscribers did not read.
+//  - "p50_ns", "p99_ns" and "p999_ns": time from the kernel receiving a
+//    datagram to a fast subscriber reading its sample.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "benchmark/benchmark.h"
+#include "glog/logging.h"
+#include "grpcpp/client_context.h"
+#include "grpcpp/create_channel.h"
+#include "grpcpp/security/credentials.h"
+#include "grpcpp/security/server_credentials.h"
+#include "grpcpp/server.h"
+#include "grpcpp/server_builder.h"
+#include "proto/gnpsi/gnpsi.grpc.pb.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_benchmark_util.h"
+#include "server/gnpsi_relay_server.h"
+#include "server/gnpsi_service_impl.h"
+#include "server/gnpsi_sflow_parser.h"
+#include "server/gnpsi_sflow_test_util.h"
+
+namespace gnpsi {
+namespace {
+
+// Time datagrams are sent for in each run.
+constexpr absl::Duration kSoakDuration = absl::Seconds(5);
+// Time a slow subscriber spends on each sample it reads.
+constexpr absl::Duration kSlowReadDelay = absl::Milliseconds(1);
+// Interval at which the sender tops up the datagrams due.
+constexpr absl::Duration kSendInterval = absl::Microseconds(100);
+// Longest time the relay and the fast subscribers get to catch up after the
+// last datagram was sent.
+constexpr absl::Duration kMaxDrainTime = absl::Seconds(5);
+// Offset of the sequence number in the header of a datagram with an IPv4
+// agent address.
+constexpr int kSequenceNumberOffset = 16;
+
+// Sends sFlow v5 datagrams of a single exporter to a loopback UDP port, with
+// consecutive sequence numbers.
+class DatagramSender {
+ public:
+  DatagramSender(int port, int packet_size) {
+    SFlowDatagramBuilder builder;
+    builder.AddFlowSample(
+        /*input_if_index=*/1, /*output_if_index=*/2, /*sampling_rate=*/1000,
+        {SampledIpv4HeaderRecord(std::string("\x0a\0\0\x01", 4),
+                                 std::string("\x0a\0\0\x02", 4),
+                                 /*protocol=*/6, /*src_port=*/1234,
+                                 /*dst_port=*/443)});
+    // Pads the datagram up to packet_size with an opaque sample.
+    const int unpadded_size = builder.Build().size();
+    const int padding = (packet_size - unpadded_size - 8) & ~3;
+    if (padding > 0) {
+      builder.AddSample(/*format=*/(1 << 12) | 1, std::string(padding, '\0'));
+    }
+    datagram_ = builder.Build();
+
+    fd_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    CHECK_EQ(connect(fd_, reinterpret_cast<struct sockaddr*>(&addr),
+                     sizeof(addr)),
+             0);
+  }
+  ~DatagramSender() { close(fd_); }
+
+  // Sends the next datagram. Returns false if it could not be sent, which
+  // leaves a gap in the sequence numbers.
+  bool Send() {
+    WriteXdrUint32(++sequence_number_,
+                   datagram_.data() + kSequenceNumberOffset);
+    return send(fd_, datagram_.data(), datagram_.size(), 0) > 0;
+  }
+
+  // Sends `rate` datagrams per second, evenly spread, for `duration`.
+  // Returns the number of datagrams sent.
+  int64_t SendAtRate(int64_t rate, absl::Duration duration) {
+    const absl::Time start = absl::Now();
+    int64_t attempted = 0;
+    int64_t sent = 0;
+    for (absl::Duration elapsed = absl::ZeroDuration(); elapsed < duration;
+         elapsed = absl::Now() - start) {
+      const int64_t due = rate * absl::FDivDuration(elapsed, absl::Seconds(1));
+      for (; attempted < due; ++attempted) {
+        if (Send()) ++sent;
+      }
+      absl::SleepFor(kSendInterval);
+    }
+    return sent;
+  }
+
+  int size() const { return datagram_.size(); }
+
+ private:
+  std::string datagram_;
+  int fd_;
+  uint32_t sequence_number_ = 0;
+};
+
+// A Subscribe client reading samples on a thread of its own, recording the
+// time from the relay receiving each datagram to reading its sample.
+class Subscriber {
+ public:
+  Subscriber(gNPSI::Stub* stub, absl::Duration read_delay)
+      : thread_([this, stub, read_delay] { Run(stub, read_delay); }) {}
+
+  // Cancels the stream, unless it was closed already, and waits for the client
+  // to return.
+  void Stop() {
+    context_.TryCancel();
+    thread_.join();
+  }
+
+  int64_t received() const { return received_.load(std::memory_order_relaxed); }
+  // Only read once stopped.
+  const LatencyRecorder& latency() const { return latency_; }
+
+ private:
+  void Run(gNPSI::Stub* stub, absl::Duration read_delay) {
+    auto reader = stub->Subscribe(&context_, Request());
+    Sample sample;
+    while (reader->Read(&sample)) {
+      latency_.Record(absl::ToChronoNanoseconds(
+          absl::Now() - absl::FromUnixNanos(sample.timestamp())));
+      received_.fetch_add(1, std::memory_order_relaxed);
+      if (read_delay > absl::ZeroDuration()) absl::SleepFor(read_delay);
+    }
+    reader->Finish();
+  }
+
+  grpc::ClientContext context_;
+  std::atomic<int64_t> received_{0};
+  LatencyRecorder latency_;
+  std::thread thread_;
+};
+
+// Returns the number of samples read by `subscribers`.
+int64_t TotalReceived(
+    const std::vector<std::unique_ptr<Subscriber>>& subscribers) {
+  int64_t total = 0;
+  for (const auto& subscriber : subscribers) total += subscriber->received();
+  return total;
+}
+
+// Relays datagrams of state.range(1) bytes sent at state.range(0) per second
+// to state.range(2) subscribers, state.range(3) of them slow.
+void BM_Soak(benchmark::State& state) {
+  const int64_t rate = state.range(0);
+  const int packet_size = state.range(1);
+  const int subscriber_count = state.range(2);
+  const int slow_count = std::min<int>(state.range(3), subscriber_count);
+  const int fast_count = subscriber_count - slow_count;
+
+  GnpsiServiceImpl service(subscriber_count);
+  int grpc_port = 0;
+  grpc::ServerBuilder builder;
+  builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(),
+                           &grpc_port);
+  builder.RegisterService(&service);
+  std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  std::unique_ptr<gNPSI::Stub> stub = gNPSI::NewStub(
+      grpc::CreateChannel(absl::StrCat("localhost:", grpc_port),
+                          grpc::InsecureChannelCredentials()));
+
+  GnpsiRelayOptions options;
+  options.batch_size = 32;
+  options.kernel_timestamps = true;
+  options.count_kernel_drops = true;
+  const int udp_port = FreeUdpPort();
+  GnpsiRelayServer relay(udp_port, AF_INET, options);
+  std::thread relay_thread([&] { relay.StartRelayAndWait(service); });
+  DatagramSender sender(udp_port, packet_size);
+  // Waits for the relay to bind its socket, before anyone subscribed.
+  while (relay.GetStats().datagram_count == 0) {
+    sender.Send();
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+
+  std::vector<std::unique_ptr<Subscriber>> fast;
+  std::vector<std::unique_ptr<Subscriber>> slow;
+  for (int i = 0; i < fast_count; ++i) {
+    fast.push_back(std::make_unique<Subscriber>(stub.get(),
+                                                absl::ZeroDuration()));
+  }
+  for (int i = 0; i < slow_count; ++i) {
+    slow.push_back(std::make_unique<Subscriber>(stub.get(), kSlowReadDelay));
+  }
+  while (service.GetStats().size() < static_cast<size_t>(subscriber_count)) {
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+  const GnpsiRelayStats start_stats = relay.GetStats();
+
+  int64_t sent = 0;
+  for (auto _ : state) {
+    sent += sender.SendAtRate(rate, kSoakDuration);
+  }
+  // Gives the relay and the fast subscribers time to catch up with what is
+  // queued. Slow subscribers would take their time, and only count for what
+  // they read so far.
+  const absl::Time drain_deadline = absl::Now() + kMaxDrainTime;
+  uint64_t relayed_so_far = 0;
+  int64_t received_so_far = -1;
+  while (absl::Now() < drain_deadline &&
+         (relayed_so_far != relay.GetStats().datagram_count ||
+          received_so_far != TotalReceived(fast))) {
+    relayed_so_far = relay.GetStats().datagram_count;
+    received_so_far = TotalReceived(fast);
+    absl::SleepFor(absl::Milliseconds(50));
+  }
+
+  const GnpsiRelayStats stats = relay.GetStats();
+  uint64_t queue_drops = 0;
+  for (const GnpsiStats& connection : service.GetStats()) {
+    queue_drops += connection.dropped_count;
+  }
+  const int64_t fast_received = TotalReceived(fast);
+  const int64_t slow_received = TotalReceived(slow);
+  // Closes the streams, which the service only finds cancelled when it has a
+  // sample for them.
+  service.DrainConnections();
+  LatencyRecorder latency;
+  for (auto& subscriber : fast) {
+    subscriber->Stop();
+    latency.Add(subscriber->latency());
+  }
+  for (auto& subscriber : slow) subscriber->Stop();
+  relay.Stop();
+  relay_thread.join();
+  server->Shutdown();
+
+  const int64_t relayed = stats.datagram_count - start_stats.datagram_count;
+  const double seconds =
+      state.iterations() * absl::ToDoubleSeconds(kSoakDuration);
+  state.counters["sent_rate"] = sent / seconds;
+  state.counters["socket_loss"] =
+      1 - static_cast<double>(relayed) / std::max<int64_t>(sent, 1);
+  state.counters["kernel_drops"] =
+      stats.kernel_drop_count - start_stats.kernel_drop_count;
+  state.counters["sequence_gaps"] =
+      stats.sequences.lost_count - start_stats.sequences.lost_count;
+  state.counters["queue_loss"] =
+      static_cast<double>(queue_drops) /
+      std::max<int64_t>(relayed * subscriber_count, 1);
+  if (fast_count > 0) {
+    state.counters["delivered_rate"] = fast_received / seconds / fast_count;
+    state.counters["fast_loss"] =
+        1 - static_cast<double>(fast_received) /
+                std::max<int64_t>(relayed * fast_count, 1);
+  }
+  if (slow_count > 0) {
+    state.counters["slow_delivered_rate"] =
+        slow_received / seconds / slow_count;
+  }
+  latency.Report(state);
+  state.SetItemsProcessed(relayed);
+  state.SetBytesProcessed(relayed * sender.size());
+}
+
+BENCHMARK(BM_Soak)
+    ->ArgNames({"rate", "packet_size", "subscribers", "slow"})
+    ->ArgsProduct({{10000, 100000}, {256, 1400}, {4}, {0, 1}})
+    ->Iterations(1)
+    ->UseRealTime()
+    ->Unit(benchmark::kSecond);
+
+}  // namespace
+}  // namespace gnpsi
@@ -0,0 +1,390 @@
+#include "server/gnpsi_spool.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "glog/logging.h"
+#include "grpcpp/support/slice.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_shared_sample.h"
+
+namespace gnpsi {
+
+struct GnpsiSpool::Segment {
+  ~Segment() { munmap(data, size); }
+
+  std::string path;
+  char* data = nullptr;
+  size_t size = 0;
+  // End of the records written. Only used by the write thread.
+  size_t end = 0;
+  // Offsets of the records readable, in the order of their sequence numbers.
+  // Guarded by GnpsiSpool::mu_.
+  std::vector<uint32_t> offsets;
+};
+
+namespace {
+
+constexpr absl::string_view kSegmentPrefix = "gnpsi-";
+constexpr absl::string_view kSegmentSuffix = ".spool";
+
+// Header of a record in a segment. It is followed by the packet and by the
+// congestion telemetry messages, each preceded by its 4 byte size. Records are
+// 8 byte aligned. Segments are only read by the process that wrote them, so
+// fields are in host byte order.
+struct RecordHeader {
+  uint64_t sequence_number;
+  int64_t timestamp;
+  uint32_t packet_size;
+  uint32_t congestion_telemetry_size;
+  uint8_t protocol;
+  uint8_t version;
+  uint8_t serialized;
+  uint8_t reserved[5];
+};
+static_assert(sizeof(RecordHeader) == 32, "RecordHeader must not be padded");
+
+size_t RecordSize(size_t size) { return (size + 7) & ~size_t{7}; }
+
+bool IsSegmentFile(absl::string_view name) {
+  return absl::StartsWith(name, kSegmentPrefix) &&
+         absl::EndsWith(name, kSegmentSuffix);
+}
+
+// Segments are named after the sequence number of their first sample.
+std::string SegmentPath(const std::string& directory,
+                        uint64_t sequence_number) {
+  return absl::StrCat(directory, "/", kSegmentPrefix,
+                      absl::Dec(sequence_number, absl::kZeroPad20),
+                      kSegmentSuffix);
+}
+
+uint64_t SequenceNumberAt(const char* record) {
+  uint64_t sequence_number;
+  memcpy(&sequence_number, record, sizeof(sequence_number));
+  return sequence_number;
+}
+
+GnpsiSampleMetadata ToMetadata(uint8_t protocol, uint8_t version) {
+  switch (static_cast<GnpsiSampleMetadata::Protocol>(protocol)) {
+    case GnpsiSampleMetadata::Protocol::kNetFlow:
+      return static_cast<NetFlowMetadata::Version>(version);
+    case GnpsiSampleMetadata::Protocol::kIpfix:
+      return static_cast<IPFIXMetadata::Version>(version);
+    case GnpsiSampleMetadata::Protocol::kSFlow:
+      break;
+  }
+  return static_cast<SFlowMetadata::Version>(version);
+}
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<GnpsiSpool>> GnpsiSpool::Create(
+    const GnpsiSpoolOptions& options) {
+  if (options.segment_bytes < kMinSegmentBytes ||
+      options.segment_bytes > std::numeric_limits<uint32_t>::max()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Spool segment size out of range: ",
+                     options.segment_bytes));
+  }
+  if (options.max_bytes < options.segment_bytes) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Spool size ", options.max_bytes, " is below the segment size ",
+        options.segment_bytes));
+  }
+  if (mkdir(options.directory.c_str(), 0700) != 0 && errno != EEXIST) {
+    return absl::InternalError(absl::StrCat("Failed to create spool directory ",
+                                            options.directory, ": ",
+                                            strerror(errno)));
+  }
+  DIR* directory = opendir(options.directory.c_str());
+  if (directory == nullptr) {
+    return absl::InternalError(absl::StrCat("Failed to open spool directory ",
+                                            options.directory, ": ",
+                                            strerror(errno)));
+  }
+  // Segments of a previous process hold samples numbered from a different
+  // start, so they cannot be replayed.
+  while (const dirent* entry = readdir(directory)) {
+    if (!IsSegmentFile(entry->d_name)) continue;
+    std::string path = absl::StrCat(options.directory, "/", entry->d_name);
+    if (unlink(path.c_str()) != 0) {
+      LOG(ERROR) << "Failed to delete spool segment " << path << ": "
+                 << strerror(errno);
+    }
+  }
+  closedir(directory);
+  return absl::WrapUnique(new GnpsiSpool(options));
+}
+
+GnpsiSpool::GnpsiSpool(const GnpsiSpoolOptions& options)
+    : options_(options), write_thread_([this] { WriteLoop(); }) {}
+
+GnpsiSpool::~GnpsiSpool() {
+  {
+    absl::MutexLock l(&mu_);
+    stopping_ = true;
+  }
+  write_thread_.join();
+  // Segments stay mapped for the samples still referencing them.
+  absl::MutexLock l(&mu_);
+  for (const std::shared_ptr<Segment>& segment : segments_) {
+    unlink(segment->path.c_str());
+  }
+  if (active_ != nullptr) unlink(active_->path.c_str());
+}
+
+void GnpsiSpool::Write(
+    std::vector<std::shared_ptr<const SharedSample>> samples) {
+  // Dropped samples are released with `samples`, outside of the lock.
+  absl::MutexLock l(&mu_);
+  for (std::shared_ptr<const SharedSample>& sample : samples) {
+    if (pending_bytes_ >= options_.segment_bytes) {
+      ++dropped_count_;
+      continue;
+    }
+    pending_bytes_ += sample->packet().size();
+    pending_.push_back(std::move(sample));
+  }
+}
+
+bool GnpsiSpool::Read(
+    uint64_t* after, int max_samples,
+    std::vector<std::shared_ptr<const SharedSample>>* samples) const {
+  // The records are located under the lock and read back without it, so the
+  // callers of Write do not wait for the samples to be built.
+  std::vector<std::pair<std::shared_ptr<Segment>, uint32_t>> records;
+  std::vector<std::shared_ptr<const SharedSample>> pending;
+  bool caught_up = true;
+  {
+    absl::MutexLock l(&mu_);
+    int read = 0;
+    for (const std::shared_ptr<Segment>& segment : segments_) {
+      const std::vector<uint32_t>& offsets = segment->offsets;
+      auto it = std::upper_bound(
+          offsets.begin(), offsets.end(), *after,
+          [&segment](uint64_t after, uint32_t offset) {
+            return after < SequenceNumberAt(segment->data + offset);
+          });
+      for (; it != offsets.end() && read < max_samples; ++it, ++read) {
+        records.emplace_back(segment, *it);
+        *after = SequenceNumberAt(segment->data + *it);
+      }
+      if (it != offsets.end()) {
+        caught_up = false;
+        break;
+      }
+    }
+    for (auto it = pending_.begin(); caught_up && it != pending_.end(); ++it) {
+      if ((*it)->sequence_number() <= *after) continue;
+      if (read == max_samples) {
+        caught_up = false;
+        break;
+      }
+      pending.push_back(*it);
+      *after = (*it)->sequence_number();
+      ++read;
+    }
+  }
+  for (const auto& [segment, offset] : records) {
+    samples->push_back(ReadRecord(segment, offset));
+  }
+  samples->insert(samples->end(), pending.begin(), pending.end());
+  return caught_up;
+}
+
+void GnpsiSpool::Flush() {
+  absl::MutexLock l(&mu_);
+  auto written = [this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return pending_.empty();
+  };
+  mu_.Await(absl::Condition(&written));
+}
+
+int64_t GnpsiSpool::dropped_count() const {
+  absl::MutexLock l(&mu_);
+  return dropped_count_;
+}
+
+void GnpsiSpool::WriteLoop() {
+  while (true) {
+    // The queued samples are written without holding the lock, and stay
+    // readable from pending_ until their records are.
+    std::vector<std::shared_ptr<const SharedSample>> batch;
+    {
+      absl::MutexLock l(&mu_);
+      auto has_work = [this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+        return stopping_ || !pending_.empty();
+      };
+      mu_.Await(absl::Condition(&has_work));
+      if (stopping_) return;
+      batch.assign(pending_.begin(), pending_.end());
+    }
+    std::vector<std::pair<std::shared_ptr<Segment>, uint32_t>> records;
+    records.reserve(batch.size());
+    for (const std::shared_ptr<const SharedSample>& sample : batch) {
+      uint32_t offset = 0;
+      if (WriteRecord(*sample, &offset)) {
+        records.emplace_back(active_, offset);
+      } else {
+        records.emplace_back(nullptr, 0);
+      }
+    }
+    std::vector<std::shared_ptr<Segment>> deleted;
+    {
+      absl::MutexLock l(&mu_);
+      for (const auto& [segment, offset] : records) {
+        if (segment == nullptr) {
+          ++dropped_count_;
+          continue;
+        }
+        if (segments_.empty() || segments_.back() != segment) {
+          segments_.push_back(segment);
+          while (static_cast<int64_t>(segments_.size()) *
+                     options_.segment_bytes >
+                 options_.max_bytes) {
+            deleted.push_back(std::move(segments_.front()));
+            segments_.pop_front();
+          }
+        }
+        segment->offsets.push_back(offset);
+      }
+    }
+    for (const std::shared_ptr<Segment>& segment : deleted) {
+      if (unlink(segment->path.c_str()) != 0) {
+        LOG(ERROR) << "Failed to delete spool segment " << segment->path
+                   << ": " << strerror(errno);
+      }
+    }
+    // The batch is dequeued once the segments beyond the maximum are deleted,
+    // so Flush() returns with the spool within its size. Meanwhile readers
+    // skip the queued samples they read from the segments.
+    absl::MutexLock l(&mu_);
+    for (size_t i = 0; i < batch.size(); ++i) {
+      pending_bytes_ -= pending_.front()->packet().size();
+      pending_.pop_front();
+    }
+  }
+}
+
+bool GnpsiSpool::WriteRecord(const SharedSample& sample, uint32_t* offset) {
+  std::vector<std::string> telemetry;
+  size_t telemetry_size = 0;
+  for (const auto& record : sample.congestion_telemetry()) {
+    telemetry.push_back(record->telemetry().SerializeAsString());
+    telemetry_size += sizeof(uint32_t) + telemetry.back().size();
+  }
+  const absl::string_view packet = sample.packet();
+  const size_t record_size =
+      RecordSize(sizeof(RecordHeader) + packet.size() + telemetry_size);
+  if (record_size > static_cast<size_t>(options_.segment_bytes)) return false;
+  if (active_ == nullptr || active_->end + record_size > active_->size) {
+    std::string path =
+        SegmentPath(options_.directory, sample.sequence_number());
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+      LOG(ERROR) << "Failed to create spool segment " << path << ": "
+                 << strerror(errno);
+      return false;
+    }
+    // The blocks are allocated up front, so that writing to the mapping cannot
+    // fault on a full disk.
+    int error = posix_fallocate(fd, 0, options_.segment_bytes);
+    void* data = MAP_FAILED;
+    if (error == 0) {
+      data = mmap(nullptr, options_.segment_bytes, PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+      if (data == MAP_FAILED) error = errno;
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+      LOG(ERROR) << "Failed to map spool segment " << path << ": "
+                 << strerror(error);
+      unlink(path.c_str());
+      return false;
+    }
+    active_ = std::make_shared<Segment>();
+    active_->path = std::move(path);
+    active_->data = static_cast<char*>(data);
+    active_->size = options_.segment_bytes;
+  }
+
+  RecordHeader header = {};
+  header.sequence_number = sample.sequence_number();
+  header.timestamp = sample.timestamp();
+  header.packet_size = packet.size();
+  header.congestion_telemetry_size = telemetry_size;
+  header.protocol = static_cast<uint8_t>(sample.metadata().protocol());
+  header.version = sample.metadata().version();
+  header.serialized = sample.serialized().Valid();
+  char* data = active_->data + active_->end;
+  memcpy(data, &header, sizeof(header));
+  data += sizeof(header);
+  memcpy(data, packet.data(), packet.size());
+  data += packet.size();
+  for (const std::string& message : telemetry) {
+    uint32_t size = message.size();
+    memcpy(data, &size, sizeof(size));
+    memcpy(data + sizeof(size), message.data(), message.size());
+    data += sizeof(size) + message.size();
+  }
+  *offset = active_->end;
+  active_->end += record_size;
+  return true;
+}
+
+void GnpsiSpool::ReleaseSegment(void* segment) {
+  delete static_cast<std::shared_ptr<Segment>*>(segment);
+}
+
+std::shared_ptr<const SharedSample> GnpsiSpool::ReadRecord(
+    const std::shared_ptr<Segment>& segment, uint32_t offset) {
+  const char* record = segment->data + offset;
+  RecordHeader header;
+  memcpy(&header, record, sizeof(header));
+  char* packet = segment->data + offset + sizeof(header);
+  // The packet slice holds a reference to the segment, which keeps it mapped.
+  auto sample = std::make_shared<SharedSample>(
+      grpc::Slice(packet, header.packet_size, &GnpsiSpool::ReleaseSegment,
+                  new std::shared_ptr<Segment>(segment)),
+      header.timestamp, ToMetadata(header.protocol, header.version),
+      header.sequence_number);
+  const char* telemetry = packet + header.packet_size;
+  const char* end = telemetry + header.congestion_telemetry_size;
+  while (telemetry < end) {
+    uint32_t size;
+    memcpy(&size, telemetry, sizeof(size));
+    CongestionTelemetry message;
+    message.ParseFromArray(telemetry + sizeof(size), size);
+    sample->AddCongestionTelemetry(
+        std::make_shared<const GnpsiCongestionRecord>(std::move(message)));
+    telemetry += sizeof(size) + size;
+  }
+  if (header.serialized) {
+    sample->Serialize();
+  } else {
+    sample->BuildSample();
+  }
+  return sample;
+}
+
+}  // namespace gnpsi
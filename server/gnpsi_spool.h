@@ -0,0 +1,114 @@
+#ifndef OPENCONFIG_GNPSI_SERVER_GNPSI_SPOOL_H_
+#define OPENCONFIG_GNPSI_SERVER_GNPSI_SPOOL_H_
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "server/gnpsi_shared_sample.h"
+
+namespace gnpsi {
+
+// Options for spooling samples to disk once they no longer fit in memory.
+struct GnpsiSpoolOptions {
+  // Directory holding the segment files. Samples are not spooled if empty.
+  std::string directory;
+  // Size of each segment file. Must be at least kMinSegmentBytes.
+  int64_t segment_bytes = int64_t{64} << 20;
+  // Maximum disk space used by the segment files. The oldest segment is
+  // deleted to make room for a new one. Must be at least segment_bytes.
+  int64_t max_bytes = int64_t{1} << 30;
+};
+
+// An append-only spool of samples, in the order of their sequence numbers,
+// held in memory-mapped segment files.
+//
+// Write() only queues the samples; they are copied to the mapped segments by a
+// thread owned by the spool, so spooling does not add disk latency to the
+// caller. Samples are read back with packets that reference the mapped
+// segment rather than copies of it. A segment stays mapped until the last of
+// these samples is released, even once it is deleted. Queued samples are
+// readable too, so samples are never missing while they are being written.
+//
+// The spool only lives as long as the process: sequence numbers restart with
+// it, so the segment files left by a previous process are deleted by Create()
+// and the spool deletes its own when destroyed. This class is thread-safe.
+class GnpsiSpool {
+ public:
+  static constexpr int64_t kMinSegmentBytes = int64_t{1} << 20;
+
+  // Creates a spool writing to options.directory, which is created if it does
+  // not exist. Returns an INVALID_ARGUMENT error if the sizes of `options` are
+  // out of range, or an INTERNAL error if the directory cannot be used.
+  static absl::StatusOr<std::unique_ptr<GnpsiSpool>> Create(
+      const GnpsiSpoolOptions& options);
+
+  GnpsiSpool(const GnpsiSpool&) = delete;
+  GnpsiSpool& operator=(const GnpsiSpool&) = delete;
+  ~GnpsiSpool();
+
+  // Queues `samples` for writing. Their sequence numbers must follow the ones
+  // of the samples written before. Samples are dropped if the samples queued
+  // already take a segment, as the disk is not keeping up.
+  void Write(std::vector<std::shared_ptr<const SharedSample>> samples)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Appends to `samples` up to `max_samples` spooled samples with a sequence
+  // number above `*after` and advances `*after` past them. Returns true if no
+  // samples are left after `*after`. Samples read back from a segment are
+  // serialized if they were serialized when written, and built otherwise.
+  bool Read(uint64_t* after, int max_samples,
+            std::vector<std::shared_ptr<const SharedSample>>* samples) const
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Blocks until the queued samples are written to the segments.
+  void Flush() ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Number of samples dropped rather than written.
+  int64_t dropped_count() const ABSL_LOCKS_EXCLUDED(mu_);
+
+ private:
+  struct Segment;
+
+  explicit GnpsiSpool(const GnpsiSpoolOptions& options);
+
+  // Writes the queued samples to the segments until the spool is destroyed.
+  void WriteLoop() ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Copies `sample` to the end of active_, moving on to a new segment if it is
+  // full. Returns false if the sample cannot be written. Only called by the
+  // write thread.
+  bool WriteRecord(const SharedSample& sample, uint32_t* offset);
+
+  // Returns the sample of the record at `offset` of `segment`.
+  static std::shared_ptr<const SharedSample> ReadRecord(
+      const std::shared_ptr<Segment>& segment, uint32_t offset);
+
+  // Releases the reference to a segment held by a packet slice.
+  static void ReleaseSegment(void* segment);
+
+  const GnpsiSpoolOptions options_;
+  mutable absl::Mutex mu_;
+  // Segments in the order of their samples. The records written to each are
+  // listed in its `offsets`, which are guarded by mu_ too.
+  std::deque<std::shared_ptr<Segment>> segments_ ABSL_GUARDED_BY(mu_);
+  // Samples queued for writing, and their packet bytes.
+  std::deque<std::shared_ptr<const SharedSample>> pending_
+      ABSL_GUARDED_BY(mu_);
+  int64_t pending_bytes_ ABSL_GUARDED_BY(mu_) = 0;
+  int64_t dropped_count_ ABSL_GUARDED_BY(mu_) = 0;
+  bool stopping_ ABSL_GUARDED_BY(mu_) = false;
+  // Segment being written. Only used by the write thread.
+  std::shared_ptr<Segment> active_;
+  std::thread write_thread_;
+};
+
+}  // namespace gnpsi
+
+#endif  // OPENCONFIG_GNPSI_SERVER_GNPSI_SPOOL_H_
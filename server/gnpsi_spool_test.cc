@@ -0,0 +1,191 @@
+#include "server/gnpsi_spool.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "grpcpp/support/slice.h"
+#include "gtest/gtest.h"
+#include "proto/gnpsi/gnpsi.pb.h"
+#include "server/gnpsi_shared_sample.h"
+
+namespace gnpsi {
+namespace {
+
+// Returns the options of a spool in a directory of its own for the running
+// test.
+GnpsiSpoolOptions Options(
+    int64_t segment_bytes = GnpsiSpool::kMinSegmentBytes,
+    int64_t max_bytes = 4 * GnpsiSpool::kMinSegmentBytes) {
+  GnpsiSpoolOptions options;
+  options.directory = absl::StrCat(
+      ::testing::TempDir(), "/",
+      ::testing::UnitTest::GetInstance()->current_test_info()->name());
+  options.segment_bytes = segment_bytes;
+  options.max_bytes = max_bytes;
+  return options;
+}
+
+// Returns the names of the segment files in `directory`.
+std::vector<std::string> SegmentFiles(const std::string& directory) {
+  std::vector<std::string> files;
+  DIR* dir = opendir(directory.c_str());
+  if (dir == nullptr) return files;
+  while (const dirent* entry = readdir(dir)) {
+    if (absl::EndsWith(entry->d_name, ".spool")) files.push_back(entry->d_name);
+  }
+  closedir(dir);
+  return files;
+}
+
+std::shared_ptr<const SharedSample> MakeSample(
+    uint64_t sequence_number, const std::string& packet,
+    GnpsiSampleMetadata metadata = SFlowMetadata::V5, bool serialize = true) {
+  auto sample = std::make_shared<SharedSample>(
+      grpc::Slice(packet), /*timestamp=*/1700000000123456789 + sequence_number,
+      metadata, sequence_number);
+  if (serialize) {
+    sample->Serialize();
+  } else {
+    sample->BuildSample();
+  }
+  return sample;
+}
+
+std::vector<uint64_t> SequenceNumbers(
+    const std::vector<std::shared_ptr<const SharedSample>>& samples) {
+  std::vector<uint64_t> sequence_numbers;
+  for (const auto& sample : samples) {
+    sequence_numbers.push_back(sample->sequence_number());
+  }
+  return sequence_numbers;
+}
+
+TEST(GnpsiSpoolTest, RejectsOutOfRangeOptions) {
+  EXPECT_EQ(GnpsiSpool::Create(Options(/*segment_bytes=*/4096)).status().code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(GnpsiSpool::Create(Options(GnpsiSpool::kMinSegmentBytes,
+                                       GnpsiSpool::kMinSegmentBytes - 1))
+                .status()
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+  GnpsiSpoolOptions options = Options();
+  options.directory = "/dev/null/spool";
+  EXPECT_EQ(GnpsiSpool::Create(options).status().code(),
+            absl::StatusCode::kInternal);
+}
+
+TEST(GnpsiSpoolTest, ReadsBackWrittenSamples) {
+  auto spool = GnpsiSpool::Create(Options());
+  ASSERT_TRUE(spool.ok()) << spool.status();
+  auto with_telemetry = std::make_shared<SharedSample>(
+      grpc::Slice(std::string("datagram")), /*timestamp=*/1, SFlowMetadata::V5,
+      /*sequence_number=*/3);
+  CongestionTelemetry telemetry;
+  telemetry.set_ingress_port(7);
+  telemetry.set_sample_sequence_number(9);
+  with_telemetry->AddCongestionTelemetry(
+      std::make_shared<const GnpsiCongestionRecord>(telemetry));
+  with_telemetry->Serialize();
+  (*spool)->Write({MakeSample(1, "first"),
+                   MakeSample(2, "", NetFlowMetadata::V9, /*serialize=*/false),
+                   with_telemetry});
+  (*spool)->Flush();
+
+  std::vector<std::shared_ptr<const SharedSample>> samples;
+  uint64_t after = 0;
+  EXPECT_TRUE((*spool)->Read(&after, /*max_samples=*/10, &samples));
+  EXPECT_EQ(after, 3);
+  ASSERT_EQ(samples.size(), 3);
+  EXPECT_EQ(samples[0]->packet(), "first");
+  EXPECT_EQ(samples[0]->timestamp(), 1700000000123456790);
+  EXPECT_EQ(samples[0]->metadata(), GnpsiSampleMetadata(SFlowMetadata::V5));
+  EXPECT_EQ(samples[0]->serialized().Length(),
+            MakeSample(1, "first")->serialized().Length());
+  EXPECT_EQ(samples[1]->packet(), "");
+  EXPECT_EQ(samples[1]->metadata(), GnpsiSampleMetadata(NetFlowMetadata::V9));
+  EXPECT_FALSE(samples[1]->serialized().Valid());
+  EXPECT_EQ(samples[1]->sample().sequence_number(), 2);
+  ASSERT_EQ(samples[2]->congestion_telemetry().size(), 1);
+  EXPECT_EQ(samples[2]->congestion_telemetry()[0]->telemetry().ingress_port(),
+            7);
+
+  // The samples read back keep their segment mapped.
+  spool->reset();
+  EXPECT_EQ(samples[0]->packet(), "first");
+  EXPECT_EQ(samples[2]->packet(), "datagram");
+}
+
+TEST(GnpsiSpoolTest, ReadsQueuedSamples) {
+  auto spool = GnpsiSpool::Create(Options());
+  ASSERT_TRUE(spool.ok()) << spool.status();
+  // The samples may or may not be written yet.
+  for (uint64_t i = 1; i <= 100; ++i) {
+    (*spool)->Write({MakeSample(i, "sample")});
+  }
+  std::vector<std::shared_ptr<const SharedSample>> samples;
+  uint64_t after = 10;
+  while (!(*spool)->Read(&after, /*max_samples=*/7, &samples)) {
+  }
+  ASSERT_EQ(samples.size(), 90);
+  for (size_t i = 0; i < samples.size(); ++i) {
+    EXPECT_EQ(samples[i]->sequence_number(), i + 11);
+  }
+}
+
+TEST(GnpsiSpoolTest, DeletesOldestSegmentsBeyondMaxBytes) {
+  const GnpsiSpoolOptions options = Options(GnpsiSpool::kMinSegmentBytes,
+                                            2 * GnpsiSpool::kMinSegmentBytes);
+  auto spool = GnpsiSpool::Create(options);
+  ASSERT_TRUE(spool.ok()) << spool.status();
+  // 17 samples fit in a segment, so the samples take 4 segments.
+  const std::string packet(60000, 'p');
+  for (uint64_t i = 1; i <= 60; i += 10) {
+    std::vector<std::shared_ptr<const SharedSample>> samples;
+    for (uint64_t j = i; j < i + 10; ++j) {
+      samples.push_back(MakeSample(j, packet));
+    }
+    (*spool)->Write(std::move(samples));
+    (*spool)->Flush();
+  }
+  EXPECT_EQ((*spool)->dropped_count(), 0);
+  EXPECT_EQ(SegmentFiles(options.directory).size(), 2);
+
+  std::vector<std::shared_ptr<const SharedSample>> samples;
+  uint64_t after = 0;
+  EXPECT_FALSE((*spool)->Read(&after, /*max_samples=*/2, &samples));
+  EXPECT_EQ(SequenceNumbers(samples), (std::vector<uint64_t>{35, 36}));
+
+  spool->reset();
+  EXPECT_TRUE(SegmentFiles(options.directory).empty());
+}
+
+TEST(GnpsiSpoolTest, DeletesSegmentsOfPreviousProcess) {
+  const GnpsiSpoolOptions options = Options();
+  ASSERT_TRUE(GnpsiSpool::Create(options).ok());
+  const std::string stale =
+      absl::StrCat(options.directory, "/gnpsi-00000000000000000001.spool");
+  int fd = open(stale.c_str(), O_WRONLY | O_CREAT, 0600);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  ASSERT_EQ(SegmentFiles(options.directory).size(), 1);
+
+  auto spool = GnpsiSpool::Create(options);
+  ASSERT_TRUE(spool.ok()) << spool.status();
+  EXPECT_TRUE(SegmentFiles(options.directory).empty());
+  std::vector<std::shared_ptr<const SharedSample>> samples;
+  uint64_t after = 0;
+  EXPECT_TRUE((*spool)->Read(&after, /*max_samples=*/10, &samples));
+  EXPECT_TRUE(samples.empty());
+}
+
+}  // namespace
+}  // namespace gnpsi
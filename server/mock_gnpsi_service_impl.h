@@ -1,7 +1,10 @@
 #ifndef OPENCONFIG_GNPSI_SERVER_MOCK_GNPSI_SERVICE_IMPL_H_
 #define OPENCONFIG_GNPSI_SERVER_MOCK_GNPSI_SERVICE_IMPL_H_
 
+#include <string>
 #include <vector>
+
+#include "absl/types/span.h"
 #include "gmock/gmock.h"
 #include "server/gnpsi_service_impl.h"
 
@@ -9,10 +12,19 @@ namespace gnpsi {
 class MockGnpsiServiceImpl : public GnpsiSenderInterface {
  public:
   virtual ~MockGnpsiServiceImpl() = default;
+  // Packets passed with their buffer are copied and forwarded to the mocked
+  // string overload.
+  using GnpsiSenderInterface::SendSamplePacket;
   MOCK_METHOD(void, SendSamplePacket,
               (const std::string& sample_packet,
-               SFlowMetadata::Version version),
+               GnpsiSampleMetadata metadata),
+              (override));
+  MOCK_METHOD(void, SendSamplePackets,
+              (absl::Span<GnpsiPacketBuffer> sample_packets,
+               GnpsiSampleMetadata metadata),
               (override));
+  MOCK_METHOD(void, AddCongestionTelemetry,
+              (const CongestionTelemetry& telemetry), (override));
   MOCK_METHOD(void, DrainConnections, (), (override));
   MOCK_METHOD(void, UndrainConnections, (), (override));
   MOCK_METHOD(std::vector<GnpsiStats>, GetStats, (), (override));